@@ -85,6 +85,38 @@ SRes SzFolder_Decode(const CSzFolder *folder, const UInt64 *packSizes,
     ILookInStream *stream, UInt64 startPos,
     Byte *outBuffer, size_t outSize, ISzAlloc *allocMain);
 
+/* Same as SzFolder_Decode, but LZMA2 coders are decoded by up to numThreads threads
+   (see Lzma2DecMt_Decode). The packed LZMA2 stream is read into memory first. */
+SRes SzFolder_DecodeMt(const CSzFolder *folder, const UInt64 *packSizes,
+    ILookInStream *stream, UInt64 startPos,
+    Byte *outBuffer, size_t outSize, unsigned numThreads, ISzAlloc *allocMain);
+
+typedef struct
+{
+  SRes (*Write)(void *p, const Byte *data, size_t size);
+} IFolderOutStream;
+
+/* Decodes the folder in pieces and passes them to outStream as they become ready.
+   Memory use is bounded by the dictionary size instead of the unpack size, so folders
+   bigger than size_t or available memory can be decoded. For BCJ2 folders it is bounded
+   by the dictionary sizes of the main, call and jump coders. */
+SRes SzFolder_DecodeToStream(const CSzFolder *folder, const UInt64 *packSizes,
+    ILookInStream *stream, UInt64 startPos,
+    IFolderOutStream *outStream, ISzAlloc *allocMain);
+
+/* Same as SzFolder_DecodeToStream, but the LZMA2 coder of a folder without BCJ2 is decoded
+   by up to numThreads threads: the independent segments (see Lzma2DecMt_Decode) are read
+   into memory in batches of up to numThreads, so memory use goes up to about
+   2 * numThreads * SZ_DECODE_MT_SEGMENT_MAX. From the first segment bigger than
+   SZ_DECODE_MT_SEGMENT_MAX on, or if a batch doesn't fit in memory, the stream is
+   decoded as usual. */
+
+#define SZ_DECODE_MT_SEGMENT_MAX ((size_t)1 << 26)
+
+SRes SzFolder_DecodeToStreamMt(const CSzFolder *folder, const UInt64 *packSizes,
+    ILookInStream *stream, UInt64 startPos,
+    IFolderOutStream *outStream, unsigned numThreads, ISzAlloc *allocMain);
+
 typedef struct
 {
   UInt32 Low;
@@ -154,9 +186,12 @@ typedef struct
   UInt64 *PackStreamStartPositions;
   UInt32 *FolderStartFileIndex;
   UInt32 *FileIndexToFolderIndexMap;
+  UInt64 *FileStartPositions; /* offset of each file in the unpacked data of its folder */
 
   size_t *FileNameOffsets; /* in 2-byte steps */
   CBuf FileNames;  /* UTF-16-LE */
+
+  unsigned NumThreads; /* for LZMA2 folders in SzArEx_Extract and SzArEx_ExtractFolder, 1 after SzArEx_Init */
 } CSzArEx;
 
 void SzArEx_Init(CSzArEx *p);
@@ -185,6 +220,32 @@ SRes SzArEx_Extract(
     ISzAlloc *allocTemp);
 
 
+/*
+  SzArEx_ExtractFolder decodes a whole folder (solid block) and splits the output
+  into the files it contains, without holding the folder in memory.
+
+  For each file of the folder (including empty ones) the callback gets FileStart,
+  zero or more FileWrite calls and FileEnd, in file index order. Files that have
+  no folder (FileIndexToFolderIndexMap[i] == (UInt32)-1) are not reported.
+  File and folder CRCs are checked; an error returned from a callback stops extraction.
+  Unlike SzArEx_Extract, which returns SZ_ERROR_MEM when the folder doesn't fit in
+  size_t, this works for folders of any size (see SzFolder_DecodeToStream).
+*/
+
+typedef struct
+{
+  SRes (*FileStart)(void *p, UInt32 fileIndex);
+  SRes (*FileWrite)(void *p, UInt32 fileIndex, const Byte *data, size_t size);
+  SRes (*FileEnd)(void *p, UInt32 fileIndex);
+} ISzExtractCallback;
+
+SRes SzArEx_ExtractFolder(
+    const CSzArEx *db,
+    ILookInStream *inStream,
+    UInt32 folderIndex,
+    ISzExtractCallback *callback,
+    ISzAlloc *allocMain);
+
 /*
 SzArEx_Open Errors:
 SZ_ERROR_NO_ARCHIVE
@@ -1,6 +1,8 @@
 /* 7zAlloc.c -- Allocation functions
 2010-10-29 : Igor Pavlov : Public domain */
 
+#include <string.h>
+
 #include "7zAlloc.h"
 
 /* #define _SZ_ALLOC_DEBUG */
@@ -74,3 +76,236 @@ void SzFreeTemp(void *p, void *address)
   #endif
   free(address);
 }
+
+
+/* ---------- CSzArena ---------- */
+
+#define SZ_ALLOC_ALIGN 16
+#define SZ_ALLOC_ALIGN_SIZE(size) (((size) + (SZ_ALLOC_ALIGN - 1)) & ~(size_t)(SZ_ALLOC_ALIGN - 1))
+
+struct _CSzArenaBlock
+{
+  CSzArenaBlock *next;
+  size_t size;
+};
+
+#define ARENA_BLOCK_HEADER_SIZE SZ_ALLOC_ALIGN_SIZE(sizeof(CSzArenaBlock))
+#define ARENA_BLOCK_DATA(block) ((Byte *)(block) + ARENA_BLOCK_HEADER_SIZE)
+
+static void SzAllocStats_Add(CSzAllocStats *p, size_t size)
+{
+  p->numBaseAllocs++;
+  p->curSize += size;
+  if (p->maxSize < p->curSize)
+    p->maxSize = p->curSize;
+}
+
+static CSzArenaBlock *SzArena_AllocBlock(CSzArena *p, size_t size, CSzArenaBlock **list)
+{
+  CSzArenaBlock *block;
+  if (size > (size_t)0 - ARENA_BLOCK_HEADER_SIZE)
+    return NULL;
+  block = (CSzArenaBlock *)IAlloc_Alloc(p->baseAlloc, ARENA_BLOCK_HEADER_SIZE + size);
+  if (block == 0)
+    return NULL;
+  block->size = size;
+  block->next = *list;
+  *list = block;
+  SzAllocStats_Add(&p->stats, ARENA_BLOCK_HEADER_SIZE + size);
+  return block;
+}
+
+static void SzArena_FreeBlock(CSzArena *p, CSzArenaBlock *block)
+{
+  p->stats.curSize -= ARENA_BLOCK_HEADER_SIZE + block->size;
+  IAlloc_Free(p->baseAlloc, block);
+}
+
+static void *SzArena_Alloc(void *pp, size_t size)
+{
+  CSzArena *p = (CSzArena *)pp;
+  Byte *res;
+  if (size == 0)
+    return 0;
+  if (size > p->blockSize / 4)
+  {
+    CSzArenaBlock *block = SzArena_AllocBlock(p, size, &p->bigBlocks);
+    if (block == 0)
+      return 0;
+    res = ARENA_BLOCK_DATA(block);
+  }
+  else
+  {
+    size = SZ_ALLOC_ALIGN_SIZE(size);
+    if ((size_t)(p->lim - p->pos) < size)
+    {
+      CSzArenaBlock *block = SzArena_AllocBlock(p, p->blockSize, &p->blocks);
+      if (block == 0)
+        return 0;
+      p->pos = ARENA_BLOCK_DATA(block);
+      p->lim = p->pos + block->size;
+    }
+    res = p->pos;
+    p->pos += size;
+    p->last = res;
+  }
+  p->stats.numAllocs++;
+  return res;
+}
+
+static void SzArena_FreeAddress(void *pp, void *address)
+{
+  CSzArena *p = (CSzArena *)pp;
+  CSzArenaBlock **link;
+  if (address == 0)
+    return;
+  p->stats.numFrees++;
+  if ((Byte *)address == p->last)
+  {
+    p->pos = p->last;
+    p->last = NULL;
+    return;
+  }
+  for (link = &p->bigBlocks; *link != 0; link = &(*link)->next)
+  {
+    CSzArenaBlock *block = *link;
+    if (ARENA_BLOCK_DATA(block) == (Byte *)address)
+    {
+      *link = block->next;
+      SzArena_FreeBlock(p, block);
+      return;
+    }
+  }
+}
+
+void SzArena_Construct(CSzArena *p, ISzAlloc *baseAlloc, size_t blockSize)
+{
+  p->s.Alloc = SzArena_Alloc;
+  p->s.Free = SzArena_FreeAddress;
+  p->baseAlloc = baseAlloc;
+  p->blockSize = SZ_ALLOC_ALIGN_SIZE(blockSize);
+  p->blocks = NULL;
+  p->bigBlocks = NULL;
+  p->pos = p->lim = p->last = NULL;
+  memset(&p->stats, 0, sizeof(p->stats));
+}
+
+void SzArena_Reset(CSzArena *p)
+{
+  CSzArenaBlock *keep = NULL;
+  while (p->bigBlocks != 0)
+  {
+    CSzArenaBlock *block = p->bigBlocks;
+    p->bigBlocks = block->next;
+    SzArena_FreeBlock(p, block);
+  }
+  while (p->blocks != 0)
+  {
+    CSzArenaBlock *block = p->blocks;
+    p->blocks = block->next;
+    if (p->blocks == 0)
+      keep = block;
+    else
+      SzArena_FreeBlock(p, block);
+  }
+  p->pos = p->lim = p->last = NULL;
+  if (keep != 0)
+  {
+    p->blocks = keep;
+    p->pos = ARENA_BLOCK_DATA(keep);
+    p->lim = p->pos + keep->size;
+  }
+}
+
+void SzArena_Free(CSzArena *p)
+{
+  SzArena_Reset(p);
+  if (p->blocks != 0)
+  {
+    SzArena_FreeBlock(p, p->blocks);
+    p->blocks = NULL;
+  }
+  p->pos = p->lim = p->last = NULL;
+}
+
+
+/* ---------- CSzBufPool ---------- */
+
+/* every buffer starts with its size, so Free knows whether to keep it */
+
+#define BUF_POOL_HEADER_SIZE SZ_ALLOC_ALIGN_SIZE(sizeof(size_t))
+#define BUF_POOL_GET_SIZE(buf) (*(const size_t *)((const Byte *)(buf) - BUF_POOL_HEADER_SIZE))
+
+static void SzBufPool_Release(CSzBufPool *p, void *buf)
+{
+  p->stats.curSize -= BUF_POOL_HEADER_SIZE + BUF_POOL_GET_SIZE(buf);
+  IAlloc_Free(p->baseAlloc, (Byte *)buf - BUF_POOL_HEADER_SIZE);
+}
+
+static void *SzBufPool_Alloc(void *pp, size_t size)
+{
+  CSzBufPool *p = (CSzBufPool *)pp;
+  Byte *block;
+  if (size == 0)
+    return 0;
+  if (size >= p->minSize)
+  {
+    unsigned i, best = p->numBufs;
+    for (i = 0; i < p->numBufs; i++)
+    {
+      size_t bufSize = BUF_POOL_GET_SIZE(p->bufs[i]);
+      if (bufSize >= size && (best == p->numBufs || bufSize < BUF_POOL_GET_SIZE(p->bufs[best])))
+        best = i;
+    }
+    if (best != p->numBufs)
+    {
+      void *res = p->bufs[best];
+      p->bufs[best] = p->bufs[--p->numBufs];
+      p->stats.numReused++;
+      p->stats.numAllocs++;
+      return res;
+    }
+    for (i = 0; i < p->numBufs; i++)
+      SzBufPool_Release(p, p->bufs[i]);
+    p->numBufs = 0;
+  }
+  if (size > (size_t)0 - BUF_POOL_HEADER_SIZE)
+    return 0;
+  block = (Byte *)IAlloc_Alloc(p->baseAlloc, BUF_POOL_HEADER_SIZE + size);
+  if (block == 0)
+    return 0;
+  *(size_t *)block = size;
+  SzAllocStats_Add(&p->stats, BUF_POOL_HEADER_SIZE + size);
+  p->stats.numAllocs++;
+  return block + BUF_POOL_HEADER_SIZE;
+}
+
+static void SzBufPool_FreeAddress(void *pp, void *address)
+{
+  CSzBufPool *p = (CSzBufPool *)pp;
+  if (address == 0)
+    return;
+  p->stats.numFrees++;
+  if (BUF_POOL_GET_SIZE(address) >= p->minSize && p->numBufs < SZ_BUF_POOL_SIZE)
+    p->bufs[p->numBufs++] = address;
+  else
+    SzBufPool_Release(p, address);
+}
+
+void SzBufPool_Construct(CSzBufPool *p, ISzAlloc *baseAlloc, size_t minSize)
+{
+  p->s.Alloc = SzBufPool_Alloc;
+  p->s.Free = SzBufPool_FreeAddress;
+  p->baseAlloc = baseAlloc;
+  p->minSize = minSize;
+  p->numBufs = 0;
+  memset(&p->stats, 0, sizeof(p->stats));
+}
+
+void SzBufPool_Free(CSzBufPool *p)
+{
+  unsigned i;
+  for (i = 0; i < p->numBufs; i++)
+    SzBufPool_Release(p, p->bufs[i]);
+  p->numBufs = 0;
+}
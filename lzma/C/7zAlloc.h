@@ -6,10 +6,91 @@
 
 #include <stdlib.h>
 
+#include "Types.h"
+
+EXTERN_C_BEGIN
+
 void *SzAlloc(void *p, size_t size);
 void SzFree(void *p, void *address);
 
 void *SzAllocTemp(void *p, size_t size);
 void SzFreeTemp(void *p, void *address);
 
+typedef struct
+{
+  UInt64 numAllocs;     /* Alloc calls that returned memory */
+  UInt64 numFrees;      /* Free calls with non-NULL address */
+  UInt64 numBaseAllocs; /* blocks requested from the base allocator */
+  UInt64 numReused;     /* CSzBufPool: requests served from the cache */
+  size_t curSize;       /* bytes currently held from the base allocator */
+  size_t maxSize;       /* peak of curSize */
+} CSzAllocStats;
+
+
+/* ---------- CSzArena ---------- */
+
+/*
+CSzArena is an ISzAlloc that cuts allocations out of big blocks requested from baseAlloc.
+Requests bigger than a quarter of blockSize get their own blocks. Free only takes back
+the most recent allocation and the big requests, everything else is released at once
+by SzArena_Reset or SzArena_Free.
+It suits SzArEx_Open: the header parsing makes many small allocations, allocMain ones
+live as long as the CSzArEx and allocTemp ones are all released before SzArEx_Open returns.
+CSzArena is not thread-safe.
+*/
+
+typedef struct _CSzArenaBlock CSzArenaBlock;
+
+typedef struct
+{
+  ISzAlloc s;
+  ISzAlloc *baseAlloc;
+  size_t blockSize;
+  CSzArenaBlock *blocks;    /* blocks of blockSize bytes */
+  CSzArenaBlock *bigBlocks; /* blocks of single big requests */
+  Byte *pos;
+  Byte *lim;
+  Byte *last;
+  CSzAllocStats stats;
+} CSzArena;
+
+#define SZ_ARENA_BLOCK_SIZE_DEFAULT (1 << 16)
+
+void SzArena_Construct(CSzArena *p, ISzAlloc *baseAlloc, size_t blockSize);
+/* releases all allocations, the first block is kept for the next ones */
+void SzArena_Reset(CSzArena *p);
+void SzArena_Free(CSzArena *p);
+
+
+/* ---------- CSzBufPool ---------- */
+
+/*
+CSzBufPool is an ISzAlloc that keeps freed buffers of minSize bytes and more, and hands
+them out again to requests that fit, so the dictionaries and stream buffers of
+consecutive folders reuse the same memory instead of going back to baseAlloc.
+A request gets the smallest cached buffer that is big enough; if there is none, the
+cached buffers that are too small are released. Smaller requests go to baseAlloc directly.
+CSzBufPool is not thread-safe: use one pool per extracting thread.
+*/
+
+#define SZ_BUF_POOL_SIZE 8
+
+typedef struct
+{
+  ISzAlloc s;
+  ISzAlloc *baseAlloc;
+  size_t minSize;
+  unsigned numBufs;
+  void *bufs[SZ_BUF_POOL_SIZE];
+  CSzAllocStats stats;
+} CSzBufPool;
+
+#define SZ_BUF_POOL_MIN_SIZE_DEFAULT (1 << 12)
+
+void SzBufPool_Construct(CSzBufPool *p, ISzAlloc *baseAlloc, size_t minSize);
+/* releases the cached buffers, all buffers must be freed before */
+void SzBufPool_Free(CSzBufPool *p);
+
+EXTERN_C_END
+
 #endif
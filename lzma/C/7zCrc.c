@@ -6,11 +6,16 @@
 
 #define kCrcPoly 0xEDB88320
 
-#ifdef MY_CPU_X86_OR_AMD64
-  #define CRC_NUM_TABLES 8
+#ifdef MY_CPU_LE
+  #define CRC_NUM_TABLES 16
   UInt32 MY_FAST_CALL CrcUpdateT8(UInt32 v, const void *data, size_t size, const UInt32 *table);
-#elif defined(MY_CPU_LE)
-  #define CRC_NUM_TABLES 4
+  UInt32 MY_FAST_CALL CrcUpdateT16(UInt32 v, const void *data, size_t size, const UInt32 *table);
+  #ifdef CRC_CLMUL_SUPPORTED
+  UInt32 MY_FAST_CALL CrcUpdateClmul(UInt32 v, const void *data, size_t size, const UInt32 *table);
+  #endif
+  #ifdef CRC_VCLMUL_SUPPORTED
+  UInt32 MY_FAST_CALL CrcUpdateVClmul(UInt32 v, const void *data, size_t size, const UInt32 *table);
+  #endif
 #else
   #define CRC_NUM_TABLES 5
   #define CRC_UINT32_SWAP(v) ((v >> 24) | ((v >> 8) & 0xFF00) | ((v << 8) & 0xFF0000) | (v << 24))
@@ -24,8 +29,12 @@
 typedef UInt32 (MY_FAST_CALL *CRC_FUNC)(UInt32 v, const void *data, size_t size, const UInt32 *table);
 
 static CRC_FUNC g_CrcUpdate;
+static int g_CrcBackend = CRC_BACKEND_T4;
 UInt32 g_CrcTable[256 * CRC_NUM_TABLES];
 
+/* x^(2^n) modulo the CRC polynomial, in the reflected bit order of the CRC */
+static UInt32 g_CrcX2nTable[32];
+
 UInt32 MY_FAST_CALL CrcUpdate(UInt32 v, const void *data, size_t size)
 {
   return g_CrcUpdate(v, data, size, g_CrcTable);
@@ -36,9 +45,83 @@ UInt32 MY_FAST_CALL CrcCalc(const void *data, size_t size)
   return g_CrcUpdate(CRC_INIT_VAL, data, size, g_CrcTable) ^ CRC_INIT_VAL;
 }
 
+Bool Crc_SetBackend(int backend)
+{
+  CRC_FUNC func = NULL;
+  switch (backend)
+  {
+    #ifdef MY_CPU_LE
+    case CRC_BACKEND_T4: func = CrcUpdateT4; break;
+    case CRC_BACKEND_T8: func = CrcUpdateT8; break;
+    case CRC_BACKEND_T16: func = CrcUpdateT16; break;
+    #ifdef CRC_CLMUL_SUPPORTED
+    case CRC_BACKEND_CLMUL:
+      if (CPU_Is_Clmul_Supported())
+        func = CrcUpdateClmul;
+      break;
+    #endif
+    #ifdef CRC_VCLMUL_SUPPORTED
+    case CRC_BACKEND_VCLMUL:
+      if (CPU_Is_VClmul_Supported())
+        func = CrcUpdateVClmul;
+      break;
+    #endif
+    #else
+    /* big endian or unknown byte order, CrcGenerateTable has picked the only usable function */
+    case CRC_BACKEND_T4: func = g_CrcUpdate; break;
+    #endif
+  }
+  if (!func)
+    return False;
+  g_CrcUpdate = func;
+  g_CrcBackend = backend;
+  return True;
+}
+
+int Crc_GetBackend(void)
+{
+  return g_CrcBackend;
+}
+
+/* a * b modulo the CRC polynomial, a must not be 0 */
+static UInt32 CrcMulModPoly(UInt32 a, UInt32 b)
+{
+  UInt32 m = (UInt32)1 << 31;
+  UInt32 p = 0;
+  for (;;)
+  {
+    if (a & m)
+    {
+      p ^= b;
+      if ((a & (m - 1)) == 0)
+        break;
+    }
+    m >>= 1;
+    b = (b >> 1) ^ (kCrcPoly & ~((b & 1) - 1));
+  }
+  return p;
+}
+
+UInt32 MY_FAST_CALL CrcCombine(UInt32 crc1, UInt32 crc2, UInt64 size2)
+{
+  /* appending size2 bytes multiplies crc1 by x^(8 * size2) */
+  UInt32 p = (UInt32)1 << 31;
+  unsigned k = 3;
+  for (; size2 != 0; size2 >>= 1, k++)
+    if (size2 & 1)
+      p = CrcMulModPoly(g_CrcX2nTable[k & 31], p);
+  return CrcMulModPoly(p, crc1) ^ crc2;
+}
+
 void MY_FAST_CALL CrcGenerateTable()
 {
   UInt32 i;
+  {
+    UInt32 p = (UInt32)1 << 30;
+    g_CrcX2nTable[0] = p;
+    for (i = 1; i < 32; i++)
+      g_CrcX2nTable[i] = p = CrcMulModPoly(p, p);
+  }
   for (i = 0; i < 256; i++)
   {
     UInt32 r = i;
@@ -55,12 +138,16 @@ void MY_FAST_CALL CrcGenerateTable()
   
   #ifdef MY_CPU_LE
 
-  g_CrcUpdate = CrcUpdateT4;
-  
-  #if CRC_NUM_TABLES == 8
-  if (!CPU_Is_InOrder())
-    g_CrcUpdate = CrcUpdateT8;
-  #endif
+  if (!Crc_SetBackend(CRC_BACKEND_VCLMUL) &&
+      !Crc_SetBackend(CRC_BACKEND_CLMUL))
+  {
+    #ifdef MY_CPU_X86_OR_AMD64
+    if (CPU_Is_InOrder())
+      Crc_SetBackend(CRC_BACKEND_T4);
+    else
+    #endif
+      Crc_SetBackend(CRC_BACKEND_T16);
+  }
 
   #else
   {
@@ -10,9 +10,35 @@ EXTERN_C_BEGIN
 
 extern UInt32 g_CrcTable[];
 
-/* Call CrcGenerateTable one time before other CRC functions */
+/* Call CrcGenerateTable one time before other CRC functions.
+   It also selects the fastest backend the CPU supports. */
 void MY_FAST_CALL CrcGenerateTable(void);
 
+#define CRC_BACKEND_T4 0     /* table lookups, 4 bytes per step */
+#define CRC_BACKEND_T8 1     /* table lookups, 8 bytes per step */
+#define CRC_BACKEND_T16 2    /* table lookups, 16 bytes per step */
+#define CRC_BACKEND_CLMUL 3  /* x86 PCLMULQDQ folding */
+#define CRC_BACKEND_VCLMUL 4 /* x86 AVX-512 VPCLMULQDQ folding */
+
+/* Returns False if the backend isn't available in this build or on this CPU */
+Bool Crc_SetBackend(int backend);
+int Crc_GetBackend(void);
+
+/* PCLMULQDQ intrinsics need VS2008 SP1, GCC 4.4 or clang 3.2,
+   the VPCLMULQDQ ones VS2019, GCC 8 or clang 6 */
+#if defined(_M_IX86) || defined(_M_X64) || defined(_M_AMD64) || defined(__i386__) || defined(__x86_64__)
+  #if (defined(_MSC_VER) && _MSC_FULL_VER >= 150030729) || \
+      (defined(__clang__) && (__clang_major__ > 3 || (__clang_major__ == 3 && __clang_minor__ >= 2))) || \
+      (defined(__GNUC__) && !defined(__clang__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 4)))
+    #define CRC_CLMUL_SUPPORTED
+  #endif
+  #if (defined(_MSC_VER) && _MSC_VER >= 1920) || \
+      (defined(__clang__) && __clang_major__ >= 6) || \
+      (defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 8)
+    #define CRC_VCLMUL_SUPPORTED
+  #endif
+#endif
+
 #define CRC_INIT_VAL 0xFFFFFFFF
 #define CRC_GET_DIGEST(crc) ((crc) ^ CRC_INIT_VAL)
 #define CRC_UPDATE_BYTE(crc, b) (g_CrcTable[((crc) ^ (b)) & 0xFF] ^ ((crc) >> 8))
@@ -20,6 +46,9 @@ void MY_FAST_CALL CrcGenerateTable(void);
 UInt32 MY_FAST_CALL CrcUpdate(UInt32 crc, const void *data, size_t size);
 UInt32 MY_FAST_CALL CrcCalc(const void *data, size_t size);
 
+/* Returns the CRC of A followed by B from crc1 = CrcCalc(A), crc2 = CrcCalc(B) and the size of B */
+UInt32 MY_FAST_CALL CrcCombine(UInt32 crc1, UInt32 crc2, UInt64 size2);
+
 EXTERN_C_END
 
 #endif
@@ -1,6 +1,7 @@
 /* 7zCrcOpt.c -- CRC32 calculation
 2010-12-01 : Igor Pavlov : Public domain */
 
+#include "7zCrc.h"
 #include "CpuArch.h"
 
 #define CRC_UPDATE_BYTE_2(crc, b) (table[((crc) ^ (b)) & 0xFF] ^ ((crc) >> 8))
@@ -28,9 +29,223 @@ UInt32 MY_FAST_CALL CrcUpdateT4(UInt32 v, const void *data, size_t size, const U
 
 UInt32 MY_FAST_CALL CrcUpdateT8(UInt32 v, const void *data, size_t size, const UInt32 *table)
 {
-  return CrcUpdateT4(v, data, size, table);
+  const Byte *p = (const Byte *)data;
+  for (; size > 0 && ((unsigned)(ptrdiff_t)p & 7) != 0; size--, p++)
+    v = CRC_UPDATE_BYTE_2(v, *p);
+  for (; size >= 8; size -= 8, p += 8)
+  {
+    UInt32 d;
+    v ^= ((const UInt32 *)p)[0];
+    d = ((const UInt32 *)p)[1];
+    v =
+      table[0x700 + (v & 0xFF)] ^
+      table[0x600 + ((v >> 8) & 0xFF)] ^
+      table[0x500 + ((v >> 16) & 0xFF)] ^
+      table[0x400 + ((v >> 24))] ^
+      table[0x300 + (d & 0xFF)] ^
+      table[0x200 + ((d >> 8) & 0xFF)] ^
+      table[0x100 + ((d >> 16) & 0xFF)] ^
+      table[0x000 + ((d >> 24))];
+  }
+  for (; size > 0; size--, p++)
+    v = CRC_UPDATE_BYTE_2(v, *p);
+  return v;
+}
+
+#define CRC_T16_WORD(d, t) \
+  table[(t) + 0x300 + ((d) & 0xFF)] ^ \
+  table[(t) + 0x200 + (((d) >> 8) & 0xFF)] ^ \
+  table[(t) + 0x100 + (((d) >> 16) & 0xFF)] ^ \
+  table[(t) + 0x000 + ((d) >> 24)]
+
+UInt32 MY_FAST_CALL CrcUpdateT16(UInt32 v, const void *data, size_t size, const UInt32 *table)
+{
+  const Byte *p = (const Byte *)data;
+  for (; size > 0 && ((unsigned)(ptrdiff_t)p & 7) != 0; size--, p++)
+    v = CRC_UPDATE_BYTE_2(v, *p);
+  for (; size >= 16; size -= 16, p += 16)
+  {
+    UInt32 d1, d2, d3;
+    v ^= ((const UInt32 *)p)[0];
+    d1 = ((const UInt32 *)p)[1];
+    d2 = ((const UInt32 *)p)[2];
+    d3 = ((const UInt32 *)p)[3];
+    v =
+      (CRC_T16_WORD(v, 0xC00)) ^
+      (CRC_T16_WORD(d1, 0x800)) ^
+      (CRC_T16_WORD(d2, 0x400)) ^
+      (CRC_T16_WORD(d3, 0x000));
+  }
+  return CrcUpdateT8(v, p, size, table);
+}
+
+#endif
+
+
+#ifdef CRC_CLMUL_SUPPORTED
+
+/* Folding with carry-less multiplication, see Intel's "Fast CRC Computation for Generic
+   Polynomials Using PCLMULQDQ Instruction". The bit-reflected constants are
+   x^n mod P(x) for the n given next to them, shifted left by one. */
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#define ATTRIB_CLMUL
+#define ATTRIB_VCLMUL
+#else
+#include <immintrin.h>
+#define ATTRIB_CLMUL __attribute__((__target__("pclmul,sse4.1")))
+#define ATTRIB_VCLMUL __attribute__((__target__("pclmul,sse4.1,avx512f,avx512vl,vpclmulqdq")))
+#endif
+
+#define CRC_K_544 UINT64_CONST(0x154442bd4) /* fold by 512 bits */
+#define CRC_K_480 UINT64_CONST(0x1c6e41596)
+#define CRC_K_160 UINT64_CONST(0x1751997d0) /* fold by 128 bits */
+#define CRC_K_96  UINT64_CONST(0x0ccaa009e)
+#define CRC_K_64  UINT64_CONST(0x163cd6124) /* 64 to 32 bits */
+#define CRC_POLY  UINT64_CONST(0x1db710641) /* Barrett reduction: P(x) and x^64 / P(x) */
+#define CRC_MU    UINT64_CONST(0x1f7011641)
+
+#define CRC_FOLD128(x, k, d) \
+  _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00), _mm_clmulepi64_si128(x, k, 0x11)), d)
+
+#define CRC_LOAD128(p) _mm_loadu_si128((const __m128i *)(const void *)(p))
+
+/* Folds the 16-byte blocks of p into x and reduces the result to the CRC register value */
+ATTRIB_CLMUL
+static UInt32 CrcFoldTail_Clmul(__m128i x, const Byte *p, size_t size)
+{
+  const __m128i k128 = _mm_set_epi64x(CRC_K_96, CRC_K_160);
+  const __m128i mask32 = _mm_set_epi32(0, 0, 0, -1);
+  __m128i t;
+
+  for (; size >= 16; size -= 16, p += 16)
+    x = CRC_FOLD128(x, k128, CRC_LOAD128(p));
+
+  /* 128 to 64 bits, this also appends the 32 zero bits of the CRC */
+  x = _mm_xor_si128(_mm_clmulepi64_si128(k128, x, 0x01), _mm_srli_si128(x, 8));
+
+  /* 64 to 32 bits */
+  t = _mm_srli_si128(x, 4);
+  x = _mm_clmulepi64_si128(_mm_and_si128(x, mask32), _mm_set_epi64x(0, CRC_K_64), 0x00);
+  x = _mm_xor_si128(x, t);
+
+  /* Barrett reduction */
+  {
+    const __m128i poly = _mm_set_epi64x(CRC_MU, CRC_POLY);
+    t = x;
+    x = _mm_clmulepi64_si128(_mm_and_si128(x, mask32), poly, 0x10);
+    x = _mm_clmulepi64_si128(_mm_and_si128(x, mask32), poly, 0x00);
+    x = _mm_xor_si128(x, t);
+  }
+  return (UInt32)_mm_extract_epi32(x, 1);
+}
+
+/* size >= 64 and a multiple of 16 */
+ATTRIB_CLMUL
+static UInt32 CrcFold_Clmul(UInt32 v, const Byte *p, size_t size)
+{
+  const __m128i k512 = _mm_set_epi64x(CRC_K_480, CRC_K_544);
+  const __m128i k128 = _mm_set_epi64x(CRC_K_96, CRC_K_160);
+  __m128i x0 = _mm_xor_si128(CRC_LOAD128(p), _mm_cvtsi32_si128((int)v));
+  __m128i x1 = CRC_LOAD128(p + 16);
+  __m128i x2 = CRC_LOAD128(p + 32);
+  __m128i x3 = CRC_LOAD128(p + 48);
+
+  for (p += 64, size -= 64; size >= 64; p += 64, size -= 64)
+  {
+    x0 = CRC_FOLD128(x0, k512, CRC_LOAD128(p));
+    x1 = CRC_FOLD128(x1, k512, CRC_LOAD128(p + 16));
+    x2 = CRC_FOLD128(x2, k512, CRC_LOAD128(p + 32));
+    x3 = CRC_FOLD128(x3, k512, CRC_LOAD128(p + 48));
+  }
+
+  x0 = CRC_FOLD128(x0, k128, x1);
+  x0 = CRC_FOLD128(x0, k128, x2);
+  x0 = CRC_FOLD128(x0, k128, x3);
+  return CrcFoldTail_Clmul(x0, p, size);
+}
+
+UInt32 MY_FAST_CALL CrcUpdateClmul(UInt32 v, const void *data, size_t size, const UInt32 *table)
+{
+  const Byte *p = (const Byte *)data;
+  if (size >= 64)
+  {
+    size_t cur = size & ~(size_t)15;
+    v = CrcFold_Clmul(v, p, cur);
+    p += cur;
+    size -= cur;
+  }
+  return CrcUpdateT16(v, p, size, table);
 }
 
+#ifdef CRC_VCLMUL_SUPPORTED
+
+#define CRC_K_2080 UINT64_CONST(0x11542778a) /* fold by 2048 bits */
+#define CRC_K_2016 UINT64_CONST(0x1322d1430)
+
+#define CRC_FOLD512(x, k, d) \
+  _mm512_ternarylogic_epi64(_mm512_clmulepi64_epi128(x, k, 0x00), _mm512_clmulepi64_epi128(x, k, 0x11), d, 0x96)
+
+#define CRC_LOAD512(p) _mm512_loadu_si512((const void *)(p))
+
+/* the zero-masked forms: the plain extract and cast start from an undefined register, and gcc warns */
+#define CRC_EXTRACT128(x, i) _mm512_maskz_extracti32x4_epi32(0xF, x, i)
+
+/* size >= 256 and a multiple of 16 */
+ATTRIB_VCLMUL
+static UInt32 CrcFold_VClmul(UInt32 v, const Byte *p, size_t size)
+{
+  /* set, not broadcast or insert, for the same reason */
+  const __m512i k2048 = _mm512_set_epi64(CRC_K_2016, CRC_K_2080, CRC_K_2016, CRC_K_2080,
+      CRC_K_2016, CRC_K_2080, CRC_K_2016, CRC_K_2080);
+  const __m512i k512 = _mm512_set_epi64(CRC_K_480, CRC_K_544, CRC_K_480, CRC_K_544,
+      CRC_K_480, CRC_K_544, CRC_K_480, CRC_K_544);
+  const __m128i k128 = _mm_set_epi64x(CRC_K_96, CRC_K_160);
+  __m512i x0 = _mm512_xor_si512(CRC_LOAD512(p), _mm512_set_epi64(0, 0, 0, 0, 0, 0, 0, v));
+  __m512i x1 = CRC_LOAD512(p + 64);
+  __m512i x2 = CRC_LOAD512(p + 128);
+  __m512i x3 = CRC_LOAD512(p + 192);
+  __m128i x;
+
+  for (p += 256, size -= 256; size >= 256; p += 256, size -= 256)
+  {
+    x0 = CRC_FOLD512(x0, k2048, CRC_LOAD512(p));
+    x1 = CRC_FOLD512(x1, k2048, CRC_LOAD512(p + 64));
+    x2 = CRC_FOLD512(x2, k2048, CRC_LOAD512(p + 128));
+    x3 = CRC_FOLD512(x3, k2048, CRC_LOAD512(p + 192));
+  }
+
+  x0 = CRC_FOLD512(x0, k512, x1);
+  x0 = CRC_FOLD512(x0, k512, x2);
+  x0 = CRC_FOLD512(x0, k512, x3);
+  for (; size >= 64; p += 64, size -= 64)
+    x0 = CRC_FOLD512(x0, k512, CRC_LOAD512(p));
+
+  x = CRC_EXTRACT128(x0, 0);
+  x = CRC_FOLD128(x, k128, CRC_EXTRACT128(x0, 1));
+  x = CRC_FOLD128(x, k128, CRC_EXTRACT128(x0, 2));
+  x = CRC_FOLD128(x, k128, CRC_EXTRACT128(x0, 3));
+  /* the tail is SSE code, running it with dirty upper register halves is very slow */
+  _mm256_zeroupper();
+  return CrcFoldTail_Clmul(x, p, size);
+}
+
+UInt32 MY_FAST_CALL CrcUpdateVClmul(UInt32 v, const void *data, size_t size, const UInt32 *table)
+{
+  const Byte *p = (const Byte *)data;
+  if (size >= 256)
+  {
+    size_t cur = size & ~(size_t)15;
+    v = CrcFold_VClmul(v, p, cur);
+    p += cur;
+    size -= cur;
+  }
+  return CrcUpdateClmul(v, p, size, table);
+}
+
+#endif
+
 #endif
 
 
@@ -12,6 +12,7 @@
 #include "CpuArch.h"
 #include "LzmaDec.h"
 #include "Lzma2Dec.h"
+#include "Lzma2DecMt.h"
 #ifdef _7ZIP_PPMD_SUPPPORT
 #include "Ppmd7.h"
 #endif
@@ -240,6 +241,29 @@ static SRes SzDecodeCopy(UInt64 inSize, ILookInStream *inStream, Byte *outBuffer
   return SZ_OK;
 }
 
+/* the independent segments need the whole packed stream in memory */
+static SRes SzDecodeLzma2Mt(CSzCoderInfo *coder, UInt64 inSize, ILookInStream *inStream,
+    Byte *outBuffer, SizeT outSize, unsigned numThreads, ISzAlloc *allocMain)
+{
+  SizeT inSizeCur = (SizeT)inSize;
+  Byte *inBuf;
+  SRes res;
+  if (coder->Props.size != 1)
+    return SZ_ERROR_DATA;
+  if (inSizeCur != inSize)
+    return SZ_ERROR_MEM;
+  inBuf = (Byte *)IAlloc_Alloc(allocMain, inSizeCur);
+  if (inBuf == 0 && inSizeCur != 0)
+    return SZ_ERROR_MEM;
+  res = SzDecodeCopy(inSize, inStream, inBuf);
+  if (res == SZ_OK)
+    res = Lzma2DecMt_Decode(outBuffer, outSize, inBuf, inSizeCur, coder->Props.data[0], numThreads, allocMain);
+  IAlloc_Free(allocMain, inBuf);
+  if (res == SZ_ERROR_INPUT_EOF)
+    res = SZ_ERROR_DATA;
+  return res;
+}
+
 static Bool IS_MAIN_METHOD(UInt32 m)
 {
   switch(m)
@@ -330,141 +354,1014 @@ static UInt64 GetSum(const UInt64 *values, UInt32 index)
   return sum;
 }
 
-#define CASE_BRA_CONV(isa) case k_ ## isa: isa ## _Convert(outBuffer, outSize, 0, 0); break;
+static SRes SzDecodeCoder(CSzCoderInfo *coder, UInt64 inSize, ILookInStream *inStream,
+    Byte *outBuffer, SizeT outSize, unsigned numThreads, ISzAlloc *allocMain)
+{
+  switch ((UInt32)coder->MethodID)
+  {
+    case k_Copy:
+      if (inSize != outSize) /* check it */
+        return SZ_ERROR_DATA;
+      return SzDecodeCopy(inSize, inStream, outBuffer);
+    case k_LZMA:
+      return SzDecodeLzma(coder, inSize, inStream, outBuffer, outSize, allocMain);
+    case k_LZMA2:
+      if (numThreads > 1)
+        return SzDecodeLzma2Mt(coder, inSize, inStream, outBuffer, outSize, numThreads, allocMain);
+      return SzDecodeLzma2(coder, inSize, inStream, outBuffer, outSize, allocMain);
+    #ifdef _7ZIP_PPMD_SUPPPORT
+    case k_PPMD:
+      return SzDecodePpmd(coder, inSize, inStream, outBuffer, outSize, allocMain);
+    #endif
+  }
+  return SZ_ERROR_UNSUPPORTED;
+}
+
+#define STREAM_DIC_MIN (1 << 12)
+#define LZMA2_DIC_SIZE_FROM_PROP(p) (((UInt32)2 | ((p) & 1)) << ((p) / 2 + 11))
+
+static SizeT GetStreamDicSize(UInt32 dicSize, UInt64 outSize)
+{
+  if (dicSize < STREAM_DIC_MIN)
+    dicSize = STREAM_DIC_MIN;
+  if (outSize < dicSize)
+    return (outSize == 0) ? 1 : (SizeT)outSize;
+  return (SizeT)dicSize;
+}
 
-static SRes SzFolder_Decode2(const CSzFolder *folder, const UInt64 *packSizes,
+
+/* ---------- BCJ2 ---------- */
+
+#define BCJ2_IN_BUF_SIZE (1 << 16)
+#define BCJ2_OUT_BUF_SIZE (1 << 16)
+
+/* One input stream of the BCJ2 decoder. LZMA and LZMA2 streams are decoded piece by piece
+   into a ring buffer the size of the dictionary, stored streams are read through a small
+   buffer. Other methods (PPMd) are decoded at once into a buffer of the full size (inMem).
+   The streams share inStream, so each Read seeks to the current packed position. */
+typedef struct
+{
+  UInt32 methodID;
+  Bool inMem;
+  Bool finished;
+  UInt64 packPos;
+  UInt64 packRem;
+  UInt64 unpackRem;
+  const Byte *data;
+  Byte *buf;
+  CLzma2Dec dec;
+} CBcj2InStream;
+
+static void Bcj2InStream_Construct(CBcj2InStream *p)
+{
+  p->inMem = False;
+  p->finished = False;
+  p->buf = NULL;
+  Lzma2Dec_Construct(&p->dec);
+}
+
+static void Bcj2InStream_Free(CBcj2InStream *p, ISzAlloc *alloc)
+{
+  IAlloc_Free(alloc, p->buf);
+  p->buf = NULL;
+  IAlloc_Free(alloc, p->dec.decoder.dic);
+  p->dec.decoder.dic = NULL;
+  LzmaDec_FreeProbs(&p->dec.decoder, alloc);
+}
+
+/* the data is already in memory: the main stream decoded in place */
+static void Bcj2InStream_InitMem(CBcj2InStream *p, const Byte *data, SizeT size)
+{
+  p->inMem = True;
+  p->data = data;
+  p->unpackRem = size;
+}
+
+/* coder is NULL for the range coder stream, that is always stored */
+static SRes Bcj2InStream_Init(CBcj2InStream *p, CSzCoderInfo *coder,
+    ILookInStream *inStream, UInt64 packPos, UInt64 packSize, UInt64 unpackSize, ISzAlloc *alloc)
+{
+  p->methodID = (coder == NULL) ? k_Copy : (UInt32)coder->MethodID;
+  p->packPos = packPos;
+  p->packRem = packSize;
+  p->unpackRem = unpackSize;
+
+  switch (p->methodID)
+  {
+    case k_Copy:
+    {
+      SizeT size = BCJ2_IN_BUF_SIZE;
+      if (packSize != unpackSize)
+        return SZ_ERROR_DATA;
+      if (size > unpackSize)
+        size = (unpackSize == 0) ? 1 : (SizeT)unpackSize;
+      p->buf = (Byte *)IAlloc_Alloc(alloc, size);
+      return (p->buf == 0) ? SZ_ERROR_MEM : SZ_OK;
+    }
+    case k_LZMA:
+    {
+      CLzmaProps props;
+      RINOK(LzmaProps_Decode(&props, coder->Props.data, (unsigned)coder->Props.size));
+      RINOK(LzmaDec_AllocateProbs(&p->dec.decoder, coder->Props.data, (unsigned)coder->Props.size, alloc));
+      p->dec.decoder.dicBufSize = GetStreamDicSize(props.dicSize, unpackSize);
+      p->dec.decoder.dic = (Byte *)IAlloc_Alloc(alloc, p->dec.decoder.dicBufSize);
+      if (p->dec.decoder.dic == 0)
+        return SZ_ERROR_MEM;
+      LzmaDec_Init(&p->dec.decoder);
+      return SZ_OK;
+    }
+    case k_LZMA2:
+    {
+      Byte prop;
+      if (coder->Props.size != 1)
+        return SZ_ERROR_DATA;
+      prop = coder->Props.data[0];
+      if (prop > 40)
+        return SZ_ERROR_UNSUPPORTED;
+      RINOK(Lzma2Dec_AllocateProbs(&p->dec, prop, alloc));
+      p->dec.decoder.dicBufSize = GetStreamDicSize((prop == 40) ? 0xFFFFFFFF : LZMA2_DIC_SIZE_FROM_PROP(prop), unpackSize);
+      p->dec.decoder.dic = (Byte *)IAlloc_Alloc(alloc, p->dec.decoder.dicBufSize);
+      if (p->dec.decoder.dic == 0)
+        return SZ_ERROR_MEM;
+      Lzma2Dec_Init(&p->dec);
+      return SZ_OK;
+    }
+  }
+  {
+    SizeT size = (SizeT)unpackSize;
+    if (size != unpackSize)
+      return SZ_ERROR_MEM;
+    p->buf = (Byte *)IAlloc_Alloc(alloc, size);
+    if (p->buf == 0 && size != 0)
+      return SZ_ERROR_MEM;
+    RINOK(LookInStream_SeekTo(inStream, packPos));
+    RINOK(SzDecodeCoder(coder, packSize, inStream, p->buf, size, 1, alloc));
+    Bcj2InStream_InitMem(p, p->buf, size);
+    return SZ_OK;
+  }
+}
+
+/* Returns the next piece of the stream in (*data, *size), or (*size == 0) at its end.
+   The piece stays valid until the next call. */
+static SRes Bcj2InStream_Read(CBcj2InStream *p, ILookInStream *inStream, const Byte **data, SizeT *size)
+{
+  CLzmaDec *dec = &p->dec.decoder;
+  SizeT dicPos, dicLimit;
+  ELzmaFinishMode finishMode = LZMA_FINISH_ANY;
+
+  *size = 0;
+  if (p->inMem)
+  {
+    *data = p->data;
+    *size = (SizeT)p->unpackRem;
+    p->unpackRem = 0;
+    return SZ_OK;
+  }
+
+  if (p->methodID == k_Copy)
+  {
+    SizeT cur = BCJ2_IN_BUF_SIZE;
+    if (cur > p->unpackRem)
+      cur = (SizeT)p->unpackRem;
+    if (cur == 0)
+      return SZ_OK;
+    RINOK(LookInStream_SeekTo(inStream, p->packPos));
+    RINOK(LookInStream_Read(inStream, p->buf, cur));
+    p->packPos += cur;
+    p->unpackRem -= cur;
+    *data = p->buf;
+    *size = cur;
+    return SZ_OK;
+  }
+
+  if (p->finished)
+    return SZ_OK;
+  if (dec->dicPos == dec->dicBufSize)
+    dec->dicPos = 0;
+  dicPos = dec->dicPos;
+  dicLimit = dec->dicBufSize;
+  if (p->unpackRem <= dicLimit - dicPos)
+  {
+    dicLimit = dicPos + (SizeT)p->unpackRem;
+    finishMode = LZMA_FINISH_END;
+  }
+  RINOK(LookInStream_SeekTo(inStream, p->packPos));
+
+  for (;;)
+  {
+    Byte *inBuf = NULL;
+    size_t lookahead = (1 << 18);
+    SizeT inProcessed, outPos = dec->dicPos;
+    ELzmaStatus status;
+    if (lookahead > p->packRem)
+      lookahead = (size_t)p->packRem;
+    RINOK(inStream->Look((void *)inStream, (const void **)&inBuf, &lookahead));
+    inProcessed = (SizeT)lookahead;
+    if (p->methodID == k_LZMA)
+    {
+      RINOK(LzmaDec_DecodeToDic(dec, dicLimit, inBuf, &inProcessed, finishMode, &status));
+    }
+    else
+    {
+      RINOK(Lzma2Dec_DecodeToDic(&p->dec, dicLimit, inBuf, &inProcessed, finishMode, &status));
+    }
+    p->packPos += inProcessed;
+    p->packRem -= inProcessed;
+    RINOK(inStream->Skip((void *)inStream, inProcessed));
+    if (dec->dicPos == dicLimit)
+    {
+      if (finishMode == LZMA_FINISH_ANY)
+        break;
+      if (status == LZMA_STATUS_FINISHED_WITH_MARK ||
+          (p->methodID == k_LZMA && status == LZMA_STATUS_MAYBE_FINISHED_WITHOUT_MARK))
+      {
+        if (inProcessed != lookahead)
+          return SZ_ERROR_DATA;
+        p->finished = True;
+        break;
+      }
+    }
+    if (inProcessed == 0 && dec->dicPos == outPos)
+      return SZ_ERROR_DATA;
+  }
+
+  *data = dec->dic + dicPos;
+  *size = dec->dicPos - dicPos;
+  p->unpackRem -= *size;
+  return SZ_OK;
+}
+
+/*
+Decodes a BCJ2 folder with CBcj2Dec. The call, jump and range coder streams are decoded
+piece by piece, so they take only the dictionaries of their coders instead of buffers of
+their full sizes.
+If outStream is NULL, the output goes to outBuffer and the main stream is decoded first to
+the end of outBuffer, where the BCJ2 decoder overwrites it only after reading it.
+Otherwise the main stream is decoded piece by piece too, and the output goes to outStream.
+*/
+static SRes SzFolder_DecodeBcj2(const CSzFolder *folder, const UInt64 *packSizes,
     ILookInStream *inStream, UInt64 startPos,
-    Byte *outBuffer, SizeT outSize, ISzAlloc *allocMain,
-    Byte *tempBuf[])
+    Byte *outBuffer, SizeT outSize, IFolderOutStream *outStream,
+    unsigned numThreads, ISzAlloc *allocMain)
 {
-  UInt32 ci;
-  SizeT tempSizes[3] = { 0, 0, 0};
-  SizeT tempSize3 = 0;
-  Byte *tempBuf3 = 0;
+  /* the coder and the pack stream of BCJ2 input stream i */
+  static const unsigned coderIndices[3] = { 2, 1, 0 };
+  static const unsigned packIndices[BCJ2_NUM_STREAMS] = { 0, 2, 3, 1 };
+  CBcj2InStream streams[BCJ2_NUM_STREAMS];
+  CBcj2Dec dec;
+  Byte *outBuf = NULL;
+  SizeT outBufSize = 0;
+  UInt64 outRem = folder->UnpackSizes[3];
+  unsigned i;
+  SRes res = SZ_OK;
+
+  for (i = 0; i < BCJ2_NUM_STREAMS; i++)
+  {
+    Bcj2InStream_Construct(&streams[i]);
+    dec.bufs[i] = dec.lims[i] = NULL;
+  }
 
+  if (outStream == NULL)
+  {
+    UInt64 mainSize = folder->UnpackSizes[coderIndices[BCJ2_STREAM_MAIN]];
+    Byte *mainBuf;
+    if (mainSize > outSize) /* check it */
+      return SZ_ERROR_PARAM;
+    mainBuf = outBuffer + (outSize - (SizeT)mainSize);
+    RINOK(LookInStream_SeekTo(inStream, startPos + GetSum(packSizes, packIndices[BCJ2_STREAM_MAIN])));
+    RINOK(SzDecodeCoder(&folder->Coders[coderIndices[BCJ2_STREAM_MAIN]], packSizes[packIndices[BCJ2_STREAM_MAIN]],
+        inStream, mainBuf, (SizeT)mainSize, numThreads, allocMain));
+    Bcj2InStream_InitMem(&streams[BCJ2_STREAM_MAIN], mainBuf, (SizeT)mainSize);
+  }
+  else
+  {
+    outBufSize = BCJ2_OUT_BUF_SIZE;
+    if (outBufSize > outRem)
+      outBufSize = (outRem == 0) ? 1 : (SizeT)outRem;
+    outBuf = (Byte *)IAlloc_Alloc(allocMain, outBufSize);
+    if (outBuf == 0)
+      return SZ_ERROR_MEM;
+  }
+
+  for (i = (outStream == NULL) ? 1 : 0; i < BCJ2_NUM_STREAMS && res == SZ_OK; i++)
+  {
+    unsigned si = packIndices[i];
+    if (i == BCJ2_STREAM_RC)
+      res = Bcj2InStream_Init(&streams[i], NULL, inStream,
+          startPos + GetSum(packSizes, si), packSizes[si], packSizes[si], allocMain);
+    else
+      res = Bcj2InStream_Init(&streams[i], &folder->Coders[coderIndices[i]], inStream,
+          startPos + GetSum(packSizes, si), packSizes[si], folder->UnpackSizes[coderIndices[i]], allocMain);
+  }
+
+  Bcj2Dec_Init(&dec);
+  if (outStream == NULL)
+  {
+    dec.dest = outBuffer;
+    dec.destLim = outBuffer + outSize;
+  }
+  else
+  {
+    dec.dest = outBuf;
+    dec.destLim = outBuf;
+  }
+
+  while (res == SZ_OK)
+  {
+    Bcj2Dec_Decode(&dec);
+    if (dec.dest == dec.destLim)
+    {
+      SizeT cur = outBufSize;
+      if (outStream == NULL)
+        break;
+      if (dec.dest != outBuf)
+      {
+        res = outStream->Write(outStream, outBuf, dec.dest - outBuf);
+        if (res != SZ_OK)
+          break;
+      }
+      if (outRem == 0)
+        break;
+      if (cur > outRem)
+        cur = (SizeT)outRem;
+      dec.dest = outBuf;
+      dec.destLim = outBuf + cur;
+      outRem -= cur;
+    }
+    else
+    {
+      const Byte *data = NULL;
+      SizeT size;
+      res = Bcj2InStream_Read(&streams[dec.state], inStream, &data, &size);
+      if (res == SZ_OK && size == 0)
+        res = SZ_ERROR_DATA;
+      dec.bufs[dec.state] = data;
+      dec.lims[dec.state] = data + size;
+    }
+  }
+
+  /* the rest of the streams (normally nothing) is read only to check their ends */
+  for (i = 0; i < BCJ2_NUM_STREAMS && res == SZ_OK; i++)
+  {
+    for (;;)
+    {
+      const Byte *data = NULL;
+      SizeT size;
+      res = Bcj2InStream_Read(&streams[i], inStream, &data, &size);
+      if (res != SZ_OK || size == 0)
+        break;
+    }
+  }
+
+  for (i = 0; i < BCJ2_NUM_STREAMS; i++)
+    Bcj2InStream_Free(&streams[i], allocMain);
+  IAlloc_Free(allocMain, outBuf);
+  return res;
+}
+
+
+#define CASE_BRA_CONV(isa) case k_ ## isa: isa ## _Convert(outBuffer, outSize, 0, 0); break;
+
+SRes SzFolder_DecodeMt(const CSzFolder *folder, const UInt64 *packSizes,
+    ILookInStream *inStream, UInt64 startPos,
+    Byte *outBuffer, size_t outSize, unsigned numThreads, ISzAlloc *allocMain)
+{
   RINOK(CheckSupportedFolder(folder));
 
-  for (ci = 0; ci < folder->NumCoders; ci++)
+  if (folder->NumCoders == 4)
+    return SzFolder_DecodeBcj2(folder, packSizes, inStream, startPos,
+        outBuffer, (SizeT)outSize, NULL, numThreads, allocMain);
+
+  RINOK(LookInStream_SeekTo(inStream, startPos));
+  RINOK(SzDecodeCoder(&folder->Coders[0], packSizes[0], inStream, outBuffer, (SizeT)outSize, numThreads, allocMain));
+
+  if (folder->NumCoders == 2)
+  {
+    switch(folder->Coders[1].MethodID)
+    {
+      case k_BCJ:
+      {
+        UInt32 state;
+        x86_Convert_Init(state);
+        x86_Convert(outBuffer, outSize, 0, &state, 0);
+        break;
+      }
+      CASE_BRA_CONV(ARM)
+      default:
+        return SZ_ERROR_UNSUPPORTED;
+    }
+  }
+  return SZ_OK;
+}
+
+SRes SzFolder_Decode(const CSzFolder *folder, const UInt64 *packSizes,
+    ILookInStream *inStream, UInt64 startPos,
+    Byte *outBuffer, size_t outSize, ISzAlloc *allocMain)
+{
+  return SzFolder_DecodeMt(folder, packSizes, inStream, startPos, outBuffer, outSize, 1, allocMain);
+}
+
+/* ---------- Streaming decode ---------- */
+
+#define STREAM_FILTER_BUF_SIZE (1 << 16)
+
+/* Runs the branch filter (if any) over the decoder output before it goes to outStream.
+   The converters leave the last few bytes of a buffer alone when an instruction might
+   continue past its end, so those are carried over to the next call. */
+typedef struct
+{
+  IFolderOutStream *outStream;
+  UInt32 methodID;
+  UInt32 ip;
+  UInt32 x86State;
+  size_t pos;
+  Byte *buf;
+} CFilterStream;
+
+static SizeT FilterStream_Convert(CFilterStream *p, SizeT size)
+{
+  SizeT processed = 0;
+  switch (p->methodID)
+  {
+    case k_BCJ: processed = x86_Convert(p->buf, size, p->ip, &p->x86State, 0); break;
+    case k_ARM: processed = ARM_Convert(p->buf, size, p->ip, 0); break;
+  }
+  p->ip += (UInt32)processed;
+  return processed;
+}
+
+static SRes FilterStream_Write(CFilterStream *p, const Byte *data, size_t size)
+{
+  if (p->methodID == k_Copy)
+    return size == 0 ? SZ_OK : p->outStream->Write(p->outStream, data, size);
+
+  while (size != 0)
   {
-    CSzCoderInfo *coder = &folder->Coders[ci];
+    size_t cur = STREAM_FILTER_BUF_SIZE - p->pos;
+    if (cur > size)
+      cur = size;
+    memcpy(p->buf + p->pos, data, cur);
+    p->pos += cur;
+    data += cur;
+    size -= cur;
+
+    if (p->pos == STREAM_FILTER_BUF_SIZE)
+    {
+      SizeT processed = FilterStream_Convert(p, p->pos);
+      if (processed == 0)
+        processed = p->pos; /* can't happen with a buffer this big */
+      RINOK(p->outStream->Write(p->outStream, p->buf, processed));
+      p->pos -= processed;
+      memmove(p->buf, p->buf + processed, p->pos);
+    }
+  }
+  return SZ_OK;
+}
+
+static SRes FilterStream_Flush(CFilterStream *p)
+{
+  if (p->methodID == k_Copy || p->pos == 0)
+    return SZ_OK;
+  FilterStream_Convert(p, p->pos);
+  RINOK(p->outStream->Write(p->outStream, p->buf, p->pos));
+  p->pos = 0;
+  return SZ_OK;
+}
+
+/* Decodes into a ring buffer the size of the dictionary and hands every newly
+   decoded range to outStream before it gets overwritten */
+static SRes SzDecodeLzmaToStream(CSzCoderInfo *coder, UInt64 inSize, ILookInStream *inStream,
+    UInt64 outSize, CFilterStream *outStream, ISzAlloc *allocMain)
+{
+  CLzmaDec state;
+  CLzmaProps props;
+  SRes res = SZ_OK;
+
+  RINOK(LzmaProps_Decode(&props, coder->Props.data, (unsigned)coder->Props.size));
+  LzmaDec_Construct(&state);
+  RINOK(LzmaDec_AllocateProbs(&state, coder->Props.data, (unsigned)coder->Props.size, allocMain));
+  state.dicBufSize = GetStreamDicSize(props.dicSize, outSize);
+  state.dic = (Byte *)IAlloc_Alloc(allocMain, state.dicBufSize);
+  if (state.dic == 0)
+  {
+    LzmaDec_FreeProbs(&state, allocMain);
+    return SZ_ERROR_MEM;
+  }
+  LzmaDec_Init(&state);
+
+  for (;;)
+  {
+    Byte *inBuf = NULL;
+    size_t lookahead = (1 << 18);
+    if (lookahead > inSize)
+      lookahead = (size_t)inSize;
+    res = inStream->Look((void *)inStream, (const void **)&inBuf, &lookahead);
+    if (res != SZ_OK)
+      break;
 
-    if (IS_MAIN_METHOD((UInt32)coder->MethodID))
     {
-      UInt32 si = 0;
-      UInt64 offset;
-      UInt64 inSize;
-      Byte *outBufCur = outBuffer;
-      SizeT outSizeCur = outSize;
-      if (folder->NumCoders == 4)
+      SizeT inProcessed = (SizeT)lookahead, dicPos, dicLimit = state.dicBufSize, outProcessed;
+      ELzmaFinishMode finishMode = LZMA_FINISH_ANY;
+      ELzmaStatus status;
+
+      if (state.dicPos == state.dicBufSize)
+        state.dicPos = 0;
+      dicPos = state.dicPos;
+      if (outSize <= dicLimit - dicPos)
       {
-        UInt32 indices[] = { 3, 2, 0 };
-        UInt64 unpackSize = folder->UnpackSizes[ci];
-        si = indices[ci];
-        if (ci < 2)
-        {
-          Byte *temp;
-          outSizeCur = (SizeT)unpackSize;
-          if (outSizeCur != unpackSize)
-            return SZ_ERROR_MEM;
-          temp = (Byte *)IAlloc_Alloc(allocMain, outSizeCur);
-          if (temp == 0 && outSizeCur != 0)
-            return SZ_ERROR_MEM;
-          outBufCur = tempBuf[1 - ci] = temp;
-          tempSizes[1 - ci] = outSizeCur;
-        }
-        else if (ci == 2)
+        dicLimit = dicPos + (SizeT)outSize;
+        finishMode = LZMA_FINISH_END;
+      }
+
+      res = LzmaDec_DecodeToDic(&state, dicLimit, inBuf, &inProcessed, finishMode, &status);
+      lookahead -= inProcessed;
+      inSize -= inProcessed;
+      outProcessed = state.dicPos - dicPos;
+      outSize -= outProcessed;
+      if (res == SZ_OK)
+        res = FilterStream_Write(outStream, state.dic + dicPos, outProcessed);
+      if (res != SZ_OK)
+        break;
+      if (outSize == 0 || (inProcessed == 0 && outProcessed == 0))
+      {
+        if (outSize != 0 || lookahead != 0 ||
+            (status != LZMA_STATUS_FINISHED_WITH_MARK &&
+             status != LZMA_STATUS_MAYBE_FINISHED_WITHOUT_MARK))
+          res = SZ_ERROR_DATA;
+        break;
+      }
+      res = inStream->Skip((void *)inStream, inProcessed);
+      if (res != SZ_OK)
+        break;
+    }
+  }
+
+  IAlloc_Free(allocMain, state.dic);
+  LzmaDec_FreeProbs(&state, allocMain);
+  return res;
+}
+
+static SRes SzDecodeLzma2ToStream(CSzCoderInfo *coder, UInt64 inSize, ILookInStream *inStream,
+    UInt64 outSize, CFilterStream *outStream, ISzAlloc *allocMain)
+{
+  CLzma2Dec state;
+  Byte prop;
+  SRes res = SZ_OK;
+
+  if (coder->Props.size != 1)
+    return SZ_ERROR_DATA;
+  prop = coder->Props.data[0];
+  if (prop > 40)
+    return SZ_ERROR_UNSUPPORTED;
+  Lzma2Dec_Construct(&state);
+  RINOK(Lzma2Dec_AllocateProbs(&state, prop, allocMain));
+  state.decoder.dicBufSize = GetStreamDicSize((prop == 40) ? 0xFFFFFFFF : LZMA2_DIC_SIZE_FROM_PROP(prop), outSize);
+  state.decoder.dic = (Byte *)IAlloc_Alloc(allocMain, state.decoder.dicBufSize);
+  if (state.decoder.dic == 0)
+  {
+    Lzma2Dec_FreeProbs(&state, allocMain);
+    return SZ_ERROR_MEM;
+  }
+  Lzma2Dec_Init(&state);
+
+  for (;;)
+  {
+    Byte *inBuf = NULL;
+    size_t lookahead = (1 << 18);
+    if (lookahead > inSize)
+      lookahead = (size_t)inSize;
+    res = inStream->Look((void *)inStream, (const void **)&inBuf, &lookahead);
+    if (res != SZ_OK)
+      break;
+
+    {
+      SizeT inProcessed = (SizeT)lookahead, dicPos, dicLimit = state.decoder.dicBufSize, outProcessed;
+      ELzmaFinishMode finishMode = LZMA_FINISH_ANY;
+      ELzmaStatus status;
+
+      if (state.decoder.dicPos == state.decoder.dicBufSize)
+        state.decoder.dicPos = 0;
+      dicPos = state.decoder.dicPos;
+      if (outSize <= dicLimit - dicPos)
+      {
+        dicLimit = dicPos + (SizeT)outSize;
+        finishMode = LZMA_FINISH_END;
+      }
+
+      res = Lzma2Dec_DecodeToDic(&state, dicLimit, inBuf, &inProcessed, finishMode, &status);
+      lookahead -= inProcessed;
+      inSize -= inProcessed;
+      outProcessed = state.decoder.dicPos - dicPos;
+      outSize -= outProcessed;
+      if (res == SZ_OK)
+        res = FilterStream_Write(outStream, state.decoder.dic + dicPos, outProcessed);
+      if (res != SZ_OK)
+        break;
+      if (inProcessed == 0 && outProcessed == 0)
+      {
+        if (outSize != 0 || lookahead != 0 || status != LZMA_STATUS_FINISHED_WITH_MARK)
+          res = SZ_ERROR_DATA;
+        break;
+      }
+      res = inStream->Skip((void *)inStream, inProcessed);
+      if (res != SZ_OK)
+        break;
+    }
+  }
+
+  IAlloc_Free(allocMain, state.decoder.dic);
+  Lzma2Dec_FreeProbs(&state, allocMain);
+  return res;
+}
+
+#define LZMA2_CONTROL_LZMA (1 << 7)
+#define LZMA2_CONTROL_COPY_NO_RESET 2
+#define LZMA2_CONTROL_COPY_RESET_DIC 1
+#define LZMA2_CONTROL_EOF 0
+
+/*
+Reads up to numThreads whole segments (runs of chunks that start with a dictionary reset,
+see Lzma2DecMt_Decode) into memory, ends them with an end marker, decodes them with
+Lzma2DecMt_Decode and passes the result to outStream, then goes on with the next ones.
+From the first segment that is bigger than SZ_DECODE_MT_SEGMENT_MAX, packed or unpacked,
+SzDecodeLzma2ToStream decodes the rest of the stream: a fresh decoder starts at
+a dictionary reset in the same state as the one that got there.
+If the memory for a batch can't be allocated, SzDecodeLzma2ToStream decodes the rest
+of the stream from the start of that batch in the same way.
+*/
+
+static SRes SzReadToDynBuf(CDynBuf *buf, ILookInStream *inStream, size_t size, ISzAlloc *alloc)
+{
+  while (size != 0)
+  {
+    const void *inBuf;
+    size_t curSize = size;
+    RINOK(inStream->Look((void *)inStream, &inBuf, &curSize));
+    if (curSize == 0)
+      return SZ_ERROR_INPUT_EOF;
+    if (!DynBuf_Write(buf, (const Byte *)inBuf, curSize, alloc))
+      return SZ_ERROR_MEM;
+    size -= curSize;
+    RINOK(inStream->Skip((void *)inStream, curSize));
+  }
+  return SZ_OK;
+}
+
+static SRes SzDecodeLzma2ToStreamMt(CSzCoderInfo *coder, UInt64 startPos, UInt64 inSize,
+    ILookInStream *inStream, UInt64 outSize, CFilterStream *outStream, unsigned numThreads,
+    ISzAlloc *allocMain)
+{
+  CDynBuf pack;
+  const Byte eof = LZMA2_CONTROL_EOF;
+  Byte *unpackBuf = NULL;
+  size_t unpackBufSize = 0;
+  UInt64 packPos = 0;
+  Bool finished = False;
+  Bool fallBack = False;
+  SRes res = SZ_OK;
+
+  if (coder->Props.size != 1)
+    return SZ_ERROR_DATA;
+  DynBuf_Construct(&pack);
+
+  while (res == SZ_OK && !finished)
+  {
+    /* segPackPos / segUnpackPos are where the last segment read so far starts in the batch */
+    size_t unpackSize = 0, segPackPos = 0, segUnpackPos = 0;
+    unsigned numSegments = 0;
+    Bool tooBig = False;
+
+    DynBuf_SeekToBeg(&pack);
+    for (;;)
+    {
+      const void *inBuf;
+      size_t curSize = 1, headerSize, chunkPack, chunkUnpack;
+      const Byte *header;
+      unsigned control;
+      Bool resetDic;
+
+      res = inStream->Look((void *)inStream, &inBuf, &curSize);
+      if (res != SZ_OK)
+        break;
+      if (curSize == 0 || packPos + pack.pos == inSize)
+      {
+        res = SZ_ERROR_DATA;
+        break;
+      }
+      control = *(const Byte *)inBuf;
+      if (control == LZMA2_CONTROL_EOF)
+      {
+        finished = True;
+        break;
+      }
+      if ((control & LZMA2_CONTROL_LZMA) == 0)
+      {
+        if (control > LZMA2_CONTROL_COPY_NO_RESET)
         {
-          if (unpackSize > outSize) /* check it */
-            return SZ_ERROR_PARAM;
-          tempBuf3 = outBufCur = outBuffer + (outSize - (size_t)unpackSize);
-          tempSize3 = outSizeCur = (SizeT)unpackSize;
+          res = SZ_ERROR_DATA;
+          break;
         }
-        else
-          return SZ_ERROR_UNSUPPORTED;
+        headerSize = 3;
+        resetDic = (control == LZMA2_CONTROL_COPY_RESET_DIC);
+      }
+      else
+      {
+        headerSize = (((control >> 5) & 3) >= 2) ? 6 : 5;
+        resetDic = (((control >> 5) & 3) == 3);
       }
-      offset = GetSum(packSizes, si);
-      inSize = packSizes[si];
-      RINOK(LookInStream_SeekTo(inStream, startPos + offset));
 
-      if (coder->MethodID == k_Copy)
+      if (resetDic)
       {
-        if (inSize != outSizeCur) /* check it */
-          return SZ_ERROR_DATA;
-        RINOK(SzDecodeCopy(inSize, inStream, outBufCur));
+        if (numSegments == numThreads)
+          break;
+        segPackPos = pack.pos;
+        segUnpackPos = unpackSize;
+        numSegments++;
+      }
+      else if (numSegments == 0)
+      {
+        res = SZ_ERROR_DATA;
+        break;
       }
-      else if (coder->MethodID == k_LZMA)
+
+      if (inSize - packPos - pack.pos < headerSize)
       {
-        RINOK(SzDecodeLzma(coder, inSize, inStream, outBufCur, outSizeCur, allocMain));
+        res = SZ_ERROR_DATA;
+        break;
       }
-      else if (coder->MethodID == k_LZMA2)
+      res = SzReadToDynBuf(&pack, inStream, headerSize, allocMain);
+      if (res != SZ_OK)
+        break;
+      header = pack.data + pack.pos - headerSize;
+      if (headerSize == 3)
       {
-        RINOK(SzDecodeLzma2(coder, inSize, inStream, outBufCur, outSizeCur, allocMain));
+        chunkUnpack = ((size_t)header[1] << 8 | header[2]) + 1;
+        chunkPack = chunkUnpack;
       }
       else
       {
-        #ifdef _7ZIP_PPMD_SUPPPORT
-        RINOK(SzDecodePpmd(coder, inSize, inStream, outBufCur, outSizeCur, allocMain));
-        #else
-        return SZ_ERROR_UNSUPPORTED;
-        #endif
+        chunkUnpack = ((size_t)(control & 0x1F) << 16 | (size_t)header[1] << 8 | header[2]) + 1;
+        chunkPack = ((size_t)header[3] << 8 | header[4]) + 1;
+      }
+      if (inSize - packPos - pack.pos < chunkPack || outSize - unpackSize < chunkUnpack)
+      {
+        res = SZ_ERROR_DATA;
+        break;
+      }
+      if (pack.pos + chunkPack - segPackPos > SZ_DECODE_MT_SEGMENT_MAX ||
+          unpackSize + chunkUnpack - segUnpackPos > SZ_DECODE_MT_SEGMENT_MAX)
+      {
+        tooBig = True;
+        break;
       }
+      res = SzReadToDynBuf(&pack, inStream, chunkPack, allocMain);
+      if (res != SZ_OK)
+        break;
+      unpackSize += chunkUnpack;
     }
-    else if (coder->MethodID == k_BCJ2)
+    if (res != SZ_OK)
     {
-      UInt64 offset = GetSum(packSizes, 1);
-      UInt64 s3Size = packSizes[1];
-      SRes res;
-      if (ci != 3)
-        return SZ_ERROR_UNSUPPORTED;
-      RINOK(LookInStream_SeekTo(inStream, startPos + offset));
-      tempSizes[2] = (SizeT)s3Size;
-      if (tempSizes[2] != s3Size)
-        return SZ_ERROR_MEM;
-      tempBuf[2] = (Byte *)IAlloc_Alloc(allocMain, tempSizes[2]);
-      if (tempBuf[2] == 0 && tempSizes[2] != 0)
-        return SZ_ERROR_MEM;
-      res = SzDecodeCopy(s3Size, inStream, tempBuf[2]);
-      RINOK(res)
-
-      res = Bcj2_Decode(
-          tempBuf3, tempSize3,
-          tempBuf[0], tempSizes[0],
-          tempBuf[1], tempSizes[1],
-          tempBuf[2], tempSizes[2],
-          outBuffer, outSize);
-      RINOK(res)
+      fallBack = (res == SZ_ERROR_MEM);
+      break;
     }
+
+    /* the segment that didn't fit is read again */
+    if (tooBig)
+    {
+      pack.pos = segPackPos;
+      unpackSize = segUnpackPos;
+      numSegments--;
+    }
+
+    if (numSegments != 0)
+    {
+      if (unpackSize > unpackBufSize)
+      {
+        IAlloc_Free(allocMain, unpackBuf);
+        unpackBufSize = unpackSize;
+        unpackBuf = (Byte *)IAlloc_Alloc(allocMain, unpackBufSize);
+        if (unpackBuf == 0)
+          res = SZ_ERROR_MEM;
+      }
+      if (res == SZ_OK && !DynBuf_Write(&pack, &eof, 1, allocMain))
+        res = SZ_ERROR_MEM;
+      if (res == SZ_OK)
+        res = Lzma2DecMt_Decode(unpackBuf, unpackSize, pack.data, pack.pos,
+            coder->Props.data[0], numThreads, allocMain);
+      if (res == SZ_ERROR_MEM)
+      {
+        fallBack = True;
+        break;
+      }
+      if (res == SZ_ERROR_INPUT_EOF)
+        res = SZ_ERROR_DATA;
+      if (res == SZ_OK)
+        res = FilterStream_Write(outStream, unpackBuf, unpackSize);
+      packPos += pack.pos - 1;
+      outSize -= unpackSize;
+    }
+
+    if (res == SZ_OK && finished)
+    {
+      res = inStream->Skip((void *)inStream, 1);
+      if (res == SZ_OK && (packPos + 1 != inSize || outSize != 0))
+        res = SZ_ERROR_DATA;
+    }
+    else if (res == SZ_OK && tooBig)
+    {
+      res = LookInStream_SeekTo(inStream, startPos + packPos);
+      if (res == SZ_OK && numSegments == 0)
+      {
+        res = SzDecodeLzma2ToStream(coder, inSize - packPos, inStream, outSize, outStream, allocMain);
+        finished = True;
+      }
+    }
+  }
+
+  DynBuf_Free(&pack, allocMain);
+  IAlloc_Free(allocMain, unpackBuf);
+
+  /* nothing of the batch was written yet, and it starts at a dictionary reset */
+  if (fallBack)
+  {
+    res = LookInStream_SeekTo(inStream, startPos + packPos);
+    if (res == SZ_OK)
+      res = SzDecodeLzma2ToStream(coder, inSize - packPos, inStream, outSize, outStream, allocMain);
+  }
+  return res;
+}
+
+#ifdef _7ZIP_PPMD_SUPPPORT
+
+/* PPMd output doesn't depend on earlier output bytes, so a small buffer is enough */
+static SRes SzDecodePpmdToStream(CSzCoderInfo *coder, UInt64 inSize, ILookInStream *inStream,
+    UInt64 outSize, CFilterStream *outStream, ISzAlloc *allocMain)
+{
+  CPpmd7 ppmd;
+  CByteInToLook s;
+  Byte *buf;
+  SRes res = SZ_OK;
+
+  s.p.Read = ReadByte;
+  s.inStream = inStream;
+  s.begin = s.end = s.cur = NULL;
+  s.extra = False;
+  s.res = SZ_OK;
+  s.processed = 0;
+
+  if (coder->Props.size != 5)
+    return SZ_ERROR_UNSUPPORTED;
+
+  buf = (Byte *)IAlloc_Alloc(allocMain, STREAM_FILTER_BUF_SIZE);
+  if (buf == 0)
+    return SZ_ERROR_MEM;
+  {
+    unsigned order = coder->Props.data[0];
+    UInt32 memSize = GetUi32(coder->Props.data + 1);
+    if (order < PPMD7_MIN_ORDER ||
+        order > PPMD7_MAX_ORDER ||
+        memSize < PPMD7_MIN_MEM_SIZE ||
+        memSize > PPMD7_MAX_MEM_SIZE)
+    {
+      IAlloc_Free(allocMain, buf);
+      return SZ_ERROR_UNSUPPORTED;
+    }
+    Ppmd7_Construct(&ppmd);
+    if (!Ppmd7_Alloc(&ppmd, memSize, allocMain))
+    {
+      IAlloc_Free(allocMain, buf);
+      return SZ_ERROR_MEM;
+    }
+    Ppmd7_Init(&ppmd, order);
+  }
+  {
+    CPpmd7z_RangeDec rc;
+    Ppmd7z_RangeDec_CreateVTable(&rc);
+    rc.Stream = &s.p;
+    if (!Ppmd7z_RangeDec_Init(&rc))
+      res = SZ_ERROR_DATA;
+    else if (s.extra)
+      res = (s.res != SZ_OK ? s.res : SZ_ERROR_DATA);
     else
     {
-      if (ci != 1)
-        return SZ_ERROR_UNSUPPORTED;
-      switch(coder->MethodID)
+      while (outSize != 0 && res == SZ_OK)
       {
-        case k_BCJ:
+        size_t cur = STREAM_FILTER_BUF_SIZE, i;
+        if (cur > outSize)
+          cur = (size_t)outSize;
+        for (i = 0; i < cur; i++)
         {
-          UInt32 state;
-          x86_Convert_Init(state);
-          x86_Convert(outBuffer, outSize, 0, &state, 0);
-          break;
+          int sym = Ppmd7_DecodeSymbol(&ppmd, &rc.p);
+          if (s.extra || sym < 0)
+            break;
+          buf[i] = (Byte)sym;
+        }
+        if (i != cur)
+          res = (s.res != SZ_OK ? s.res : SZ_ERROR_DATA);
+        else
+        {
+          res = FilterStream_Write(outStream, buf, cur);
+          outSize -= cur;
         }
-        CASE_BRA_CONV(ARM)
-        default:
-          return SZ_ERROR_UNSUPPORTED;
       }
+      if (res == SZ_OK &&
+          (s.processed + (s.cur - s.begin) != inSize || !Ppmd7z_RangeDec_IsFinishedOK(&rc)))
+        res = SZ_ERROR_DATA;
     }
   }
+  Ppmd7_Free(&ppmd, allocMain);
+  IAlloc_Free(allocMain, buf);
+  return res;
+}
+
+#endif
+
+static SRes SzDecodeCopyToStream(UInt64 inSize, ILookInStream *inStream, CFilterStream *outStream)
+{
+  while (inSize > 0)
+  {
+    void *inBuf;
+    size_t curSize = (1 << 18);
+    if (curSize > inSize)
+      curSize = (size_t)inSize;
+    RINOK(inStream->Look((void *)inStream, (const void **)&inBuf, &curSize));
+    if (curSize == 0)
+      return SZ_ERROR_INPUT_EOF;
+    RINOK(FilterStream_Write(outStream, (const Byte *)inBuf, curSize));
+    inSize -= curSize;
+    RINOK(inStream->Skip((void *)inStream, curSize));
+  }
   return SZ_OK;
 }
 
-SRes SzFolder_Decode(const CSzFolder *folder, const UInt64 *packSizes,
+SRes SzFolder_DecodeToStreamMt(const CSzFolder *folder, const UInt64 *packSizes,
     ILookInStream *inStream, UInt64 startPos,
-    Byte *outBuffer, size_t outSize, ISzAlloc *allocMain)
+    IFolderOutStream *outStream, unsigned numThreads, ISzAlloc *allocMain)
 {
-  Byte *tempBuf[3] = { 0, 0, 0};
-  int i;
-  SRes res = SzFolder_Decode2(folder, packSizes, inStream, startPos,
-      outBuffer, (SizeT)outSize, allocMain, tempBuf);
-  for (i = 0; i < 3; i++)
-    IAlloc_Free(allocMain, tempBuf[i]);
+  CSzCoderInfo *coder;
+  CFilterStream filter;
+  UInt64 unpackSize;
+  SRes res;
+
+  RINOK(CheckSupportedFolder(folder));
+
+  coder = &folder->Coders[0];
+  if (numThreads > LZMA2_DEC_MT_THREADS_MAX)
+    numThreads = LZMA2_DEC_MT_THREADS_MAX;
+
+  if (folder->NumCoders == 4)
+    return SzFolder_DecodeBcj2(folder, packSizes, inStream, startPos, NULL, 0, outStream, 1, allocMain);
+
+  filter.outStream = outStream;
+  filter.methodID = (folder->NumCoders == 2) ? (UInt32)folder->Coders[1].MethodID : k_Copy;
+  filter.ip = 0;
+  x86_Convert_Init(filter.x86State);
+  filter.pos = 0;
+  filter.buf = NULL;
+  if (filter.methodID != k_Copy)
+  {
+    filter.buf = (Byte *)IAlloc_Alloc(allocMain, STREAM_FILTER_BUF_SIZE);
+    if (filter.buf == 0)
+      return SZ_ERROR_MEM;
+  }
+
+  unpackSize = folder->UnpackSizes[0];
+  res = LookInStream_SeekTo(inStream, startPos);
+
+  if (res == SZ_OK)
+  {
+    if (coder->MethodID == k_Copy)
+    {
+      if (packSizes[0] != unpackSize)
+        res = SZ_ERROR_DATA;
+      else
+        res = SzDecodeCopyToStream(packSizes[0], inStream, &filter);
+    }
+    else if (coder->MethodID == k_LZMA)
+      res = SzDecodeLzmaToStream(coder, packSizes[0], inStream, unpackSize, &filter, allocMain);
+    else if (coder->MethodID == k_LZMA2 && numThreads > 1)
+      res = SzDecodeLzma2ToStreamMt(coder, startPos, packSizes[0], inStream, unpackSize, &filter,
+          numThreads, allocMain);
+    else if (coder->MethodID == k_LZMA2)
+      res = SzDecodeLzma2ToStream(coder, packSizes[0], inStream, unpackSize, &filter, allocMain);
+    #ifdef _7ZIP_PPMD_SUPPPORT
+    else if (coder->MethodID == k_PPMD)
+      res = SzDecodePpmdToStream(coder, packSizes[0], inStream, unpackSize, &filter, allocMain);
+    #endif
+    else
+      res = SZ_ERROR_UNSUPPORTED;
+  }
+
+  if (res == SZ_OK)
+    res = FilterStream_Flush(&filter);
+
+  IAlloc_Free(allocMain, filter.buf);
   return res;
 }
+
+SRes SzFolder_DecodeToStream(const CSzFolder *folder, const UInt64 *packSizes,
+    ILookInStream *inStream, UInt64 startPos,
+    IFolderOutStream *outStream, ISzAlloc *allocMain)
+{
+  return SzFolder_DecodeToStreamMt(folder, packSizes, inStream, startPos, outStream, 1, allocMain);
+}
@@ -1,12 +1,15 @@
 /* 7zFile.c -- File IO
 2009-11-24 : Igor Pavlov : Public domain */
 
+#include <string.h>
+
 #include "7zFile.h"
 
 #ifndef USE_WINDOWS_FILE
 
 #ifndef UNDER_CE
 #include <errno.h>
+#include <sys/mman.h>
 #endif
 
 #else
@@ -282,3 +285,137 @@ void FileOutStream_CreateVTable(CFileOutStream *p)
 {
   p->s.Write = FileOutStream_Write;
 }
+
+
+/* ---------- MappedInStream ---------- */
+
+static SRes MappedInStream_Look(void *pp, const void **buf, size_t *size)
+{
+  CMappedInStream *p = (CMappedInStream *)pp;
+  UInt64 rem = p->size - p->pos;
+  if (*size > rem)
+    *size = (size_t)rem;
+  *buf = p->data + (size_t)p->pos;
+  return SZ_OK;
+}
+
+static SRes MappedInStream_Skip(void *pp, size_t offset)
+{
+  CMappedInStream *p = (CMappedInStream *)pp;
+  /* Look and Read compute the remaining size from pos, so it must not pass the end */
+  if (offset > p->size - p->pos)
+    offset = (size_t)(p->size - p->pos);
+  p->pos += offset;
+  return SZ_OK;
+}
+
+static SRes MappedInStream_Read(void *pp, void *buf, size_t *size)
+{
+  CMappedInStream *p = (CMappedInStream *)pp;
+  UInt64 rem = p->size - p->pos;
+  if (*size > rem)
+    *size = (size_t)rem;
+  memcpy(buf, p->data + (size_t)p->pos, *size);
+  p->pos += *size;
+  return SZ_OK;
+}
+
+static SRes MappedInStream_Seek(void *pp, Int64 *pos, ESzSeek origin)
+{
+  CMappedInStream *p = (CMappedInStream *)pp;
+  Int64 newPos;
+  switch (origin)
+  {
+    case SZ_SEEK_SET: newPos = *pos; break;
+    case SZ_SEEK_CUR: newPos = (Int64)p->pos + *pos; break;
+    case SZ_SEEK_END: newPos = (Int64)p->size + *pos; break;
+    default: return SZ_ERROR_PARAM;
+  }
+  if (newPos < 0)
+    return SZ_ERROR_PARAM;
+  /* reading past the end returns 0 bytes, as with a file */
+  p->pos = ((UInt64)newPos > p->size) ? p->size : (UInt64)newPos;
+  *pos = (Int64)p->pos;
+  return SZ_OK;
+}
+
+void MappedInStream_Construct(CMappedInStream *p)
+{
+  p->s.Look = MappedInStream_Look;
+  p->s.Skip = MappedInStream_Skip;
+  p->s.Read = MappedInStream_Read;
+  p->s.Seek = MappedInStream_Seek;
+  p->data = NULL;
+  p->size = 0;
+  p->pos = 0;
+  #ifdef USE_WINDOWS_FILE
+  p->mapping = NULL;
+  #endif
+}
+
+WRes MappedInStream_Open(CMappedInStream *p, CSzFile *file)
+{
+  UInt64 size;
+  RINOK(File_GetLength(file, &size));
+  p->pos = 0;
+  p->size = size;
+  if (size == 0)
+    return 0;
+
+  #ifdef USE_WINDOWS_FILE
+
+  if ((SIZE_T)size != size)
+    return ERROR_NOT_ENOUGH_MEMORY;
+  p->mapping = CreateFileMapping(file->handle, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (p->mapping == NULL)
+    return GetLastError();
+  p->data = (const Byte *)MapViewOfFile(p->mapping, FILE_MAP_READ, 0, 0, (SIZE_T)size);
+  if (p->data == NULL)
+  {
+    WRes res = GetLastError();
+    CloseHandle(p->mapping);
+    p->mapping = NULL;
+    return res;
+  }
+  return 0;
+
+  #elif defined(UNDER_CE)
+
+  return 1;
+
+  #else
+
+  {
+    void *data;
+    if ((size_t)size != size)
+      return ENOMEM;
+    data = mmap(NULL, (size_t)size, PROT_READ, MAP_PRIVATE, fileno(file->file), 0);
+    if (data == MAP_FAILED)
+      return errno;
+    /* folders are decoded front to back, so let the kernel read ahead aggressively */
+    madvise(data, (size_t)size, MADV_SEQUENTIAL);
+    p->data = (const Byte *)data;
+  }
+  return 0;
+
+  #endif
+}
+
+WRes MappedInStream_Close(CMappedInStream *p)
+{
+  WRes res = 0;
+  #ifdef USE_WINDOWS_FILE
+  if (p->data != NULL && !UnmapViewOfFile(p->data))
+    res = GetLastError();
+  if (p->mapping != NULL && !CloseHandle(p->mapping))
+    res = GetLastError();
+  p->mapping = NULL;
+  #elif !defined(UNDER_CE)
+  if (p->data != NULL && munmap((void *)p->data, (size_t)p->size) != 0)
+    res = errno;
+  #endif
+  p->data = NULL;
+  p->size = 0;
+  p->pos = 0;
+  return res;
+}
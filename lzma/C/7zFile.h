@@ -78,6 +78,29 @@ typedef struct
 
 void FileOutStream_CreateVTable(CFileOutStream *p);
 
+
+/* ---------- MappedInStream ---------- */
+
+/* ILookInStream over a read-only mapping of the whole file.
+   Look returns pointers into the mapping, so nothing is copied or buffered.
+   The file can be closed after MappedInStream_Open; the mapping keeps its own reference.
+   A read error in the underlying file shows up as an access violation (SIGBUS), not as SZ_ERROR_READ. */
+
+typedef struct
+{
+  ILookInStream s;
+  const Byte *data;
+  UInt64 size;
+  UInt64 pos;
+  #ifdef USE_WINDOWS_FILE
+  HANDLE mapping;
+  #endif
+} CMappedInStream;
+
+void MappedInStream_Construct(CMappedInStream *p);
+WRes MappedInStream_Open(CMappedInStream *p, CSzFile *file);
+WRes MappedInStream_Close(CMappedInStream *p);
+
 EXTERN_C_END
 
 #endif
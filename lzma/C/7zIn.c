@@ -136,8 +136,10 @@ void SzArEx_Init(CSzArEx *p)
   p->PackStreamStartPositions = 0;
   p->FolderStartFileIndex = 0;
   p->FileIndexToFolderIndexMap = 0;
+  p->FileStartPositions = 0;
   p->FileNameOffsets = 0;
   Buf_Init(&p->FileNames);
+  p->NumThreads = 1;
 }
 
 void SzArEx_Free(CSzArEx *p, ISzAlloc *alloc)
@@ -146,6 +148,7 @@ void SzArEx_Free(CSzArEx *p, ISzAlloc *alloc)
   IAlloc_Free(alloc, p->PackStreamStartPositions);
   IAlloc_Free(alloc, p->FolderStartFileIndex);
   IAlloc_Free(alloc, p->FileIndexToFolderIndexMap);
+  IAlloc_Free(alloc, p->FileStartPositions);
 
   IAlloc_Free(alloc, p->FileNameOffsets);
   Buf_Free(&p->FileNames, alloc);
@@ -183,6 +186,7 @@ static SRes SzArEx_Fill(CSzArEx *p, ISzAlloc *alloc)
   UInt32 i;
   UInt32 folderIndex = 0;
   UInt32 indexInFolder = 0;
+  UInt64 posInFolder = 0;
   MY_ALLOC(UInt32, p->FolderStartPackStreamIndex, p->db.NumFolders, alloc);
   for (i = 0; i < p->db.NumFolders; i++)
   {
@@ -200,6 +204,7 @@ static SRes SzArEx_Fill(CSzArEx *p, ISzAlloc *alloc)
 
   MY_ALLOC(UInt32, p->FolderStartFileIndex, p->db.NumFolders, alloc);
   MY_ALLOC(UInt32, p->FileIndexToFolderIndexMap, p->db.NumFiles, alloc);
+  MY_ALLOC(UInt64, p->FileStartPositions, p->db.NumFiles, alloc);
 
   for (i = 0; i < p->db.NumFiles; i++)
   {
@@ -208,10 +213,12 @@ static SRes SzArEx_Fill(CSzArEx *p, ISzAlloc *alloc)
     if (emptyStream && indexInFolder == 0)
     {
       p->FileIndexToFolderIndexMap[i] = (UInt32)-1;
+      p->FileStartPositions[i] = 0;
       continue;
     }
     if (indexInFolder == 0)
     {
+      posInFolder = 0;
       /*
       v3.13 incorrectly worked with empty folders
       v4.07: Loop for skipping empty folders
@@ -227,8 +234,10 @@ static SRes SzArEx_Fill(CSzArEx *p, ISzAlloc *alloc)
       }
     }
     p->FileIndexToFolderIndexMap[i] = folderIndex;
+    p->FileStartPositions[i] = posInFolder;
     if (emptyStream)
       continue;
+    posInFolder += file->Size;
     indexInFolder++;
     if (indexInFolder >= p->db.Folders[folderIndex].NumUnpackStreams)
     {
@@ -1319,6 +1328,52 @@ SRes SzArEx_Open(CSzArEx *p, ILookInStream *inStream, ISzAlloc *allocMain, ISzAl
   return res;
 }
 
+static UInt32 SzArEx_GetFolderNumFiles(const CSzArEx *p, UInt32 folderIndex)
+{
+  UInt32 start = p->FolderStartFileIndex[folderIndex];
+  UInt32 i;
+  for (i = start; i < p->db.NumFiles && p->FileIndexToFolderIndexMap[i] == folderIndex; i++);
+  return i - start;
+}
+
+/* Checks the CRCs of all files of a decoded folder in one pass. The folder CRC is combined
+   from the file CRCs instead of being computed over the data again. crcOk[i] is set to 0
+   if the i-th file of the folder has a wrong CRC. */
+static SRes SzArEx_CheckFolderCrcs(const CSzArEx *p, UInt32 folderIndex,
+    const Byte *data, size_t size, Byte *crcOk)
+{
+  const CSzFolder *folder = p->db.Folders + folderIndex;
+  UInt32 numFiles = SzArEx_GetFolderNumFiles(p, folderIndex);
+  UInt32 i;
+  UInt32 folderCrc = 0;
+  size_t pos = 0;
+  for (i = 0; i < numFiles; i++)
+  {
+    const CSzFileItem *file = p->db.Files + p->FolderStartFileIndex[folderIndex] + i;
+    crcOk[i] = 1;
+    if (file->Size > size - pos)
+      break; /* SzArEx_Extract fails for this file anyway */
+    if (file->CrcDefined || folder->UnpackCRCDefined)
+    {
+      UInt32 crc = CrcCalc(data + pos, (size_t)file->Size);
+      if (file->CrcDefined && crc != file->Crc)
+        crcOk[i] = 0;
+      folderCrc = CrcCombine(folderCrc, crc, file->Size);
+    }
+    pos += (size_t)file->Size;
+  }
+  for (; i < numFiles; i++)
+    crcOk[i] = 1;
+  if (folder->UnpackCRCDefined)
+  {
+    if (pos != size)
+      folderCrc = CrcCombine(folderCrc, CrcCalc(data + pos, size - pos), size - pos);
+    if (folderCrc != folder->UnpackCRC)
+      return SZ_ERROR_CRC;
+  }
+  return SZ_OK;
+}
+
 SRes SzArEx_Extract(
     const CSzArEx *p,
     ILookInStream *inStream,
@@ -1349,9 +1404,10 @@ SRes SzArEx_Extract(
     CSzFolder *folder = p->db.Folders + folderIndex;
     UInt64 unpackSizeSpec = SzFolder_GetUnpackSize(folder);
     size_t unpackSize = (size_t)unpackSizeSpec;
+    size_t numFiles = SzArEx_GetFolderNumFiles(p, folderIndex);
     UInt64 startOffset = SzArEx_GetFolderStreamPos(p, folderIndex, 0);
 
-    if (unpackSize != unpackSizeSpec)
+    if (unpackSize != unpackSizeSpec || unpackSize + numFiles < unpackSize)
       return SZ_ERROR_MEM;
     *blockIndex = folderIndex;
     IAlloc_Free(allocMain, *outBuffer);
@@ -1361,42 +1417,129 @@ SRes SzArEx_Extract(
     
     if (res == SZ_OK)
     {
+      /* the per-file CRC results are kept after the data, so later calls
+         for other files of this folder don't have to check them again */
       *outBufferSize = unpackSize;
-      if (unpackSize != 0)
+      if (unpackSize + numFiles != 0)
       {
-        *outBuffer = (Byte *)IAlloc_Alloc(allocMain, unpackSize);
+        *outBuffer = (Byte *)IAlloc_Alloc(allocMain, unpackSize + numFiles);
         if (*outBuffer == 0)
           res = SZ_ERROR_MEM;
       }
       if (res == SZ_OK)
       {
-        res = SzFolder_Decode(folder,
+        res = SzFolder_DecodeMt(folder,
           p->db.PackSizes + p->FolderStartPackStreamIndex[folderIndex],
           inStream, startOffset,
-          *outBuffer, unpackSize, allocTemp);
+          *outBuffer, unpackSize, p->NumThreads, allocTemp);
         if (res == SZ_OK)
-        {
-          if (folder->UnpackCRCDefined)
-          {
-            if (CrcCalc(*outBuffer, unpackSize) != folder->UnpackCRC)
-              res = SZ_ERROR_CRC;
-          }
-        }
+          res = SzArEx_CheckFolderCrcs(p, folderIndex, *outBuffer, unpackSize, *outBuffer + unpackSize);
       }
     }
   }
   if (res == SZ_OK)
   {
-    UInt32 i;
     CSzFileItem *fileItem = p->db.Files + fileIndex;
-    *offset = 0;
-    for (i = p->FolderStartFileIndex[folderIndex]; i < fileIndex; i++)
-      *offset += (UInt32)p->db.Files[i].Size;
-    *outSizeProcessed = (size_t)fileItem->Size;
-    if (*offset + *outSizeProcessed > *outBufferSize)
+    if (p->FileStartPositions[fileIndex] + fileItem->Size > *outBufferSize)
       return SZ_ERROR_FAIL;
-    if (fileItem->CrcDefined && CrcCalc(*outBuffer + *offset, *outSizeProcessed) != fileItem->Crc)
+    *offset = (size_t)p->FileStartPositions[fileIndex];
+    *outSizeProcessed = (size_t)fileItem->Size;
+    if (fileItem->CrcDefined && !(*outBuffer)[*outBufferSize + fileIndex - p->FolderStartFileIndex[folderIndex]])
       res = SZ_ERROR_CRC;
   }
   return res;
 }
+
+typedef struct
+{
+  IFolderOutStream s;
+  const CSzArEx *db;
+  ISzExtractCallback *callback;
+  UInt32 folderIndex;
+  UInt32 fileIndex;
+  UInt64 rem;
+  Bool inFile;
+  UInt32 crc;
+  UInt32 folderCrc; /* combined from the file CRCs as each file ends */
+} CSzFolderSplitter;
+
+/* ends the current file if all of it was written and starts the next non-empty one */
+static SRes SzFolderSplitter_Next(CSzFolderSplitter *p)
+{
+  while (!p->inFile || p->rem == 0)
+  {
+    if (p->inFile)
+    {
+      const CSzFileItem *file = p->db->db.Files + p->fileIndex;
+      if (file->CrcDefined && CRC_GET_DIGEST(p->crc) != file->Crc)
+        return SZ_ERROR_CRC;
+      p->folderCrc = CrcCombine(p->folderCrc, CRC_GET_DIGEST(p->crc), file->Size);
+      RINOK(p->callback->FileEnd(p->callback, p->fileIndex));
+      p->inFile = False;
+      p->fileIndex++;
+    }
+    if (p->fileIndex >= p->db->db.NumFiles ||
+        p->db->FileIndexToFolderIndexMap[p->fileIndex] != p->folderIndex)
+      break;
+    RINOK(p->callback->FileStart(p->callback, p->fileIndex));
+    p->inFile = True;
+    p->rem = p->db->db.Files[p->fileIndex].Size;
+    p->crc = CRC_INIT_VAL;
+  }
+  return SZ_OK;
+}
+
+static SRes SzFolderSplitter_Write(void *pp, const Byte *data, size_t size)
+{
+  CSzFolderSplitter *p = (CSzFolderSplitter *)pp;
+  while (size != 0)
+  {
+    size_t cur = size;
+    if (!p->inFile)
+      return SZ_ERROR_DATA;
+    if (cur > p->rem)
+      cur = (size_t)p->rem;
+    RINOK(p->callback->FileWrite(p->callback, p->fileIndex, data, cur));
+    p->crc = CrcUpdate(p->crc, data, cur);
+    p->rem -= cur;
+    data += cur;
+    size -= cur;
+    if (p->rem == 0)
+    {
+      RINOK(SzFolderSplitter_Next(p));
+    }
+  }
+  return SZ_OK;
+}
+
+SRes SzArEx_ExtractFolder(
+    const CSzArEx *p,
+    ILookInStream *inStream,
+    UInt32 folderIndex,
+    ISzExtractCallback *callback,
+    ISzAlloc *allocMain)
+{
+  CSzFolder *folder = p->db.Folders + folderIndex;
+  CSzFolderSplitter splitter;
+
+  splitter.s.Write = SzFolderSplitter_Write;
+  splitter.db = p;
+  splitter.callback = callback;
+  splitter.folderIndex = folderIndex;
+  splitter.fileIndex = p->FolderStartFileIndex[folderIndex];
+  splitter.rem = 0;
+  splitter.inFile = False;
+  splitter.crc = CRC_INIT_VAL;
+  splitter.folderCrc = 0;
+
+  RINOK(SzFolderSplitter_Next(&splitter));
+  RINOK(SzFolder_DecodeToStreamMt(folder,
+      p->db.PackSizes + p->FolderStartPackStreamIndex[folderIndex],
+      inStream, SzArEx_GetFolderStreamPos(p, folderIndex, 0),
+      &splitter.s, p->NumThreads, allocMain));
+  if (splitter.inFile)
+    return SZ_ERROR_DATA;
+  if (folder->UnpackCRCDefined && splitter.folderCrc != folder->UnpackCRC)
+    return SZ_ERROR_CRC;
+  return SZ_OK;
+}
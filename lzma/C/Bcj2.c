@@ -3,12 +3,6 @@
 
 #include "Bcj2.h"
 
-#ifdef _LZMA_PROB32
-#define CProb UInt32
-#else
-#define CProb UInt16
-#endif
-
 #define IsJcc(b0, b1) ((b0) == 0x0F && ((b1) & 0xF0) == 0x80)
 #define IsJ(b0, b1) ((b1 & 0xFE) == 0xE8 || IsJcc(b0, b1))
 
@@ -19,114 +13,199 @@
 #define kBitModelTotal (1 << kNumBitModelTotalBits)
 #define kNumMoveBits 5
 
-#define RC_READ_BYTE (*buffer++)
-#define RC_TEST { if (buffer == bufferLim) return SZ_ERROR_DATA; }
-#define RC_INIT2 code = 0; range = 0xFFFFFFFF; \
-  { int i; for (i = 0; i < 5; i++) { RC_TEST; code = (code << 8) | RC_READ_BYTE; }}
-
-#define NORMALIZE if (range < kTopValue) { RC_TEST; range <<= 8; code = (code << 8) | RC_READ_BYTE; }
-
-#define IF_BIT_0(p) ttt = *(p); bound = (range >> kNumBitModelTotalBits) * ttt; if (code < bound)
-#define UPDATE_0(p) range = bound; *(p) = (CProb)(ttt + ((kBitModelTotal - ttt) >> kNumMoveBits)); NORMALIZE;
-#define UPDATE_1(p) range -= bound; code -= bound; *(p) = (CProb)(ttt - (ttt >> kNumMoveBits)); NORMALIZE;
-
-int Bcj2_Decode(
-    const Byte *buf0, SizeT size0,
-    const Byte *buf1, SizeT size1,
-    const Byte *buf2, SizeT size2,
-    const Byte *buf3, SizeT size3,
-    Byte *outBuf, SizeT outSize)
+void Bcj2Dec_Init(CBcj2Dec *p)
 {
-  CProb p[256 + 2];
-  SizeT inPos = 0, outPos = 0;
-
-  const Byte *buffer, *bufferLim;
-  UInt32 range, code;
-  Byte prevByte = 0;
-
-  unsigned int i;
-  for (i = 0; i < sizeof(p) / sizeof(p[0]); i++)
-    p[i] = kBitModelTotal >> 1;
-
-  buffer = buf3;
-  bufferLim = buffer + size3;
-  RC_INIT2
-
-  if (outSize == 0)
-    return SZ_OK;
+  unsigned i;
+  p->state = BCJ2_STREAM_RC;
+  p->tempPos = 0;
+  p->rcInitRem = 5;
+  p->ip = 0;
+  p->range = 0xFFFFFFFF;
+  p->code = 0;
+  p->prevByte = 0;
+  p->opcode = 0;
+  for (i = 0; i < sizeof(p->probs) / sizeof(p->probs[0]); i++)
+    p->probs[i] = kBitModelTotal >> 1;
+}
 
+/*
+p->state:
+  BCJ2_STREAM_MAIN   - copies the main stream up to the next E8, E9 or Jcc opcode
+  BCJ2_STREAM_RC     - reads the range coder init bytes (p->opcode == 0),
+                       or decodes the bit that tells if p->opcode has a converted address
+  BCJ2_STREAM_CALL,
+  BCJ2_STREAM_JUMP   - reads the absolute address to p->temp
+  BCJ2_DEC_STATE_ADDRESS - writes the relative address from p->temp
+*/
+
+SRes Bcj2Dec_Decode(CBcj2Dec *p)
+{
   for (;;)
   {
-    Byte b;
-    CProb *prob;
-    UInt32 bound;
-    UInt32 ttt;
+    if (p->dest == p->destLim)
+      return SZ_OK;
 
-    SizeT limit = size0 - inPos;
-    if (outSize - outPos < limit)
-      limit = outSize - outPos;
-    while (limit != 0)
+    switch (p->state)
     {
-      Byte b = buf0[inPos];
-      outBuf[outPos++] = b;
-      if (IsJ(prevByte, b))
-        break;
-      inPos++;
-      prevByte = b;
-      limit--;
-    }
-
-    if (limit == 0 || outPos == outSize)
-      break;
-
-    b = buf0[inPos++];
-
-    if (b == 0xE8)
-      prob = p + prevByte;
-    else if (b == 0xE9)
-      prob = p + 256;
-    else
-      prob = p + 257;
-
-    IF_BIT_0(prob)
-    {
-      UPDATE_0(prob)
-      prevByte = b;
-    }
-    else
-    {
-      UInt32 dest;
-      const Byte *v;
-      UPDATE_1(prob)
-      if (b == 0xE8)
+      case BCJ2_STREAM_MAIN:
       {
-        v = buf1;
-        if (size1 < 4)
-          return SZ_ERROR_DATA;
-        buf1 += 4;
-        size1 -= 4;
+        const Byte *src = p->bufs[BCJ2_STREAM_MAIN];
+        const Byte *srcLim;
+        Byte *dest = p->dest;
+        Byte prevByte = p->prevByte;
+        SizeT num = p->lims[BCJ2_STREAM_MAIN] - src;
+        if (num == 0)
+          return SZ_OK;
+        if (num > (SizeT)(p->destLim - dest))
+          num = p->destLim - dest;
+        srcLim = src + num;
+        do
+        {
+          Byte b = *src++;
+          *dest++ = b;
+          if (IsJ(prevByte, b))
+          {
+            p->opcode = b;
+            p->state = BCJ2_STREAM_RC;
+            break;
+          }
+          prevByte = b;
+        }
+        while (src != srcLim);
+        p->ip += (UInt32)(dest - p->dest);
+        p->dest = dest;
+        p->bufs[BCJ2_STREAM_MAIN] = src;
+        p->prevByte = prevByte;
+        if (p->state != BCJ2_STREAM_RC)
+          break;
+        /* the bit of the opcode usually follows at once */
       }
-      else
+      /* fall through */
+
+      case BCJ2_STREAM_RC:
       {
-        v = buf2;
-        if (size2 < 4)
-          return SZ_ERROR_DATA;
-        buf2 += 4;
-        size2 -= 4;
-      }
-      dest = (((UInt32)v[0] << 24) | ((UInt32)v[1] << 16) |
-          ((UInt32)v[2] << 8) | ((UInt32)v[3])) - ((UInt32)outPos + 4);
-      outBuf[outPos++] = (Byte)dest;
-      if (outPos == outSize)
+        CBcj2Prob *prob;
+        UInt32 bound, ttt;
+        const Byte *rc = p->bufs[BCJ2_STREAM_RC];
+        if (p->rcInitRem != 0)
+        {
+          for (; p->rcInitRem != 0; p->rcInitRem--)
+          {
+            if (rc == p->lims[BCJ2_STREAM_RC])
+            {
+              p->bufs[BCJ2_STREAM_RC] = rc;
+              return SZ_OK;
+            }
+            p->code = (p->code << 8) | *rc++;
+          }
+          p->bufs[BCJ2_STREAM_RC] = rc;
+        }
+        if (p->opcode == 0)
+        {
+          p->state = BCJ2_STREAM_MAIN;
+          break;
+        }
+        if (p->range < kTopValue)
+        {
+          if (rc == p->lims[BCJ2_STREAM_RC])
+            return SZ_OK;
+          p->range <<= 8;
+          p->code = (p->code << 8) | *rc++;
+          p->bufs[BCJ2_STREAM_RC] = rc;
+        }
+
+        if (p->opcode == 0xE8)
+          prob = p->probs + p->prevByte;
+        else if (p->opcode == 0xE9)
+          prob = p->probs + 256;
+        else
+          prob = p->probs + 257;
+
+        ttt = *prob;
+        bound = (p->range >> kNumBitModelTotalBits) * ttt;
+        if (p->code < bound)
+        {
+          p->range = bound;
+          *prob = (CBcj2Prob)(ttt + ((kBitModelTotal - ttt) >> kNumMoveBits));
+          p->prevByte = p->opcode;
+          p->state = BCJ2_STREAM_MAIN;
+        }
+        else
+        {
+          p->range -= bound;
+          p->code -= bound;
+          *prob = (CBcj2Prob)(ttt - (ttt >> kNumMoveBits));
+          p->state = (p->opcode == 0xE8) ? BCJ2_STREAM_CALL : BCJ2_STREAM_JUMP;
+          p->tempPos = 0;
+        }
+        p->opcode = 0;
         break;
-      outBuf[outPos++] = (Byte)(dest >> 8);
-      if (outPos == outSize)
+      }
+
+      case BCJ2_STREAM_CALL:
+      case BCJ2_STREAM_JUMP:
+      {
+        const Byte *src = p->bufs[p->state];
+        UInt32 dest;
+        for (; p->tempPos < 4; p->tempPos++)
+        {
+          if (src == p->lims[p->state])
+          {
+            p->bufs[p->state] = src;
+            return SZ_OK;
+          }
+          p->temp[p->tempPos] = *src++;
+        }
+        p->bufs[p->state] = src;
+        dest = (((UInt32)p->temp[0] << 24) | ((UInt32)p->temp[1] << 16) |
+            ((UInt32)p->temp[2] << 8) | ((UInt32)p->temp[3])) - (p->ip + 4);
+        p->temp[0] = (Byte)dest;
+        p->temp[1] = (Byte)(dest >> 8);
+        p->temp[2] = (Byte)(dest >> 16);
+        p->temp[3] = (Byte)(dest >> 24);
+        p->tempPos = 0;
+        p->state = BCJ2_DEC_STATE_ADDRESS;
         break;
-      outBuf[outPos++] = (Byte)(dest >> 16);
-      if (outPos == outSize)
+      }
+
+      default:
+      {
+        Byte *dest = p->dest;
+        while (p->tempPos < 4 && dest != p->destLim)
+          *dest++ = p->temp[p->tempPos++];
+        p->ip += (UInt32)(dest - p->dest);
+        p->dest = dest;
+        if (p->tempPos == 4)
+        {
+          p->prevByte = p->temp[3];
+          p->state = BCJ2_STREAM_MAIN;
+        }
         break;
-      outBuf[outPos++] = prevByte = (Byte)(dest >> 24);
+      }
     }
   }
-  return (outPos == outSize) ? SZ_OK : SZ_ERROR_DATA;
+}
+
+int Bcj2_Decode(
+    const Byte *buf0, SizeT size0,
+    const Byte *buf1, SizeT size1,
+    const Byte *buf2, SizeT size2,
+    const Byte *buf3, SizeT size3,
+    Byte *outBuf, SizeT outSize)
+{
+  CBcj2Dec p;
+  Bcj2Dec_Init(&p);
+  p.bufs[BCJ2_STREAM_MAIN] = buf0;
+  p.lims[BCJ2_STREAM_MAIN] = buf0 + size0;
+  p.bufs[BCJ2_STREAM_CALL] = buf1;
+  p.lims[BCJ2_STREAM_CALL] = buf1 + size1;
+  p.bufs[BCJ2_STREAM_JUMP] = buf2;
+  p.lims[BCJ2_STREAM_JUMP] = buf2 + size2;
+  p.bufs[BCJ2_STREAM_RC] = buf3;
+  p.lims[BCJ2_STREAM_RC] = buf3 + size3;
+  p.dest = outBuf;
+  p.destLim = outBuf + outSize;
+  Bcj2Dec_Decode(&p);
+  /* if the output isn't full, the stream in p.state has ended too early */
+  return (p.dest == p.destLim) ? SZ_OK : SZ_ERROR_DATA;
 }
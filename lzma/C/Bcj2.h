@@ -31,6 +31,62 @@ int Bcj2_Decode(
     const Byte *buf3, SizeT size3,
     Byte *outBuf, SizeT outSize);
 
+
+/* ---------- Incremental decoder ---------- */
+
+#ifdef _LZMA_PROB32
+#define CBcj2Prob UInt32
+#else
+#define CBcj2Prob UInt16
+#endif
+
+#define BCJ2_STREAM_MAIN 0
+#define BCJ2_STREAM_CALL 1
+#define BCJ2_STREAM_JUMP 2
+#define BCJ2_STREAM_RC 3
+
+#define BCJ2_NUM_STREAMS 4
+
+/* the decoder writes the bytes of a converted address */
+#define BCJ2_DEC_STATE_ADDRESS 4
+
+typedef struct
+{
+  const Byte *bufs[BCJ2_NUM_STREAMS];
+  const Byte *lims[BCJ2_NUM_STREAMS];
+  Byte *dest;
+  const Byte *destLim;
+
+  unsigned state;
+  unsigned tempPos;
+  unsigned rcInitRem;
+  UInt32 ip;
+  UInt32 range;
+  UInt32 code;
+  Byte prevByte;
+  Byte opcode;
+  Byte temp[4];
+  CBcj2Prob probs[2 + 256];
+} CBcj2Dec;
+
+void Bcj2Dec_Init(CBcj2Dec *p);
+
+/*
+Bcj2Dec_Decode
+  Decodes from the bufs[i] ... lims[i] windows of the four streams to dest ... destLim,
+  and moves bufs[i] and dest past the processed data. The caller sets new windows and
+  calls it again, there is no other state outside of CBcj2Dec.
+  It returns when dest reaches destLim, or when it needs more of stream (p->state):
+  the caller has to give the next part of that stream or, if the stream has ended
+  while more output is expected, treat the data as broken.
+  The range coder is normalized before a bit is decoded, not after it, so it doesn't
+  read the last bytes of the range coder stream ahead of time.
+Returns:
+  SZ_OK
+*/
+
+SRes Bcj2Dec_Decode(CBcj2Dec *p);
+
 #ifdef __cplusplus
 }
 #endif
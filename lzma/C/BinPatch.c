@@ -0,0 +1,334 @@
+/* BinPatch.c -- Binary delta patches
+2013-05-20 : Public domain */
+
+#include <string.h>
+
+#include "BinPatch.h"
+#include "CpuArch.h"
+#include "Sha1.h"
+
+#define PATCH_BUF_SIZE (1 << 15)
+
+#define MATCH_WINDOW 32 /* bytes hashed per lookup, also the shortest COPY */
+#define MATCH_STEP 16   /* distance between indexed source blocks */
+#define HASH_MUL 0x01000193
+
+const Byte BIN_PATCH_SIGNATURE[BIN_PATCH_SIGNATURE_SIZE] = { 'B', 'P', 'A', 'T', 'C', 'H', 0, 1 };
+
+/* ---------- Apply ---------- */
+
+typedef struct
+{
+  ISeqInStream *stream;
+  size_t pos;
+  size_t lim;
+  Byte buf[PATCH_BUF_SIZE];
+} CPatchReader;
+
+static SRes PatchReader_Fill(CPatchReader *p)
+{
+  size_t size = PATCH_BUF_SIZE;
+  p->pos = 0;
+  p->lim = 0;
+  RINOK(p->stream->Read(p->stream, p->buf, &size));
+  if (size == 0)
+    return SZ_ERROR_INPUT_EOF;
+  p->lim = size;
+  return SZ_OK;
+}
+
+static SRes PatchReader_ReadNumber(CPatchReader *p, UInt64 *value)
+{
+  unsigned shift;
+  *value = 0;
+  for (shift = 0; shift < 64; shift += 7)
+  {
+    Byte b;
+    if (p->pos == p->lim)
+    {
+      RINOK(PatchReader_Fill(p));
+    }
+    b = p->buf[p->pos++];
+    *value |= (UInt64)(b & 0x7F) << shift;
+    if ((b & 0x80) == 0)
+      return SZ_OK;
+  }
+  return SZ_ERROR_DATA;
+}
+
+static SRes WriteTarget(ISeqOutStream *target, CSha1 *sha, const Byte *data, size_t size)
+{
+  Sha1_Update(sha, data, size);
+  if (target->Write(target, data, size) != size)
+    return SZ_ERROR_WRITE;
+  return SZ_OK;
+}
+
+SRes BinPatch_ReadHeader(CBinPatchHeader *p, ISeqInStream *patch)
+{
+  Byte header[BIN_PATCH_HEADER_SIZE];
+  SRes res = SeqInStream_Read(patch, header, BIN_PATCH_HEADER_SIZE);
+  if (res == SZ_ERROR_INPUT_EOF)
+    return SZ_ERROR_NO_ARCHIVE;
+  RINOK(res);
+  if (memcmp(header, BIN_PATCH_SIGNATURE, BIN_PATCH_SIGNATURE_SIZE) != 0)
+    return SZ_ERROR_NO_ARCHIVE;
+  p->sourceSize = GetUi64(header + 8);
+  p->targetSize = GetUi64(header + 16);
+  memcpy(p->sourceHash, header + 24, 20);
+  memcpy(p->targetHash, header + 44, 20);
+  return SZ_OK;
+}
+
+SRes BinPatch_Apply(const CBinPatchHeader *p, ISeqInStream *patch, ISeekInStream *source, ISeqOutStream *target)
+{
+  CPatchReader reader;
+  CSha1 sha;
+  Byte copyBuf[PATCH_BUF_SIZE];
+  Byte digest[SHA1_DIGEST_SIZE];
+  UInt64 written = 0;
+  UInt64 sourcePos = 0;
+  UInt64 lastCopyEnd = 0;
+
+  reader.stream = patch;
+  reader.pos = reader.lim = 0;
+  Sha1_Init(&sha);
+
+  while (written < p->targetSize)
+  {
+    UInt64 cmd, len;
+    RINOK(PatchReader_ReadNumber(&reader, &cmd));
+    len = cmd >> 1;
+    if (len == 0 || len > p->targetSize - written)
+      return SZ_ERROR_DATA;
+
+    if ((cmd & 1) == 0)
+    {
+      UInt64 rem = len;
+      while (rem != 0)
+      {
+        size_t cur;
+        if (reader.pos == reader.lim)
+        {
+          RINOK(PatchReader_Fill(&reader));
+        }
+        cur = reader.lim - reader.pos;
+        if (cur > rem)
+          cur = (size_t)rem;
+        RINOK(WriteTarget(target, &sha, reader.buf + reader.pos, cur));
+        reader.pos += cur;
+        rem -= cur;
+      }
+    }
+    else
+    {
+      UInt64 zigzag, pos, rem;
+      Int64 delta;
+      RINOK(PatchReader_ReadNumber(&reader, &zigzag));
+      delta = (Int64)(zigzag >> 1) ^ -(Int64)(zigzag & 1);
+      if (delta < 0 ? (UInt64)-delta > lastCopyEnd : (UInt64)delta > p->sourceSize - lastCopyEnd)
+        return SZ_ERROR_DATA;
+      pos = lastCopyEnd + delta;
+      if (len > p->sourceSize - pos)
+        return SZ_ERROR_DATA;
+
+      if (pos != sourcePos)
+      {
+        Int64 seekPos = (Int64)pos;
+        RINOK(source->Seek(source, &seekPos, SZ_SEEK_SET));
+        sourcePos = pos;
+      }
+
+      for (rem = len; rem != 0;)
+      {
+        size_t cur = PATCH_BUF_SIZE;
+        if (cur > rem)
+          cur = (size_t)rem;
+        RINOK(SeqInStream_Read((ISeqInStream *)source, copyBuf, cur));
+        RINOK(WriteTarget(target, &sha, copyBuf, cur));
+        rem -= cur;
+      }
+
+      sourcePos = lastCopyEnd = pos + len;
+    }
+
+    written += len;
+  }
+
+  Sha1_Final(&sha, digest);
+  return memcmp(digest, p->targetHash, SHA1_DIGEST_SIZE) == 0 ? SZ_OK : SZ_ERROR_CRC;
+}
+
+/* ---------- Create ---------- */
+
+typedef struct
+{
+  ISeqOutStream *stream;
+  size_t pos;
+  SRes res;
+  Byte buf[PATCH_BUF_SIZE];
+} CPatchWriter;
+
+static void PatchWriter_Flush(CPatchWriter *p)
+{
+  if (p->pos != 0 && p->res == SZ_OK)
+    if (p->stream->Write(p->stream, p->buf, p->pos) != p->pos)
+      p->res = SZ_ERROR_WRITE;
+  p->pos = 0;
+}
+
+static void PatchWriter_Write(CPatchWriter *p, const Byte *data, size_t size)
+{
+  while (size != 0)
+  {
+    size_t cur = PATCH_BUF_SIZE - p->pos;
+    if (cur > size)
+      cur = size;
+    memcpy(p->buf + p->pos, data, cur);
+    p->pos += cur;
+    data += cur;
+    size -= cur;
+    if (p->pos == PATCH_BUF_SIZE)
+      PatchWriter_Flush(p);
+  }
+}
+
+static void PatchWriter_WriteNumber(CPatchWriter *p, UInt64 value)
+{
+  Byte buf[10];
+  unsigned i = 0;
+  while (value >= 0x80)
+  {
+    buf[i++] = (Byte)(value | 0x80);
+    value >>= 7;
+  }
+  buf[i++] = (Byte)value;
+  PatchWriter_Write(p, buf, i);
+}
+
+static void PatchWriter_Add(CPatchWriter *p, const Byte *data, size_t size)
+{
+  if (size == 0)
+    return;
+  PatchWriter_WriteNumber(p, (UInt64)size << 1);
+  PatchWriter_Write(p, data, size);
+}
+
+static void PatchWriter_Copy(CPatchWriter *p, UInt32 pos, size_t size, UInt32 *lastCopyEnd)
+{
+  Int64 delta = (Int64)pos - (Int64)*lastCopyEnd;
+  PatchWriter_WriteNumber(p, ((UInt64)size << 1) | 1);
+  PatchWriter_WriteNumber(p, ((UInt64)delta << 1) ^ (UInt64)(delta >> 63));
+  *lastCopyEnd = pos + (UInt32)size;
+}
+
+static UInt32 HashWindow(const Byte *p)
+{
+  UInt32 h = 0;
+  unsigned i;
+  for (i = 0; i < MATCH_WINDOW; i++)
+    h = h * HASH_MUL + p[i];
+  return h;
+}
+
+#define HASH_SLOT(h, bits) (((h) * 0x9E3779B1) >> (32 - (bits)))
+
+SRes BinPatch_Create(const Byte *source, size_t sourceSize, const Byte *target, size_t targetSize,
+    ISeqOutStream *patch, ISzAlloc *alloc)
+{
+  CPatchWriter *writer;
+  CSha1 sha;
+  Byte header[BIN_PATCH_HEADER_SIZE];
+  UInt32 *table = NULL;
+  unsigned tableBits = 10;
+  UInt32 mulPow = 1;
+  UInt32 lastCopyEnd = 0;
+  size_t t = 0, literalStart = 0;
+  SRes res;
+  unsigned i;
+
+  if ((UInt64)sourceSize >= ((UInt64)1 << 32))
+    return SZ_ERROR_PARAM;
+
+  writer = (CPatchWriter *)alloc->Alloc(alloc, sizeof(CPatchWriter));
+  if (!writer)
+    return SZ_ERROR_MEM;
+  writer->stream = patch;
+  writer->pos = 0;
+  writer->res = SZ_OK;
+
+  memcpy(header, BIN_PATCH_SIGNATURE, BIN_PATCH_SIGNATURE_SIZE);
+  SetUi64(header + 8, (UInt64)sourceSize);
+  SetUi64(header + 16, (UInt64)targetSize);
+  Sha1_Init(&sha);
+  Sha1_Update(&sha, source, sourceSize);
+  Sha1_Final(&sha, header + 24);
+  Sha1_Init(&sha);
+  Sha1_Update(&sha, target, targetSize);
+  Sha1_Final(&sha, header + 44);
+  PatchWriter_Write(writer, header, BIN_PATCH_HEADER_SIZE);
+
+  if (sourceSize >= MATCH_WINDOW && targetSize >= MATCH_WINDOW)
+  {
+    UInt32 h;
+    size_t pos;
+
+    while (tableBits < 30 && ((size_t)1 << tableBits) < sourceSize / MATCH_STEP * 2)
+      tableBits++;
+
+    table = (UInt32 *)alloc->Alloc(alloc, sizeof(UInt32) << tableBits);
+    if (!table)
+    {
+      alloc->Free(alloc, writer);
+      return SZ_ERROR_MEM;
+    }
+    memset(table, 0, sizeof(UInt32) << tableBits);
+
+    for (pos = 0; pos + MATCH_WINDOW <= sourceSize; pos += MATCH_STEP)
+      table[HASH_SLOT(HashWindow(source + pos), tableBits)] = (UInt32)pos + 1;
+
+    for (i = 1; i < MATCH_WINDOW; i++)
+      mulPow *= HASH_MUL;
+
+    h = HashWindow(target);
+
+    while (t + MATCH_WINDOW <= targetSize)
+    {
+      UInt32 slot = table[HASH_SLOT(h, tableBits)];
+
+      if (slot != 0 && memcmp(source + slot - 1, target + t, MATCH_WINDOW) == 0)
+      {
+        size_t s = slot - 1;
+        size_t fwd = MATCH_WINDOW;
+        size_t back = 0;
+
+        while (s + fwd < sourceSize && t + fwd < targetSize && source[s + fwd] == target[t + fwd])
+          fwd++;
+        while (back < t - literalStart && back < s && source[s - back - 1] == target[t - back - 1])
+          back++;
+
+        PatchWriter_Add(writer, target + literalStart, t - back - literalStart);
+        PatchWriter_Copy(writer, (UInt32)(s - back), back + fwd, &lastCopyEnd);
+
+        t += fwd;
+        literalStart = t;
+        if (t + MATCH_WINDOW <= targetSize)
+          h = HashWindow(target + t);
+        continue;
+      }
+
+      if (t + MATCH_WINDOW < targetSize)
+        h = (h - target[t] * mulPow) * HASH_MUL + target[t + MATCH_WINDOW];
+      t++;
+    }
+
+    alloc->Free(alloc, table);
+  }
+
+  PatchWriter_Add(writer, target + literalStart, targetSize - literalStart);
+  PatchWriter_Flush(writer);
+
+  res = writer->res;
+  alloc->Free(alloc, writer);
+  return res;
+}
@@ -0,0 +1,73 @@
+/* BinPatch.h -- Binary delta patches
+2013-05-20 : Public domain */
+
+#ifndef __BIN_PATCH_H
+#define __BIN_PATCH_H
+
+#include "Types.h"
+
+EXTERN_C_BEGIN
+
+/*
+Patch layout (all numbers little endian):
+
+  Byte   Signature[8]   "BPATCH\x00\x01"
+  UInt64 SourceSize
+  UInt64 TargetSize
+  Byte   SourceHash[20] SHA-1 of the file the patch applies to
+  Byte   TargetHash[20] SHA-1 of the result
+
+followed by commands until TargetSize bytes have been produced:
+
+  Number (Len << 1) | 0, Byte[Len]    ADD:  copy Len literal bytes from the patch
+  Number (Len << 1) | 1, SNumber Pos  COPY: copy Len bytes from the source file
+
+Numbers are 7-bit groups, low group first, high bit set on all but the last.
+COPY positions are stored zigzag encoded, relative to the end of the
+previous COPY, so that runs of copies compress well.
+*/
+
+/* Name of a patch inside an update package: the patched file's name plus this */
+#define BIN_PATCH_SUFFIX ".bpatch"
+
+#define BIN_PATCH_SIGNATURE_SIZE 8
+#define BIN_PATCH_HEADER_SIZE 64
+
+extern const Byte BIN_PATCH_SIGNATURE[BIN_PATCH_SIGNATURE_SIZE];
+
+typedef struct
+{
+  UInt64 sourceSize;
+  UInt64 targetSize;
+  Byte sourceHash[20];
+  Byte targetHash[20];
+} CBinPatchHeader;
+
+/* Returns SZ_ERROR_NO_ARCHIVE if the stream isn't a patch */
+SRes BinPatch_ReadHeader(CBinPatchHeader *p, ISeqInStream *patch);
+
+/*
+Reads the commands following the header and writes the result to target.
+The source is only read, with a seek whenever a COPY doesn't continue where
+the previous one ended. The caller is expected to have checked the source
+against p->sourceHash; the result is checked against p->targetHash.
+
+Returns:
+  SZ_OK
+  SZ_ERROR_DATA   - malformed commands or a COPY outside the source
+  SZ_ERROR_CRC    - the result doesn't match p->targetHash
+  SZ_ERROR_READ / SZ_ERROR_WRITE / SZ_ERROR_INPUT_EOF
+*/
+SRes BinPatch_Apply(const CBinPatchHeader *p, ISeqInStream *patch, ISeekInStream *source, ISeqOutStream *target);
+
+/*
+Builds a patch that turns source into target. Matches are found by indexing
+the source in small blocks and extending hits in both directions, so the
+whole of both files has to be in memory. Source must be smaller than 4 GB.
+*/
+SRes BinPatch_Create(const Byte *source, size_t sourceSize, const Byte *target, size_t targetSize,
+    ISeqOutStream *patch, ISzAlloc *alloc);
+
+EXTERN_C_END
+
+#endif
@@ -2,6 +2,156 @@
 2010-04-16 : Igor Pavlov : Public domain */
 
 #include "Bra.h"
+#include "CpuArch.h"
+
+/* SSE2 and AVX2 intrinsics in functions with their own target need GCC 4.9 or clang 3.8 */
+#if defined(MY_CPU_X86_OR_AMD64) && (defined(_MSC_VER) || \
+    (defined(__clang__) && (__clang_major__ > 3 || (__clang_major__ == 3 && __clang_minor__ >= 8))) || \
+    (defined(__GNUC__) && !defined(__clang__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))))
+#define BRA_SSE2_SUPPORTED
+#if !defined(_MSC_VER) || _MSC_VER >= 1700
+#define BRA_AVX2_SUPPORTED
+#endif
+#endif
+
+/* ---------- Opcode scanners ---------- */
+
+typedef SizeT (MY_FAST_CALL *BRA_FIND_FUNC)(const Byte *data, SizeT i, SizeT lim,
+    unsigned mask, unsigned value, unsigned stride);
+
+/*
+Returns the first i + k * stride below lim where ((data[i + k * stride] & mask) == value).
+If there is none, it returns the first i + k * stride at or after lim, like a scalar loop would.
+stride is 1, 2 or 4.
+*/
+static SizeT MY_FAST_CALL Bra_FindScalar(const Byte *data, SizeT i, SizeT lim,
+    unsigned mask, unsigned value, unsigned stride)
+{
+  for (; i < lim; i += stride)
+    if ((data[i] & mask) == value)
+      break;
+  return i;
+}
+
+#ifdef BRA_SSE2_SUPPORTED
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#include <immintrin.h>
+#define ATTRIB_SSE2
+#define ATTRIB_AVX2
+static unsigned GetLowBit32(UInt32 v) { unsigned long i; _BitScanForward(&i, v); return (unsigned)i; }
+#else
+#include <immintrin.h>
+#define ATTRIB_SSE2 __attribute__((__target__("sse2")))
+#define ATTRIB_AVX2 __attribute__((__target__("avx2")))
+#define GetLowBit32(v) ((unsigned)__builtin_ctz(v))
+#endif
+
+/* bits of the movemask result that belong to the positions p + k * stride */
+#define BRA_STRIDE_MASK(stride) ((stride) == 1 ? 0xFFFFFFFF : (stride) == 2 ? 0x55555555 : 0x11111111)
+
+ATTRIB_SSE2
+static SizeT MY_FAST_CALL Bra_FindSse2(const Byte *data, SizeT i, SizeT lim,
+    unsigned mask, unsigned value, unsigned stride)
+{
+  const __m128i vMask = _mm_set1_epi8((char)mask);
+  const __m128i vValue = _mm_set1_epi8((char)value);
+  const UInt32 posMask = BRA_STRIDE_MASK(stride);
+  for (; i < lim && lim - i >= 16; i += 16)
+  {
+    __m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i *)(const void *)(data + i)), vMask);
+    UInt32 m = (UInt32)_mm_movemask_epi8(_mm_cmpeq_epi8(v, vValue)) & posMask;
+    if (m != 0)
+      return i + GetLowBit32(m);
+  }
+  return Bra_FindScalar(data, i, lim, mask, value, stride);
+}
+
+#ifdef BRA_AVX2_SUPPORTED
+
+ATTRIB_AVX2
+static SizeT MY_FAST_CALL Bra_FindAvx2(const Byte *data, SizeT i, SizeT lim,
+    unsigned mask, unsigned value, unsigned stride)
+{
+  const __m256i vMask = _mm256_set1_epi8((char)mask);
+  const __m256i vValue = _mm256_set1_epi8((char)value);
+  const UInt32 posMask = BRA_STRIDE_MASK(stride);
+  for (; i < lim && lim - i >= 32; i += 32)
+  {
+    __m256i v = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(const void *)(data + i)), vMask);
+    UInt32 m = (UInt32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, vValue)) & posMask;
+    if (m != 0)
+      return i + GetLowBit32(m);
+  }
+  return Bra_FindScalar(data, i, lim, mask, value, stride);
+}
+
+#endif
+
+#endif
+
+static SizeT MY_FAST_CALL Bra_FindFirst(const Byte *data, SizeT i, SizeT lim,
+    unsigned mask, unsigned value, unsigned stride);
+
+static BRA_FIND_FUNC g_BraFind = Bra_FindFirst;
+static int g_BraBackend = BRA_BACKEND_SCALAR;
+
+Bool Bra_SetBackend(int backend)
+{
+  BRA_FIND_FUNC func = NULL;
+  switch (backend)
+  {
+    case BRA_BACKEND_SCALAR: func = Bra_FindScalar; break;
+    #ifdef BRA_SSE2_SUPPORTED
+    case BRA_BACKEND_SSE2:
+      if (CPU_Is_Sse2_Supported())
+        func = Bra_FindSse2;
+      break;
+    #ifdef BRA_AVX2_SUPPORTED
+    case BRA_BACKEND_AVX2:
+      if (CPU_Is_Avx2_Supported())
+        func = Bra_FindAvx2;
+      break;
+    #endif
+    #endif
+  }
+  if (!func)
+    return False;
+  g_BraFind = func;
+  g_BraBackend = backend;
+  return True;
+}
+
+static void Bra_SelectBackend(void)
+{
+  if (!Bra_SetBackend(BRA_BACKEND_AVX2) &&
+      !Bra_SetBackend(BRA_BACKEND_SSE2))
+    Bra_SetBackend(BRA_BACKEND_SCALAR);
+}
+
+int Bra_GetBackend(void)
+{
+  if (g_BraFind == Bra_FindFirst)
+    Bra_SelectBackend();
+  return g_BraBackend;
+}
+
+/* Threads that get here at the same time select the same backend, so the race is harmless */
+static SizeT MY_FAST_CALL Bra_FindFirst(const Byte *data, SizeT i, SizeT lim,
+    unsigned mask, unsigned value, unsigned stride)
+{
+  Bra_SelectBackend();
+  return g_BraFind(data, i, lim, mask, value, stride);
+}
+
+/* for x86_Convert */
+SizeT MY_FAST_CALL Bra_Find(const Byte *data, SizeT i, SizeT lim, unsigned mask, unsigned value, unsigned stride)
+{
+  return g_BraFind(data, i, lim, mask, value, stride);
+}
+
+/* ---------- Converters ---------- */
 
 SizeT ARM_Convert(Byte *data, SizeT size, UInt32 ip, int encoding)
 {
@@ -12,20 +162,21 @@ SizeT ARM_Convert(Byte *data, SizeT size, UInt32 ip, int encoding)
   ip += 8;
   for (i = 0; i <= size; i += 4)
   {
-    if (data[i + 3] == 0xEB)
-    {
-      UInt32 dest;
-      UInt32 src = ((UInt32)data[i + 2] << 16) | ((UInt32)data[i + 1] << 8) | (data[i + 0]);
-      src <<= 2;
-      if (encoding)
-        dest = ip + (UInt32)i + src;
-      else
-        dest = src - (ip + (UInt32)i);
-      dest >>= 2;
-      data[i + 2] = (Byte)(dest >> 16);
-      data[i + 1] = (Byte)(dest >> 8);
-      data[i + 0] = (Byte)dest;
-    }
+    UInt32 dest;
+    UInt32 src;
+    i = g_BraFind(data + 3, i, size + 1, 0xFF, 0xEB, 4);
+    if (i > size)
+      break;
+    src = ((UInt32)data[i + 2] << 16) | ((UInt32)data[i + 1] << 8) | (data[i + 0]);
+    src <<= 2;
+    if (encoding)
+      dest = ip + (UInt32)i + src;
+    else
+      dest = src - (ip + (UInt32)i);
+    dest >>= 2;
+    data[i + 2] = (Byte)(dest >> 16);
+    data[i + 1] = (Byte)(dest >> 8);
+    data[i + 0] = (Byte)dest;
   }
   return i;
 }
@@ -39,8 +190,10 @@ SizeT ARMT_Convert(Byte *data, SizeT size, UInt32 ip, int encoding)
   ip += 4;
   for (i = 0; i <= size; i += 2)
   {
-    if ((data[i + 1] & 0xF8) == 0xF0 &&
-        (data[i + 3] & 0xF8) == 0xF8)
+    i = g_BraFind(data + 1, i, size + 1, 0xF8, 0xF0, 2);
+    if (i > size)
+      break;
+    if ((data[i + 3] & 0xF8) == 0xF8)
     {
       UInt32 dest;
       UInt32 src =
@@ -74,7 +227,10 @@ SizeT PPC_Convert(Byte *data, SizeT size, UInt32 ip, int encoding)
   size -= 4;
   for (i = 0; i <= size; i += 4)
   {
-    if ((data[i] >> 2) == 0x12 && (data[i + 3] & 3) == 1)
+    i = g_BraFind(data, i, size + 1, 0xFC, 0x48, 4);
+    if (i > size)
+      break;
+    if ((data[i + 3] & 3) == 1)
     {
       UInt32 src = ((UInt32)(data[i + 0] & 3) << 24) |
         ((UInt32)data[i + 1] << 16) |
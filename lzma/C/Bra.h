@@ -61,6 +61,21 @@ SizeT PPC_Convert(Byte *data, SizeT size, UInt32 ip, int encoding);
 SizeT SPARC_Convert(Byte *data, SizeT size, UInt32 ip, int encoding);
 SizeT IA64_Convert(Byte *data, SizeT size, UInt32 ip, int encoding);
 
+/*
+The x86, ARM, ARMT and PPC converters look for the opcode bytes of branch instructions
+with vector instructions where the CPU has them, and check the candidates one by one.
+The output is the same for any backend. The fastest supported backend is selected
+on the first call of a converter.
+*/
+
+#define BRA_BACKEND_SCALAR 0 /* byte by byte */
+#define BRA_BACKEND_SSE2 1   /* x86 SSE2, 16 bytes per step */
+#define BRA_BACKEND_AVX2 2   /* x86 AVX2, 32 bytes per step */
+
+/* Returns False if the backend isn't available in this build or on this CPU */
+Bool Bra_SetBackend(int backend);
+int Bra_GetBackend(void);
+
 #ifdef __cplusplus
 }
 #endif
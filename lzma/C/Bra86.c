@@ -5,6 +5,9 @@
 
 #define Test86MSByte(b) ((b) == 0 || (b) == 0xFF)
 
+/* in Bra.c, finds the next byte with ((data[i] & mask) == value) */
+SizeT MY_FAST_CALL Bra_Find(const Byte *data, SizeT i, SizeT lim, unsigned mask, unsigned value, unsigned stride);
+
 const Byte kMaskToAllowedStatus[8] = {1, 1, 1, 0, 1, 0, 0, 0};
 const Byte kMaskToBitNumber[8] = {0, 1, 2, 2, 3, 3, 3, 3};
 
@@ -19,14 +22,11 @@ SizeT x86_Convert(Byte *data, SizeT size, UInt32 ip, UInt32 *state, int encoding
 
   for (;;)
   {
-    Byte *p = data + bufferPos;
-    Byte *limit = data + size - 4;
-    for (; p < limit; p++)
-      if ((*p & 0xFE) == 0xE8)
-        break;
-    bufferPos = (SizeT)(p - data);
-    if (p >= limit)
+    Byte *p;
+    bufferPos = Bra_Find(data, bufferPos, size - 4, 0xFE, 0xE8, 1);
+    if (bufferPos >= size - 4)
       break;
+    p = data + bufferPos;
     prevPosT = bufferPos - prevPosT;
     if (prevPosT > 3)
       prevMask = 0;
@@ -0,0 +1,57 @@
+/* Chunker.c -- Content-defined chunking
+2013-05-20 : Public domain */
+
+#include "Chunker.h"
+
+/* top bits of the hash, 2 more than log2(CHUNK_AVG_SIZE) before the average and 2 fewer after it */
+#define MASK_HARD 0xFFFF0000
+#define MASK_EASY 0xFFF00000
+
+static UInt32 g_Gear[256];
+
+void ChunkerGenerateTable(void)
+{
+  /* xorshift32 from a fixed seed, so every build gets the same table */
+  UInt32 x = 0x9E3779B9;
+  unsigned i;
+  for (i = 0; i < 256; i++)
+  {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    g_Gear[i] = x;
+  }
+}
+
+size_t Chunker_Next(const Byte *data, size_t size)
+{
+  UInt32 h = 0;
+  size_t i, avg;
+
+  if (size <= CHUNK_MIN_SIZE)
+    return size;
+  if (size > CHUNK_MAX_SIZE)
+    size = CHUNK_MAX_SIZE;
+
+  avg = (size < CHUNK_AVG_SIZE) ? size : CHUNK_AVG_SIZE;
+
+  /* bytes before the minimum only warm up the hash */
+  for (i = CHUNK_MIN_SIZE - 32; i < CHUNK_MIN_SIZE; i++)
+    h = (h << 1) + g_Gear[data[i]];
+
+  for (; i < avg; i++)
+  {
+    h = (h << 1) + g_Gear[data[i]];
+    if ((h & MASK_HARD) == 0)
+      return i + 1;
+  }
+
+  for (; i < size; i++)
+  {
+    h = (h << 1) + g_Gear[data[i]];
+    if ((h & MASK_EASY) == 0)
+      return i + 1;
+  }
+
+  return size;
+}
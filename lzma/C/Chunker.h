@@ -0,0 +1,38 @@
+/* Chunker.h -- Content-defined chunking
+2013-05-20 : Public domain */
+
+#ifndef __CHUNKER_H
+#define __CHUNKER_H
+
+#include "Types.h"
+
+EXTERN_C_BEGIN
+
+/*
+Splits data at positions chosen by a gear rolling hash over the last 32
+bytes, so an insertion or deletion only changes the chunks around it and
+every other chunk of the file keeps its boundaries and content. Boundaries
+are harder to hit before CHUNK_AVG_SIZE and easier after it, which keeps
+most chunks close to the average.
+
+The table and masks are part of the update format: changing them changes
+every chunk ID.
+*/
+
+#define CHUNK_MIN_SIZE (1 << 12)
+#define CHUNK_AVG_SIZE (1 << 14)
+#define CHUNK_MAX_SIZE (1 << 16)
+
+/* call once before Chunker_Next, like CrcGenerateTable */
+void ChunkerGenerateTable(void);
+
+/*
+Returns the length of the chunk that starts at data. Pass at least
+CHUNK_MAX_SIZE bytes unless data runs to the end of the file; with less,
+the whole of size is returned when no boundary is found.
+*/
+size_t Chunker_Next(const Byte *data, size_t size);
+
+EXTERN_C_END
+
+#endif
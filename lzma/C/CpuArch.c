@@ -5,6 +5,10 @@
 
 #ifdef MY_CPU_X86_OR_AMD64
 
+#if defined(_MSC_VER) && _MSC_FULL_VER >= 160040219
+#include <immintrin.h>
+#endif
+
 #if (defined(_MSC_VER) && !defined(MY_CPU_AMD64)) || defined(__GNUC__)
 #define USE_ASM
 #endif
@@ -78,14 +82,14 @@ static void MyCPUID(UInt32 function, UInt32 *a, UInt32 *b, UInt32 *c, UInt32 *d)
       "=b" (*b) ,
       "=c" (*c) ,
       "=d" (*d)
-    : "0" (function)) ;
+    : "0" (function), "2" (0)) ;
 
   #endif
   
   #else
 
   int CPUInfo[4];
-  __cpuid(CPUInfo, function);
+  __cpuidex(CPUInfo, function, 0);
   *a = CPUInfo[0];
   *b = CPUInfo[1];
   *c = CPUInfo[2];
@@ -156,6 +160,19 @@ static Bool CPU_Sys_Is_SSE_Supported()
 #define CHECK_SYS_SSE_SUPPORT
 #endif
 
+Bool CPU_Is_Sse2_Supported()
+{
+  #ifdef MY_CPU_AMD64
+  return True;
+  #else
+  Cx86cpuid p;
+  CHECK_SYS_SSE_SUPPORT
+  if (!x86cpuid_CheckAndRead(&p))
+    return False;
+  return (p.d >> 26) & 1;
+  #endif
+}
+
 Bool CPU_Is_Aes_Supported()
 {
   Cx86cpuid p;
@@ -165,4 +182,70 @@ Bool CPU_Is_Aes_Supported()
   return (p.c >> 25) & 1;
 }
 
+Bool CPU_Is_Sha_Supported()
+{
+  Cx86cpuid p;
+  UInt32 a, b, c, d;
+  CHECK_SYS_SSE_SUPPORT
+  if (!x86cpuid_CheckAndRead(&p) || p.maxFunc < 7)
+    return False;
+  /* SSSE3 and SSE4.1 are used next to the SHA instructions */
+  if (((p.c >> 9) & 1) == 0 || ((p.c >> 19) & 1) == 0)
+    return False;
+  MyCPUID(7, &a, &b, &c, &d);
+  return (b >> 29) & 1;
+}
+
+Bool CPU_Is_Clmul_Supported()
+{
+  Cx86cpuid p;
+  CHECK_SYS_SSE_SUPPORT
+  if (!x86cpuid_CheckAndRead(&p))
+    return False;
+  /* SSE4.1 is used next to PCLMULQDQ */
+  return ((p.c >> 1) & 1) && ((p.c >> 19) & 1);
+}
+
+/* low 32 bits of XCR0, the register states the OS saves */
+static UInt32 GetXcr0()
+{
+  #if defined(_MSC_VER) && _MSC_FULL_VER >= 160040219
+  return (UInt32)_xgetbv(0);
+  #elif defined(__GNUC__)
+  UInt32 a, d;
+  __asm__ __volatile__ (".byte 0x0f, 0x01, 0xd0" : "=a" (a), "=d" (d) : "c" (0));
+  return a;
+  #else
+  return 0;
+  #endif
+}
+
+Bool CPU_Is_VClmul_Supported()
+{
+  Cx86cpuid p;
+  UInt32 a, b, c, d;
+  if (!CPU_Is_Clmul_Supported() || !x86cpuid_CheckAndRead(&p) || p.maxFunc < 7)
+    return False;
+  /* the OS must use XSAVE and save the SSE, AVX and AVX-512 states */
+  if (((p.c >> 27) & 1) == 0 || (GetXcr0() & 0xE6) != 0xE6)
+    return False;
+  MyCPUID(7, &a, &b, &c, &d);
+  /* AVX512F, AVX512VL and VPCLMULQDQ */
+  return ((b >> 16) & 1) && ((b >> 31) & 1) && ((c >> 10) & 1);
+}
+
+Bool CPU_Is_Avx2_Supported()
+{
+  Cx86cpuid p;
+  UInt32 a, b, c, d;
+  CHECK_SYS_SSE_SUPPORT
+  if (!x86cpuid_CheckAndRead(&p) || p.maxFunc < 7)
+    return False;
+  /* the OS must use XSAVE and save the SSE and AVX states */
+  if (((p.c >> 27) & 1) == 0 || ((p.c >> 28) & 1) == 0 || (GetXcr0() & 6) != 6)
+    return False;
+  MyCPUID(7, &a, &b, &c, &d);
+  return (b >> 5) & 1;
+}
+
 #endif
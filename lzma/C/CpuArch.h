@@ -146,7 +146,12 @@ int x86cpuid_GetFirm(const Cx86cpuid *p);
 #define x86cpuid_GetStepping(p) ((p)->ver & 0xF)
 
 Bool CPU_Is_InOrder();
+Bool CPU_Is_Sse2_Supported();
 Bool CPU_Is_Aes_Supported();
+Bool CPU_Is_Sha_Supported();
+Bool CPU_Is_Clmul_Supported();
+Bool CPU_Is_VClmul_Supported();
+Bool CPU_Is_Avx2_Supported();
 
 #endif
 
@@ -0,0 +1,283 @@
+/* Lzma2DecMt.c -- Multi-thread LZMA2 Decoder
+2013-05-20 : Public domain */
+
+#include "Lzma2DecMt.h"
+
+#ifndef _7ZIP_ST
+#include "Threads.h"
+#endif
+
+#define LZMA2_CONTROL_LZMA (1 << 7)
+#define LZMA2_CONTROL_COPY_NO_RESET 2
+#define LZMA2_CONTROL_COPY_RESET_DIC 1
+#define LZMA2_CONTROL_EOF 0
+
+static SRes Lzma2DecSt_Decode(Byte *dest, SizeT destLen, const Byte *src, SizeT srcLen,
+    Byte prop, ISzAlloc *alloc)
+{
+  SizeT outSize = destLen, inSize = srcLen;
+  ELzmaStatus status;
+  RINOK(Lzma2Decode(dest, &outSize, src, &inSize, prop, LZMA_FINISH_END, &status, alloc));
+  if (outSize != destLen || inSize != srcLen || status != LZMA_STATUS_FINISHED_WITH_MARK)
+    return SZ_ERROR_DATA;
+  return SZ_OK;
+}
+
+#ifndef _7ZIP_ST
+
+/* ---------- segments ---------- */
+
+/* a run of chunks that starts with a dictionary reset; the last one also holds the end marker */
+typedef struct
+{
+  SizeT srcPos;
+  SizeT srcSize;
+  SizeT destPos;
+  SizeT destSize;
+} CLzma2Segment;
+
+/*
+Walks the chunk headers without decoding. If segments is NULL, only counts the segments.
+Returns SZ_ERROR_DATA if the stream is broken or doesn't match destLen / srcLen;
+the serial decoder is used then, so it reports the actual error.
+*/
+static SRes Lzma2_ScanSegments(const Byte *src, SizeT srcLen, SizeT destLen,
+    CLzma2Segment *segments, unsigned *numSegments)
+{
+  SizeT srcPos = 0, destPos = 0;
+  unsigned num = 0;
+  for (;;)
+  {
+    unsigned control;
+    SizeT unpackSize, packSize, headerSize;
+    Bool resetDic;
+
+    if (srcPos == srcLen)
+      return SZ_ERROR_DATA;
+    control = src[srcPos];
+    if (control == LZMA2_CONTROL_EOF)
+    {
+      if (srcPos + 1 != srcLen || destPos != destLen || num == 0)
+        return SZ_ERROR_DATA;
+      if (segments)
+        segments[num - 1].srcSize++;
+      break;
+    }
+    if ((control & LZMA2_CONTROL_LZMA) == 0)
+    {
+      if (control > LZMA2_CONTROL_COPY_NO_RESET || srcLen - srcPos < 3)
+        return SZ_ERROR_DATA;
+      unpackSize = ((SizeT)src[srcPos + 1] << 8 | src[srcPos + 2]) + 1;
+      packSize = unpackSize;
+      headerSize = 3;
+      resetDic = (control == LZMA2_CONTROL_COPY_RESET_DIC);
+    }
+    else
+    {
+      unsigned mode = (control >> 5) & 3;
+      headerSize = (mode >= 2) ? 6 : 5;
+      if (srcLen - srcPos < headerSize)
+        return SZ_ERROR_DATA;
+      unpackSize = ((SizeT)(control & 0x1F) << 16 | (SizeT)src[srcPos + 1] << 8 | src[srcPos + 2]) + 1;
+      packSize = ((SizeT)src[srcPos + 3] << 8 | src[srcPos + 4]) + 1;
+      resetDic = (mode == 3);
+    }
+    if (srcLen - srcPos - headerSize < packSize || destLen - destPos < unpackSize)
+      return SZ_ERROR_DATA;
+
+    if (resetDic)
+    {
+      if (segments)
+      {
+        segments[num].srcPos = srcPos;
+        segments[num].srcSize = 0;
+        segments[num].destPos = destPos;
+        segments[num].destSize = 0;
+      }
+      num++;
+    }
+    else if (num == 0)
+      return SZ_ERROR_DATA;
+    if (segments)
+    {
+      segments[num - 1].srcSize += headerSize + packSize;
+      segments[num - 1].destSize += unpackSize;
+    }
+    srcPos += headerSize + packSize;
+    destPos += unpackSize;
+  }
+  *numSegments = num;
+  return SZ_OK;
+}
+
+/*
+A segment starts with a dictionary reset, and Lzma2Dec resets the state and requires
+new props after it, so a fresh decoder decodes it exactly as the sequential one would.
+Other than the last one, a segment ends without the end marker. The decoder gets the
+control byte of the next segment too: it has accepted the segment only if it reads that
+byte, since an LZMA chunk whose range coder didn't finish cleanly stops before it.
+*/
+static SRes Lzma2Segment_Decode(CLzma2Dec *dec, const CLzma2Segment *seg, Byte *dest,
+    const Byte *src, Bool isLast)
+{
+  SizeT srcSize = seg->srcSize + (isLast ? 0 : 1);
+  SizeT srcLen = srcSize;
+  ELzmaStatus status;
+  SRes res;
+  dec->decoder.dic = dest + seg->destPos;
+  dec->decoder.dicBufSize = seg->destSize;
+  Lzma2Dec_Init(dec);
+  res = Lzma2Dec_DecodeToDic(dec, seg->destSize, src + seg->srcPos, &srcLen, LZMA_FINISH_END, &status);
+  RINOK(res);
+  if (srcLen != srcSize || dec->decoder.dicPos != seg->destSize ||
+      status != (isLast ? LZMA_STATUS_FINISHED_WITH_MARK : LZMA_STATUS_NEEDS_MORE_INPUT))
+    return SZ_ERROR_DATA;
+  return SZ_OK;
+}
+
+/* ---------- threads ---------- */
+
+struct CLzma2DecMt;
+
+typedef struct
+{
+  struct CLzma2DecMt *mt;
+  CLzma2Dec dec;
+  CThread thread;
+} CLzma2DecMtThread;
+
+typedef struct CLzma2DecMt
+{
+  Byte *dest;
+  const Byte *src;
+  const CLzma2Segment *segments;
+  unsigned numSegments;
+  unsigned next;
+  SRes res;
+  CCriticalSection cs;
+  CLzma2DecMtThread threads[LZMA2_DEC_MT_THREADS_MAX];
+} CLzma2DecMt;
+
+/* takes segments until they run out or some thread fails */
+static void Lzma2DecMtThread_Process(CLzma2DecMtThread *t)
+{
+  CLzma2DecMt *p = t->mt;
+  for (;;)
+  {
+    unsigned index;
+    SRes res;
+    CriticalSection_Enter(&p->cs);
+    index = p->next;
+    if (p->res == SZ_OK && index != p->numSegments)
+      p->next++;
+    else
+      index = p->numSegments;
+    CriticalSection_Leave(&p->cs);
+    if (index == p->numSegments)
+      return;
+    res = Lzma2Segment_Decode(&t->dec, &p->segments[index], p->dest, p->src, index == p->numSegments - 1);
+    if (res != SZ_OK)
+    {
+      CriticalSection_Enter(&p->cs);
+      if (p->res == SZ_OK)
+        p->res = res;
+      CriticalSection_Leave(&p->cs);
+      return;
+    }
+  }
+}
+
+static THREAD_FUNC_RET_TYPE THREAD_FUNC_CALL_TYPE Lzma2DecMt_ThreadFunc(void *pp)
+{
+  Lzma2DecMtThread_Process((CLzma2DecMtThread *)pp);
+  return 0;
+}
+
+static SRes Lzma2DecMt_Code(CLzma2DecMt *p, Byte prop, unsigned numThreads, ISzAlloc *alloc)
+{
+  unsigned i, numCreated = 0;
+  SRes res = SZ_OK;
+
+  for (i = 0; i < numThreads; i++)
+  {
+    CLzma2DecMtThread *t = &p->threads[i];
+    t->mt = p;
+    Lzma2Dec_Construct(&t->dec);
+    Thread_Construct(&t->thread);
+  }
+  for (i = 0; i < numThreads && res == SZ_OK; i++)
+    res = Lzma2Dec_AllocateProbs(&p->threads[i].dec, prop, alloc);
+
+  if (res == SZ_OK)
+  {
+    /* a thread that can't be started just leaves its segments to the others */
+    for (i = 1; i < numThreads; i++)
+    {
+      if (Thread_Create(&p->threads[i].thread, Lzma2DecMt_ThreadFunc, &p->threads[i]) != 0)
+        break;
+      numCreated = i;
+    }
+    Lzma2DecMtThread_Process(&p->threads[0]);
+    for (i = 1; i <= numCreated; i++)
+    {
+      Thread_Wait(&p->threads[i].thread);
+      Thread_Close(&p->threads[i].thread);
+    }
+    res = p->res;
+  }
+
+  for (i = 0; i < numThreads; i++)
+    Lzma2Dec_FreeProbs(&p->threads[i].dec, alloc);
+  return res;
+}
+
+#endif
+
+SRes Lzma2DecMt_Decode(Byte *dest, SizeT destLen, const Byte *src, SizeT srcLen,
+    Byte prop, unsigned numThreads, ISzAlloc *alloc)
+{
+  #ifndef _7ZIP_ST
+  unsigned numSegments = 0;
+  if (numThreads > LZMA2_DEC_MT_THREADS_MAX)
+    numThreads = LZMA2_DEC_MT_THREADS_MAX;
+  if (numThreads > 1 &&
+      Lzma2_ScanSegments(src, srcLen, destLen, NULL, &numSegments) == SZ_OK &&
+      numSegments > 1)
+  {
+    CLzma2DecMt *p;
+    SRes res;
+    if (prop > 40)
+      return SZ_ERROR_UNSUPPORTED;
+    if (numThreads > numSegments)
+      numThreads = numSegments;
+    p = (CLzma2DecMt *)IAlloc_Alloc(alloc, sizeof(CLzma2DecMt));
+    if (p == 0)
+      return SZ_ERROR_MEM;
+    p->segments = (CLzma2Segment *)IAlloc_Alloc(alloc, numSegments * sizeof(CLzma2Segment));
+    if (p->segments == 0)
+    {
+      IAlloc_Free(alloc, p);
+      return SZ_ERROR_MEM;
+    }
+    Lzma2_ScanSegments(src, srcLen, destLen, (CLzma2Segment *)p->segments, &numSegments);
+    p->dest = dest;
+    p->src = src;
+    p->numSegments = numSegments;
+    p->next = 0;
+    p->res = SZ_OK;
+    if (CriticalSection_Init(&p->cs) != 0)
+      res = Lzma2DecSt_Decode(dest, destLen, src, srcLen, prop, alloc);
+    else
+    {
+      res = Lzma2DecMt_Code(p, prop, numThreads, alloc);
+      CriticalSection_Delete(&p->cs);
+    }
+    IAlloc_Free(alloc, (void *)p->segments);
+    IAlloc_Free(alloc, p);
+    return res;
+  }
+  #else
+  numThreads = numThreads;
+  #endif
+  return Lzma2DecSt_Decode(dest, destLen, src, srcLen, prop, alloc);
+}
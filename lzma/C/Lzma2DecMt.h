@@ -0,0 +1,45 @@
+/* Lzma2DecMt.h -- Multi-thread LZMA2 Decoder
+2013-05-20 : Public domain */
+
+#ifndef __LZMA2_DEC_MT_H
+#define __LZMA2_DEC_MT_H
+
+#include "Lzma2Dec.h"
+
+EXTERN_C_BEGIN
+
+#ifndef _7ZIP_ST
+#define LZMA2_DEC_MT_THREADS_MAX 32
+#else
+#define LZMA2_DEC_MT_THREADS_MAX 1
+#endif
+
+/*
+Lzma2DecMt_Decode
+  Decodes the whole LZMA2 stream in src to dest. The stream must end with the end marker
+  exactly at srcLen, and it must unpack to exactly destLen bytes.
+
+  Lzma2Enc with numBlockThreads > 1 starts every block with a dictionary reset, so such
+  streams consist of segments that don't refer to each other. The chunk headers are
+  scanned for the reset points first, then the segments are decoded by numThreads threads
+  (the calling thread is one of them), each directly to its own place in dest.
+  Streams with one segment, streams that fail the scan, and numThreads <= 1 are decoded
+  by Lzma2Decode on the calling thread.
+
+  Every thread gets its own probs, but they are allocated and freed by the calling thread,
+  so alloc doesn't have to be thread-safe.
+
+Returns:
+  SZ_OK
+  SZ_ERROR_DATA - Data error
+  SZ_ERROR_MEM  - Memory allocation error
+  SZ_ERROR_UNSUPPORTED - Unsupported properties
+  SZ_ERROR_INPUT_EOF - The stream ends before the end marker
+*/
+
+SRes Lzma2DecMt_Decode(Byte *dest, SizeT destLen, const Byte *src, SizeT srcLen,
+    Byte prop, unsigned numThreads, ISzAlloc *alloc);
+
+EXTERN_C_END
+
+#endif
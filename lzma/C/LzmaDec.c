@@ -24,6 +24,12 @@
   { UPDATE_1(p); i = (i + i) + 1; A1; }
 #define GET_BIT(p, i) GET_BIT2(p, i, ; , ;)
 
+#define MATCHED_LITER_DEC \
+  matchByte <<= 1; \
+  bit = (matchByte & offs); \
+  probLit = prob + offs + bit + symbol; \
+  GET_BIT2(probLit, symbol, offs &= ~bit, offs &= bit)
+
 #define TREE_GET_BIT(probs, i) { GET_BIT((probs + i), i); }
 #define TREE_DECODE(probs, limit, i) \
   { i = 1; do { TREE_GET_BIT(probs, i); } while (i < limit); i -= limit; }
@@ -91,19 +97,30 @@
 #define kMatchMinLen 2
 #define kMatchSpecLenStart (kMatchMinLen + kLenNumLowSymbols + kLenNumMidSymbols + kLenNumHighSymbols)
 
+/*
+The probs that are read for every symbol are grouped by state, so that one symbol
+touches as few cache lines as possible:
+  IsMatch and IsRep0Long of a state are neighbours (64 bytes with 16-bit probs),
+  IsRep, IsRepG0, IsRepG1 and IsRepG2 of a state are 4 consecutive probs.
+The total size is the same as in the LZMA specification's layout.
+*/
+
 #define IsMatch 0
-#define IsRep (IsMatch + (kNumStates << kNumPosBitsMax))
-#define IsRepG0 (IsRep + kNumStates)
-#define IsRepG1 (IsRepG0 + kNumStates)
-#define IsRepG2 (IsRepG1 + kNumStates)
-#define IsRep0Long (IsRepG2 + kNumStates)
-#define PosSlot (IsRep0Long + (kNumStates << kNumPosBitsMax))
+#define IsRep0Long (IsMatch + kNumPosStatesMax)
+#define IsRep (IsMatch + (kNumStates << (kNumPosBitsMax + 1)))
+#define IsRepG0 (IsRep + 1)
+#define IsRepG1 (IsRep + 2)
+#define IsRepG2 (IsRep + 3)
+#define PosSlot (IsRep + (kNumStates << 2))
 #define SpecPos (PosSlot + (kNumLenToPosStates << kNumPosSlotBits))
 #define Align (SpecPos + kNumFullDistances - kEndPosModelIndex)
 #define LenCoder (Align + kAlignTableSize)
 #define RepLenCoder (LenCoder + kNumLenProbs)
 #define Literal (RepLenCoder + kNumLenProbs)
 
+#define IS_MATCH_INDEX(state, posState) (((state) << (kNumPosBitsMax + 1)) + (posState))
+#define IS_REP_INDEX(state) ((state) << 2)
+
 #define LZMA_BASE_SIZE 1846
 #define LZMA_LIT_SIZE 768
 
@@ -128,15 +145,22 @@ Out:
     = kMatchSpecLenStart + 2 : State Init Marker
 */
 
-static int MY_FAST_CALL LzmaDec_DecodeReal(CLzmaDec *p, SizeT limit, const Byte *bufLimit)
+/*
+LzmaDec_DecodeRealT is the decoding loop for the given lc, lp and pb. It's expanded
+into LzmaDec_DecodeReal that takes them from p->prop, and into specialized versions
+for the common properties, where the literal context and the position masks
+are compile-time constants.
+*/
+
+static MY_FORCE_INLINE int LzmaDec_DecodeRealT(CLzmaDec *p, SizeT limit, const Byte *bufLimit,
+    unsigned lc, unsigned lp, unsigned pb)
 {
   CLzmaProb *probs = p->probs;
 
   unsigned state = p->state;
   UInt32 rep0 = p->reps[0], rep1 = p->reps[1], rep2 = p->reps[2], rep3 = p->reps[3];
-  unsigned pbMask = ((unsigned)1 << (p->prop.pb)) - 1;
-  unsigned lpMask = ((unsigned)1 << (p->prop.lp)) - 1;
-  unsigned lc = p->prop.lc;
+  unsigned pbMask = ((unsigned)1 << pb) - 1;
+  unsigned lpMask = ((unsigned)1 << lp) - 1;
 
   Byte *dic = p->dic;
   SizeT dicBufSize = p->dicBufSize;
@@ -157,7 +181,7 @@ static int MY_FAST_CALL LzmaDec_DecodeReal(CLzmaDec *p, SizeT limit, const Byte
     unsigned ttt;
     unsigned posState = processedPos & pbMask;
 
-    prob = probs + IsMatch + (state << kNumPosBitsMax) + posState;
+    prob = probs + IsMatch + IS_MATCH_INDEX(state, posState);
     IF_BIT_0(prob)
     {
       unsigned symbol;
@@ -171,7 +195,18 @@ static int MY_FAST_CALL LzmaDec_DecodeReal(CLzmaDec *p, SizeT limit, const Byte
       {
         state -= (state < 4) ? state : 3;
         symbol = 1;
+        #ifdef _LZMA_SIZE_OPT
         do { GET_BIT(prob + symbol, symbol) } while (symbol < 0x100);
+        #else
+        GET_BIT(prob + symbol, symbol)
+        GET_BIT(prob + symbol, symbol)
+        GET_BIT(prob + symbol, symbol)
+        GET_BIT(prob + symbol, symbol)
+        GET_BIT(prob + symbol, symbol)
+        GET_BIT(prob + symbol, symbol)
+        GET_BIT(prob + symbol, symbol)
+        GET_BIT(prob + symbol, symbol)
+        #endif
       }
       else
       {
@@ -179,16 +214,28 @@ static int MY_FAST_CALL LzmaDec_DecodeReal(CLzmaDec *p, SizeT limit, const Byte
         unsigned offs = 0x100;
         state -= (state < 10) ? 3 : 6;
         symbol = 1;
+        #ifdef _LZMA_SIZE_OPT
         do
         {
           unsigned bit;
           CLzmaProb *probLit;
-          matchByte <<= 1;
-          bit = (matchByte & offs);
-          probLit = prob + offs + bit + symbol;
-          GET_BIT2(probLit, symbol, offs &= ~bit, offs &= bit)
+          MATCHED_LITER_DEC
         }
         while (symbol < 0x100);
+        #else
+        {
+          unsigned bit;
+          CLzmaProb *probLit;
+          MATCHED_LITER_DEC
+          MATCHED_LITER_DEC
+          MATCHED_LITER_DEC
+          MATCHED_LITER_DEC
+          MATCHED_LITER_DEC
+          MATCHED_LITER_DEC
+          MATCHED_LITER_DEC
+          MATCHED_LITER_DEC
+        }
+        #endif
       }
       dic[dicPos++] = (Byte)symbol;
       processedPos++;
@@ -197,7 +244,7 @@ static int MY_FAST_CALL LzmaDec_DecodeReal(CLzmaDec *p, SizeT limit, const Byte
     else
     {
       UPDATE_1(prob);
-      prob = probs + IsRep + state;
+      prob = probs + IsRep + IS_REP_INDEX(state);
       IF_BIT_0(prob)
       {
         UPDATE_0(prob);
@@ -209,11 +256,11 @@ static int MY_FAST_CALL LzmaDec_DecodeReal(CLzmaDec *p, SizeT limit, const Byte
         UPDATE_1(prob);
         if (checkDicSize == 0 && processedPos == 0)
           return SZ_ERROR_DATA;
-        prob = probs + IsRepG0 + state;
+        prob = probs + IsRepG0 + IS_REP_INDEX(state);
         IF_BIT_0(prob)
         {
           UPDATE_0(prob);
-          prob = probs + IsRep0Long + (state << kNumPosBitsMax) + posState;
+          prob = probs + IsRep0Long + IS_MATCH_INDEX(state, posState);
           IF_BIT_0(prob)
           {
             UPDATE_0(prob);
@@ -229,7 +276,7 @@ static int MY_FAST_CALL LzmaDec_DecodeReal(CLzmaDec *p, SizeT limit, const Byte
         {
           UInt32 distance;
           UPDATE_1(prob);
-          prob = probs + IsRepG1 + state;
+          prob = probs + IsRepG1 + IS_REP_INDEX(state);
           IF_BIT_0(prob)
           {
             UPDATE_0(prob);
@@ -238,7 +285,7 @@ static int MY_FAST_CALL LzmaDec_DecodeReal(CLzmaDec *p, SizeT limit, const Byte
           else
           {
             UPDATE_1(prob);
-            prob = probs + IsRepG2 + state;
+            prob = probs + IsRepG2 + IS_REP_INDEX(state);
             IF_BIT_0(prob)
             {
               UPDATE_0(prob);
@@ -425,6 +472,39 @@ static int MY_FAST_CALL LzmaDec_DecodeReal(CLzmaDec *p, SizeT limit, const Byte
   return SZ_OK;
 }
 
+typedef int (MY_FAST_CALL *LzmaDec_DecodeRealFunc)(CLzmaDec *p, SizeT limit, const Byte *bufLimit);
+
+static int MY_FAST_CALL LzmaDec_DecodeReal(CLzmaDec *p, SizeT limit, const Byte *bufLimit)
+{
+  return LzmaDec_DecodeRealT(p, limit, bufLimit, p->prop.lc, p->prop.lp, p->prop.pb);
+}
+
+#ifndef _LZMA_SIZE_OPT
+
+#define LZMA_DEC_REAL_SPEC(lc, lp, pb) \
+  static int MY_FAST_CALL LzmaDec_DecodeReal_ ## lc ## lp ## pb(CLzmaDec *p, SizeT limit, const Byte *bufLimit) \
+    { return LzmaDec_DecodeRealT(p, limit, bufLimit, lc, lp, pb); }
+
+/* 3-0-2 is the default, 4-0-0 is for text, 0-2-2 is for 32-bit aligned data */
+LZMA_DEC_REAL_SPEC(3, 0, 2)
+LZMA_DEC_REAL_SPEC(4, 0, 0)
+LZMA_DEC_REAL_SPEC(0, 2, 2)
+
+#endif
+
+static LzmaDec_DecodeRealFunc LzmaDec_GetDecodeReal(const CLzmaProps *prop)
+{
+  #ifndef _LZMA_SIZE_OPT
+  if (prop->lc == 3 && prop->lp == 0 && prop->pb == 2)
+    return LzmaDec_DecodeReal_302;
+  if (prop->lc == 4 && prop->lp == 0 && prop->pb == 0)
+    return LzmaDec_DecodeReal_400;
+  if (prop->lc == 0 && prop->lp == 2 && prop->pb == 2)
+    return LzmaDec_DecodeReal_022;
+  #endif
+  return LzmaDec_DecodeReal;
+}
+
 static void MY_FAST_CALL LzmaDec_WriteRem(CLzmaDec *p, SizeT limit)
 {
   if (p->remainLen != 0 && p->remainLen < kMatchSpecLenStart)
@@ -452,8 +532,11 @@ static void MY_FAST_CALL LzmaDec_WriteRem(CLzmaDec *p, SizeT limit)
   }
 }
 
+/* Lzma2Dec changes p->prop without LzmaDec_Allocate, so the decoding loop is selected here */
+
 static int MY_FAST_CALL LzmaDec_DecodeReal2(CLzmaDec *p, SizeT limit, const Byte *bufLimit)
 {
+  LzmaDec_DecodeRealFunc decodeReal = LzmaDec_GetDecodeReal(&p->prop);
   do
   {
     SizeT limit2 = limit;
@@ -463,7 +546,7 @@ static int MY_FAST_CALL LzmaDec_DecodeReal2(CLzmaDec *p, SizeT limit, const Byte
       if (limit - p->dicPos > rem)
         limit2 = p->dicPos + rem;
     }
-    RINOK(LzmaDec_DecodeReal(p, limit2, bufLimit));
+    RINOK(decodeReal(p, limit2, bufLimit));
     if (p->processedPos >= p->prop.dicSize)
       p->checkDicSize = p->prop.dicSize;
     LzmaDec_WriteRem(p, limit);
@@ -500,7 +583,7 @@ static ELzmaDummy LzmaDec_TryDummy(const CLzmaDec *p, const Byte *buf, SizeT inS
     unsigned ttt;
     unsigned posState = (p->processedPos) & ((1 << p->prop.pb) - 1);
 
-    prob = probs + IsMatch + (state << kNumPosBitsMax) + posState;
+    prob = probs + IsMatch + IS_MATCH_INDEX(state, posState);
     IF_BIT_0_CHECK(prob)
     {
       UPDATE_0_CHECK
@@ -542,7 +625,7 @@ static ELzmaDummy LzmaDec_TryDummy(const CLzmaDec *p, const Byte *buf, SizeT inS
       unsigned len;
       UPDATE_1_CHECK;
 
-      prob = probs + IsRep + state;
+      prob = probs + IsRep + IS_REP_INDEX(state);
       IF_BIT_0_CHECK(prob)
       {
         UPDATE_0_CHECK;
@@ -554,11 +637,11 @@ static ELzmaDummy LzmaDec_TryDummy(const CLzmaDec *p, const Byte *buf, SizeT inS
       {
         UPDATE_1_CHECK;
         res = DUMMY_REP;
-        prob = probs + IsRepG0 + state;
+        prob = probs + IsRepG0 + IS_REP_INDEX(state);
         IF_BIT_0_CHECK(prob)
         {
           UPDATE_0_CHECK;
-          prob = probs + IsRep0Long + (state << kNumPosBitsMax) + posState;
+          prob = probs + IsRep0Long + IS_MATCH_INDEX(state, posState);
           IF_BIT_0_CHECK(prob)
           {
             UPDATE_0_CHECK;
@@ -573,7 +656,7 @@ static ELzmaDummy LzmaDec_TryDummy(const CLzmaDec *p, const Byte *buf, SizeT inS
         else
         {
           UPDATE_1_CHECK;
-          prob = probs + IsRepG1 + state;
+          prob = probs + IsRepG1 + IS_REP_INDEX(state);
           IF_BIT_0_CHECK(prob)
           {
             UPDATE_0_CHECK;
@@ -581,7 +664,7 @@ static ELzmaDummy LzmaDec_TryDummy(const CLzmaDec *p, const Byte *buf, SizeT inS
           else
           {
             UPDATE_1_CHECK;
-            prob = probs + IsRepG2 + state;
+            prob = probs + IsRepG2 + IS_REP_INDEX(state);
             IF_BIT_0_CHECK(prob)
             {
               UPDATE_0_CHECK;
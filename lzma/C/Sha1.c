@@ -0,0 +1,181 @@
+/* Sha1.c -- SHA-1 Hash
+2013-05-20 : Public domain
+Same structure as Sha256.c, so the two can be used interchangeably.
+The SHA extensions version is in Sha1Opt.c. */
+
+#include <string.h>
+
+#include "CpuArch.h"
+#include "RotateDefs.h"
+#include "Sha1.h"
+
+#ifdef SHA_HW_SUPPORTED
+void MY_FAST_CALL Sha1_UpdateBlocks_HW(UInt32 state[5], const Byte *data, size_t numBlocks);
+#endif
+
+static void MY_FAST_CALL Sha1_UpdateBlocks(UInt32 state[5], const Byte *data, size_t numBlocks);
+
+static SHA_FUNC_UPDATE_BLOCKS g_Sha1_UpdateBlocks = Sha1_UpdateBlocks;
+static int g_Sha1_Backend = SHA_BACKEND_PORTABLE;
+
+Bool Sha1_SetBackend(int backend)
+{
+  switch (backend)
+  {
+    case SHA_BACKEND_PORTABLE:
+      g_Sha1_UpdateBlocks = Sha1_UpdateBlocks;
+      break;
+    #ifdef SHA_HW_SUPPORTED
+    case SHA_BACKEND_HW:
+      if (!CPU_Is_Sha_Supported())
+        return False;
+      g_Sha1_UpdateBlocks = Sha1_UpdateBlocks_HW;
+      break;
+    #endif
+    default:
+      return False;
+  }
+  g_Sha1_Backend = backend;
+  return True;
+}
+
+int Sha1_GetBackend(void)
+{
+  return g_Sha1_Backend;
+}
+
+void Sha1Prepare(void)
+{
+  if (!Sha1_SetBackend(SHA_BACKEND_HW))
+    Sha1_SetBackend(SHA_BACKEND_PORTABLE);
+}
+
+void Sha1_Init(CSha1 *p)
+{
+  p->state[0] = 0x67452301;
+  p->state[1] = 0xEFCDAB89;
+  p->state[2] = 0x98BADCFE;
+  p->state[3] = 0x10325476;
+  p->state[4] = 0xC3D2E1F0;
+  p->count = 0;
+}
+
+#define blk0(i) (W[i] = data[i])
+#define blk(i) (W[(i)&15] = rotlFixed(W[((i)-3)&15] ^ W[((i)-8)&15] ^ W[((i)-14)&15] ^ W[((i)-16)&15], 1))
+
+#define f1(x,y,z) (z^(x&(y^z)))
+#define f2(x,y,z) (x^y^z)
+#define f3(x,y,z) ((x&y)|(z&(x|y)))
+#define f4(x,y,z) (x^y^z)
+
+#define RK(a,b,c,d,e, i, f, w, k) e += f(b,c,d) + w(i) + k + rotlFixed(a,5); b = rotlFixed(b,30);
+
+#define R0(a,b,c,d,e, i) RK(a,b,c,d,e, i, f1, blk0, 0x5A827999)
+#define R1(a,b,c,d,e, i) RK(a,b,c,d,e, i, f1, blk,  0x5A827999)
+#define R2(a,b,c,d,e, i) RK(a,b,c,d,e, i, f2, blk,  0x6ED9EBA1)
+#define R3(a,b,c,d,e, i) RK(a,b,c,d,e, i, f3, blk,  0x8F1BBCDC)
+#define R4(a,b,c,d,e, i) RK(a,b,c,d,e, i, f4, blk,  0xCA62C1D6)
+
+#define RX_5(rx, i) \
+  rx(a,b,c,d,e, i); \
+  rx(e,a,b,c,d, i+1); \
+  rx(d,e,a,b,c, i+2); \
+  rx(c,d,e,a,b, i+3); \
+  rx(b,c,d,e,a, i+4);
+
+static void Sha1_Transform(UInt32 *state, const UInt32 *data)
+{
+  UInt32 W[16];
+  UInt32 a,b,c,d,e;
+  a = state[0];
+  b = state[1];
+  c = state[2];
+  d = state[3];
+  e = state[4];
+
+  RX_5(R0, 0); RX_5(R0, 5); RX_5(R0, 10);
+  R0(a,b,c,d,e, 15);
+  R1(e,a,b,c,d, 16);
+  R1(d,e,a,b,c, 17);
+  R1(c,d,e,a,b, 18);
+  R1(b,c,d,e,a, 19);
+
+  RX_5(R2, 20); RX_5(R2, 25); RX_5(R2, 30); RX_5(R2, 35);
+  RX_5(R3, 40); RX_5(R3, 45); RX_5(R3, 50); RX_5(R3, 55);
+  RX_5(R4, 60); RX_5(R4, 65); RX_5(R4, 70); RX_5(R4, 75);
+
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+}
+
+static void MY_FAST_CALL Sha1_UpdateBlocks(UInt32 state[5], const Byte *data, size_t numBlocks)
+{
+  UInt32 data32[16];
+  for (; numBlocks != 0; numBlocks--, data += 64)
+  {
+    unsigned i;
+    for (i = 0; i < 16; i++)
+      data32[i] = GetBe32(data + i * 4);
+    Sha1_Transform(state, data32);
+  }
+}
+
+void Sha1_Update(CSha1 *p, const Byte *data, size_t size)
+{
+  unsigned curBufferPos = (unsigned)p->count & 0x3F;
+  p->count += size;
+  if (curBufferPos != 0)
+  {
+    unsigned num = 64 - curBufferPos;
+    if (num > size)
+      num = (unsigned)size;
+    memcpy(p->buffer + curBufferPos, data, num);
+    data += num;
+    size -= num;
+    curBufferPos += num;
+    if (curBufferPos != 64)
+      return;
+    g_Sha1_UpdateBlocks(p->state, p->buffer, 1);
+  }
+  /* whole blocks are hashed straight from the caller's buffer */
+  if (size >= 64)
+  {
+    g_Sha1_UpdateBlocks(p->state, data, size >> 6);
+    data += size & ~(size_t)0x3F;
+    size &= 0x3F;
+  }
+  memcpy(p->buffer, data, size);
+}
+
+void Sha1_Final(CSha1 *p, Byte *digest)
+{
+  UInt64 lenInBits = (p->count << 3);
+  unsigned curBufferPos = (unsigned)p->count & 0x3F;
+  unsigned i;
+  p->buffer[curBufferPos++] = 0x80;
+  while (curBufferPos != (64 - 8))
+  {
+    curBufferPos &= 0x3F;
+    if (curBufferPos == 0)
+      g_Sha1_UpdateBlocks(p->state, p->buffer, 1);
+    p->buffer[curBufferPos++] = 0;
+  }
+  for (i = 0; i < 8; i++)
+  {
+    p->buffer[curBufferPos++] = (Byte)(lenInBits >> 56);
+    lenInBits <<= 8;
+  }
+  g_Sha1_UpdateBlocks(p->state, p->buffer, 1);
+
+  for (i = 0; i < 5; i++)
+  {
+    *digest++ = (Byte)(p->state[i] >> 24);
+    *digest++ = (Byte)(p->state[i] >> 16);
+    *digest++ = (Byte)(p->state[i] >> 8);
+    *digest++ = (Byte)(p->state[i]);
+  }
+  Sha1_Init(p);
+}
@@ -0,0 +1,33 @@
+/* Sha1.h -- SHA-1 Hash
+2013-05-20 : Public domain */
+
+#ifndef __CRYPTO_SHA1_H
+#define __CRYPTO_SHA1_H
+
+#include "Types.h"
+#include "ShaBackend.h"
+
+EXTERN_C_BEGIN
+
+#define SHA1_DIGEST_SIZE 20
+
+typedef struct
+{
+  UInt32 state[5];
+  UInt64 count;
+  Byte buffer[64];
+} CSha1;
+
+/* Call Sha1Prepare one time to switch to the fastest backend the CPU supports.
+   Without it the portable code is used. */
+void Sha1Prepare(void);
+Bool Sha1_SetBackend(int backend);
+int Sha1_GetBackend(void);
+
+void Sha1_Init(CSha1 *p);
+void Sha1_Update(CSha1 *p, const Byte *data, size_t size);
+void Sha1_Final(CSha1 *p, Byte *digest);
+
+EXTERN_C_END
+
+#endif
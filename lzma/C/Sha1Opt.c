@@ -0,0 +1,83 @@
+/* Sha1Opt.c -- SHA-1 using x86 SHA extensions
+2013-05-20 : Public domain */
+
+#include "Sha1.h"
+
+#ifdef SHA_HW_SUPPORTED
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#define ATTRIB_SHA
+#else
+#include <immintrin.h>
+#define ATTRIB_SHA __attribute__((__target__("sha,ssse3,sse4.1")))
+#endif
+
+/* 4 rounds with round function f; e1 receives the E value for the next group */
+#define RND4(e0, e1, f) \
+  e1 = abcd; \
+  abcd = _mm_sha1rnds4_epu32(abcd, e0, f);
+
+/* m0 = next 4 schedule words, computed from the previous 16 words in m0..m3 */
+#define SCHED(m0, m1, m2, m3) \
+  m0 = _mm_sha1msg2_epu32(_mm_xor_si128(_mm_sha1msg1_epu32(m0, m1), m2), m3);
+
+#define NEXT(e, m) e = _mm_sha1nexte_epu32(e, m);
+
+#define LOAD(m, n) m = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(const void *)(data + (n) * 16)), mask);
+
+ATTRIB_SHA
+void MY_FAST_CALL Sha1_UpdateBlocks_HW(UInt32 state[5], const Byte *data, size_t numBlocks)
+{
+  const __m128i mask = _mm_set_epi32(0x00010203, 0x04050607, 0x08090a0b, 0x0c0d0e0f);
+  __m128i abcd, e0, e1;
+  __m128i m0, m1, m2, m3;
+
+  if (numBlocks == 0)
+    return;
+
+  abcd = _mm_loadu_si128((const __m128i *)(const void *)state);
+  abcd = _mm_shuffle_epi32(abcd, 0x1B);
+  e0 = _mm_set_epi32((int)state[4], 0, 0, 0);
+
+  do
+  {
+    const __m128i abcdSave = abcd;
+    const __m128i eSave = e0;
+
+    /* rounds 0-15 */
+    LOAD(m0, 0) e0 = _mm_add_epi32(e0, m0); RND4(e0, e1, 0)
+    LOAD(m1, 1) NEXT(e1, m1) RND4(e1, e0, 0)
+    LOAD(m2, 2) NEXT(e0, m2) RND4(e0, e1, 0)
+    LOAD(m3, 3) NEXT(e1, m3) RND4(e1, e0, 0)
+
+    /* rounds 16-79 */
+    SCHED(m0, m1, m2, m3) NEXT(e0, m0) RND4(e0, e1, 0)
+    SCHED(m1, m2, m3, m0) NEXT(e1, m1) RND4(e1, e0, 1)
+    SCHED(m2, m3, m0, m1) NEXT(e0, m2) RND4(e0, e1, 1)
+    SCHED(m3, m0, m1, m2) NEXT(e1, m3) RND4(e1, e0, 1)
+    SCHED(m0, m1, m2, m3) NEXT(e0, m0) RND4(e0, e1, 1)
+    SCHED(m1, m2, m3, m0) NEXT(e1, m1) RND4(e1, e0, 1)
+    SCHED(m2, m3, m0, m1) NEXT(e0, m2) RND4(e0, e1, 2)
+    SCHED(m3, m0, m1, m2) NEXT(e1, m3) RND4(e1, e0, 2)
+    SCHED(m0, m1, m2, m3) NEXT(e0, m0) RND4(e0, e1, 2)
+    SCHED(m1, m2, m3, m0) NEXT(e1, m1) RND4(e1, e0, 2)
+    SCHED(m2, m3, m0, m1) NEXT(e0, m2) RND4(e0, e1, 2)
+    SCHED(m3, m0, m1, m2) NEXT(e1, m3) RND4(e1, e0, 3)
+    SCHED(m0, m1, m2, m3) NEXT(e0, m0) RND4(e0, e1, 3)
+    SCHED(m1, m2, m3, m0) NEXT(e1, m1) RND4(e1, e0, 3)
+    SCHED(m2, m3, m0, m1) NEXT(e0, m2) RND4(e0, e1, 3)
+    SCHED(m3, m0, m1, m2) NEXT(e1, m3) RND4(e1, e0, 3)
+
+    NEXT(e0, eSave)
+    abcd = _mm_add_epi32(abcd, abcdSave);
+    data += 64;
+  }
+  while (--numBlocks);
+
+  abcd = _mm_shuffle_epi32(abcd, 0x1B);
+  _mm_storeu_si128((__m128i *)(void *)state, abcd);
+  state[4] = (UInt32)_mm_extract_epi32(e0, 3);
+}
+
+#endif
@@ -1,10 +1,55 @@
 /* Crypto/Sha256.c -- SHA-256 Hash
 2010-06-11 : Igor Pavlov : Public domain
-This code is based on public domain code from Wei Dai's Crypto++ library. */
+This code is based on public domain code from Wei Dai's Crypto++ library.
+The SHA extensions version is in Sha256Opt.c. */
 
+#include <string.h>
+
+#include "CpuArch.h"
 #include "RotateDefs.h"
 #include "Sha256.h"
 
+#ifdef SHA_HW_SUPPORTED
+void MY_FAST_CALL Sha256_UpdateBlocks_HW(UInt32 state[8], const Byte *data, size_t numBlocks);
+#endif
+
+static void MY_FAST_CALL Sha256_UpdateBlocks(UInt32 state[8], const Byte *data, size_t numBlocks);
+
+static SHA_FUNC_UPDATE_BLOCKS g_Sha256_UpdateBlocks = Sha256_UpdateBlocks;
+static int g_Sha256_Backend = SHA_BACKEND_PORTABLE;
+
+Bool Sha256_SetBackend(int backend)
+{
+  switch (backend)
+  {
+    case SHA_BACKEND_PORTABLE:
+      g_Sha256_UpdateBlocks = Sha256_UpdateBlocks;
+      break;
+    #ifdef SHA_HW_SUPPORTED
+    case SHA_BACKEND_HW:
+      if (!CPU_Is_Sha_Supported())
+        return False;
+      g_Sha256_UpdateBlocks = Sha256_UpdateBlocks_HW;
+      break;
+    #endif
+    default:
+      return False;
+  }
+  g_Sha256_Backend = backend;
+  return True;
+}
+
+int Sha256_GetBackend(void)
+{
+  return g_Sha256_Backend;
+}
+
+void Sha256Prepare(void)
+{
+  if (!Sha256_SetBackend(SHA_BACKEND_HW))
+    Sha256_SetBackend(SHA_BACKEND_PORTABLE);
+}
+
 /* define it for speed optimization */
 /* #define _SHA256_UNROLL */
 /* #define _SHA256_UNROLL2 */
@@ -144,33 +189,45 @@ static void Sha256_Transform(UInt32 *state, const UInt32 *data)
 #undef s0
 #undef s1
 
-static void Sha256_WriteByteBlock(CSha256 *p)
+static void MY_FAST_CALL Sha256_UpdateBlocks(UInt32 state[8], const Byte *data, size_t numBlocks)
 {
   UInt32 data32[16];
-  unsigned i;
-  for (i = 0; i < 16; i++)
-    data32[i] =
-      ((UInt32)(p->buffer[i * 4    ]) << 24) +
-      ((UInt32)(p->buffer[i * 4 + 1]) << 16) +
-      ((UInt32)(p->buffer[i * 4 + 2]) <<  8) +
-      ((UInt32)(p->buffer[i * 4 + 3]));
-  Sha256_Transform(p->state, data32);
+  for (; numBlocks != 0; numBlocks--, data += 64)
+  {
+    unsigned i;
+    for (i = 0; i < 16; i++)
+      data32[i] = GetBe32(data + i * 4);
+    Sha256_Transform(state, data32);
+  }
 }
 
+#define Sha256_WriteByteBlock(p) g_Sha256_UpdateBlocks((p)->state, (p)->buffer, 1)
+
 void Sha256_Update(CSha256 *p, const Byte *data, size_t size)
 {
-  UInt32 curBufferPos = (UInt32)p->count & 0x3F;
-  while (size > 0)
+  unsigned curBufferPos = (unsigned)p->count & 0x3F;
+  p->count += size;
+  if (curBufferPos != 0)
   {
-    p->buffer[curBufferPos++] = *data++;
-    p->count++;
-    size--;
-    if (curBufferPos == 64)
-    {
-      curBufferPos = 0;
-      Sha256_WriteByteBlock(p);
-    }
+    unsigned num = 64 - curBufferPos;
+    if (num > size)
+      num = (unsigned)size;
+    memcpy(p->buffer + curBufferPos, data, num);
+    data += num;
+    size -= num;
+    curBufferPos += num;
+    if (curBufferPos != 64)
+      return;
+    Sha256_WriteByteBlock(p);
+  }
+  /* whole blocks are hashed straight from the caller's buffer */
+  if (size >= 64)
+  {
+    g_Sha256_UpdateBlocks(p->state, data, size >> 6);
+    data += size & ~(size_t)0x3F;
+    size &= 0x3F;
   }
+  memcpy(p->buffer, data, size);
 }
 
 void Sha256_Final(CSha256 *p, Byte *digest)
@@ -5,6 +5,7 @@
 #define __CRYPTO_SHA256_H
 
 #include "Types.h"
+#include "ShaBackend.h"
 
 EXTERN_C_BEGIN
 
@@ -17,6 +18,12 @@ typedef struct
   Byte buffer[64];
 } CSha256;
 
+/* Call Sha256Prepare one time to switch to the fastest backend the CPU supports.
+   Without it the portable code is used. */
+void Sha256Prepare(void);
+Bool Sha256_SetBackend(int backend);
+int Sha256_GetBackend(void);
+
 void Sha256_Init(CSha256 *p);
 void Sha256_Update(CSha256 *p, const Byte *data, size_t size);
 void Sha256_Final(CSha256 *p, Byte *digest);
@@ -0,0 +1,106 @@
+/* Sha256Opt.c -- SHA-256 using x86 SHA extensions
+2013-05-20 : Public domain */
+
+#include "Sha256.h"
+
+#ifdef SHA_HW_SUPPORTED
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#define ATTRIB_SHA
+#else
+#include <immintrin.h>
+#define ATTRIB_SHA __attribute__((__target__("sha,ssse3,sse4.1")))
+#endif
+
+static const UInt32 K[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+  0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+  0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+  0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+  0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+  0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+  0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+  0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+  0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/* 4 rounds: two SHA256RNDS2, each consuming two message+constant words */
+#define RND4(m, i) \
+  msg = _mm_add_epi32(m, _mm_loadu_si128((const __m128i *)(const void *)&K[(i) * 4])); \
+  state1 = _mm_sha256rnds2_epu32(state1, state0, msg); \
+  msg = _mm_shuffle_epi32(msg, 0x0E); \
+  state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+
+/* m0 = next 4 schedule words, computed from the previous 16 words in m0..m3 */
+#define SCHED(m0, m1, m2, m3) \
+  m0 = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32(m0, m1), _mm_alignr_epi8(m3, m2, 4)), m3);
+
+#define LOAD(m, n) m = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(const void *)(data + (n) * 16)), mask);
+
+ATTRIB_SHA
+void MY_FAST_CALL Sha256_UpdateBlocks_HW(UInt32 state[8], const Byte *data, size_t numBlocks)
+{
+  const __m128i mask = _mm_set_epi32(0x0c0d0e0f, 0x08090a0b, 0x04050607, 0x00010203);
+  __m128i state0, state1, tmp, msg;
+  __m128i m0, m1, m2, m3;
+
+  if (numBlocks == 0)
+    return;
+
+  /* state0 = ABEF, state1 = CDGH */
+  tmp = _mm_loadu_si128((const __m128i *)(const void *)&state[0]);
+  state1 = _mm_loadu_si128((const __m128i *)(const void *)&state[4]);
+  tmp = _mm_shuffle_epi32(tmp, 0xB1);
+  state1 = _mm_shuffle_epi32(state1, 0x1B);
+  state0 = _mm_alignr_epi8(tmp, state1, 8);
+  state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+  do
+  {
+    const __m128i abefSave = state0;
+    const __m128i cdghSave = state1;
+
+    LOAD(m0, 0) RND4(m0, 0)
+    LOAD(m1, 1) RND4(m1, 1)
+    LOAD(m2, 2) RND4(m2, 2)
+    LOAD(m3, 3) RND4(m3, 3)
+
+    SCHED(m0, m1, m2, m3) RND4(m0, 4)
+    SCHED(m1, m2, m3, m0) RND4(m1, 5)
+    SCHED(m2, m3, m0, m1) RND4(m2, 6)
+    SCHED(m3, m0, m1, m2) RND4(m3, 7)
+
+    SCHED(m0, m1, m2, m3) RND4(m0, 8)
+    SCHED(m1, m2, m3, m0) RND4(m1, 9)
+    SCHED(m2, m3, m0, m1) RND4(m2, 10)
+    SCHED(m3, m0, m1, m2) RND4(m3, 11)
+
+    SCHED(m0, m1, m2, m3) RND4(m0, 12)
+    SCHED(m1, m2, m3, m0) RND4(m1, 13)
+    SCHED(m2, m3, m0, m1) RND4(m2, 14)
+    SCHED(m3, m0, m1, m2) RND4(m3, 15)
+
+    state0 = _mm_add_epi32(state0, abefSave);
+    state1 = _mm_add_epi32(state1, cdghSave);
+    data += 64;
+  }
+  while (--numBlocks);
+
+  tmp = _mm_shuffle_epi32(state0, 0x1B);
+  state1 = _mm_shuffle_epi32(state1, 0xB1);
+  state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+  state1 = _mm_alignr_epi8(state1, tmp, 8);
+
+  _mm_storeu_si128((__m128i *)(void *)&state[0], state0);
+  _mm_storeu_si128((__m128i *)(void *)&state[4], state1);
+}
+
+#endif
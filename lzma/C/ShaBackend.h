@@ -0,0 +1,27 @@
+/* ShaBackend.h -- backend selection shared by Sha1 and Sha256
+2013-05-20 : Public domain */
+
+#ifndef __CRYPTO_SHA_BACKEND_H
+#define __CRYPTO_SHA_BACKEND_H
+
+#include "Types.h"
+
+EXTERN_C_BEGIN
+
+#define SHA_BACKEND_PORTABLE 0
+#define SHA_BACKEND_HW 1 /* x86 SHA extensions */
+
+/* SHA instruction intrinsics need VS2015, GCC 5 or clang 3.8 */
+#if defined(_M_IX86) || defined(_M_X64) || defined(_M_AMD64) || defined(__i386__) || defined(__x86_64__)
+  #if (defined(_MSC_VER) && _MSC_VER >= 1900) || \
+      (defined(__clang__) && (__clang_major__ > 3 || (__clang_major__ == 3 && __clang_minor__ >= 8))) || \
+      (defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 5)
+    #define SHA_HW_SUPPORTED
+  #endif
+#endif
+
+typedef void (MY_FAST_CALL *SHA_FUNC_UPDATE_BLOCKS)(UInt32 *state, const Byte *data, size_t numBlocks);
+
+EXTERN_C_END
+
+#endif
@@ -1,12 +1,14 @@
 /* Threads.c -- multithreading library
 2009-09-20 : Igor Pavlov : Public domain */
 
+#include "Threads.h"
+
+#ifdef _WIN32
+
 #ifndef _WIN32_WCE
 #include <process.h>
 #endif
 
-#include "Threads.h"
-
 static WRes GetError()
 {
   DWORD res = GetLastError();
@@ -82,3 +84,162 @@ WRes CriticalSection_Init(CCriticalSection *p)
   #endif
   return 0;
 }
+
+#else
+
+#include <errno.h>
+
+static void *Thread_Start(void *param)
+{
+  CThread *p = (CThread *)param;
+  p->func(p->param);
+  return NULL;
+}
+
+WRes Thread_Create(CThread *p, THREAD_FUNC_TYPE func, void *param)
+{
+  int res;
+  p->func = func;
+  p->param = param;
+  res = pthread_create(&p->thread, NULL, Thread_Start, p);
+  if (res != 0)
+    return res;
+  p->created = 1;
+  return 0;
+}
+
+WRes Thread_Wait(CThread *p)
+{
+  int res;
+  if (!p->created)
+    return EINVAL;
+  res = pthread_join(p->thread, NULL);
+  if (res == 0)
+    p->created = 0;
+  return res;
+}
+
+/* pthread threads have no handle to close: Thread_Close detaches a thread that was not waited for */
+WRes Thread_Close(CThread *p)
+{
+  int res = 0;
+  if (p->created)
+    res = pthread_detach(p->thread);
+  p->created = 0;
+  return res;
+}
+
+static WRes Event_Create(CEvent *p, int manualReset, int signaled)
+{
+  RINOK(pthread_mutex_init(&p->mutex, NULL));
+  if (pthread_cond_init(&p->cond, NULL) != 0)
+  {
+    pthread_mutex_destroy(&p->mutex);
+    return EAGAIN;
+  }
+  p->manualReset = manualReset;
+  p->state = (signaled ? 1 : 0);
+  p->created = 1;
+  return 0;
+}
+
+WRes Event_Close(CEvent *p)
+{
+  if (!p->created)
+    return 0;
+  p->created = 0;
+  pthread_mutex_destroy(&p->mutex);
+  pthread_cond_destroy(&p->cond);
+  return 0;
+}
+
+WRes Event_Set(CEvent *p)
+{
+  pthread_mutex_lock(&p->mutex);
+  p->state = 1;
+  pthread_cond_broadcast(&p->cond);
+  pthread_mutex_unlock(&p->mutex);
+  return 0;
+}
+
+WRes Event_Reset(CEvent *p)
+{
+  pthread_mutex_lock(&p->mutex);
+  p->state = 0;
+  pthread_mutex_unlock(&p->mutex);
+  return 0;
+}
+
+WRes Event_Wait(CEvent *p)
+{
+  pthread_mutex_lock(&p->mutex);
+  while (p->state == 0)
+    pthread_cond_wait(&p->cond, &p->mutex);
+  if (!p->manualReset)
+    p->state = 0;
+  pthread_mutex_unlock(&p->mutex);
+  return 0;
+}
+
+WRes ManualResetEvent_Create(CManualResetEvent *p, int signaled) { return Event_Create(p, 1, signaled); }
+WRes AutoResetEvent_Create(CAutoResetEvent *p, int signaled) { return Event_Create(p, 0, signaled); }
+WRes ManualResetEvent_CreateNotSignaled(CManualResetEvent *p) { return ManualResetEvent_Create(p, 0); }
+WRes AutoResetEvent_CreateNotSignaled(CAutoResetEvent *p) { return AutoResetEvent_Create(p, 0); }
+
+
+WRes Semaphore_Create(CSemaphore *p, UInt32 initCount, UInt32 maxCount)
+{
+  if (initCount > maxCount || maxCount == 0)
+    return EINVAL;
+  RINOK(pthread_mutex_init(&p->mutex, NULL));
+  if (pthread_cond_init(&p->cond, NULL) != 0)
+  {
+    pthread_mutex_destroy(&p->mutex);
+    return EAGAIN;
+  }
+  p->count = initCount;
+  p->maxCount = maxCount;
+  p->created = 1;
+  return 0;
+}
+
+WRes Semaphore_Close(CSemaphore *p)
+{
+  if (!p->created)
+    return 0;
+  p->created = 0;
+  pthread_mutex_destroy(&p->mutex);
+  pthread_cond_destroy(&p->cond);
+  return 0;
+}
+
+WRes Semaphore_ReleaseN(CSemaphore *p, UInt32 num)
+{
+  WRes res = 0;
+  pthread_mutex_lock(&p->mutex);
+  if (num > p->maxCount - p->count)
+    res = EINVAL;
+  else
+  {
+    p->count += num;
+    pthread_cond_broadcast(&p->cond);
+  }
+  pthread_mutex_unlock(&p->mutex);
+  return res;
+}
+
+WRes Semaphore_Release1(CSemaphore *p) { return Semaphore_ReleaseN(p, 1); }
+
+WRes Semaphore_Wait(CSemaphore *p)
+{
+  pthread_mutex_lock(&p->mutex);
+  while (p->count == 0)
+    pthread_cond_wait(&p->cond, &p->mutex);
+  p->count--;
+  pthread_mutex_unlock(&p->mutex);
+  return 0;
+}
+
+WRes CriticalSection_Init(CCriticalSection *p) { return pthread_mutex_init(p, NULL); }
+
+#endif
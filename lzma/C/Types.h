@@ -111,11 +111,19 @@ typedef int Bool;
 #define MY_NO_INLINE
 #endif
 
+#define MY_FORCE_INLINE __forceinline
+
 #define MY_CDECL __cdecl
 #define MY_FAST_CALL __fastcall
 
 #else
 
+#if defined(__GNUC__)
+#define MY_FORCE_INLINE __inline__ __attribute__((always_inline))
+#else
+#define MY_FORCE_INLINE
+#endif
+
 #define MY_CDECL
 #define MY_FAST_CALL
 
@@ -177,6 +177,14 @@ SOURCE=..\..\Lzma2Dec.h
 # End Source File
 # Begin Source File
 
+SOURCE=..\..\Lzma2DecMt.c
+# End Source File
+# Begin Source File
+
+SOURCE=..\..\Lzma2DecMt.h
+# End Source File
+# Begin Source File
+
 SOURCE=..\..\LzmaDec.c
 # End Source File
 # Begin Source File
@@ -203,6 +211,14 @@ SOURCE=..\..\Ppmd7Dec.c
 # End Source File
 # Begin Source File
 
+SOURCE=..\..\Threads.c
+# End Source File
+# Begin Source File
+
+SOURCE=..\..\Threads.h
+# End Source File
+# Begin Source File
+
 SOURCE=..\..\Types.h
 # End Source File
 # End Group
@@ -0,0 +1,1009 @@
+/* 7zBench.c -- 7z archive open and extract benchmark
+2013-05-20 : Public domain */
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/time.h>
+#endif
+
+#include "../../7z.h"
+#include "../../7zAlloc.h"
+#include "../../7zCrc.h"
+#include "../../7zFile.h"
+#include "../../7zVersion.h"
+#include "../../CpuArch.h"
+#include "../../Lzma2Enc.h"
+#include "../../Ppmd7.h"
+#include "../../Threads.h"
+
+static void PrintHelp(void)
+{
+  printf("\n7zBench " MY_VERSION_COPYRIGHT_DATE "\n"
+      "\nUsage:  7zbench [<switches>] archive.7z\n"
+      "  Opens the archive and extracts all of its folders (discarding the data) several times,\n"
+      "  first with malloc for every allocation, then with CSzArena for SzArEx_Open\n"
+      "  and CSzBufPool for extraction, then with the same allocators reading the archive\n"
+      "  through CMappedInStream instead of CFileInStream + CLookToRead, and prints the best\n"
+      "  times, the allocation counts and the peak memory held during extraction.\n"
+      "Switches:\n"
+      "  -n<N>:  number of passes (default: 3)\n"
+      "  -m:     extract with SzArEx_Extract, into a buffer of the folder size,\n"
+      "          instead of SzArEx_ExtractFolder\n"
+      "  -g<N>x<S>: first write archive.7z with N synthetic files of S bytes each\n"
+      "          (S can end with k, m or g) in one solid folder (see -f), for example\n"
+      "          -g2x3g for a folder over 4 GB, or -g100000x1k -m for many small files\n"
+      "  -c<M>:  method for -g: lzma2 (default), ppmd, or copy to measure\n"
+      "          the CRC checks without a decoder\n"
+      "  -f<N>:  for -g, split the files into N solid folders (default: 1)\n"
+      "  -p<N>:  then extract the folders on 1, 2, 4, ... N threads, each one reading\n"
+      "          the archive through its own stream like the updater's extraction workers,\n"
+      "          and print the wall time for each thread count\n"
+      "  -t<N>:  decode LZMA2 folders with up to N threads (default: 1); with -g, the folder\n"
+      "          is also encoded with N block threads, so it has blocks to decode in parallel\n");
+}
+
+static double GetTimeSeconds(void)
+{
+  #ifdef _WIN32
+  LARGE_INTEGER freq, count;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&count);
+  return (double)count.QuadPart / (double)freq.QuadPart;
+  #else
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (double)tv.tv_sec + (double)tv.tv_usec / 1000000;
+  #endif
+}
+
+/* malloc that counts the calls and the bytes held */
+
+#define COUNT_ALLOC_HEADER_SIZE 16
+
+typedef struct
+{
+  ISzAlloc s;
+  UInt64 numAllocs;
+  size_t curSize;
+  size_t maxSize;
+} CCountAlloc;
+
+static void *CountAlloc_Alloc(void *pp, size_t size)
+{
+  CCountAlloc *p = (CCountAlloc *)pp;
+  Byte *block;
+  if (size == 0)
+    return 0;
+  block = (Byte *)malloc(size + COUNT_ALLOC_HEADER_SIZE);
+  if (block == 0)
+    return 0;
+  *(size_t *)block = size;
+  p->numAllocs++;
+  p->curSize += size;
+  if (p->maxSize < p->curSize)
+    p->maxSize = p->curSize;
+  return block + COUNT_ALLOC_HEADER_SIZE;
+}
+
+static void CountAlloc_Free(void *pp, void *address)
+{
+  CCountAlloc *p = (CCountAlloc *)pp;
+  Byte *block;
+  if (address == 0)
+    return;
+  block = (Byte *)address - COUNT_ALLOC_HEADER_SIZE;
+  p->curSize -= *(const size_t *)block;
+  free(block);
+}
+
+typedef struct
+{
+  ISzExtractCallback s;
+  UInt64 size;
+} CNullExtractCallback;
+
+static SRes NullExtract_FileStart(void *p, UInt32 fileIndex)
+{
+  p = p;
+  fileIndex = fileIndex;
+  return SZ_OK;
+}
+
+static SRes NullExtract_FileWrite(void *p, UInt32 fileIndex, const Byte *data, size_t size)
+{
+  fileIndex = fileIndex;
+  data = data;
+  ((CNullExtractCallback *)p)->size += size;
+  return SZ_OK;
+}
+
+static SRes NullExtract_FileEnd(void *p, UInt32 fileIndex)
+{
+  p = p;
+  fileIndex = fileIndex;
+  return SZ_OK;
+}
+
+typedef struct
+{
+  double openTime;
+  double extractTime;
+  UInt64 openAllocs;
+  UInt64 extractAllocs;
+  size_t extractPeak;
+  UInt64 size;
+  UInt32 numFiles;
+  UInt32 numFolders;
+} CBenchResult;
+
+/* SzArEx_Extract keeps the last folder in outBuffer, like 7zMain does */
+static SRes ExtractInMemory(const CSzArEx *db, ILookInStream *inStream, ISzAlloc *allocMain, UInt64 *size)
+{
+  UInt32 blockIndex = 0xFFFFFFFF;
+  Byte *outBuffer = 0;
+  size_t outBufferSize = 0;
+  UInt32 i;
+  SRes res = SZ_OK;
+  for (i = 0; i < db->db.NumFiles && res == SZ_OK; i++)
+  {
+    size_t offset = 0, outSizeProcessed = 0;
+    if (db->db.Files[i].IsDir)
+      continue;
+    res = SzArEx_Extract(db, inStream, i, &blockIndex, &outBuffer, &outBufferSize,
+        &offset, &outSizeProcessed, allocMain, allocMain);
+    *size += outSizeProcessed;
+  }
+  IAlloc_Free(allocMain, outBuffer);
+  return res;
+}
+
+static SRes Bench(ILookInStream *inStream, Bool usePools, Bool inMemory, unsigned numThreads,
+    CBenchResult *r)
+{
+  CCountAlloc baseAlloc;
+  CSzArena arenaMain, arenaTemp;
+  CSzBufPool pool;
+  ISzAlloc *allocMain = &baseAlloc.s, *allocTemp = &baseAlloc.s, *allocExtract = &baseAlloc.s;
+  CNullExtractCallback callback;
+  CSzArEx db;
+  UInt32 i;
+  size_t baseSize;
+  double startTime;
+  SRes res;
+
+  baseAlloc.s.Alloc = CountAlloc_Alloc;
+  baseAlloc.s.Free = CountAlloc_Free;
+  baseAlloc.numAllocs = 0;
+  baseAlloc.curSize = 0;
+  baseAlloc.maxSize = 0;
+  SzArena_Construct(&arenaMain, &baseAlloc.s, SZ_ARENA_BLOCK_SIZE_DEFAULT);
+  SzArena_Construct(&arenaTemp, &baseAlloc.s, SZ_ARENA_BLOCK_SIZE_DEFAULT);
+  SzBufPool_Construct(&pool, &baseAlloc.s, SZ_BUF_POOL_MIN_SIZE_DEFAULT);
+  if (usePools)
+  {
+    allocMain = &arenaMain.s;
+    allocTemp = &arenaTemp.s;
+    allocExtract = &pool.s;
+  }
+
+  callback.s.FileStart = NullExtract_FileStart;
+  callback.s.FileWrite = NullExtract_FileWrite;
+  callback.s.FileEnd = NullExtract_FileEnd;
+  callback.size = 0;
+
+  SzArEx_Init(&db);
+  startTime = GetTimeSeconds();
+  res = SzArEx_Open(&db, inStream, allocMain, allocTemp);
+  SzArena_Free(&arenaTemp);
+  r->openTime = GetTimeSeconds() - startTime;
+  r->openAllocs = baseAlloc.numAllocs;
+  db.NumThreads = numThreads;
+
+  baseSize = baseAlloc.curSize;
+  baseAlloc.maxSize = baseSize;
+  startTime = GetTimeSeconds();
+  if (inMemory)
+  {
+    if (res == SZ_OK)
+      res = ExtractInMemory(&db, inStream, allocExtract, &callback.size);
+  }
+  else
+    for (i = 0; i < db.db.NumFolders && res == SZ_OK; i++)
+      res = SzArEx_ExtractFolder(&db, inStream, i, &callback.s, allocExtract);
+  r->extractTime = GetTimeSeconds() - startTime;
+  r->extractAllocs = baseAlloc.numAllocs - r->openAllocs;
+  r->extractPeak = baseAlloc.maxSize - baseSize;
+  r->size = callback.size;
+  r->numFiles = db.db.NumFiles;
+  r->numFolders = db.db.NumFolders;
+
+  SzArEx_Free(&db, allocMain);
+  SzArena_Free(&arenaMain);
+  SzBufPool_Free(&pool);
+  return res;
+}
+
+/* ---------- Synthetic archives ---------- */
+
+#define GEN_METHOD_LZMA2 0
+#define GEN_METHOD_PPMD 1
+#define GEN_METHOD_COPY 2
+
+#define GEN_BUF_SIZE (1 << 16)
+
+#define GEN_PPMD_ORDER 6
+#define GEN_PPMD_MEM_SIZE (1 << 24)
+
+static ISzAlloc g_Alloc = { SzAlloc, SzFree };
+
+/* Every 4 KB block starts with its file and block numbers and repeats a fixed pattern after them,
+   so the data compresses well, but no block is the same as another one */
+static void Gen_Fill(UInt32 fileIndex, UInt64 pos, Byte *data, size_t size)
+{
+  size_t i;
+  for (i = 0; i < size; i++, pos++)
+  {
+    unsigned k = (unsigned)pos & 0xFFF;
+    if (k < 4)
+      data[i] = (Byte)(fileIndex >> (8 * k));
+    else if (k < 12)
+      data[i] = (Byte)((pos >> 12) >> (8 * (k - 4)));
+    else
+      data[i] = (Byte)(k * 7 + (k >> 5));
+  }
+}
+
+/* the contents of the files of one folder in a row, with their CRCs */
+typedef struct
+{
+  ISeqInStream s;
+  UInt32 fileEnd;
+  UInt64 fileSize;
+  UInt32 fileIndex;
+  UInt64 filePos;
+  UInt32 *crcs;
+  UInt32 folderCrc;
+} CGenInStream;
+
+static SRes GenInStream_Read(void *pp, void *buf, size_t *size)
+{
+  CGenInStream *p = (CGenInStream *)pp;
+  UInt64 rem;
+  if (p->fileIndex < p->fileEnd && p->filePos == p->fileSize)
+  {
+    p->fileIndex++;
+    p->filePos = 0;
+  }
+  if (p->fileIndex == p->fileEnd)
+  {
+    *size = 0;
+    return SZ_OK;
+  }
+  rem = p->fileSize - p->filePos;
+  if (*size > rem)
+    *size = (size_t)rem;
+  Gen_Fill(p->fileIndex, p->filePos, (Byte *)buf, *size);
+  p->crcs[p->fileIndex] = CrcUpdate(p->crcs[p->fileIndex], buf, *size);
+  p->folderCrc = CrcUpdate(p->folderCrc, buf, *size);
+  p->filePos += *size;
+  return SZ_OK;
+}
+
+typedef struct
+{
+  IByteOut s;
+  CSzFile *file;
+  size_t pos;
+  WRes res;
+  Byte buf[GEN_BUF_SIZE];
+} CGenByteOut;
+
+static void GenByteOut_Flush(CGenByteOut *p)
+{
+  size_t size = p->pos;
+  if (p->res == 0 && (p->res = File_Write(p->file, p->buf, &size)) == 0 && size != p->pos)
+    p->res = SZ_ERROR_WRITE;
+  p->pos = 0;
+}
+
+static void GenByteOut_Write(void *pp, Byte b)
+{
+  CGenByteOut *p = (CGenByteOut *)pp;
+  p->buf[p->pos++] = b;
+  if (p->pos == GEN_BUF_SIZE)
+    GenByteOut_Flush(p);
+}
+
+static SRes Gen_EncodeLzma2(CSzFile *file, CGenInStream *inStream, Byte *props, unsigned numThreads)
+{
+  CFileOutStream outStream;
+  CLzma2EncProps encProps;
+  SRes res;
+  CLzma2EncHandle enc = Lzma2Enc_Create(&g_Alloc, &g_Alloc);
+  if (enc == 0)
+    return SZ_ERROR_MEM;
+  FileOutStream_CreateVTable(&outStream);
+  outStream.file = *file;
+  Lzma2EncProps_Init(&encProps);
+  encProps.lzmaProps.level = 1;
+  encProps.lzmaProps.dictSize = 1 << 20;
+  encProps.numBlockThreads = (int)numThreads;
+  Lzma2EncProps_Normalize(&encProps);
+  res = Lzma2Enc_SetProps(enc, &encProps);
+  if (res == SZ_OK)
+  {
+    props[0] = Lzma2Enc_WriteProperties(enc);
+    res = Lzma2Enc_Encode(enc, &outStream.s, &inStream->s, NULL);
+  }
+  Lzma2Enc_Destroy(enc);
+  return res;
+}
+
+static SRes Gen_EncodePpmd(CSzFile *file, CGenInStream *inStream, Byte *props, Byte *buf)
+{
+  CPpmd7 ppmd;
+  CPpmd7z_RangeEnc rc;
+  CGenByteOut *out = (CGenByteOut *)malloc(sizeof(CGenByteOut));
+  SRes res = SZ_OK;
+  if (out == 0)
+    return SZ_ERROR_MEM;
+  Ppmd7_Construct(&ppmd);
+  if (!Ppmd7_Alloc(&ppmd, GEN_PPMD_MEM_SIZE, &g_Alloc))
+  {
+    free(out);
+    return SZ_ERROR_MEM;
+  }
+  out->s.Write = GenByteOut_Write;
+  out->file = file;
+  out->pos = 0;
+  out->res = 0;
+  rc.Stream = &out->s;
+  Ppmd7z_RangeEnc_Init(&rc);
+  Ppmd7_Init(&ppmd, GEN_PPMD_ORDER);
+  for (;;)
+  {
+    size_t size = GEN_BUF_SIZE, i;
+    res = GenInStream_Read(inStream, buf, &size);
+    if (res != SZ_OK || size == 0)
+      break;
+    for (i = 0; i < size; i++)
+      Ppmd7_EncodeSymbol(&ppmd, &rc, buf[i]);
+  }
+  Ppmd7z_RangeEnc_FlushData(&rc);
+  GenByteOut_Flush(out);
+  if (res == SZ_OK && out->res != 0)
+    res = SZ_ERROR_WRITE;
+  Ppmd7_Free(&ppmd, &g_Alloc);
+  free(out);
+  props[0] = GEN_PPMD_ORDER;
+  SetUi32(props + 1, GEN_PPMD_MEM_SIZE);
+  return res;
+}
+
+static SRes Gen_Copy(CSzFile *file, CGenInStream *inStream, Byte *buf)
+{
+  for (;;)
+  {
+    size_t size = GEN_BUF_SIZE, written;
+    RINOK(GenInStream_Read(inStream, buf, &size));
+    if (size == 0)
+      return SZ_OK;
+    written = size;
+    if (File_Write(file, buf, &written) != 0 || written != size)
+      return SZ_ERROR_WRITE;
+  }
+}
+
+/* a growing buffer for the archive header */
+typedef struct
+{
+  Byte *data;
+  size_t size;
+  size_t capacity;
+  Bool error;
+} CGenBuf;
+
+static void GenBuf_Byte(CGenBuf *p, Byte b)
+{
+  if (p->size == p->capacity)
+  {
+    size_t newCapacity = p->capacity * 2 + 256;
+    Byte *data = (Byte *)realloc(p->data, newCapacity);
+    if (data == 0)
+    {
+      p->error = True;
+      return;
+    }
+    p->data = data;
+    p->capacity = newCapacity;
+  }
+  p->data[p->size++] = b;
+}
+
+static void GenBuf_Bytes(CGenBuf *p, const Byte *data, size_t size)
+{
+  size_t i;
+  for (i = 0; i < size; i++)
+    GenBuf_Byte(p, data[i]);
+}
+
+static void GenBuf_UInt32(CGenBuf *p, UInt32 v)
+{
+  int i;
+  for (i = 0; i < 4; i++, v >>= 8)
+    GenBuf_Byte(p, (Byte)v);
+}
+
+/* 7z numbers: the count of leading 1 bits in the first byte is the number of extra little endian bytes */
+static void GenBuf_Number(CGenBuf *p, UInt64 v)
+{
+  Byte firstByte = 0;
+  Byte mask = 0x80;
+  int i;
+  for (i = 0; i < 8; i++)
+  {
+    if (v < ((UInt64)1 << (7 * (i + 1))))
+    {
+      firstByte |= (Byte)(v >> (8 * i));
+      break;
+    }
+    firstByte |= mask;
+    mask >>= 1;
+  }
+  GenBuf_Byte(p, firstByte);
+  for (; i > 0; i--, v >>= 8)
+    GenBuf_Byte(p, (Byte)v);
+}
+
+/* the files are spread evenly over the folders */
+static UInt32 Gen_FolderStart(UInt32 folderIndex, UInt32 numFiles, UInt32 numFolders)
+{
+  return (UInt32)((UInt64)folderIndex * numFiles / numFolders);
+}
+
+static void Gen_WriteHeader(CGenBuf *h, int method, const Byte *props, UInt32 numFolders,
+    const UInt64 *packSizes, UInt32 numFiles, UInt64 fileSize, const UInt32 *crcs, const UInt32 *folderCrcs)
+{
+  static const Byte kLzma2Id[] = { 0x21 };
+  static const Byte kPpmdId[] = { 0x03, 0x04, 0x01 };
+  static const Byte kCopyId[] = { 0x00 };
+  CGenBuf names = { 0, 0, 0, False };
+  UInt32 i, f;
+
+  GenBuf_Byte(h, k7zIdHeader);
+  GenBuf_Byte(h, k7zIdMainStreamsInfo);
+
+  GenBuf_Byte(h, k7zIdPackInfo);
+  GenBuf_Number(h, 0);
+  GenBuf_Number(h, numFolders);
+  GenBuf_Byte(h, k7zIdSize);
+  for (f = 0; f < numFolders; f++)
+    GenBuf_Number(h, packSizes[f]);
+  GenBuf_Byte(h, k7zIdEnd);
+
+  GenBuf_Byte(h, k7zIdUnpackInfo);
+  GenBuf_Byte(h, k7zIdFolder);
+  GenBuf_Number(h, numFolders);
+  GenBuf_Byte(h, 0);
+  for (f = 0; f < numFolders; f++)
+  {
+    GenBuf_Number(h, 1);
+    switch (method)
+    {
+      case GEN_METHOD_LZMA2:
+        GenBuf_Byte(h, 0x20 | sizeof(kLzma2Id));
+        GenBuf_Bytes(h, kLzma2Id, sizeof(kLzma2Id));
+        GenBuf_Number(h, 1);
+        GenBuf_Bytes(h, props, 1);
+        break;
+      case GEN_METHOD_PPMD:
+        GenBuf_Byte(h, 0x20 | sizeof(kPpmdId));
+        GenBuf_Bytes(h, kPpmdId, sizeof(kPpmdId));
+        GenBuf_Number(h, 5);
+        GenBuf_Bytes(h, props, 5);
+        break;
+      default:
+        GenBuf_Byte(h, sizeof(kCopyId));
+        GenBuf_Bytes(h, kCopyId, sizeof(kCopyId));
+        break;
+    }
+  }
+  GenBuf_Byte(h, k7zIdCodersUnpackSize);
+  for (f = 0; f < numFolders; f++)
+    GenBuf_Number(h, fileSize * (Gen_FolderStart(f + 1, numFiles, numFolders) - Gen_FolderStart(f, numFiles, numFolders)));
+  GenBuf_Byte(h, k7zIdCRC);
+  GenBuf_Byte(h, 1);
+  for (f = 0; f < numFolders; f++)
+    GenBuf_UInt32(h, folderCrcs[f]);
+  GenBuf_Byte(h, k7zIdEnd);
+
+  /* a folder with a single file gives that file its CRC */
+  GenBuf_Byte(h, k7zIdSubStreamsInfo);
+  if (numFiles > numFolders)
+  {
+    GenBuf_Byte(h, k7zIdNumUnpackStream);
+    for (f = 0; f < numFolders; f++)
+      GenBuf_Number(h, Gen_FolderStart(f + 1, numFiles, numFolders) - Gen_FolderStart(f, numFiles, numFolders));
+    GenBuf_Byte(h, k7zIdSize);
+    for (f = 0; f < numFolders; f++)
+      for (i = Gen_FolderStart(f, numFiles, numFolders) + 1; i < Gen_FolderStart(f + 1, numFiles, numFolders); i++)
+        GenBuf_Number(h, fileSize);
+    GenBuf_Byte(h, k7zIdCRC);
+    GenBuf_Byte(h, 1);
+    for (f = 0; f < numFolders; f++)
+    {
+      UInt32 start = Gen_FolderStart(f, numFiles, numFolders), end = Gen_FolderStart(f + 1, numFiles, numFolders);
+      if (end - start != 1)
+        for (i = start; i < end; i++)
+          GenBuf_UInt32(h, crcs[i]);
+    }
+  }
+  GenBuf_Byte(h, k7zIdEnd);
+  GenBuf_Byte(h, k7zIdEnd);
+
+  GenBuf_Byte(h, k7zIdFilesInfo);
+  GenBuf_Number(h, numFiles);
+  for (i = 0; i < numFiles; i++)
+  {
+    char name[32];
+    const char *c;
+    sprintf(name, "f%u.bin", (unsigned)i);
+    for (c = name;; c++)
+    {
+      GenBuf_Byte(&names, (Byte)*c);
+      GenBuf_Byte(&names, 0);
+      if (*c == 0)
+        break;
+    }
+  }
+  /* the names follow the "external" byte */
+  GenBuf_Byte(h, k7zIdName);
+  GenBuf_Number(h, names.size + 1);
+  GenBuf_Byte(h, 0);
+  GenBuf_Bytes(h, names.data, names.size);
+  if (names.error)
+    h->error = True;
+  free(names.data);
+  GenBuf_Byte(h, k7zIdEnd);
+  GenBuf_Byte(h, k7zIdEnd);
+}
+
+static SRes GenerateArchive(const char *name, UInt32 numFiles, UInt64 fileSize, UInt32 numFolders,
+    int method, unsigned numThreads, UInt64 *packSize)
+{
+  CSzFile file;
+  CGenInStream inStream;
+  CGenBuf header = { 0, 0, 0, False };
+  Byte startHeader[k7zStartHeaderSize];
+  Byte props[5];
+  Byte *buf;
+  UInt64 *packSizes;
+  UInt32 *folderCrcs;
+  Int64 pos;
+  size_t size;
+  UInt32 i;
+  SRes res;
+
+  inStream.s.Read = GenInStream_Read;
+  inStream.fileSize = fileSize;
+  inStream.crcs = (UInt32 *)malloc((size_t)numFiles * sizeof(UInt32));
+  packSizes = (UInt64 *)malloc((size_t)numFolders * sizeof(UInt64));
+  folderCrcs = (UInt32 *)malloc((size_t)numFolders * sizeof(UInt32));
+  buf = (Byte *)malloc(GEN_BUF_SIZE);
+  if (inStream.crcs == 0 || packSizes == 0 || folderCrcs == 0 || buf == 0)
+  {
+    free(inStream.crcs);
+    free(packSizes);
+    free(folderCrcs);
+    free(buf);
+    return SZ_ERROR_MEM;
+  }
+  for (i = 0; i < numFiles; i++)
+    inStream.crcs[i] = CRC_INIT_VAL;
+
+  File_Construct(&file);
+  if (OutFile_Open(&file, name) != 0)
+  {
+    free(inStream.crcs);
+    free(packSizes);
+    free(folderCrcs);
+    free(buf);
+    return SZ_ERROR_WRITE;
+  }
+
+  /* the start header is written last, when the header position is known */
+  memset(startHeader, 0, sizeof(startHeader));
+  size = sizeof(startHeader);
+  res = (File_Write(&file, startHeader, &size) == 0 && size == sizeof(startHeader)) ? SZ_OK : SZ_ERROR_WRITE;
+
+  /* every folder is a separate pack stream, encoded from scratch */
+  pos = k7zStartHeaderSize;
+  for (i = 0; i < numFolders && res == SZ_OK; i++)
+  {
+    Int64 folderStart = pos;
+    inStream.fileIndex = Gen_FolderStart(i, numFiles, numFolders);
+    inStream.fileEnd = Gen_FolderStart(i + 1, numFiles, numFolders);
+    inStream.filePos = 0;
+    inStream.folderCrc = CRC_INIT_VAL;
+    if (method == GEN_METHOD_LZMA2)
+      res = Gen_EncodeLzma2(&file, &inStream, props, numThreads);
+    else if (method == GEN_METHOD_PPMD)
+      res = Gen_EncodePpmd(&file, &inStream, props, buf);
+    else
+      res = Gen_Copy(&file, &inStream, buf);
+    pos = 0;
+    if (res == SZ_OK && File_Seek(&file, &pos, SZ_SEEK_CUR) != 0)
+      res = SZ_ERROR_WRITE;
+    packSizes[i] = (UInt64)(pos - folderStart);
+    folderCrcs[i] = CRC_GET_DIGEST(inStream.folderCrc);
+  }
+  *packSize = (UInt64)pos - k7zStartHeaderSize;
+
+  if (res == SZ_OK)
+  {
+    for (i = 0; i < numFiles; i++)
+      inStream.crcs[i] = CRC_GET_DIGEST(inStream.crcs[i]);
+    Gen_WriteHeader(&header, method, props, numFolders, packSizes, numFiles, fileSize,
+        inStream.crcs, folderCrcs);
+    if (header.error)
+      res = SZ_ERROR_MEM;
+  }
+
+  if (res == SZ_OK)
+  {
+    size = header.size;
+    if (File_Write(&file, header.data, &size) != 0 || size != header.size)
+      res = SZ_ERROR_WRITE;
+  }
+
+  if (res == SZ_OK)
+  {
+    memcpy(startHeader, k7zSignature, k7zSignatureSize);
+    startHeader[6] = k7zMajorVersion;
+    startHeader[7] = 3;
+    SetUi64(startHeader + 12, *packSize);
+    SetUi64(startHeader + 20, (UInt64)header.size);
+    SetUi32(startHeader + 28, CrcCalc(header.data, header.size));
+    SetUi32(startHeader + 8, CrcCalc(startHeader + 12, 20));
+    pos = 0;
+    size = sizeof(startHeader);
+    if (File_Seek(&file, &pos, SZ_SEEK_SET) != 0 ||
+        File_Write(&file, startHeader, &size) != 0 || size != sizeof(startHeader))
+      res = SZ_ERROR_WRITE;
+  }
+
+  if (File_Close(&file) != 0 && res == SZ_OK)
+    res = SZ_ERROR_WRITE;
+  free(header.data);
+  free(inStream.crcs);
+  free(packSizes);
+  free(folderCrcs);
+  free(buf);
+  return res;
+}
+
+/* ---------- Folder pool ---------- */
+
+#define FOLDER_POOL_THREADS_MAX 64
+
+/* the threads claim the folders in order, like the updater's extraction workers */
+typedef struct
+{
+  const CSzArEx *db;
+  const char *path;
+  CCriticalSection cs;
+  UInt32 nextFolder;
+  UInt64 size;
+  SRes res;
+} CFolderPool;
+
+static THREAD_FUNC_RET_TYPE THREAD_FUNC_CALL_TYPE FolderPool_ThreadFunc(void *pp)
+{
+  CFolderPool *p = (CFolderPool *)pp;
+  CFileInStream fileStream;
+  CLookToRead lookStream;
+  CMappedInStream mappedStream;
+  ILookInStream *inStream = &lookStream.s;
+  CSzBufPool pool;
+  CNullExtractCallback callback;
+  SRes res = SZ_OK;
+
+  callback.s.FileStart = NullExtract_FileStart;
+  callback.s.FileWrite = NullExtract_FileWrite;
+  callback.s.FileEnd = NullExtract_FileEnd;
+  callback.size = 0;
+  SzBufPool_Construct(&pool, &g_Alloc, SZ_BUF_POOL_MIN_SIZE_DEFAULT);
+
+  /* every thread has its own stream, mapped if that works */
+  File_Construct(&fileStream.file);
+  MappedInStream_Construct(&mappedStream);
+  if (InFile_Open(&fileStream.file, p->path) != 0)
+    res = SZ_ERROR_READ;
+  else if (MappedInStream_Open(&mappedStream, &fileStream.file) == 0)
+    inStream = &mappedStream.s;
+  else
+  {
+    FileInStream_CreateVTable(&fileStream);
+    LookToRead_CreateVTable(&lookStream, False);
+    lookStream.realStream = &fileStream.s;
+    LookToRead_Init(&lookStream);
+  }
+
+  while (res == SZ_OK)
+  {
+    UInt32 folderIndex;
+    CriticalSection_Enter(&p->cs);
+    folderIndex = (p->res == SZ_OK ? p->nextFolder++ : p->db->db.NumFolders);
+    CriticalSection_Leave(&p->cs);
+    if (folderIndex >= p->db->db.NumFolders)
+      break;
+    res = SzArEx_ExtractFolder(p->db, inStream, folderIndex, &callback.s, &pool.s);
+  }
+
+  CriticalSection_Enter(&p->cs);
+  p->size += callback.size;
+  if (p->res == SZ_OK)
+    p->res = res;
+  CriticalSection_Leave(&p->cs);
+
+  MappedInStream_Close(&mappedStream);
+  File_Close(&fileStream.file);
+  SzBufPool_Free(&pool);
+  return 0;
+}
+
+static SRes BenchFolderPool(const CSzArEx *db, const char *path, unsigned numThreads,
+    double *time, UInt64 *size)
+{
+  CFolderPool p;
+  CThread threads[FOLDER_POOL_THREADS_MAX];
+  double startTime;
+  unsigned i;
+
+  p.db = db;
+  p.path = path;
+  p.nextFolder = 0;
+  p.size = 0;
+  p.res = SZ_OK;
+  if (CriticalSection_Init(&p.cs) != 0)
+    return SZ_ERROR_THREAD;
+
+  startTime = GetTimeSeconds();
+  for (i = 0; i < numThreads; i++)
+  {
+    Thread_Construct(&threads[i]);
+    if (Thread_Create(&threads[i], FolderPool_ThreadFunc, &p) != 0)
+    {
+      p.res = SZ_ERROR_THREAD;
+      break;
+    }
+  }
+  numThreads = i;
+  for (i = 0; i < numThreads; i++)
+  {
+    Thread_Wait(&threads[i]);
+    Thread_Close(&threads[i]);
+  }
+  *time = GetTimeSeconds() - startTime;
+  *size = p.size;
+
+  CriticalSection_Delete(&p.cs);
+  return p.res;
+}
+
+/* 1, 2, 4, ... and then maxThreads */
+static int NextThreadCount(int n, int maxThreads)
+{
+  return (n < maxThreads && n * 2 > maxThreads) ? maxThreads : n * 2;
+}
+
+static Bool ParseGenSwitch(const char *s, UInt32 *numFiles, UInt64 *fileSize)
+{
+  char *end;
+  unsigned long n = strtoul(s, &end, 10);
+  UInt64 size = 0;
+  if (end == s || *end != 'x' || n == 0 || (UInt32)n != n)
+    return False;
+  for (s = end + 1; *s >= '0' && *s <= '9'; s++)
+    size = size * 10 + (unsigned)(*s - '0');
+  switch (*s)
+  {
+    case 'k': size <<= 10; s++; break;
+    case 'm': size <<= 20; s++; break;
+    case 'g': size <<= 30; s++; break;
+  }
+  if (*s != 0 || size == 0)
+    return False;
+  *numFiles = (UInt32)n;
+  *fileSize = size;
+  return True;
+}
+
+int main(int numArgs, const char *args[])
+{
+  CFileInStream archiveStream;
+  CLookToRead lookStream;
+  CMappedInStream mappedStream;
+  Bool mapped;
+  int numPasses = 3;
+  Bool inMemory = False;
+  UInt32 genFiles = 0;
+  UInt64 genFileSize = 0;
+  UInt32 genFolders = 1;
+  int genMethod = GEN_METHOD_LZMA2;
+  int numThreads = 1;
+  int numPoolThreads = 0;
+  double perFile[3];
+  int argIndex, mode;
+
+  for (argIndex = 1; argIndex < numArgs && args[argIndex][0] == '-'; argIndex++)
+  {
+    const char *s = args[argIndex] + 1;
+    if (s[0] == 'n')
+      numPasses = atoi(s + 1);
+    else if (s[0] == 'm' && s[1] == 0)
+      inMemory = True;
+    else if (s[0] == 't')
+      numThreads = atoi(s + 1);
+    else if (s[0] == 'f')
+      genFolders = (UInt32)atoi(s + 1);
+    else if (s[0] == 'p')
+      numPoolThreads = atoi(s + 1);
+    else if (s[0] == 'g' && ParseGenSwitch(s + 1, &genFiles, &genFileSize))
+      continue;
+    else if (strcmp(s, "clzma2") == 0)
+      genMethod = GEN_METHOD_LZMA2;
+    else if (strcmp(s, "cppmd") == 0)
+      genMethod = GEN_METHOD_PPMD;
+    else if (strcmp(s, "ccopy") == 0)
+      genMethod = GEN_METHOD_COPY;
+    else
+    {
+      PrintHelp();
+      return 1;
+    }
+  }
+  if (numArgs - argIndex != 1)
+  {
+    PrintHelp();
+    return numArgs == 1 ? 0 : 1;
+  }
+  if (numPasses < 1)
+    numPasses = 1;
+  if (numThreads < 1)
+    numThreads = 1;
+  if (numPoolThreads > FOLDER_POOL_THREADS_MAX)
+    numPoolThreads = FOLDER_POOL_THREADS_MAX;
+  if (genFolders < 1 || genFolders > genFiles)
+    genFolders = (genFiles != 0 ? genFiles : 1);
+
+  CrcGenerateTable();
+
+  if (genFiles != 0)
+  {
+    UInt64 packSize;
+    double startTime = GetTimeSeconds();
+    SRes res = GenerateArchive(args[argIndex], genFiles, genFileSize, genFolders, genMethod,
+        (unsigned)numThreads, &packSize);
+    if (res != SZ_OK)
+    {
+      fprintf(stderr, "\nError: Can not write the archive (%d)\n", (int)res);
+      return 1;
+    }
+    printf("generated: %u files of %.0f bytes in %u folders, %.0f bytes packed in %.1f s\n\n",
+        (unsigned)genFiles, (double)genFileSize, (unsigned)genFolders, (double)packSize,
+        GetTimeSeconds() - startTime);
+  }
+
+  if (InFile_Open(&archiveStream.file, args[argIndex]))
+  {
+    fprintf(stderr, "\nError: Can not open input file\n");
+    return 1;
+  }
+  FileInStream_CreateVTable(&archiveStream);
+  LookToRead_CreateVTable(&lookStream, False);
+  lookStream.realStream = &archiveStream.s;
+  LookToRead_Init(&lookStream);
+
+  /* it fails for an archive bigger than the address space */
+  MappedInStream_Construct(&mappedStream);
+  mapped = (MappedInStream_Open(&mappedStream, &archiveStream.file) == 0);
+
+  /* malloc, then pools, then pools with the mapped stream */
+  for (mode = 0; mode < (mapped ? 3 : 2); mode++)
+  {
+    ILookInStream *inStream = (mode == 2 ? &mappedStream.s : &lookStream.s);
+    CBenchResult best;
+    int pass;
+    for (pass = 0; pass < numPasses; pass++)
+    {
+      CBenchResult r;
+      Int64 pos = 0;
+      SRes res = inStream->Seek(inStream, &pos, SZ_SEEK_SET);
+      if (res == SZ_OK)
+        res = Bench(inStream, (Bool)(mode != 0), inMemory, (unsigned)numThreads, &r);
+      if (res != SZ_OK)
+      {
+        fprintf(stderr, "\nError: %d\n", (int)res);
+        return 1;
+      }
+      if (pass == 0)
+        best = r;
+      if (best.openTime > r.openTime)
+        best.openTime = r.openTime;
+      if (best.extractTime > r.extractTime)
+        best.extractTime = r.extractTime;
+    }
+    if (mode == 0)
+    {
+      printf("files: %u, folders: %u, unpacked: %.0f bytes\n\n",
+          (unsigned)best.numFiles, (unsigned)best.numFolders, (double)best.size);
+      printf("%-8s %10s %10s %10s %12s %12s %14s\n", "run", "open (s)", "extr (s)", "extr MB/s",
+          "open allocs", "extr allocs", "extr peak KB");
+    }
+    if (best.extractTime <= 0)
+      best.extractTime = 1e-6;
+    printf("%-8s %10.3f %10.3f %10.2f %12.0f %12.0f %14.0f\n", mode == 2 ? "mapped" : mode ? "pools" : "malloc",
+        best.openTime, best.extractTime, (double)best.size / best.extractTime / 1000000,
+        (double)best.openAllocs, (double)best.extractAllocs, (double)(best.extractPeak >> 10));
+    perFile[mode] = best.extractTime / (best.numFiles ? best.numFiles : 1) * 1000000;
+  }
+
+  /* with many small files in a folder, this shows what finding a file's data costs */
+  if (inMemory)
+    printf("\nSzArEx_Extract per file: %.2f us (malloc), %.2f us (pools)\n", perFile[0], perFile[1]);
+  if (!mapped)
+    printf("\nThe archive can't be mapped, so the mapped stream is not measured\n");
+
+  /* the wall time of the whole extraction for a growing number of folder threads */
+  if (numPoolThreads > 0)
+  {
+    CSzArEx db;
+    Int64 pos = 0;
+    double oneThread = 0;
+    int n;
+    SRes res = lookStream.s.Seek(&lookStream.s, &pos, SZ_SEEK_SET);
+    SzArEx_Init(&db);
+    if (res == SZ_OK)
+      res = SzArEx_Open(&db, &lookStream.s, &g_Alloc, &g_Alloc);
+    if (res == SZ_OK)
+      printf("\n%-8s %10s %10s %10s\n", "threads", "extr (s)", "extr MB/s", "speedup");
+    for (n = 1; n <= numPoolThreads && res == SZ_OK; n = NextThreadCount(n, numPoolThreads))
+    {
+      double best = 0;
+      UInt64 size = 0;
+      int pass;
+      for (pass = 0; pass < numPasses && res == SZ_OK; pass++)
+      {
+        double t = 0;
+        res = BenchFolderPool(&db, args[argIndex], (unsigned)n, &t, &size);
+        if (pass == 0 || best > t)
+          best = t;
+      }
+      if (res != SZ_OK)
+        break;
+      if (best <= 0)
+        best = 1e-6;
+      if (n == 1)
+        oneThread = best;
+      printf("%-8d %10.3f %10.2f %10.2f\n", n, best, (double)size / best / 1000000, oneThread / best);
+    }
+    SzArEx_Free(&db, &g_Alloc);
+    if (res != SZ_OK)
+    {
+      fprintf(stderr, "\nError: %d\n", (int)res);
+      return 1;
+    }
+  }
+
+  MappedInStream_Close(&mappedStream);
+  File_Close(&archiveStream.file);
+  return 0;
+}
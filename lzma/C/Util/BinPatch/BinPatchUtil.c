@@ -0,0 +1,433 @@
+/* BinPatchUtil.c -- Builds and applies binary delta patches
+2013-05-20 : Public domain */
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#define MY_MKDIR(name) _mkdir(name)
+#define DIR_SEP "\\"
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#define MY_MKDIR(name) mkdir(name, 0777)
+#define DIR_SEP "/"
+#endif
+
+#include "../../Alloc.h"
+#include "../../7zFile.h"
+#include "../../7zVersion.h"
+#include "../../BinPatch.h"
+#include "../../Sha1.h"
+
+#define MAX_PATH_LEN 1024
+
+static void *SzAlloc(void *p, size_t size) { p = p; return MyAlloc(size); }
+static void SzFree(void *p, void *address) { p = p; MyFree(address); }
+static ISzAlloc g_Alloc = { SzAlloc, SzFree };
+
+typedef struct
+{
+  UInt64 numFiles;
+  UInt64 numPatched;
+  UInt64 numUnchanged;
+  UInt64 fullBytes;  /* what the new file set weighs as a full package */
+  UInt64 deltaBytes; /* what ends up in the delta package */
+} CDiffStats;
+
+static void PrintHelp(void)
+{
+  printf("\nBinary Patch Utility " MY_VERSION_COPYRIGHT_DATE "\n"
+      "\nUsage:  binpatch d oldFile newFile patchFile\n"
+             "        binpatch a oldFile patchFile newFile\n"
+             "        binpatch dir oldDir newDir outDir\n"
+             "  d:   create a patch that turns oldFile into newFile\n"
+             "  a:   apply a patch to oldFile\n"
+             "  dir: write the files of newDir to outDir, as " BIN_PATCH_SUFFIX " patches against\n"
+             "       oldDir where that is smaller, skipping files that didn't change\n");
+}
+
+static int PrintError(const char *message, const char *name)
+{
+  fprintf(stderr, "\nError: %s: %s\n", message, name);
+  return 1;
+}
+
+static int FileExists(const char *name)
+{
+  CSzFile file;
+  File_Construct(&file);
+  if (InFile_Open(&file, name) != 0)
+    return 0;
+  File_Close(&file);
+  return 1;
+}
+
+/* leaves room for BIN_PATCH_SUFFIX */
+static int JoinPath(char *dest, const char *dir, const char *name)
+{
+  if (strlen(dir) + strlen(name) + 1 + sizeof(BIN_PATCH_SUFFIX) > MAX_PATH_LEN)
+    return 0;
+  sprintf(dest, "%s" DIR_SEP "%s", dir, name);
+  return 1;
+}
+
+static SRes LoadFile(const char *name, Byte **data, size_t *size)
+{
+  CSzFile file;
+  UInt64 length;
+  size_t processed;
+  SRes res = SZ_OK;
+
+  *data = NULL;
+  *size = 0;
+
+  File_Construct(&file);
+  if (InFile_Open(&file, name) != 0)
+    return SZ_ERROR_READ;
+
+  if (File_GetLength(&file, &length) != 0 || length != (size_t)length)
+  {
+    File_Close(&file);
+    return SZ_ERROR_READ;
+  }
+
+  *size = (size_t)length;
+  *data = (Byte *)MyAlloc(*size ? *size : 1);
+  if (!*data)
+    res = SZ_ERROR_MEM;
+  else
+  {
+    processed = *size;
+    if (File_Read(&file, *data, &processed) != 0 || processed != *size)
+      res = SZ_ERROR_READ;
+  }
+
+  File_Close(&file);
+
+  if (res != SZ_OK)
+  {
+    MyFree(*data);
+    *data = NULL;
+  }
+  return res;
+}
+
+static SRes SaveFile(const char *name, const Byte *data, size_t size)
+{
+  CSzFile file;
+  size_t processed = size;
+  SRes res = SZ_OK;
+
+  File_Construct(&file);
+  if (OutFile_Open(&file, name) != 0)
+    return SZ_ERROR_WRITE;
+  if (size != 0 && (File_Write(&file, data, &processed) != 0 || processed != size))
+    res = SZ_ERROR_WRITE;
+  if (File_Close(&file) != 0)
+    res = SZ_ERROR_WRITE;
+  return res;
+}
+
+static SRes CreatePatchFile(const Byte *oldData, size_t oldSize, const Byte *newData, size_t newSize,
+    const char *patchName, UInt64 *patchSize)
+{
+  CFileOutStream outStream;
+  UInt64 length = 0;
+  SRes res;
+
+  FileOutStream_CreateVTable(&outStream);
+  File_Construct(&outStream.file);
+  if (OutFile_Open(&outStream.file, patchName) != 0)
+    return SZ_ERROR_WRITE;
+
+  res = BinPatch_Create(oldData, oldSize, newData, newSize, &outStream.s, &g_Alloc);
+  if (res == SZ_OK && patchSize)
+  {
+    Int64 pos = 0;
+    if (File_Seek(&outStream.file, &pos, SZ_SEEK_CUR) != 0)
+      res = SZ_ERROR_WRITE;
+    length = (UInt64)pos;
+  }
+  if (File_Close(&outStream.file) != 0 && res == SZ_OK)
+    res = SZ_ERROR_WRITE;
+
+  if (patchSize)
+    *patchSize = length;
+  return res;
+}
+
+static int Diff(const char *oldName, const char *newName, const char *patchName)
+{
+  Byte *oldData, *newData;
+  size_t oldSize, newSize;
+  UInt64 patchSize;
+  SRes res;
+
+  if (LoadFile(oldName, &oldData, &oldSize) != SZ_OK)
+    return PrintError("Can not read input file", oldName);
+  if (LoadFile(newName, &newData, &newSize) != SZ_OK)
+  {
+    MyFree(oldData);
+    return PrintError("Can not read input file", newName);
+  }
+
+  res = CreatePatchFile(oldData, oldSize, newData, newSize, patchName, &patchSize);
+
+  MyFree(oldData);
+  MyFree(newData);
+
+  if (res != SZ_OK)
+    return PrintError("Can not write output file", patchName);
+
+  printf("%s: %lu -> %lu bytes\n", newName, (unsigned long)newSize, (unsigned long)patchSize);
+  return 0;
+}
+
+static int Apply(const char *oldName, const char *patchName, const char *newName)
+{
+  CFileInStream source;
+  CFileSeqInStream patch;
+  CFileOutStream target;
+  CBinPatchHeader header;
+  SRes res;
+
+  FileInStream_CreateVTable(&source);
+  File_Construct(&source.file);
+  FileSeqInStream_CreateVTable(&patch);
+  File_Construct(&patch.file);
+  FileOutStream_CreateVTable(&target);
+  File_Construct(&target.file);
+
+  if (InFile_Open(&patch.file, patchName) != 0)
+    return PrintError("Can not open input file", patchName);
+
+  res = BinPatch_ReadHeader(&header, &patch.s);
+  if (res != SZ_OK)
+  {
+    File_Close(&patch.file);
+    return PrintError("Not a patch", patchName);
+  }
+
+  /* same check the updater does before patching */
+  {
+    Byte *oldData;
+    size_t oldSize;
+    Byte digest[SHA1_DIGEST_SIZE];
+    CSha1 sha;
+
+    if (LoadFile(oldName, &oldData, &oldSize) != SZ_OK)
+    {
+      File_Close(&patch.file);
+      return PrintError("Can not read input file", oldName);
+    }
+    Sha1_Init(&sha);
+    Sha1_Update(&sha, oldData, oldSize);
+    Sha1_Final(&sha, digest);
+    MyFree(oldData);
+
+    if (oldSize != header.sourceSize || memcmp(digest, header.sourceHash, SHA1_DIGEST_SIZE) != 0)
+    {
+      File_Close(&patch.file);
+      return PrintError("Patch was made for a different file", oldName);
+    }
+  }
+
+  if (InFile_Open(&source.file, oldName) != 0)
+  {
+    File_Close(&patch.file);
+    return PrintError("Can not open input file", oldName);
+  }
+  if (OutFile_Open(&target.file, newName) != 0)
+  {
+    File_Close(&patch.file);
+    File_Close(&source.file);
+    return PrintError("Can not open output file", newName);
+  }
+
+  res = BinPatch_Apply(&header, &patch.s, &source.s, &target.s);
+
+  File_Close(&patch.file);
+  File_Close(&source.file);
+  File_Close(&target.file);
+
+  if (res == SZ_ERROR_CRC)
+    return PrintError("Result doesn't match the patch", newName);
+  if (res != SZ_OK)
+    return PrintError("Patch is damaged", patchName);
+  return 0;
+}
+
+static int DiffFile(const char *oldName, const char *newName, const char *outName, CDiffStats *stats)
+{
+  Byte *oldData = NULL, *newData;
+  size_t oldSize = 0, newSize;
+  char patchName[MAX_PATH_LEN];
+  UInt64 patchSize;
+
+  if (LoadFile(newName, &newData, &newSize) != SZ_OK)
+    return PrintError("Can not read input file", newName);
+
+  stats->numFiles++;
+  stats->fullBytes += newSize;
+
+  if (FileExists(oldName) && LoadFile(oldName, &oldData, &oldSize) != SZ_OK)
+  {
+    MyFree(newData);
+    return PrintError("Can not read input file", oldName);
+  }
+
+  if (oldData && oldSize == newSize && memcmp(oldData, newData, newSize) == 0)
+  {
+    stats->numUnchanged++;
+    MyFree(oldData);
+    MyFree(newData);
+    return 0;
+  }
+
+  if (oldData)
+  {
+    strcpy(patchName, outName);
+    strcat(patchName, BIN_PATCH_SUFFIX);
+    if (CreatePatchFile(oldData, oldSize, newData, newSize, patchName, &patchSize) != SZ_OK)
+    {
+      MyFree(oldData);
+      MyFree(newData);
+      return PrintError("Can not write output file", patchName);
+    }
+    MyFree(oldData);
+
+    if (patchSize < newSize)
+    {
+      stats->numPatched++;
+      stats->deltaBytes += patchSize;
+      MyFree(newData);
+      return 0;
+    }
+
+    /* patch didn't pay off, ship the file as is */
+    remove(patchName);
+  }
+
+  stats->deltaBytes += newSize;
+  if (SaveFile(outName, newData, newSize) != SZ_OK)
+  {
+    MyFree(newData);
+    return PrintError("Can not write output file", outName);
+  }
+  MyFree(newData);
+  return 0;
+}
+
+static int DiffDir(const char *oldDir, const char *newDir, const char *outDir, CDiffStats *stats)
+{
+  char oldName[MAX_PATH_LEN], newName[MAX_PATH_LEN], outName[MAX_PATH_LEN];
+  int res = 0;
+
+  MY_MKDIR(outDir);
+
+  #ifdef _WIN32
+  {
+    WIN32_FIND_DATAA fd;
+    HANDLE hFind;
+
+    if (!JoinPath(newName, newDir, "*"))
+      return PrintError("Path too long", newDir);
+    hFind = FindFirstFileA(newName, &fd);
+    if (hFind == INVALID_HANDLE_VALUE)
+      return PrintError("Can not open directory", newDir);
+
+    do
+    {
+      const char *name = fd.cFileName;
+      if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        continue;
+
+      if (!JoinPath(oldName, oldDir, name) || !JoinPath(newName, newDir, name) || !JoinPath(outName, outDir, name))
+        res = PrintError("Path too long", name);
+      else if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+        res = DiffDir(oldName, newName, outName, stats);
+      else
+        res = DiffFile(oldName, newName, outName, stats);
+    }
+    while (res == 0 && FindNextFileA(hFind, &fd));
+
+    FindClose(hFind);
+  }
+  #else
+  {
+    DIR *dir = opendir(newDir);
+    struct dirent *entry;
+
+    if (!dir)
+      return PrintError("Can not open directory", newDir);
+
+    while (res == 0 && (entry = readdir(dir)) != NULL)
+    {
+      const char *name = entry->d_name;
+      struct stat st;
+
+      if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        continue;
+
+      if (!JoinPath(oldName, oldDir, name) || !JoinPath(newName, newDir, name) || !JoinPath(outName, outDir, name))
+        res = PrintError("Path too long", name);
+      else if (stat(newName, &st) != 0)
+        res = PrintError("Can not read input file", newName);
+      else if (S_ISDIR(st.st_mode))
+        res = DiffDir(oldName, newName, outName, stats);
+      else
+        res = DiffFile(oldName, newName, outName, stats);
+    }
+
+    closedir(dir);
+  }
+  #endif
+
+  return res;
+}
+
+int main(int numArgs, const char *args[])
+{
+  if (numArgs == 1)
+  {
+    PrintHelp();
+    return 0;
+  }
+
+  if (numArgs != 5)
+  {
+    PrintHelp();
+    return 1;
+  }
+
+  if (strcmp(args[1], "d") == 0)
+    return Diff(args[2], args[3], args[4]);
+
+  if (strcmp(args[1], "a") == 0)
+    return Apply(args[2], args[3], args[4]);
+
+  if (strcmp(args[1], "dir") == 0)
+  {
+    CDiffStats stats;
+    int res;
+
+    memset(&stats, 0, sizeof(stats));
+    res = DiffDir(args[2], args[3], args[4], &stats);
+    if (res == 0)
+      printf("%lu files: %lu patched, %lu unchanged\n"
+          "full: %lu bytes, delta: %lu bytes (before compression)\n",
+          (unsigned long)stats.numFiles, (unsigned long)stats.numPatched, (unsigned long)stats.numUnchanged,
+          (unsigned long)stats.fullBytes, (unsigned long)stats.deltaBytes);
+    return res;
+  }
+
+  PrintHelp();
+  return 1;
+}
@@ -0,0 +1,201 @@
+/* BraBench.c -- branch converter decoding benchmark
+2013-05-20 : Public domain */
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/time.h>
+#endif
+
+#include "../../Alloc.h"
+#include "../../Bra.h"
+#include "../../7zFile.h"
+#include "../../7zVersion.h"
+
+#define NUM_BACKENDS 3
+#define NUM_CONVERTERS 4
+
+static const char * const g_BackendNames[NUM_BACKENDS] = { "scalar", "sse2", "avx2" };
+static const char * const g_ConverterNames[NUM_CONVERTERS] = { "x86", "ARM", "ARMT", "PPC" };
+
+static void PrintHelp(void)
+{
+  printf("\nBraBench " MY_VERSION_COPYRIGHT_DATE "\n"
+      "\nUsage:  brabench [<switches>] file1 [file2 ...]\n"
+      "  Encodes every file with the x86, ARM, ARMT and PPC branch converters, decodes it\n"
+      "  several times with every opcode scanner backend this build and CPU support,\n"
+      "  checks that the decoded data matches the file, and prints the best decoding speeds.\n"
+      "Switches:\n"
+      "  -n<N>:  number of decoding passes (default: 5)\n");
+}
+
+static double GetTimeSeconds(void)
+{
+  #ifdef _WIN32
+  LARGE_INTEGER freq, count;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&count);
+  return (double)count.QuadPart / (double)freq.QuadPart;
+  #else
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (double)tv.tv_sec + (double)tv.tv_usec / 1000000;
+  #endif
+}
+
+static Byte *ReadFile(const char *name, size_t *size)
+{
+  CSzFile file;
+  UInt64 fileSize = 0;
+  Byte *data;
+  File_Construct(&file);
+  if (InFile_Open(&file, name) != 0)
+    return NULL;
+  File_GetLength(&file, &fileSize);
+  *size = (size_t)fileSize;
+  data = (*size == fileSize) ? (Byte *)MyAlloc(*size + 1) : NULL;
+  if (data != NULL && (File_Read(&file, data, size) != 0 || *size != fileSize))
+  {
+    MyFree(data);
+    data = NULL;
+  }
+  File_Close(&file);
+  return data;
+}
+
+static void Convert(unsigned converter, Byte *data, SizeT size, int encoding)
+{
+  UInt32 state;
+  switch (converter)
+  {
+    case 0: x86_Convert_Init(state); x86_Convert(data, size, 0, &state, encoding); break;
+    case 1: ARM_Convert(data, size, 0, encoding); break;
+    case 2: ARMT_Convert(data, size, 0, encoding); break;
+    default: PPC_Convert(data, size, 0, encoding); break;
+  }
+}
+
+/* returns the best decoding time, or a negative value if the decoded data differs */
+static double BenchDecode(unsigned converter, const Byte *data, const Byte *encoded, Byte *temp,
+    size_t size, int numPasses)
+{
+  double best = -1;
+  int pass;
+  for (pass = 0; pass < numPasses; pass++)
+  {
+    double startTime, elapsed;
+    memcpy(temp, encoded, size);
+    startTime = GetTimeSeconds();
+    Convert(converter, temp, size, 0);
+    elapsed = GetTimeSeconds() - startTime;
+    if (memcmp(temp, data, size) != 0)
+      return -1;
+    if (best < 0 || elapsed < best)
+      best = elapsed;
+  }
+  return best;
+}
+
+int main(int numArgs, const char *args[])
+{
+  int numPasses = 5;
+  int argIndex;
+  double totalSize = 0;
+  double totalTimes[NUM_CONVERTERS][NUM_BACKENDS];
+  Bool available[NUM_BACKENDS];
+  unsigned c, b;
+
+  for (argIndex = 1; argIndex < numArgs && args[argIndex][0] == '-'; argIndex++)
+  {
+    const char *s = args[argIndex] + 1;
+    if (s[0] == 'n')
+      numPasses = atoi(s + 1);
+    else
+    {
+      PrintHelp();
+      return 1;
+    }
+  }
+  if (argIndex == numArgs)
+  {
+    PrintHelp();
+    return numArgs == 1 ? 0 : 1;
+  }
+  if (numPasses < 1)
+    numPasses = 1;
+
+  for (b = 0; b < NUM_BACKENDS; b++)
+    available[b] = Bra_SetBackend((int)b);
+  for (c = 0; c < NUM_CONVERTERS; c++)
+    for (b = 0; b < NUM_BACKENDS; b++)
+      totalTimes[c][b] = 0;
+
+  for (; argIndex < numArgs; argIndex++)
+  {
+    size_t size = 0;
+    Byte *data = ReadFile(args[argIndex], &size);
+    Byte *encoded, *temp;
+    if (data == NULL)
+    {
+      fprintf(stderr, "\nError: Can not read %s\n", args[argIndex]);
+      return 1;
+    }
+    encoded = (Byte *)MyAlloc(size + 1);
+    temp = (Byte *)MyAlloc(size + 1);
+    if (encoded == NULL || temp == NULL)
+    {
+      fprintf(stderr, "\nError: Can not allocate memory\n");
+      return 1;
+    }
+    for (c = 0; c < NUM_CONVERTERS; c++)
+    {
+      memcpy(encoded, data, size);
+      Bra_SetBackend(BRA_BACKEND_SCALAR);
+      Convert(c, encoded, size, 1);
+      for (b = 0; b < NUM_BACKENDS; b++)
+      {
+        double elapsed;
+        if (!available[b])
+          continue;
+        Bra_SetBackend((int)b);
+        elapsed = BenchDecode(c, data, encoded, temp, size, numPasses);
+        if (elapsed < 0)
+        {
+          fprintf(stderr, "\nError: %s decoding with %s backend doesn't match %s\n",
+              g_ConverterNames[c], g_BackendNames[b], args[argIndex]);
+          return 1;
+        }
+        totalTimes[c][b] += elapsed;
+      }
+    }
+    totalSize += (double)size;
+    MyFree(temp);
+    MyFree(encoded);
+    MyFree(data);
+  }
+
+  printf("size: %.0f bytes, decoding MB/s\n\n%-6s", totalSize, "");
+  for (b = 0; b < NUM_BACKENDS; b++)
+    printf(" %10s", g_BackendNames[b]);
+  printf("\n");
+  for (c = 0; c < NUM_CONVERTERS; c++)
+  {
+    printf("%-6s", g_ConverterNames[c]);
+    for (b = 0; b < NUM_BACKENDS; b++)
+    {
+      double t = totalTimes[c][b];
+      if (!available[b])
+        printf(" %10s", "-");
+      else
+        printf(" %10.0f", totalSize / (t <= 0 ? 1e-6 : t) / 1000000);
+    }
+    printf("\n");
+  }
+  return 0;
+}
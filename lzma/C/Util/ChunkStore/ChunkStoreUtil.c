@@ -0,0 +1,628 @@
+/* ChunkStoreUtil.c -- Builds chunk stores and indexes for chunked updates
+2013-05-20 : Public domain */
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#define MY_MKDIR(name) _mkdir(name)
+#define DIR_SEP "\\"
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#define MY_MKDIR(name) mkdir(name, 0777)
+#define DIR_SEP "/"
+#endif
+
+#include "../../Alloc.h"
+#include "../../7zFile.h"
+#include "../../7zVersion.h"
+#include "../../Chunker.h"
+#include "../../Sha1.h"
+
+#define MAX_PATH_LEN 1024
+#define ID_SIZE SHA1_DIGEST_SIZE
+
+/* ---------- chunk ID set ---------- */
+
+typedef struct
+{
+  Byte *ids;
+  size_t numIds;
+  size_t capacity; /* power of 2 */
+} CIdSet;
+
+static void IdSet_Init(CIdSet *p)
+{
+  p->ids = NULL;
+  p->numIds = 0;
+  p->capacity = 0;
+}
+
+static void IdSet_Free(CIdSet *p)
+{
+  MyFree(p->ids);
+  IdSet_Init(p);
+}
+
+static int IdSet_IsEmptySlot(const Byte *slot)
+{
+  unsigned i;
+  for (i = 0; i < ID_SIZE; i++)
+    if (slot[i] != 0)
+      return 0;
+  return 1;
+}
+
+static SRes IdSet_Insert(CIdSet *p, const Byte *id, int *isNew);
+
+static SRes IdSet_Grow(CIdSet *p)
+{
+  CIdSet bigger;
+  size_t i;
+  int isNew;
+
+  bigger.capacity = p->capacity ? p->capacity * 2 : (1 << 12);
+  bigger.numIds = 0;
+  bigger.ids = (Byte *)MyAlloc(bigger.capacity * ID_SIZE);
+  if (!bigger.ids)
+    return SZ_ERROR_MEM;
+  memset(bigger.ids, 0, bigger.capacity * ID_SIZE);
+
+  for (i = 0; i < p->capacity; i++)
+    if (!IdSet_IsEmptySlot(p->ids + i * ID_SIZE))
+      IdSet_Insert(&bigger, p->ids + i * ID_SIZE, &isNew);
+
+  MyFree(p->ids);
+  *p = bigger;
+  return SZ_OK;
+}
+
+/* IDs are SHA-1 digests, so the first bytes are already a good hash; an all-zero ID is never stored */
+static SRes IdSet_Insert(CIdSet *p, const Byte *id, int *isNew)
+{
+  size_t i;
+
+  if ((p->numIds + 1) * 2 > p->capacity)
+  {
+    RINOK(IdSet_Grow(p));
+  }
+
+  i = (((size_t)id[0] << 24) | ((size_t)id[1] << 16) | ((size_t)id[2] << 8) | id[3]) & (p->capacity - 1);
+  for (;; i = (i + 1) & (p->capacity - 1))
+  {
+    Byte *slot = p->ids + i * ID_SIZE;
+    if (IdSet_IsEmptySlot(slot))
+    {
+      memcpy(slot, id, ID_SIZE);
+      p->numIds++;
+      *isNew = 1;
+      return SZ_OK;
+    }
+    if (memcmp(slot, id, ID_SIZE) == 0)
+    {
+      *isNew = 0;
+      return SZ_OK;
+    }
+  }
+}
+
+/* ---------- helpers ---------- */
+
+typedef struct
+{
+  UInt64 numFiles;
+  UInt64 numChunks;
+  UInt64 numNewChunks;
+  UInt64 totalBytes;
+  UInt64 newBytes;
+} CStoreStats;
+
+static void PrintHelp(void)
+{
+  printf("\nChunk Store Utility " MY_VERSION_COPYRIGHT_DATE "\n"
+      "\nUsage:  chunkstore add storeDir releaseDir indexFile\n"
+             "        chunkstore bench [numReleases [numFiles [fileSize]]]\n"
+             "  add:   split the files of releaseDir into chunks, copy the chunks storeDir\n"
+             "         doesn't have yet and write the chunk index for the release\n"
+             "  bench: report dedup across a series of synthetic releases\n");
+}
+
+static int PrintError(const char *message, const char *name)
+{
+  fprintf(stderr, "\nError: %s: %s\n", message, name);
+  return 1;
+}
+
+static void IdToString(const Byte *id, char *s)
+{
+  const char *alphabet = "0123456789abcdef";
+  unsigned i;
+  for (i = 0; i < ID_SIZE; i++)
+  {
+    s[i * 2] = alphabet[id[i] >> 4];
+    s[i * 2 + 1] = alphabet[id[i] & 15];
+  }
+  s[ID_SIZE * 2] = 0;
+}
+
+static void ChunkId(const Byte *data, size_t size, Byte *id)
+{
+  CSha1 sha;
+  Sha1_Init(&sha);
+  Sha1_Update(&sha, data, size);
+  Sha1_Final(&sha, id);
+}
+
+static int JoinPath(char *dest, const char *dir, const char *sep, const char *name)
+{
+  if (strlen(dir) + strlen(sep) + strlen(name) + 1 > MAX_PATH_LEN)
+    return 0;
+  strcpy(dest, dir);
+  strcat(dest, sep);
+  strcat(dest, name);
+  return 1;
+}
+
+static SRes LoadFile(const char *name, Byte **data, size_t *size)
+{
+  CSzFile file;
+  UInt64 length;
+  size_t processed;
+  SRes res = SZ_OK;
+
+  *data = NULL;
+  *size = 0;
+
+  File_Construct(&file);
+  if (InFile_Open(&file, name) != 0)
+    return SZ_ERROR_READ;
+
+  if (File_GetLength(&file, &length) != 0 || length != (size_t)length)
+  {
+    File_Close(&file);
+    return SZ_ERROR_READ;
+  }
+
+  *size = (size_t)length;
+  *data = (Byte *)MyAlloc(*size ? *size : 1);
+  if (!*data)
+    res = SZ_ERROR_MEM;
+  else
+  {
+    processed = *size;
+    if (File_Read(&file, *data, &processed) != 0 || processed != *size)
+      res = SZ_ERROR_READ;
+  }
+
+  File_Close(&file);
+
+  if (res != SZ_OK)
+  {
+    MyFree(*data);
+    *data = NULL;
+  }
+  return res;
+}
+
+static SRes SaveFile(const char *name, const Byte *data, size_t size)
+{
+  CSzFile file;
+  size_t processed = size;
+  SRes res = SZ_OK;
+
+  File_Construct(&file);
+  if (OutFile_Open(&file, name) != 0)
+    return SZ_ERROR_WRITE;
+  if (size != 0 && (File_Write(&file, data, &processed) != 0 || processed != size))
+    res = SZ_ERROR_WRITE;
+  if (File_Close(&file) != 0)
+    res = SZ_ERROR_WRITE;
+  return res;
+}
+
+static int FileExists(const char *name)
+{
+  CSzFile file;
+  File_Construct(&file);
+  if (InFile_Open(&file, name) != 0)
+    return 0;
+  File_Close(&file);
+  return 1;
+}
+
+/* ---------- add ---------- */
+
+typedef struct
+{
+  const char *storeDir;
+  FILE *index;
+  int firstFile;
+  CStoreStats stats;
+} CAddContext;
+
+static void WriteJsonString(FILE *f, const char *s)
+{
+  fputc('"', f);
+  for (; *s; s++)
+  {
+    if (*s == '"' || *s == '\\')
+      fputc('\\', f);
+    fputc(*s, f);
+  }
+  fputc('"', f);
+}
+
+static int AddFile(CAddContext *ctx, const char *path, const char *relName)
+{
+  Byte *data;
+  size_t size, pos, len;
+  Byte id[ID_SIZE];
+  char idString[ID_SIZE * 2 + 1];
+  char chunkName[MAX_PATH_LEN];
+  int firstChunk = 1;
+
+  if (LoadFile(path, &data, &size) != SZ_OK)
+    return PrintError("Can not read input file", path);
+
+  ctx->stats.numFiles++;
+  ctx->stats.totalBytes += size;
+
+  ChunkId(data, size, id);
+  IdToString(id, idString);
+
+  fprintf(ctx->index, "%s\n    {\"name\": ", ctx->firstFile ? "" : ",");
+  WriteJsonString(ctx->index, relName);
+  fprintf(ctx->index, ", \"size\": %lu, \"sha1\": \"%s\", \"chunks\": [", (unsigned long)size, idString);
+  ctx->firstFile = 0;
+
+  for (pos = 0; pos < size; pos += len)
+  {
+    len = Chunker_Next(data + pos, size - pos);
+
+    ChunkId(data + pos, len, id);
+    IdToString(id, idString);
+
+    fprintf(ctx->index, "%s[\"%s\", %lu]", firstChunk ? "" : ", ", idString, (unsigned long)len);
+    firstChunk = 0;
+
+    ctx->stats.numChunks++;
+
+    if (!JoinPath(chunkName, ctx->storeDir, DIR_SEP, idString))
+    {
+      MyFree(data);
+      return PrintError("Path too long", ctx->storeDir);
+    }
+
+    if (!FileExists(chunkName))
+    {
+      if (SaveFile(chunkName, data + pos, len) != SZ_OK)
+      {
+        MyFree(data);
+        return PrintError("Can not write output file", chunkName);
+      }
+      ctx->stats.numNewChunks++;
+      ctx->stats.newBytes += len;
+    }
+  }
+
+  fprintf(ctx->index, "]}");
+  MyFree(data);
+  return 0;
+}
+
+/* relName uses '/' whatever the platform, it ends up in the index */
+static int AddDir(CAddContext *ctx, const char *dir, const char *relDir)
+{
+  char path[MAX_PATH_LEN], relName[MAX_PATH_LEN];
+  int res = 0;
+
+  #ifdef _WIN32
+  {
+    WIN32_FIND_DATAA fd;
+    HANDLE hFind;
+
+    if (!JoinPath(path, dir, DIR_SEP, "*"))
+      return PrintError("Path too long", dir);
+    hFind = FindFirstFileA(path, &fd);
+    if (hFind == INVALID_HANDLE_VALUE)
+      return PrintError("Can not open directory", dir);
+
+    do
+    {
+      const char *name = fd.cFileName;
+      if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        continue;
+
+      if (!JoinPath(path, dir, DIR_SEP, name) || !JoinPath(relName, relDir, *relDir ? "/" : "", name))
+        res = PrintError("Path too long", name);
+      else if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+        res = AddDir(ctx, path, relName);
+      else
+        res = AddFile(ctx, path, relName);
+    }
+    while (res == 0 && FindNextFileA(hFind, &fd));
+
+    FindClose(hFind);
+  }
+  #else
+  {
+    DIR *d = opendir(dir);
+    struct dirent *entry;
+
+    if (!d)
+      return PrintError("Can not open directory", dir);
+
+    while (res == 0 && (entry = readdir(d)) != NULL)
+    {
+      const char *name = entry->d_name;
+      struct stat st;
+
+      if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        continue;
+
+      if (!JoinPath(path, dir, DIR_SEP, name) || !JoinPath(relName, relDir, *relDir ? "/" : "", name))
+        res = PrintError("Path too long", name);
+      else if (stat(path, &st) != 0)
+        res = PrintError("Can not read input file", path);
+      else if (S_ISDIR(st.st_mode))
+        res = AddDir(ctx, path, relName);
+      else
+        res = AddFile(ctx, path, relName);
+    }
+
+    closedir(d);
+  }
+  #endif
+
+  return res;
+}
+
+static int Add(const char *storeDir, const char *releaseDir, const char *indexName)
+{
+  CAddContext ctx;
+  int res;
+
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.storeDir = storeDir;
+  ctx.firstFile = 1;
+
+  MY_MKDIR(storeDir);
+
+  ctx.index = fopen(indexName, "w");
+  if (!ctx.index)
+    return PrintError("Can not open output file", indexName);
+
+  fprintf(ctx.index, "{\n  \"chunker\": {\"min\": %u, \"avg\": %u, \"max\": %u},\n  \"files\": [",
+      (unsigned)CHUNK_MIN_SIZE, (unsigned)CHUNK_AVG_SIZE, (unsigned)CHUNK_MAX_SIZE);
+
+  res = AddDir(&ctx, releaseDir, "");
+
+  fprintf(ctx.index, "\n  ]\n}\n");
+  if (fclose(ctx.index) != 0 && res == 0)
+    res = PrintError("Can not write output file", indexName);
+
+  if (res == 0)
+    printf("%lu files, %lu bytes in %lu chunks\n"
+        "new: %lu chunks, %lu bytes (%.1f%% of the release)\n",
+        (unsigned long)ctx.stats.numFiles, (unsigned long)ctx.stats.totalBytes, (unsigned long)ctx.stats.numChunks,
+        (unsigned long)ctx.stats.numNewChunks, (unsigned long)ctx.stats.newBytes,
+        ctx.stats.totalBytes ? 100.0 * (double)ctx.stats.newBytes / (double)ctx.stats.totalBytes : 0.0);
+  return res;
+}
+
+/* ---------- bench ---------- */
+
+static UInt32 g_RandState = 1;
+
+static UInt32 Rand(void)
+{
+  g_RandState ^= g_RandState << 13;
+  g_RandState ^= g_RandState >> 17;
+  g_RandState ^= g_RandState << 5;
+  return g_RandState;
+}
+
+/* mostly incompressible bytes with some repeated runs, roughly like a binary */
+static void FillSynthetic(Byte *data, size_t size)
+{
+  size_t i = 0;
+  while (i < size)
+  {
+    size_t run = 16 + Rand() % 512;
+    if (run > size - i)
+      run = size - i;
+    if (i > 4096 && (Rand() & 3) == 0)
+      memcpy(data + i, data + Rand() % (i - run), run);
+    else
+    {
+      size_t k;
+      for (k = 0; k < run; k++)
+        data[i + k] = (Byte)Rand();
+    }
+    i += run;
+  }
+}
+
+/* a point release: a handful of small edits, inserts and deletes */
+static size_t MutateFile(Byte *data, size_t size, size_t capacity)
+{
+  unsigned numEdits = 1 + Rand() % 8, e;
+  for (e = 0; e < numEdits; e++)
+  {
+    size_t pos = size ? Rand() % size : 0;
+    size_t len = 1 + Rand() % 256;
+    unsigned kind = Rand() % 3;
+    size_t k;
+
+    if (kind == 0)
+    {
+      if (len > size - pos)
+        len = size - pos;
+      for (k = 0; k < len; k++)
+        data[pos + k] = (Byte)Rand();
+    }
+    else if (kind == 1 && size + len <= capacity)
+    {
+      memmove(data + pos + len, data + pos, size - pos);
+      for (k = 0; k < len; k++)
+        data[pos + k] = (Byte)Rand();
+      size += len;
+    }
+    else if (kind == 2 && len < size - pos)
+    {
+      memmove(data + pos, data + pos + len, size - pos - len);
+      size -= len;
+    }
+  }
+  return size;
+}
+
+static SRes AddChunks(CIdSet *set, const Byte *data, size_t size, int fixed, CStoreStats *stats)
+{
+  size_t pos, len;
+  Byte id[ID_SIZE];
+  int isNew;
+
+  for (pos = 0; pos < size; pos += len)
+  {
+    if (fixed)
+      len = (size - pos < CHUNK_AVG_SIZE) ? size - pos : CHUNK_AVG_SIZE;
+    else
+      len = Chunker_Next(data + pos, size - pos);
+
+    ChunkId(data + pos, len, id);
+    RINOK(IdSet_Insert(set, id, &isNew));
+
+    stats->numChunks++;
+    if (isNew)
+    {
+      stats->numNewChunks++;
+      stats->newBytes += len;
+    }
+  }
+  stats->totalBytes += size;
+  return SZ_OK;
+}
+
+static int Bench(unsigned numReleases, unsigned numFiles, size_t fileSize)
+{
+  Byte **files;
+  size_t *sizes;
+  size_t capacity = fileSize + fileSize / 4;
+  CIdSet cdcSet, fixedSet;
+  UInt64 totalFull = 0, totalCdc = 0, totalFixed = 0;
+  unsigned r, i;
+  int res = 0;
+  clock_t start = clock();
+
+  files = (Byte **)MyAlloc(numFiles * sizeof(Byte *));
+  sizes = (size_t *)MyAlloc(numFiles * sizeof(size_t));
+  if (!files || !sizes)
+    return PrintError("Can not allocate memory", "");
+
+  for (i = 0; i < numFiles; i++)
+  {
+    files[i] = (Byte *)MyAlloc(capacity);
+    if (!files[i])
+      return PrintError("Can not allocate memory", "");
+    sizes[i] = fileSize / 2 + Rand() % fileSize;
+    if (sizes[i] > capacity)
+      sizes[i] = capacity;
+    FillSynthetic(files[i], sizes[i]);
+  }
+
+  IdSet_Init(&cdcSet);
+  IdSet_Init(&fixedSet);
+
+  printf("%u files, %lu bytes average, %u releases\n\n", numFiles, (unsigned long)fileSize, numReleases);
+  printf("release       full bytes    CDC download  fixed download   CDC saved\n");
+
+  for (r = 0; r < numReleases && res == 0; r++)
+  {
+    CStoreStats cdc, fixed;
+    memset(&cdc, 0, sizeof(cdc));
+    memset(&fixed, 0, sizeof(fixed));
+
+    /* each release touches about a third of the files */
+    if (r != 0)
+      for (i = 0; i < numFiles; i++)
+        if (Rand() % 3 == 0)
+          sizes[i] = MutateFile(files[i], sizes[i], capacity);
+
+    for (i = 0; i < numFiles; i++)
+    {
+      if (AddChunks(&cdcSet, files[i], sizes[i], 0, &cdc) != SZ_OK ||
+          AddChunks(&fixedSet, files[i], sizes[i], 1, &fixed) != SZ_OK)
+      {
+        res = PrintError("Can not allocate memory", "");
+        break;
+      }
+    }
+
+    printf("%7u %16lu %15lu %15lu %10.1f%%\n", r,
+        (unsigned long)cdc.totalBytes, (unsigned long)cdc.newBytes, (unsigned long)fixed.newBytes,
+        100.0 - 100.0 * (double)cdc.newBytes / (double)(cdc.totalBytes ? cdc.totalBytes : 1));
+
+    /* release 0 is the initial install, not an update */
+    if (r != 0)
+    {
+      totalFull += cdc.totalBytes;
+      totalCdc += cdc.newBytes;
+      totalFixed += fixed.newBytes;
+    }
+  }
+
+  if (res == 0 && numReleases > 1)
+    printf("\nupdates: full %lu bytes, CDC %lu bytes (dedup ratio %.1fx), fixed-size chunks %lu bytes (%.1fx)\n"
+        "time: %.2f s\n",
+        (unsigned long)totalFull,
+        (unsigned long)totalCdc, (double)totalFull / (double)(totalCdc ? totalCdc : 1),
+        (unsigned long)totalFixed, (double)totalFull / (double)(totalFixed ? totalFixed : 1),
+        (double)(clock() - start) / CLOCKS_PER_SEC);
+
+  IdSet_Free(&cdcSet);
+  IdSet_Free(&fixedSet);
+  for (i = 0; i < numFiles; i++)
+    MyFree(files[i]);
+  MyFree(files);
+  MyFree(sizes);
+  return res;
+}
+
+int main(int numArgs, const char *args[])
+{
+  ChunkerGenerateTable();
+
+  if (numArgs == 1)
+  {
+    PrintHelp();
+    return 0;
+  }
+
+  if (strcmp(args[1], "add") == 0 && numArgs == 5)
+    return Add(args[2], args[3], args[4]);
+
+  if (strcmp(args[1], "bench") == 0 && numArgs <= 5)
+  {
+    unsigned numReleases = (numArgs > 2) ? (unsigned)atoi(args[2]) : 10;
+    unsigned numFiles = (numArgs > 3) ? (unsigned)atoi(args[3]) : 50;
+    size_t fileSize = (numArgs > 4) ? (size_t)atol(args[4]) : (2 << 20);
+    if (numReleases == 0 || numFiles == 0 || fileSize == 0)
+    {
+      PrintHelp();
+      return 1;
+    }
+    return Bench(numReleases, numFiles, fileSize);
+  }
+
+  PrintHelp();
+  return 1;
+}
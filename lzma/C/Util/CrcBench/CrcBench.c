@@ -0,0 +1,237 @@
+/* CrcBench.c -- CRC32 and CRC64 speed benchmark
+2013-05-20 : Public domain */
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/time.h>
+#endif
+
+#include "../../Alloc.h"
+#include "../../7zCrc.h"
+#include "../../7zVersion.h"
+#include "../../XzCrc64.h"
+
+#define NUM_CRC_BACKENDS 5
+#define NUM_CRC64_BACKENDS 3
+#define NUM_BLOCK_SIZES 3
+
+/* every measurement runs over this many bytes, in blocks of one of the sizes below */
+#define BENCH_TOTAL_SIZE ((size_t)1 << 28)
+#define BENCH_BUF_SIZE ((size_t)1 << 20)
+
+#define NUM_CHECKS 2000
+
+static const char * const g_CrcBackendNames[NUM_CRC_BACKENDS] = { "T4", "T8", "T16", "CLMUL", "VCLMUL" };
+static const char * const g_Crc64BackendNames[NUM_CRC64_BACKENDS] = { "T1", "T8", "CLMUL" };
+static const size_t g_BlockSizes[NUM_BLOCK_SIZES] = { (size_t)1 << 20, (size_t)1 << 10, 64 };
+
+static void PrintHelp(void)
+{
+  printf("\nCrcBench " MY_VERSION_COPYRIGHT_DATE "\n"
+      "\nUsage:  crcbench [<switches>]\n"
+      "  Checks every CRC32 and CRC64 backend this build and CPU support against the\n"
+      "  T4 and T1 tables on random lengths, alignments and split points, then prints\n"
+      "  the best speed of each one on 1 MB, 1 KB and 64 byte blocks.\n"
+      "Switches:\n"
+      "  -n<N>:  number of passes (default: 3)\n");
+}
+
+static double GetTimeSeconds(void)
+{
+  #ifdef _WIN32
+  LARGE_INTEGER freq, count;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&count);
+  return (double)count.QuadPart / (double)freq.QuadPart;
+  #else
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (double)tv.tv_sec + (double)tv.tv_usec / 1000000;
+  #endif
+}
+
+static UInt32 g_RandState = 1;
+
+static UInt32 GetRand(void)
+{
+  g_RandState = g_RandState * 1103515245 + 12345;
+  return g_RandState >> 8;
+}
+
+/* the lengths, alignments and split points are the same for every backend */
+static void GetCheck(unsigned index, size_t *offset, size_t *size, size_t *split)
+{
+  *offset = GetRand() % 64;
+  *size = GetRand() % (index < NUM_CHECKS / 2 ? 300 : 100000);
+  *split = GetRand() % (*size + 1);
+}
+
+/* CRC32 (is64 = False) or CRC64 of data, updated in two parts at split */
+static UInt64 CalcCrc(Bool is64, const Byte *data, size_t size, size_t split)
+{
+  if (is64)
+  {
+    UInt64 crc = Crc64Update(CRC64_INIT_VAL, data, split);
+    return CRC64_GET_DIGEST(Crc64Update(crc, data + split, size - split));
+  }
+  else
+  {
+    UInt32 crc = CrcUpdate(CRC_INIT_VAL, data, split);
+    return CRC_GET_DIGEST(CrcUpdate(crc, data + split, size - split));
+  }
+}
+
+static void CalcExpected(Bool is64, const Byte *data, UInt64 *expected)
+{
+  unsigned i;
+  g_RandState = 1;
+  for (i = 0; i < NUM_CHECKS; i++)
+  {
+    size_t offset, size, split;
+    GetCheck(i, &offset, &size, &split);
+    expected[i] = CalcCrc(is64, data + offset, size, size);
+  }
+}
+
+static Bool CheckCrc(Bool is64, const Byte *data, const UInt64 *expected)
+{
+  unsigned i;
+  g_RandState = 1;
+  for (i = 0; i < NUM_CHECKS; i++)
+  {
+    size_t offset, size, split;
+    GetCheck(i, &offset, &size, &split);
+    if (CalcCrc(is64, data + offset, size, split) != expected[i])
+      return False;
+  }
+  return True;
+}
+
+static double BenchCrc(Bool is64, const Byte *data, size_t blockSize, int numPasses)
+{
+  double best = -1;
+  int pass;
+  for (pass = 0; pass < numPasses; pass++)
+  {
+    UInt32 crc = CRC_INIT_VAL;
+    UInt64 crc64 = CRC64_INIT_VAL;
+    size_t done, pos = 0;
+    double startTime = GetTimeSeconds(), elapsed;
+    for (done = 0; done < BENCH_TOTAL_SIZE; done += blockSize)
+    {
+      if (is64)
+        crc64 = Crc64Update(crc64, data + pos, blockSize);
+      else
+        crc = CrcUpdate(crc, data + pos, blockSize);
+      pos += blockSize;
+      if (pos == BENCH_BUF_SIZE)
+        pos = 0;
+    }
+    elapsed = GetTimeSeconds() - startTime;
+    /* keep the result alive */
+    if (crc == 0 || crc64 == 0)
+      elapsed += 1e-9;
+    if (best < 0 || elapsed < best)
+      best = elapsed;
+  }
+  return best;
+}
+
+static Bool SetBackend(Bool is64, int backend)
+{
+  return is64 ? Crc64_SetBackend(backend) : Crc_SetBackend(backend);
+}
+
+static int BenchAll(Bool is64, const Byte *data, UInt64 *expected, int numPasses)
+{
+  unsigned numBackends = is64 ? NUM_CRC64_BACKENDS : NUM_CRC_BACKENDS;
+  const char * const *names = is64 ? g_Crc64BackendNames : g_CrcBackendNames;
+  unsigned b, k;
+
+  printf("%s: %s selected, GB/s\n\n%-8s", is64 ? "CRC64" : "CRC32",
+      names[is64 ? Crc64_GetBackend() : Crc_GetBackend()], "");
+  for (k = 0; k < NUM_BLOCK_SIZES; k++)
+    printf(" %10u", (unsigned)g_BlockSizes[k]);
+  printf("\n");
+
+  /* the first backend is the plain table loop */
+  SetBackend(is64, 0);
+  CalcExpected(is64, data, expected);
+
+  for (b = 0; b < numBackends; b++)
+  {
+    printf("%-8s", names[b]);
+    if (!SetBackend(is64, (int)b))
+    {
+      for (k = 0; k < NUM_BLOCK_SIZES; k++)
+        printf(" %10s", "-");
+      printf("\n");
+      continue;
+    }
+    if (!CheckCrc(is64, data, expected))
+    {
+      fprintf(stderr, "\nError: the %s backend doesn't match %s\n", names[b], names[0]);
+      return 1;
+    }
+    for (k = 0; k < NUM_BLOCK_SIZES; k++)
+    {
+      double t = BenchCrc(is64, data, g_BlockSizes[k], numPasses);
+      printf(" %10.2f", (double)BENCH_TOTAL_SIZE / (t <= 0 ? 1e-9 : t) / 1e9);
+    }
+    printf("\n");
+  }
+  return 0;
+}
+
+int main(int numArgs, const char *args[])
+{
+  int numPasses = 3;
+  int argIndex;
+  Byte *data;
+  UInt64 *expected;
+  size_t i;
+
+  for (argIndex = 1; argIndex < numArgs; argIndex++)
+  {
+    const char *s = args[argIndex];
+    if (s[0] == '-' && s[1] == 'n')
+      numPasses = atoi(s + 2);
+    else
+    {
+      PrintHelp();
+      return 1;
+    }
+  }
+  if (numPasses < 1)
+    numPasses = 1;
+
+  data = (Byte *)MyAlloc(BENCH_BUF_SIZE);
+  expected = (UInt64 *)MyAlloc(NUM_CHECKS * sizeof(UInt64));
+  if (data == NULL || expected == NULL)
+  {
+    fprintf(stderr, "\nError: Can not allocate memory\n");
+    return 1;
+  }
+  for (i = 0; i < BENCH_BUF_SIZE; i++)
+    data[i] = (Byte)GetRand();
+
+  CrcGenerateTable();
+  Crc64GenerateTable();
+
+  if (BenchAll(False, data, expected, numPasses) != 0)
+    return 1;
+  printf("\n");
+  if (BenchAll(True, data, expected, numPasses) != 0)
+    return 1;
+
+  MyFree(expected);
+  MyFree(data);
+  return 0;
+}
@@ -0,0 +1,509 @@
+/* HashBench.c -- file hashing benchmark
+2013-05-23 : Public domain */
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#define MY_MKDIR(name) _mkdir(name)
+#define MY_RMDIR(name) _rmdir(name)
+#define DIR_SEP "\\"
+#else
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define MY_MKDIR(name) mkdir(name, 0777)
+#define MY_RMDIR(name) rmdir(name)
+#define DIR_SEP "/"
+#endif
+
+#include "../../Alloc.h"
+#include "../../7zFile.h"
+#include "../../7zVersion.h"
+#include "../../Sha1.h"
+#include "../../Threads.h"
+
+/* the updater writes every piece it receives, and CalculateFileHash reads in 64 KB */
+#define DOWNLOAD_PIECE_SIZE (1 << 15)
+#define HASH_READ_SIZE (1 << 16)
+
+#define BENCH_BUF_SIZE ((size_t)1 << 20)
+
+#define TREE_POOL_THREADS_MAX 64
+#define TREE_PATH_MAX 1024
+
+static const char * const g_ShaBackendNames[] = { "portable", "SHA-NI" };
+
+static void PrintHelp(void)
+{
+  printf("\nHashBench " MY_VERSION_COPYRIGHT_DATE "\n"
+      "\nUsage:  hashbench <command> [<switches>] <path>\n"
+      "<Commands>\n"
+      "  d: writes a download to the file <path> in 32 KB pieces, once hashing every piece\n"
+      "     as it is written, once reading the file back in 64 KB pieces to hash it after\n"
+      "     it is written, and prints the best time of each\n"
+      "  t: writes a tree of 1 KB to 256 KB files to the new directory <path>, hashes them\n"
+      "     from mappings on 1, 2, 4, ... threads like CalculateFileHashes, prints the best\n"
+      "     files/s and MB/s of each count, and deletes the tree\n"
+      "Switches:\n"
+      "  -c:     d: drop the file from the page cache after writing it (not on Windows)\n"
+      "  -f<N>:  t: number of files (default: 10000)\n"
+      "  -n<N>:  number of passes (default: 1)\n"
+      "  -s<N>:  d: size of the download, in MB (default: 256)\n"
+      "  -t<N>:  t: maximum number of threads (default: number of CPUs)\n");
+}
+
+static int PrintError(const char *message)
+{
+  fprintf(stderr, "\nError: %s\n", message);
+  return 1;
+}
+
+static unsigned GetNumberOfProcessors(void)
+{
+  #ifdef _WIN32
+  SYSTEM_INFO si;
+  GetSystemInfo(&si);
+  return (unsigned)si.dwNumberOfProcessors;
+  #else
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return (n > 0) ? (unsigned)n : 1;
+  #endif
+}
+
+static double GetTimeSeconds(void)
+{
+  #ifdef _WIN32
+  LARGE_INTEGER freq, count;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&count);
+  return (double)count.QuadPart / (double)freq.QuadPart;
+  #else
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (double)tv.tv_sec + (double)tv.tv_usec / 1000000;
+  #endif
+}
+
+static UInt32 g_RandState = 1;
+
+static UInt32 GetRand(void)
+{
+  g_RandState = g_RandState * 1103515245 + 12345;
+  return g_RandState >> 8;
+}
+
+/* writes the data to the disk and drops it from the page cache, so reading it back hits the disk */
+static WRes DropFromCache(CSzFile *file)
+{
+  #ifdef USE_WINDOWS_FILE
+  (void)file;
+  return 0;
+  #else
+  int fd;
+  if (fflush(file->file) != 0)
+    return errno;
+  fd = fileno(file->file);
+  if (fsync(fd) != 0)
+    return errno;
+  return posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  #endif
+}
+
+/* writes size bytes of data in download pieces, hashing them as they are written if sha != NULL */
+static WRes WriteDownload(const char *path, const Byte *data, UInt64 size, Bool dropCache, CSha1 *sha)
+{
+  CSzFile file;
+  UInt64 done;
+  WRes res;
+
+  res = OutFile_Open(&file, path);
+  if (res != 0)
+    return res;
+  for (done = 0; done < size && res == 0; done += DOWNLOAD_PIECE_SIZE)
+  {
+    size_t cur = DOWNLOAD_PIECE_SIZE;
+    res = File_Write(&file, data + (size_t)(done % BENCH_BUF_SIZE), &cur);
+    if (res == 0 && cur != DOWNLOAD_PIECE_SIZE)
+      res = ENOSPC;
+    if (res == 0 && sha != NULL)
+      Sha1_Update(sha, data + (size_t)(done % BENCH_BUF_SIZE), cur);
+  }
+  if (res == 0 && dropCache)
+    res = DropFromCache(&file);
+  if (res == 0)
+    res = File_Close(&file);
+  else
+    File_Close(&file);
+  return res;
+}
+
+static WRes HashFile(const char *path, Byte *buf, CSha1 *sha)
+{
+  CSzFile file;
+  WRes res;
+
+  res = InFile_Open(&file, path);
+  if (res != 0)
+    return res;
+  for (;;)
+  {
+    size_t cur = HASH_READ_SIZE;
+    res = File_Read(&file, buf, &cur);
+    if (res != 0 || cur == 0)
+      break;
+    Sha1_Update(sha, buf, cur);
+  }
+  File_Close(&file);
+  return res;
+}
+
+/* returns the best time of numPasses downloads, or a negative value on error */
+static double BenchDownload(const char *path, const Byte *data, Byte *buf, UInt64 size,
+    Bool twoPass, Bool dropCache, int numPasses, Byte *digest)
+{
+  double best = -1;
+  int pass;
+  for (pass = 0; pass < numPasses; pass++)
+  {
+    CSha1 sha;
+    double startTime = GetTimeSeconds(), elapsed;
+    WRes res;
+    Sha1_Init(&sha);
+    res = WriteDownload(path, data, size, dropCache, twoPass ? NULL : &sha);
+    if (res == 0 && twoPass)
+      res = HashFile(path, buf, &sha);
+    if (res != 0)
+      return -1;
+    Sha1_Final(&sha, digest);
+    elapsed = GetTimeSeconds() - startTime;
+    if (best < 0 || elapsed < best)
+      best = elapsed;
+  }
+  return best;
+}
+
+static int BenchDownloads(const char *path, UInt64 size, Bool dropCache, int numPasses)
+{
+  static const char * const kModeNames[2] = { "one pass", "two pass" };
+  Byte digests[2][SHA1_DIGEST_SIZE];
+  Byte *data;
+  Byte *buf;
+  size_t i;
+  int mode;
+
+  data = (Byte *)MyAlloc(BENCH_BUF_SIZE);
+  buf = (Byte *)MyAlloc(HASH_READ_SIZE);
+  if (data == NULL || buf == NULL)
+    return PrintError("Can not allocate memory");
+  for (i = 0; i < BENCH_BUF_SIZE; i++)
+    data[i] = (Byte)GetRand();
+
+  printf("%u MB download, SHA-1: %s\n\n", (unsigned)(size >> 20), g_ShaBackendNames[Sha1_GetBackend()]);
+  printf("%-10s %10s %10s\n", "mode", "s", "MB/s");
+
+  for (mode = 0; mode < 2; mode++)
+  {
+    double t = BenchDownload(path, data, buf, size, mode != 0, dropCache, numPasses, digests[mode]);
+    if (t < 0)
+    {
+      remove(path);
+      return PrintError("Can not write or read the file");
+    }
+    printf("%-10s %10.3f %10.1f\n", kModeNames[mode], t, (double)size / (t <= 0 ? 1e-9 : t) / (1 << 20));
+  }
+  remove(path);
+
+  MyFree(buf);
+  MyFree(data);
+
+  if (memcmp(digests[0], digests[1], SHA1_DIGEST_SIZE) != 0)
+    return PrintError("The hashes of the two modes don't match");
+  return 0;
+}
+
+/* ---------- Tree ---------- */
+
+static void GetTreeFilePath(const char *dir, UInt32 index, char *path)
+{
+  sprintf(path, "%s" DIR_SEP "f%05u.dll", dir, (unsigned)index);
+}
+
+static UInt32 GetTreeFileSize(void)
+{
+  return (UInt32)1 << (10 + GetRand() % 9);
+}
+
+static WRes WriteTree(const char *dir, UInt32 numFiles, const Byte *data, UInt64 *totalSize)
+{
+  UInt32 i;
+  if (MY_MKDIR(dir) != 0)
+    return errno;
+  *totalSize = 0;
+  for (i = 0; i < numFiles; i++)
+  {
+    char path[TREE_PATH_MAX];
+    CSzFile file;
+    size_t size = GetTreeFileSize();
+    size_t cur = size;
+    WRes res;
+    GetTreeFilePath(dir, i, path);
+    res = OutFile_Open(&file, path);
+    if (res != 0)
+      return res;
+    res = File_Write(&file, data + GetRand() % (BENCH_BUF_SIZE - size + 1), &cur);
+    File_Close(&file);
+    if (res == 0 && cur != size)
+      res = ENOSPC;
+    if (res != 0)
+      return res;
+    *totalSize += size;
+  }
+  return 0;
+}
+
+static void DeleteTree(const char *dir, UInt32 numFiles)
+{
+  UInt32 i;
+  for (i = 0; i < numFiles; i++)
+  {
+    char path[TREE_PATH_MAX];
+    GetTreeFilePath(dir, i, path);
+    remove(path);
+  }
+  MY_RMDIR(dir);
+}
+
+/* the threads claim the files in order, like the updater's hash workers */
+typedef struct
+{
+  const char *dir;
+  Byte *digests;
+  CCriticalSection cs;
+  UInt32 numFiles;
+  UInt32 nextFile;
+  WRes res;
+} CTreePool;
+
+static WRes HashMappedFile(const char *path, Byte *digest)
+{
+  CSzFile file;
+  CMappedInStream mappedStream;
+  CSha1 sha;
+  WRes res;
+
+  res = InFile_Open(&file, path);
+  if (res != 0)
+    return res;
+  MappedInStream_Construct(&mappedStream);
+  res = MappedInStream_Open(&mappedStream, &file);
+  File_Close(&file);
+  if (res != 0)
+    return res;
+  Sha1_Init(&sha);
+  Sha1_Update(&sha, mappedStream.data, (size_t)mappedStream.size);
+  Sha1_Final(&sha, digest);
+  return MappedInStream_Close(&mappedStream);
+}
+
+static THREAD_FUNC_RET_TYPE THREAD_FUNC_CALL_TYPE TreePool_ThreadFunc(void *pp)
+{
+  CTreePool *p = (CTreePool *)pp;
+  WRes res = 0;
+
+  while (res == 0)
+  {
+    char path[TREE_PATH_MAX];
+    UInt32 index;
+    CriticalSection_Enter(&p->cs);
+    index = (p->res == 0 ? p->nextFile++ : p->numFiles);
+    CriticalSection_Leave(&p->cs);
+    if (index >= p->numFiles)
+      break;
+    GetTreeFilePath(p->dir, index, path);
+    res = HashMappedFile(path, p->digests + (size_t)index * SHA1_DIGEST_SIZE);
+  }
+
+  CriticalSection_Enter(&p->cs);
+  if (p->res == 0)
+    p->res = res;
+  CriticalSection_Leave(&p->cs);
+  return 0;
+}
+
+static WRes BenchTreePool(const char *dir, UInt32 numFiles, unsigned numThreads, Byte *digests, double *time)
+{
+  CTreePool p;
+  CThread threads[TREE_POOL_THREADS_MAX];
+  double startTime;
+  unsigned i;
+
+  p.dir = dir;
+  p.digests = digests;
+  p.numFiles = numFiles;
+  p.nextFile = 0;
+  p.res = 0;
+  if (CriticalSection_Init(&p.cs) != 0)
+    return ENOMEM;
+
+  startTime = GetTimeSeconds();
+  for (i = 0; i < numThreads; i++)
+  {
+    Thread_Construct(&threads[i]);
+    if (Thread_Create(&threads[i], TreePool_ThreadFunc, &p) != 0)
+    {
+      p.res = EAGAIN;
+      break;
+    }
+  }
+  numThreads = i;
+  for (i = 0; i < numThreads; i++)
+  {
+    Thread_Wait(&threads[i]);
+    Thread_Close(&threads[i]);
+  }
+  *time = GetTimeSeconds() - startTime;
+
+  CriticalSection_Delete(&p.cs);
+  return p.res;
+}
+
+/* 1, 2, 4, ... and then maxThreads */
+static unsigned NextThreadCount(unsigned n, unsigned maxThreads)
+{
+  return (n < maxThreads && n * 2 > maxThreads) ? maxThreads : n * 2;
+}
+
+static int BenchTree(const char *dir, UInt32 numFiles, unsigned maxThreads, int numPasses)
+{
+  Byte *data;
+  Byte *digests;
+  Byte *expected;
+  UInt64 totalSize;
+  unsigned numThreads;
+  size_t i;
+  int ret = 0;
+
+  data = (Byte *)MyAlloc(BENCH_BUF_SIZE);
+  digests = (Byte *)MyAlloc((size_t)numFiles * SHA1_DIGEST_SIZE);
+  expected = (Byte *)MyAlloc((size_t)numFiles * SHA1_DIGEST_SIZE);
+  if (data == NULL || digests == NULL || expected == NULL)
+    return PrintError("Can not allocate memory");
+  for (i = 0; i < BENCH_BUF_SIZE; i++)
+    data[i] = (Byte)GetRand();
+
+  if (WriteTree(dir, numFiles, data, &totalSize) != 0)
+  {
+    DeleteTree(dir, numFiles);
+    return PrintError("Can not write the tree");
+  }
+
+  printf("%u files, %u MB, SHA-1: %s\n\n", (unsigned)numFiles, (unsigned)(totalSize >> 20),
+      g_ShaBackendNames[Sha1_GetBackend()]);
+  printf("%-10s %10s %10s %10s\n", "threads", "s", "files/s", "MB/s");
+
+  for (numThreads = 1; numThreads <= maxThreads; numThreads = NextThreadCount(numThreads, maxThreads))
+  {
+    double best = -1;
+    int pass;
+    for (pass = 0; pass < numPasses; pass++)
+    {
+      double t;
+      if (BenchTreePool(dir, numFiles, numThreads, digests, &t) != 0)
+      {
+        ret = PrintError("Can not hash the tree");
+        break;
+      }
+      /* the first run is the reference for the others */
+      if (numThreads == 1 && pass == 0)
+        memcpy(expected, digests, (size_t)numFiles * SHA1_DIGEST_SIZE);
+      else if (memcmp(expected, digests, (size_t)numFiles * SHA1_DIGEST_SIZE) != 0)
+      {
+        ret = PrintError("The hashes of the thread counts don't match");
+        break;
+      }
+      if (best < 0 || t < best)
+        best = t;
+    }
+    if (ret != 0)
+      break;
+    if (best <= 0)
+      best = 1e-9;
+    printf("%-10u %10.3f %10.0f %10.1f\n", numThreads, best,
+        (double)numFiles / best, (double)totalSize / best / (1 << 20));
+  }
+  DeleteTree(dir, numFiles);
+
+  MyFree(expected);
+  MyFree(digests);
+  MyFree(data);
+  return ret;
+}
+
+int main(int numArgs, const char *args[])
+{
+  int numPasses = 1;
+  UInt64 size = (UInt64)256 << 20;
+  Bool dropCache = False;
+  UInt32 numFiles = 10000;
+  unsigned maxThreads = GetNumberOfProcessors();
+  const char *path = NULL;
+  int argIndex;
+  char command;
+
+  if (numArgs < 3 || (strcmp(args[1], "d") != 0 && strcmp(args[1], "t") != 0))
+  {
+    PrintHelp();
+    return 1;
+  }
+  command = args[1][0];
+  for (argIndex = 2; argIndex < numArgs; argIndex++)
+  {
+    const char *s = args[argIndex];
+    if (s[0] == '-' && s[1] == 'c' && s[2] == 0)
+      dropCache = True;
+    else if (s[0] == '-' && s[1] == 'f')
+      numFiles = (UInt32)atoi(s + 2);
+    else if (s[0] == '-' && s[1] == 'n')
+      numPasses = atoi(s + 2);
+    else if (s[0] == '-' && s[1] == 's')
+      size = (UInt64)atoi(s + 2) << 20;
+    else if (s[0] == '-' && s[1] == 't')
+      maxThreads = (unsigned)atoi(s + 2);
+    else if (s[0] != '-' && path == NULL)
+      path = s;
+    else
+    {
+      PrintHelp();
+      return 1;
+    }
+  }
+  if (path == NULL || strlen(path) > TREE_PATH_MAX - 16)
+  {
+    PrintHelp();
+    return 1;
+  }
+  if (numPasses < 1)
+    numPasses = 1;
+  if (size < BENCH_BUF_SIZE)
+    size = BENCH_BUF_SIZE;
+  if (numFiles < 1 || numFiles > 99999)
+    numFiles = 10000;
+  if (maxThreads < 1)
+    maxThreads = 1;
+  if (maxThreads > TREE_POOL_THREADS_MAX)
+    maxThreads = TREE_POOL_THREADS_MAX;
+
+  Sha1Prepare();
+  if (command == 't')
+    return BenchTree(path, numFiles, maxThreads, numPasses);
+  return BenchDownloads(path, size, dropCache, numPasses);
+}
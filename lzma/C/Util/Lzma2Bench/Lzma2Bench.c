@@ -0,0 +1,235 @@
+/* Lzma2Bench.c -- Multi-thread LZMA2 decoding benchmark
+2013-05-20 : Public domain */
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+#include "../../Alloc.h"
+#include "../../7zFile.h"
+#include "../../7zVersion.h"
+#include "../../Lzma2DecMt.h"
+#include "../../Lzma2Enc.h"
+
+static void *SzAlloc(void *p, size_t size) { p = p; return MyAlloc(size); }
+static void SzFree(void *p, void *address) { p = p; MyFree(address); }
+static ISzAlloc g_Alloc = { SzAlloc, SzFree };
+
+static void *SzBigAlloc(void *p, size_t size) { p = p; return BigAlloc(size); }
+static void SzBigFree(void *p, void *address) { p = p; BigFree(address); }
+static ISzAlloc g_BigAlloc = { SzBigAlloc, SzBigFree };
+
+static void PrintHelp(void)
+{
+  printf("\nLzma2Bench " MY_VERSION_COPYRIGHT_DATE "\n"
+      "\nUsage:  lzma2bench [<switches>] inputFile\n"
+      "  Encodes the file with Lzma2Enc in blocks, then decodes it with 1, 2, 4, ... threads\n"
+      "  and prints the decoding speeds.\n"
+      "Switches:\n"
+      "  -mt<N>: maximum number of decoding threads (default: number of CPUs)\n"
+      "  -et<N>: number of encoding threads, the blocks are the same for any value (default: -mt)\n"
+      "  -x<N>:  compression level, 0-9 (default: 5)\n"
+      "  -b<N>:  block size in MB (default: 4 * dictionary size)\n");
+}
+
+static int PrintError(const char *message)
+{
+  fprintf(stderr, "\nError: %s\n", message);
+  return 1;
+}
+
+static unsigned GetNumberOfProcessors(void)
+{
+  #ifdef _WIN32
+  SYSTEM_INFO si;
+  GetSystemInfo(&si);
+  return (unsigned)si.dwNumberOfProcessors;
+  #else
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return (n > 0) ? (unsigned)n : 1;
+  #endif
+}
+
+static double GetTimeSeconds(void)
+{
+  #ifdef _WIN32
+  LARGE_INTEGER freq, count;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&count);
+  return (double)count.QuadPart / (double)freq.QuadPart;
+  #else
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (double)tv.tv_sec + (double)tv.tv_usec / 1000000;
+  #endif
+}
+
+typedef struct
+{
+  ISeqInStream s;
+  const Byte *data;
+  size_t rem;
+} CBufInStream;
+
+static SRes BufInStream_Read(void *pp, void *buf, size_t *size)
+{
+  CBufInStream *p = (CBufInStream *)pp;
+  if (*size > p->rem)
+    *size = p->rem;
+  memcpy(buf, p->data, *size);
+  p->data += *size;
+  p->rem -= *size;
+  return SZ_OK;
+}
+
+typedef struct
+{
+  ISeqOutStream s;
+  Byte *data;
+  size_t size;
+  size_t pos;
+} CBufOutStream;
+
+static size_t BufOutStream_Write(void *pp, const void *buf, size_t size)
+{
+  CBufOutStream *p = (CBufOutStream *)pp;
+  if (size > p->size - p->pos)
+    size = p->size - p->pos;
+  memcpy(p->data + p->pos, buf, size);
+  p->pos += size;
+  return size;
+}
+
+/* the output buffer is big enough for incompressible data: the copy chunks add 3 bytes per 64 KB */
+static SRes Encode(const CLzma2EncProps *props, const Byte *src, size_t srcSize,
+    Byte *dest, size_t *destSize, Byte *prop)
+{
+  CBufInStream inStream;
+  CBufOutStream outStream;
+  SRes res;
+  CLzma2EncHandle enc = Lzma2Enc_Create(&g_Alloc, &g_BigAlloc);
+  if (enc == 0)
+    return SZ_ERROR_MEM;
+  inStream.s.Read = BufInStream_Read;
+  inStream.data = src;
+  inStream.rem = srcSize;
+  outStream.s.Write = BufOutStream_Write;
+  outStream.data = dest;
+  outStream.size = *destSize;
+  outStream.pos = 0;
+  res = Lzma2Enc_SetProps(enc, props);
+  if (res == SZ_OK)
+  {
+    *prop = Lzma2Enc_WriteProperties(enc);
+    res = Lzma2Enc_Encode(enc, &outStream.s, &inStream.s, NULL);
+  }
+  Lzma2Enc_Destroy(enc);
+  *destSize = outStream.pos;
+  return res;
+}
+
+int main(int numArgs, const char *args[])
+{
+  CLzma2EncProps props;
+  CSzFile file;
+  UInt64 fileSize = 0;
+  size_t size, packSize;
+  Byte *data, *packed, *unpacked;
+  unsigned maxThreads = GetNumberOfProcessors(), numThreads;
+  int encThreads = 0;
+  int argIndex;
+  Byte prop;
+  double startTime;
+  SRes res;
+
+  Lzma2EncProps_Init(&props);
+  for (argIndex = 1; argIndex < numArgs && args[argIndex][0] == '-'; argIndex++)
+  {
+    const char *s = args[argIndex] + 1;
+    if (strncmp(s, "mt", 2) == 0)
+      maxThreads = (unsigned)atoi(s + 2);
+    else if (strncmp(s, "et", 2) == 0)
+      encThreads = atoi(s + 2);
+    else if (s[0] == 'x')
+      props.lzmaProps.level = atoi(s + 1);
+    else if (s[0] == 'b')
+      props.blockSize = (size_t)atoi(s + 1) << 20;
+    else
+    {
+      PrintHelp();
+      return 1;
+    }
+  }
+  if (numArgs - argIndex != 1)
+  {
+    PrintHelp();
+    return numArgs == 1 ? 0 : 1;
+  }
+  if (maxThreads == 0)
+    maxThreads = 1;
+
+  File_Construct(&file);
+  if (InFile_Open(&file, args[argIndex]) != 0)
+    return PrintError("Can not open input file");
+  File_GetLength(&file, &fileSize);
+  size = (size_t)fileSize;
+  if (size != fileSize)
+    return PrintError("The file is too big");
+  packSize = size + (size >> 10) + (1 << 16);
+  data = (Byte *)MyAlloc(size + 1);
+  packed = (Byte *)MyAlloc(packSize);
+  unpacked = (Byte *)MyAlloc(size + 1);
+  if (data == 0 || packed == 0 || unpacked == 0)
+    return PrintError("Can not allocate memory");
+  if (File_Read(&file, data, &size) != 0 || size != fileSize)
+    return PrintError("Can not read input file");
+  File_Close(&file);
+
+  /* every block of the multi-thread encoder starts with a dictionary reset */
+  props.numBlockThreads = (encThreads > 0) ? encThreads : (int)maxThreads;
+  if (props.numBlockThreads < 2)
+    props.numBlockThreads = 2;
+  Lzma2EncProps_Normalize(&props);
+
+  startTime = GetTimeSeconds();
+  res = Encode(&props, data, size, packed, &packSize, &prop);
+  if (res != SZ_OK)
+    return PrintError("Encoding error");
+  printf("unpacked: %.0f bytes, packed: %.0f bytes, block: %u KB, encoded in %.3f s\n\n",
+      (double)size, (double)packSize, (unsigned)(props.blockSize >> 10), GetTimeSeconds() - startTime);
+
+  printf("threads   time (s)     MB/s\n");
+  for (numThreads = 1;; numThreads <<= 1)
+  {
+    double elapsed;
+    if (numThreads > maxThreads)
+      numThreads = maxThreads;
+    memset(unpacked, 0, size);
+    startTime = GetTimeSeconds();
+    res = Lzma2DecMt_Decode(unpacked, size, packed, packSize, prop, numThreads, &g_Alloc);
+    elapsed = GetTimeSeconds() - startTime;
+    if (res != SZ_OK)
+      return PrintError("Decoding error");
+    if (memcmp(unpacked, data, size) != 0)
+      return PrintError("Decoded data differs from the input");
+    if (elapsed <= 0)
+      elapsed = 1e-6;
+    printf("%7u %10.3f %8.2f\n", numThreads, elapsed, (double)size / elapsed / 1000000);
+    if (numThreads >= maxThreads)
+      break;
+  }
+
+  MyFree(data);
+  MyFree(packed);
+  MyFree(unpacked);
+  return 0;
+}
@@ -0,0 +1,178 @@
+/* LzmaDecBench.c -- LZMA decoding benchmark over a set of files
+2013-05-20 : Public domain */
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/time.h>
+#endif
+
+#include "../../Alloc.h"
+#include "../../7zFile.h"
+#include "../../7zVersion.h"
+#include "../../LzmaDec.h"
+#include "../../LzmaEnc.h"
+
+static void *SzAlloc(void *p, size_t size) { p = p; return MyAlloc(size); }
+static void SzFree(void *p, void *address) { p = p; MyFree(address); }
+static ISzAlloc g_Alloc = { SzAlloc, SzFree };
+
+static void *SzBigAlloc(void *p, size_t size) { p = p; return BigAlloc(size); }
+static void SzBigFree(void *p, void *address) { p = p; BigFree(address); }
+static ISzAlloc g_BigAlloc = { SzBigAlloc, SzBigFree };
+
+static void PrintHelp(void)
+{
+  printf("\nLzmaDecBench " MY_VERSION_COPYRIGHT_DATE "\n"
+      "\nUsage:  lzmadecbench [<switches>] file1 [file2 ...]\n"
+      "  Encodes every file with LzmaEnc, decodes it several times with LzmaDecode\n"
+      "  and prints the best decoding speed for each file and for all of them.\n"
+      "Switches:\n"
+      "  -x<N>:  compression level, 0-9 (default: 5)\n"
+      "  -lc<N>, -lp<N>, -pb<N>: literal context, literal position and position bits (default: 3, 0, 2)\n"
+      "  -n<N>:  number of decoding passes per file (default: 5)\n");
+}
+
+static double GetTimeSeconds(void)
+{
+  #ifdef _WIN32
+  LARGE_INTEGER freq, count;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&count);
+  return (double)count.QuadPart / (double)freq.QuadPart;
+  #else
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (double)tv.tv_sec + (double)tv.tv_usec / 1000000;
+  #endif
+}
+
+static Byte *ReadFile(const char *name, size_t *size)
+{
+  CSzFile file;
+  UInt64 fileSize = 0;
+  Byte *data;
+  File_Construct(&file);
+  if (InFile_Open(&file, name) != 0)
+    return NULL;
+  File_GetLength(&file, &fileSize);
+  *size = (size_t)fileSize;
+  data = (*size == fileSize) ? (Byte *)MyAlloc(*size + 1) : NULL;
+  if (data != NULL && (File_Read(&file, data, size) != 0 || *size != fileSize))
+  {
+    MyFree(data);
+    data = NULL;
+  }
+  File_Close(&file);
+  return data;
+}
+
+/* returns the best decoding time, or a negative value on error */
+static double BenchFile(const CLzmaEncProps *props, const Byte *data, size_t size, int numPasses, size_t *packSizeRes)
+{
+  SizeT packSize = size + (size >> 2) + (1 << 16);
+  Byte propsEncoded[LZMA_PROPS_SIZE];
+  SizeT propsSize = LZMA_PROPS_SIZE;
+  Byte *packed = (Byte *)MyAlloc(packSize);
+  Byte *unpacked = (Byte *)MyAlloc(size + 1);
+  double best = -1;
+  int pass;
+
+  if (packed != NULL && unpacked != NULL &&
+      LzmaEncode(packed, &packSize, data, size, props, propsEncoded, &propsSize, 0,
+        NULL, &g_Alloc, &g_BigAlloc) == SZ_OK)
+  {
+    for (pass = 0; pass < numPasses; pass++)
+    {
+      SizeT destLen = size, srcLen = packSize;
+      ELzmaStatus status;
+      double startTime = GetTimeSeconds(), elapsed;
+      SRes res = LzmaDecode(unpacked, &destLen, packed, &srcLen, propsEncoded, (unsigned)propsSize,
+          LZMA_FINISH_END, &status, &g_Alloc);
+      elapsed = GetTimeSeconds() - startTime;
+      if (res != SZ_OK || destLen != size || memcmp(unpacked, data, size) != 0)
+      {
+        best = -1;
+        break;
+      }
+      if (best < 0 || elapsed < best)
+        best = elapsed;
+    }
+  }
+  *packSizeRes = packSize;
+  MyFree(packed);
+  MyFree(unpacked);
+  return best;
+}
+
+int main(int numArgs, const char *args[])
+{
+  CLzmaEncProps props;
+  int numPasses = 5;
+  int argIndex;
+  double totalSize = 0, totalPackSize = 0, totalTime = 0;
+
+  LzmaEncProps_Init(&props);
+  for (argIndex = 1; argIndex < numArgs && args[argIndex][0] == '-'; argIndex++)
+  {
+    const char *s = args[argIndex] + 1;
+    if (strncmp(s, "lc", 2) == 0)
+      props.lc = atoi(s + 2);
+    else if (strncmp(s, "lp", 2) == 0)
+      props.lp = atoi(s + 2);
+    else if (strncmp(s, "pb", 2) == 0)
+      props.pb = atoi(s + 2);
+    else if (s[0] == 'x')
+      props.level = atoi(s + 1);
+    else if (s[0] == 'n')
+      numPasses = atoi(s + 1);
+    else
+    {
+      PrintHelp();
+      return 1;
+    }
+  }
+  if (argIndex == numArgs)
+  {
+    PrintHelp();
+    return numArgs == 1 ? 0 : 1;
+  }
+  if (numPasses < 1)
+    numPasses = 1;
+
+  printf("%12s %12s %10s  %s\n", "size", "packed", "MB/s", "file");
+  for (; argIndex < numArgs; argIndex++)
+  {
+    size_t size = 0, packSize = 0;
+    double elapsed;
+    Byte *data = ReadFile(args[argIndex], &size);
+    if (data == NULL)
+    {
+      fprintf(stderr, "\nError: Can not read %s\n", args[argIndex]);
+      return 1;
+    }
+    elapsed = BenchFile(&props, data, size, numPasses, &packSize);
+    MyFree(data);
+    if (elapsed < 0)
+    {
+      fprintf(stderr, "\nError: Encoding or decoding failed for %s\n", args[argIndex]);
+      return 1;
+    }
+    if (elapsed <= 0)
+      elapsed = 1e-6;
+    printf("%12.0f %12.0f %10.2f  %s\n", (double)size, (double)packSize, (double)size / elapsed / 1000000, args[argIndex]);
+    totalSize += (double)size;
+    totalPackSize += (double)packSize;
+    totalTime += elapsed;
+  }
+  if (totalTime <= 0)
+    totalTime = 1e-6;
+  printf("%12.0f %12.0f %10.2f  total\n", totalSize, totalPackSize, totalSize / totalTime / 1000000);
+  return 0;
+}
@@ -179,6 +179,14 @@ SOURCE=..\..\Lzma2Dec.h
 # End Source File
 # Begin Source File
 
+SOURCE=..\..\Lzma2DecMt.c
+# End Source File
+# Begin Source File
+
+SOURCE=..\..\Lzma2DecMt.h
+# End Source File
+# Begin Source File
+
 SOURCE=..\..\LzmaDec.c
 # End Source File
 # Begin Source File
@@ -187,6 +195,14 @@ SOURCE=..\..\LzmaDec.h
 # End Source File
 # Begin Source File
 
+SOURCE=..\..\Threads.c
+# End Source File
+# Begin Source File
+
+SOURCE=..\..\Threads.h
+# End Source File
+# Begin Source File
+
 SOURCE=..\..\Types.h
 # End Source File
 # End Group
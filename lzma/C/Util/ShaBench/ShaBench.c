@@ -0,0 +1,265 @@
+/* ShaBench.c -- SHA-1 and SHA-256 speed benchmark
+2013-05-20 : Public domain */
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/time.h>
+#endif
+
+#include "../../Alloc.h"
+#include "../../7zVersion.h"
+#include "../../Sha1.h"
+#include "../../Sha256.h"
+
+#define NUM_SHA_BACKENDS 2
+
+#define BENCH_BUF_SIZE ((size_t)1 << 20)
+
+#define NUM_CHECKS 1000
+
+static const char * const g_ShaBackendNames[NUM_SHA_BACKENDS] = { "portable", "SHA-NI" };
+
+static void PrintHelp(void)
+{
+  printf("\nShaBench " MY_VERSION_COPYRIGHT_DATE "\n"
+      "\nUsage:  shabench [<switches>]\n"
+      "  Checks the SHA-1 and SHA-256 code on the FIPS 180 test message, checks every\n"
+      "  backend this build and CPU support against the portable code on random lengths,\n"
+      "  alignments and split points, then prints the best speed of each one.\n"
+      "Switches:\n"
+      "  -n<N>:  number of passes (default: 1)\n"
+      "  -s<N>:  size to hash in every pass, in MB (default: 2048)\n");
+}
+
+static double GetTimeSeconds(void)
+{
+  #ifdef _WIN32
+  LARGE_INTEGER freq, count;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&count);
+  return (double)count.QuadPart / (double)freq.QuadPart;
+  #else
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (double)tv.tv_sec + (double)tv.tv_usec / 1000000;
+  #endif
+}
+
+static UInt32 g_RandState = 1;
+
+static UInt32 GetRand(void)
+{
+  g_RandState = g_RandState * 1103515245 + 12345;
+  return g_RandState >> 8;
+}
+
+/* the lengths, alignments and split points are the same for every backend */
+static void GetCheck(unsigned index, size_t *offset, size_t *size, size_t *split)
+{
+  *offset = GetRand() % 64;
+  *size = GetRand() % (index < NUM_CHECKS / 2 ? 300 : 100000);
+  *split = GetRand() % (*size + 1);
+}
+
+/* SHA-1 (is256 = False) or SHA-256 of data, updated in two parts at split */
+static void CalcSha(Bool is256, const Byte *data, size_t size, size_t split, Byte *digest)
+{
+  if (is256)
+  {
+    CSha256 sha;
+    Sha256_Init(&sha);
+    Sha256_Update(&sha, data, split);
+    Sha256_Update(&sha, data + split, size - split);
+    Sha256_Final(&sha, digest);
+  }
+  else
+  {
+    CSha1 sha;
+    Sha1_Init(&sha);
+    Sha1_Update(&sha, data, split);
+    Sha1_Update(&sha, data + split, size - split);
+    Sha1_Final(&sha, digest);
+  }
+}
+
+static void CalcExpected(Bool is256, const Byte *data, Byte *expected)
+{
+  unsigned i;
+  g_RandState = 1;
+  for (i = 0; i < NUM_CHECKS; i++)
+  {
+    size_t offset, size, split;
+    GetCheck(i, &offset, &size, &split);
+    CalcSha(is256, data + offset, size, size, expected + i * SHA256_DIGEST_SIZE);
+  }
+}
+
+static Bool CheckSha(Bool is256, const Byte *data, const Byte *expected)
+{
+  size_t digestSize = is256 ? SHA256_DIGEST_SIZE : SHA1_DIGEST_SIZE;
+  unsigned i;
+  g_RandState = 1;
+  for (i = 0; i < NUM_CHECKS; i++)
+  {
+    size_t offset, size, split;
+    Byte digest[SHA256_DIGEST_SIZE];
+    GetCheck(i, &offset, &size, &split);
+    CalcSha(is256, data + offset, size, split, digest);
+    if (memcmp(digest, expected + i * SHA256_DIGEST_SIZE, digestSize) != 0)
+      return False;
+  }
+  return True;
+}
+
+/* "abc" from FIPS 180-2, appendix A and B */
+static Bool CheckTestMessage(Bool is256)
+{
+  static const Byte kSha1[SHA1_DIGEST_SIZE] =
+  {
+    0xa9, 0x99, 0x3e, 0x36, 0x47, 0x06, 0x81, 0x6a, 0xba, 0x3e,
+    0x25, 0x71, 0x78, 0x50, 0xc2, 0x6c, 0x9c, 0xd0, 0xd8, 0x9d
+  };
+  static const Byte kSha256[SHA256_DIGEST_SIZE] =
+  {
+    0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+    0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c, 0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad
+  };
+  Byte digest[SHA256_DIGEST_SIZE];
+  CalcSha(is256, (const Byte *)"abc", 3, 1, digest);
+  if (is256)
+    return memcmp(digest, kSha256, SHA256_DIGEST_SIZE) == 0;
+  return memcmp(digest, kSha1, SHA1_DIGEST_SIZE) == 0;
+}
+
+static double BenchSha(Bool is256, const Byte *data, UInt64 totalSize, int numPasses)
+{
+  double best = -1;
+  int pass;
+  for (pass = 0; pass < numPasses; pass++)
+  {
+    CSha1 sha1;
+    CSha256 sha256;
+    Byte digest[SHA256_DIGEST_SIZE];
+    UInt64 done;
+    double startTime = GetTimeSeconds(), elapsed;
+    Sha1_Init(&sha1);
+    Sha256_Init(&sha256);
+    for (done = 0; done < totalSize; done += BENCH_BUF_SIZE)
+    {
+      if (is256)
+        Sha256_Update(&sha256, data, BENCH_BUF_SIZE);
+      else
+        Sha1_Update(&sha1, data, BENCH_BUF_SIZE);
+    }
+    if (is256)
+      Sha256_Final(&sha256, digest);
+    else
+      Sha1_Final(&sha1, digest);
+    elapsed = GetTimeSeconds() - startTime;
+    /* keep the result alive */
+    if (digest[0] == 0 && digest[1] == 0)
+      elapsed += 1e-9;
+    if (best < 0 || elapsed < best)
+      best = elapsed;
+  }
+  return best;
+}
+
+static Bool SetBackend(Bool is256, int backend)
+{
+  return is256 ? Sha256_SetBackend(backend) : Sha1_SetBackend(backend);
+}
+
+static int BenchAll(Bool is256, const Byte *data, Byte *expected, UInt64 totalSize, int numPasses)
+{
+  const char *name = is256 ? "SHA-256" : "SHA-1";
+  unsigned b;
+
+  if (is256)
+    Sha256Prepare();
+  else
+    Sha1Prepare();
+  printf("%s: %s selected, GB/s\n\n", name, g_ShaBackendNames[is256 ? Sha256_GetBackend() : Sha1_GetBackend()]);
+
+  SetBackend(is256, SHA_BACKEND_PORTABLE);
+  if (!CheckTestMessage(is256))
+  {
+    fprintf(stderr, "\nError: the %s code doesn't match the test message\n", name);
+    return 1;
+  }
+  CalcExpected(is256, data, expected);
+
+  for (b = 0; b < NUM_SHA_BACKENDS; b++)
+  {
+    double t;
+    printf("%-10s", g_ShaBackendNames[b]);
+    if (!SetBackend(is256, (int)b))
+    {
+      printf(" %10s\n", "-");
+      continue;
+    }
+    if (!CheckSha(is256, data, expected))
+    {
+      fprintf(stderr, "\nError: the %s backend doesn't match %s\n", g_ShaBackendNames[b], g_ShaBackendNames[0]);
+      return 1;
+    }
+    t = BenchSha(is256, data, totalSize, numPasses);
+    printf(" %10.2f\n", (double)totalSize / (t <= 0 ? 1e-9 : t) / 1e9);
+  }
+  return 0;
+}
+
+int main(int numArgs, const char *args[])
+{
+  int numPasses = 1;
+  UInt64 totalSize = (UInt64)2048 << 20;
+  int argIndex;
+  Byte *data;
+  Byte *expected;
+  size_t i;
+
+  for (argIndex = 1; argIndex < numArgs; argIndex++)
+  {
+    const char *s = args[argIndex];
+    if (s[0] == '-' && s[1] == 'n')
+      numPasses = atoi(s + 2);
+    else if (s[0] == '-' && s[1] == 's')
+      totalSize = (UInt64)atoi(s + 2) << 20;
+    else
+    {
+      PrintHelp();
+      return 1;
+    }
+  }
+  if (numPasses < 1)
+    numPasses = 1;
+  if (totalSize < BENCH_BUF_SIZE)
+    totalSize = BENCH_BUF_SIZE;
+
+  data = (Byte *)MyAlloc(BENCH_BUF_SIZE);
+  expected = (Byte *)MyAlloc(NUM_CHECKS * SHA256_DIGEST_SIZE);
+  if (data == NULL || expected == NULL)
+  {
+    fprintf(stderr, "\nError: Can not allocate memory\n");
+    return 1;
+  }
+  for (i = 0; i < BENCH_BUF_SIZE; i++)
+    data[i] = (Byte)GetRand();
+
+  if (BenchAll(False, data, expected, totalSize, numPasses) != 0)
+    return 1;
+  printf("\n");
+  if (BenchAll(True, data, expected, totalSize, numPasses) != 0)
+    return 1;
+
+  MyFree(expected);
+  MyFree(data);
+  return 0;
+}
@@ -0,0 +1,363 @@
+/* XzUtil.c -- Encodes, decodes and tests xz files
+2013-05-20 : Public domain */
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+#include "../../Alloc.h"
+#include "../../7zCrc.h"
+#include "../../7zFile.h"
+#include "../../7zVersion.h"
+#include "../../Sha256.h"
+#include "../../XzCrc64.h"
+#include "../../XzDecMt.h"
+#include "../../XzEnc.h"
+
+static void *SzAlloc(void *p, size_t size) { p = p; return MyAlloc(size); }
+static void SzFree(void *p, void *address) { p = p; MyFree(address); }
+static ISzAlloc g_Alloc = { SzAlloc, SzFree };
+
+static void *SzBigAlloc(void *p, size_t size) { p = p; return BigAlloc(size); }
+static void SzBigFree(void *p, void *address) { p = p; BigFree(address); }
+static ISzAlloc g_BigAlloc = { SzBigAlloc, SzBigFree };
+
+static void PrintHelp(void)
+{
+  printf("\nXz Utility " MY_VERSION_COPYRIGHT_DATE "\n"
+      "\nUsage:  xz e [<switches>] inputFile outputFile\n"
+             "        xz d [-mt<N>] [-c<B>] inputFile outputFile\n"
+             "        xz t [-mt<N>] [-c<B>] inputFile\n"
+             "        xz b [<switches>] inputFile\n"
+             "  e:   encode file\n"
+             "  d:   decode file\n"
+             "  t:   test file, and print the decoding speed\n"
+             "  b:   encode file with 1, 2, 4, ... threads, and print the encoding speeds\n"
+             "Switches:\n"
+             "  -mt<N>: number of threads (default: number of CPUs)\n"
+             "  -x<N>:  compression level, 0-9 (default: 5)\n"
+             "  -b<N>:  block size in MB (default: 4 * dictionary size)\n"
+             "  -m<N>:  memory limit for the encoder threads in MB\n"
+             "  -c<B>:  CRC64 code for d and t: t1, t8 or clmul (default: the fastest)\n");
+}
+
+static const char * const g_Crc64BackendNames[] = { "t1", "t8", "clmul" };
+
+static int PrintError(const char *message, const char *name)
+{
+  fprintf(stderr, "\nError: %s: %s\n", message, name);
+  return 1;
+}
+
+static const char *GetErrorMessage(SRes res)
+{
+  switch (res)
+  {
+    case SZ_ERROR_NO_ARCHIVE: return "Is not xz file";
+    case SZ_ERROR_ARCHIVE: return "Headers error";
+    case SZ_ERROR_DATA: return "Data error";
+    case SZ_ERROR_CRC: return "CRC error";
+    case SZ_ERROR_UNSUPPORTED: return "Unsupported method";
+    case SZ_ERROR_MEM: return "Can not allocate memory";
+    case SZ_ERROR_INPUT_EOF: return "Unexpected end of data";
+    case SZ_ERROR_READ: return "Can not read input file";
+    case SZ_ERROR_WRITE: return "Can not write output file";
+    case SZ_ERROR_THREAD: return "Can not create thread";
+  }
+  return "Error";
+}
+
+static unsigned GetNumberOfProcessors(void)
+{
+  #ifdef _WIN32
+  SYSTEM_INFO si;
+  GetSystemInfo(&si);
+  return (unsigned)si.dwNumberOfProcessors;
+  #else
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return (n > 0) ? (unsigned)n : 1;
+  #endif
+}
+
+static double GetTimeSeconds(void)
+{
+  #ifdef _WIN32
+  LARGE_INTEGER freq, count;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&count);
+  return (double)count.QuadPart / (double)freq.QuadPart;
+  #else
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (double)tv.tv_sec + (double)tv.tv_usec / 1000000;
+  #endif
+}
+
+/* counts and drops the output of the t command */
+
+typedef struct
+{
+  ISeqOutStream s;
+  UInt64 size;
+} CNullOutStream;
+
+static size_t NullOutStream_Write(void *pp, const void *data, size_t size)
+{
+  CNullOutStream *p = (CNullOutStream *)pp;
+  data = data;
+  p->size += size;
+  return size;
+}
+
+/* ---------- Encoder ---------- */
+
+typedef struct
+{
+  int numThreads;
+  int level;
+  size_t blockSize;
+  UInt64 memUsageMax;
+} CEncodeArgs;
+
+static SRes Encode(const CEncodeArgs *a, int numThreads, const char *inName, ISeqOutStream *outStream, UInt64 *inSize)
+{
+  CFileSeqInStream inStream;
+  CLzma2EncProps lzma2Props;
+  CXzProps props;
+  SRes res;
+
+  FileSeqInStream_CreateVTable(&inStream);
+  File_Construct(&inStream.file);
+  if (InFile_Open(&inStream.file, inName) != 0)
+    return SZ_ERROR_READ;
+  File_GetLength(&inStream.file, inSize);
+
+  Lzma2EncProps_Init(&lzma2Props);
+  lzma2Props.lzmaProps.level = a->level;
+  lzma2Props.blockSize = a->blockSize;
+  /* the default block size depends only on the level, so the output doesn't depend on numThreads */
+  Lzma2EncProps_Normalize(&lzma2Props);
+
+  XzProps_Init(&props);
+  props.lzma2Props = &lzma2Props;
+  props.checkId = XZ_CHECK_CRC64;
+  props.blockSize = lzma2Props.blockSize;
+  props.numThreads = numThreads;
+  props.memUsageMax = a->memUsageMax;
+
+  res = Xz_Encode(outStream, &inStream.s, &props, NULL);
+  File_Close(&inStream.file);
+  return res;
+}
+
+static int ParseEncodeArgs(CEncodeArgs *a, int numArgs, const char *args[], int argIndex)
+{
+  a->numThreads = (int)GetNumberOfProcessors();
+  a->level = 5;
+  a->blockSize = 0;
+  a->memUsageMax = (UInt64)(Int64)-1;
+  for (; argIndex < numArgs && args[argIndex][0] == '-'; argIndex++)
+  {
+    const char *s = args[argIndex] + 1;
+    if (strncmp(s, "mt", 2) == 0)
+    {
+      a->numThreads = atoi(s + 2);
+      if (a->numThreads <= 0)
+        a->numThreads = 1;
+    }
+    else if (s[0] == 'x')
+      a->level = atoi(s + 1);
+    else if (s[0] == 'b')
+      a->blockSize = (size_t)atoi(s + 1) << 20;
+    else if (s[0] == 'm')
+      a->memUsageMax = (UInt64)atoi(s + 1) << 20;
+    else
+      return -1;
+  }
+  return argIndex;
+}
+
+static int EncodeMain(int numArgs, const char *args[], int benchMode)
+{
+  CEncodeArgs a;
+  CFileOutStream outStream;
+  CNullOutStream nullStream;
+  UInt64 inSize = 0;
+  int argIndex = ParseEncodeArgs(&a, numArgs, args, 2);
+  int numThreads;
+  SRes res;
+
+  if (argIndex < 0 || numArgs - argIndex != (benchMode ? 1 : 2))
+  {
+    PrintHelp();
+    return 1;
+  }
+
+  if (!benchMode)
+  {
+    FileOutStream_CreateVTable(&outStream);
+    File_Construct(&outStream.file);
+    if (OutFile_Open(&outStream.file, args[argIndex + 1]) != 0)
+      return PrintError("Can not open output file", args[argIndex + 1]);
+    res = Encode(&a, a.numThreads, args[argIndex], &outStream.s, &inSize);
+    if (File_Close(&outStream.file) != 0 && res == SZ_OK)
+      res = SZ_ERROR_WRITE;
+    if (res != SZ_OK)
+      return PrintError(GetErrorMessage(res), args[argIndex]);
+    return 0;
+  }
+
+  printf("threads    packed size     MB/s\n");
+  for (numThreads = 1;; numThreads <<= 1)
+  {
+    double startTime, elapsed;
+    if (numThreads > a.numThreads)
+      numThreads = a.numThreads;
+    nullStream.s.Write = NullOutStream_Write;
+    nullStream.size = 0;
+    startTime = GetTimeSeconds();
+    res = Encode(&a, numThreads, args[argIndex], &nullStream.s, &inSize);
+    if (res != SZ_OK)
+      return PrintError(GetErrorMessage(res), args[argIndex]);
+    elapsed = GetTimeSeconds() - startTime;
+    if (elapsed <= 0)
+      elapsed = 1e-6;
+    printf("%7d %14.0f %8.2f\n", numThreads, (double)nullStream.size, (double)inSize / elapsed / 1000000);
+    if (numThreads >= a.numThreads)
+      break;
+  }
+  return 0;
+}
+
+int main(int numArgs, const char *args[])
+{
+  CXzDecMtProps props;
+  CFileInStream inStream;
+  CLookToRead lookStream;
+  CFileOutStream outStream;
+  CNullOutStream nullStream;
+  ISeqOutStream *out;
+  UInt64 packSize = 0;
+  double startTime;
+  int argIndex = 2;
+  int testMode;
+  int crc64Backend = -1;
+  SRes res;
+
+  if (numArgs == 1)
+  {
+    PrintHelp();
+    return 0;
+  }
+
+  if (strcmp(args[1], "e") == 0 || strcmp(args[1], "b") == 0)
+  {
+    CrcGenerateTable();
+    Crc64GenerateTable();
+    Sha256Prepare();
+    return EncodeMain(numArgs, args, args[1][0] == 'b');
+  }
+
+  testMode = (strcmp(args[1], "t") == 0);
+  if (!testMode && strcmp(args[1], "d") != 0)
+  {
+    PrintHelp();
+    return 1;
+  }
+
+  XzDecMtProps_Init(&props);
+  props.numThreads = GetNumberOfProcessors();
+  for (; argIndex < numArgs && args[argIndex][0] == '-'; argIndex++)
+  {
+    const char *s = args[argIndex] + 1;
+    if (strncmp(s, "mt", 2) == 0)
+    {
+      props.numThreads = (unsigned)atoi(s + 2);
+      if (props.numThreads == 0)
+        props.numThreads = 1;
+    }
+    else if (s[0] == 'c')
+    {
+      for (crc64Backend = CRC64_BACKEND_CLMUL; crc64Backend >= 0; crc64Backend--)
+        if (strcmp(s + 1, g_Crc64BackendNames[crc64Backend]) == 0)
+          break;
+      if (crc64Backend < 0)
+      {
+        PrintHelp();
+        return 1;
+      }
+    }
+    else
+      break;
+  }
+
+  if (numArgs - argIndex != (testMode ? 1 : 2))
+  {
+    PrintHelp();
+    return 1;
+  }
+
+  CrcGenerateTable();
+  Crc64GenerateTable();
+  Sha256Prepare();
+  if (crc64Backend >= 0 && !Crc64_SetBackend(crc64Backend))
+    return PrintError("This CRC64 code is not available", g_Crc64BackendNames[crc64Backend]);
+
+  FileInStream_CreateVTable(&inStream);
+  File_Construct(&inStream.file);
+  if (InFile_Open(&inStream.file, args[argIndex]) != 0)
+    return PrintError("Can not open input file", args[argIndex]);
+  File_GetLength(&inStream.file, &packSize);
+
+  LookToRead_CreateVTable(&lookStream, False);
+  lookStream.realStream = &inStream.s;
+  LookToRead_Init(&lookStream);
+
+  FileOutStream_CreateVTable(&outStream);
+  File_Construct(&outStream.file);
+  nullStream.s.Write = NullOutStream_Write;
+  nullStream.size = 0;
+  out = &nullStream.s;
+  if (!testMode)
+  {
+    if (OutFile_Open(&outStream.file, args[argIndex + 1]) != 0)
+    {
+      File_Close(&inStream.file);
+      return PrintError("Can not open output file", args[argIndex + 1]);
+    }
+    out = &outStream.s;
+  }
+
+  startTime = GetTimeSeconds();
+  res = XzDecMt_Decode(&props, &lookStream.s, out, NULL, &g_Alloc, &g_BigAlloc);
+
+  if (!testMode && File_Close(&outStream.file) != 0 && res == SZ_OK)
+    res = SZ_ERROR_WRITE;
+  File_Close(&inStream.file);
+
+  if (res != SZ_OK)
+    return PrintError(GetErrorMessage(res), args[argIndex]);
+
+  if (testMode)
+  {
+    double elapsed = GetTimeSeconds() - startTime;
+    if (elapsed <= 0)
+      elapsed = 1e-6;
+    printf("%s: OK\n"
+        "packed: %.0f bytes, unpacked: %.0f bytes, -mt%u -c%s\n"
+        "%.3f s, %.1f MB/s unpacked\n",
+        args[argIndex], (double)packSize, (double)nullStream.size, props.numThreads,
+        g_Crc64BackendNames[Crc64_GetBackend()],
+        elapsed, (double)nullStream.size / elapsed / 1000000);
+  }
+  return 0;
+}
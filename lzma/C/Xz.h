@@ -179,6 +179,9 @@ SRes MixCoder_Code(CMixCoder *p, Byte *dest, SizeT *destLen,
     const Byte *src, SizeT *srcLen, int srcWasFinished,
     ECoderFinishMode finishMode, ECoderStatus *status);
 
+/* sets up the coders of p for the filters of block */
+SRes XzDec_Init(CMixCoder *p, const CXzBlock *block);
+
 typedef enum
 {
   XZ_STATE_STREAM_HEADER,
@@ -2,9 +2,62 @@
 2010-04-16 : Igor Pavlov : Public domain */
 
 #include "XzCrc64.h"
+#include "7zCrc.h"
+#include "CpuArch.h"
 
 #define kCrc64Poly UINT64_CONST(0xC96C5795D7870F42)
-UInt64 g_Crc64Table[256];
+
+#ifdef MY_CPU_LE
+  #define CRC64_NUM_TABLES 8
+  UInt64 MY_FAST_CALL Crc64UpdateT8(UInt64 v, const void *data, size_t size, const UInt64 *table);
+  #ifdef CRC_CLMUL_SUPPORTED
+  UInt64 MY_FAST_CALL Crc64UpdateClmul(UInt64 v, const void *data, size_t size, const UInt64 *table);
+  #endif
+#else
+  #define CRC64_NUM_TABLES 1
+#endif
+
+typedef UInt64 (MY_FAST_CALL *CRC64_FUNC)(UInt64 v, const void *data, size_t size, const UInt64 *table);
+
+static UInt64 MY_FAST_CALL Crc64UpdateT1(UInt64 v, const void *data, size_t size, const UInt64 *table)
+{
+  const Byte *p = (const Byte *)data;
+  for (; size > 0 ; size--, p++)
+    v = table[((v) ^ (*p)) & 0xFF] ^ ((v) >> 8);
+  return v;
+}
+
+static CRC64_FUNC g_Crc64Update = Crc64UpdateT1;
+static int g_Crc64Backend = CRC64_BACKEND_T1;
+UInt64 g_Crc64Table[256 * CRC64_NUM_TABLES];
+
+Bool Crc64_SetBackend(int backend)
+{
+  CRC64_FUNC func = NULL;
+  switch (backend)
+  {
+    case CRC64_BACKEND_T1: func = Crc64UpdateT1; break;
+    #ifdef MY_CPU_LE
+    case CRC64_BACKEND_T8: func = Crc64UpdateT8; break;
+    #ifdef CRC_CLMUL_SUPPORTED
+    case CRC64_BACKEND_CLMUL:
+      if (CPU_Is_Clmul_Supported())
+        func = Crc64UpdateClmul;
+      break;
+    #endif
+    #endif
+  }
+  if (!func)
+    return False;
+  g_Crc64Update = func;
+  g_Crc64Backend = backend;
+  return True;
+}
+
+int Crc64_GetBackend(void)
+{
+  return g_Crc64Backend;
+}
 
 void MY_FAST_CALL Crc64GenerateTable(void)
 {
@@ -17,14 +70,21 @@ void MY_FAST_CALL Crc64GenerateTable(void)
       r = (r >> 1) ^ ((UInt64)kCrc64Poly & ~((r & 1) - 1));
     g_Crc64Table[i] = r;
   }
+  for (; i < 256 * CRC64_NUM_TABLES; i++)
+  {
+    UInt64 r = g_Crc64Table[i - 256];
+    g_Crc64Table[i] = g_Crc64Table[r & 0xFF] ^ (r >> 8);
+  }
+
+  #ifdef MY_CPU_LE
+  if (!Crc64_SetBackend(CRC64_BACKEND_CLMUL))
+    Crc64_SetBackend(CRC64_BACKEND_T8);
+  #endif
 }
 
 UInt64 MY_FAST_CALL Crc64Update(UInt64 v, const void *data, size_t size)
 {
-  const Byte *p = (const Byte *)data;
-  for (; size > 0 ; size--, p++)
-    v = CRC64_UPDATE_BYTE(v, *p);
-  return v;
+  return g_Crc64Update(v, data, size, g_Crc64Table);
 }
 
 UInt64 MY_FAST_CALL Crc64Calc(const void *data, size_t size)
@@ -12,8 +12,18 @@ EXTERN_C_BEGIN
 
 extern UInt64 g_Crc64Table[];
 
+/* Call Crc64GenerateTable one time before other CRC64 functions.
+   It also selects the fastest backend the CPU supports. */
 void MY_FAST_CALL Crc64GenerateTable(void);
 
+#define CRC64_BACKEND_T1 0    /* table lookups, 1 byte per step */
+#define CRC64_BACKEND_T8 1    /* table lookups, 8 bytes per step */
+#define CRC64_BACKEND_CLMUL 2 /* x86 PCLMULQDQ folding */
+
+/* Returns False if the backend isn't available in this build or on this CPU */
+Bool Crc64_SetBackend(int backend);
+int Crc64_GetBackend(void);
+
 #define CRC64_INIT_VAL UINT64_CONST(0xFFFFFFFFFFFFFFFF)
 #define CRC64_GET_DIGEST(crc) ((crc) ^ CRC64_INIT_VAL)
 #define CRC64_UPDATE_BYTE(crc, b) (g_Crc64Table[((crc) ^ (b)) & 0xFF] ^ ((crc) >> 8))
@@ -0,0 +1,104 @@
+/* XzCrc64Opt.c -- CRC64 calculation
+2013-05-20 : Public domain */
+
+#include "7zCrc.h"
+#include "CpuArch.h"
+
+#ifdef MY_CPU_LE
+
+#define CRC64_UPDATE_BYTE_2(crc, b) (table[((crc) ^ (b)) & 0xFF] ^ ((crc) >> 8))
+
+UInt64 MY_FAST_CALL Crc64UpdateT8(UInt64 v, const void *data, size_t size, const UInt64 *table)
+{
+  const Byte *p = (const Byte *)data;
+  for (; size > 0 && ((unsigned)(ptrdiff_t)p & 7) != 0; size--, p++)
+    v = CRC64_UPDATE_BYTE_2(v, *p);
+  for (; size >= 8; size -= 8, p += 8)
+  {
+    UInt32 d;
+    v ^= *(const UInt64 *)p;
+    d = (UInt32)(v >> 32);
+    v =
+      table[0x700 + ((UInt32)v & 0xFF)] ^
+      table[0x600 + (((UInt32)v >> 8) & 0xFF)] ^
+      table[0x500 + (((UInt32)v >> 16) & 0xFF)] ^
+      table[0x400 + (((UInt32)v >> 24))] ^
+      table[0x300 + (d & 0xFF)] ^
+      table[0x200 + ((d >> 8) & 0xFF)] ^
+      table[0x100 + ((d >> 16) & 0xFF)] ^
+      table[0x000 + ((d >> 24))];
+  }
+  for (; size > 0; size--, p++)
+    v = CRC64_UPDATE_BYTE_2(v, *p);
+  return v;
+}
+
+#ifdef CRC_CLMUL_SUPPORTED
+
+/* Folding with carry-less multiplication, like CrcUpdateClmul in 7zCrcOpt.c.
+   The bit-reflected constants are x^n mod P(x) for the n given next to them.
+   The last 16 bytes are reduced with the tables instead of a Barrett reduction. */
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#define ATTRIB_CLMUL
+#else
+#include <immintrin.h>
+#define ATTRIB_CLMUL __attribute__((__target__("pclmul,sse4.1")))
+#endif
+
+#define CRC64_K_575 UINT64_CONST(0x6ae3efbb9dd441f3) /* fold by 512 bits */
+#define CRC64_K_511 UINT64_CONST(0x081f6054a7842df4)
+#define CRC64_K_191 UINT64_CONST(0xe05dd497ca393ae4) /* fold by 128 bits */
+#define CRC64_K_127 UINT64_CONST(0xdabe95afc7875f40)
+
+#define CRC64_FOLD128(x, k, d) \
+  _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00), _mm_clmulepi64_si128(x, k, 0x11)), d)
+
+#define CRC64_LOAD128(p) _mm_loadu_si128((const __m128i *)(const void *)(p))
+
+/* size >= 64 and a multiple of 16, the folded 16 bytes are stored to res */
+ATTRIB_CLMUL
+static void Crc64Fold_Clmul(UInt64 v, const Byte *p, size_t size, Byte *res)
+{
+  const __m128i k512 = _mm_set_epi64x((Int64)CRC64_K_511, (Int64)CRC64_K_575);
+  const __m128i k128 = _mm_set_epi64x((Int64)CRC64_K_127, (Int64)CRC64_K_191);
+  __m128i x0 = _mm_xor_si128(CRC64_LOAD128(p), _mm_set_epi64x(0, (Int64)v));
+  __m128i x1 = CRC64_LOAD128(p + 16);
+  __m128i x2 = CRC64_LOAD128(p + 32);
+  __m128i x3 = CRC64_LOAD128(p + 48);
+
+  for (p += 64, size -= 64; size >= 64; p += 64, size -= 64)
+  {
+    x0 = CRC64_FOLD128(x0, k512, CRC64_LOAD128(p));
+    x1 = CRC64_FOLD128(x1, k512, CRC64_LOAD128(p + 16));
+    x2 = CRC64_FOLD128(x2, k512, CRC64_LOAD128(p + 32));
+    x3 = CRC64_FOLD128(x3, k512, CRC64_LOAD128(p + 48));
+  }
+
+  x0 = CRC64_FOLD128(x0, k128, x1);
+  x0 = CRC64_FOLD128(x0, k128, x2);
+  x0 = CRC64_FOLD128(x0, k128, x3);
+  for (; size >= 16; size -= 16, p += 16)
+    x0 = CRC64_FOLD128(x0, k128, CRC64_LOAD128(p));
+  _mm_storeu_si128((__m128i *)(void *)res, x0);
+}
+
+UInt64 MY_FAST_CALL Crc64UpdateClmul(UInt64 v, const void *data, size_t size, const UInt64 *table)
+{
+  const Byte *p = (const Byte *)data;
+  if (size >= 64)
+  {
+    Byte folded[16];
+    size_t cur = size & ~(size_t)15;
+    Crc64Fold_Clmul(v, p, cur, folded);
+    v = Crc64UpdateT8(0, folded, 16, table);
+    p += cur;
+    size -= cur;
+  }
+  return Crc64UpdateT8(v, p, size, table);
+}
+
+#endif
+
+#endif
@@ -347,7 +347,10 @@ void MixCoder_Free(CMixCoder *p)
   }
   p->numCoders = 0;
   if (p->buf)
+  {
     p->alloc->Free(p->alloc, p->buf);
+    p->buf = 0; /* XzDec_Init frees the coders when the filters change, and the buffer is used again */
+  }
 }
 
 void MixCoder_Init(CMixCoder *p)
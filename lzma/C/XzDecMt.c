@@ -0,0 +1,460 @@
+/* XzDecMt.c -- Multi-thread Xz Decoder
+2013-05-20 : Public domain */
+
+#include <string.h>
+
+#include "XzDecMt.h"
+
+#ifndef _7ZIP_ST
+#include "Threads.h"
+#endif
+
+#define XZ_CHECK_SIZE_MAX 64
+
+#define XZ_DEC_ST_OUT_BUF_SIZE (1 << 18)
+
+void XzDecMtProps_Init(CXzDecMtProps *p)
+{
+  p->numThreads = 1;
+  p->memUsageMax = (UInt64)1 << 30;
+}
+
+static SRes Progress(ICompressProgress *p, UInt64 inSize, UInt64 outSize)
+{
+  return (p && p->Progress(p, inSize, outSize) != SZ_OK) ? SZ_ERROR_PROGRESS : SZ_OK;
+}
+
+/* ---------- single thread ---------- */
+
+static SRes XzDecSt_Decode2(CXzUnpacker *xz, Byte *outBuf, ILookInStream *inStream, ISeqOutStream *outStream,
+    ICompressProgress *progress)
+{
+  UInt64 inProcessed = 0, outProcessed = 0;
+  Int64 offset = 0;
+  RINOK(inStream->Seek(inStream, &offset, SZ_SEEK_SET));
+  XzUnpacker_Init(xz);
+  for (;;)
+  {
+    const void *inBuf;
+    size_t inSize = XZ_DEC_ST_OUT_BUF_SIZE;
+    SizeT srcLen, destLen = XZ_DEC_ST_OUT_BUF_SIZE;
+    ECoderStatus status;
+    SRes res;
+
+    RINOK(inStream->Look(inStream, &inBuf, &inSize));
+    srcLen = inSize;
+    res = XzUnpacker_Code(xz, outBuf, &destLen, (const Byte *)inBuf, &srcLen, CODER_FINISH_ANY, &status);
+    if (destLen != 0 && outStream->Write(outStream, outBuf, destLen) != destLen)
+      return SZ_ERROR_WRITE;
+    RINOK(res);
+    RINOK(inStream->Skip(inStream, srcLen));
+    inProcessed += srcLen;
+    outProcessed += destLen;
+    RINOK(Progress(progress, inProcessed, outProcessed));
+    if (inSize == 0 && destLen == 0)
+      return XzUnpacker_IsStreamWasFinished(xz) ? SZ_OK : SZ_ERROR_INPUT_EOF;
+    if (srcLen == 0 && destLen == 0)
+      return SZ_ERROR_DATA;
+  }
+}
+
+static SRes XzDecSt_Decode(ILookInStream *inStream, ISeqOutStream *outStream,
+    ICompressProgress *progress, ISzAlloc *alloc, ISzAlloc *allocBig)
+{
+  CXzUnpacker xz;
+  SRes res;
+  Byte *outBuf = (Byte *)IAlloc_Alloc(allocBig, XZ_DEC_ST_OUT_BUF_SIZE);
+  if (outBuf == 0)
+    return SZ_ERROR_MEM;
+  XzUnpacker_Construct(&xz, alloc);
+  res = XzDecSt_Decode2(&xz, outBuf, inStream, outStream, progress);
+  XzUnpacker_Free(&xz);
+  IAlloc_Free(allocBig, outBuf);
+  return res;
+}
+
+#ifndef _7ZIP_ST
+
+/* ---------- block ---------- */
+
+/* decodes one whole block: src holds the block as it is stored, including padding and check */
+static SRes XzDecMt_DecodeBlock(CMixCoder *coder, CXzStreamFlags flags, const CXzBlockSizes *sizes,
+    const Byte *src, Byte *dest)
+{
+  CXzBlock block;
+  CXzCheck check;
+  Byte digest[XZ_CHECK_SIZE_MAX];
+  unsigned checkSize = XzFlags_GetCheckSize(flags);
+  UInt32 headerSize = ((UInt32)src[0] << 2) + 4;
+  size_t packSize, pos;
+
+  if (src[0] == 0 || sizes->totalSize <= (UInt64)headerSize + checkSize)
+    return SZ_ERROR_ARCHIVE;
+  packSize = (size_t)sizes->totalSize - headerSize - checkSize;
+
+  RINOK(XzBlock_Parse(&block, src));
+  if (XzBlock_HasPackSize(&block) && block.packSize != packSize)
+    return SZ_ERROR_ARCHIVE;
+  if (XzBlock_HasUnpackSize(&block) && block.unpackSize != sizes->unpackSize)
+    return SZ_ERROR_ARCHIVE;
+
+  RINOK(XzDec_Init(coder, &block));
+  {
+    /* a chain of coders reports the end only on a call after all of them have seen it */
+    SizeT srcPos = 0, destPos = 0;
+    ECoderStatus status;
+    for (;;)
+    {
+      SizeT srcLen = packSize - srcPos;
+      SizeT destLen = (SizeT)sizes->unpackSize - destPos;
+      RINOK(MixCoder_Code(coder, dest + destPos, &destLen, src + headerSize + srcPos, &srcLen,
+          True, CODER_FINISH_END, &status));
+      srcPos += srcLen;
+      destPos += destLen;
+      if (status == CODER_STATUS_FINISHED_WITH_MARK || (srcLen == 0 && destLen == 0))
+        break;
+    }
+    if (srcPos != packSize || destPos != sizes->unpackSize || status != CODER_STATUS_FINISHED_WITH_MARK)
+      return SZ_ERROR_DATA;
+  }
+
+  for (pos = headerSize + packSize; (pos & 3) != 0; pos++)
+    if (src[pos] != 0)
+      return SZ_ERROR_CRC;
+
+  XzCheck_Init(&check, XzFlags_GetCheckType(flags));
+  XzCheck_Update(&check, dest, (size_t)sizes->unpackSize);
+  if (XzCheck_Final(&check, digest) && memcmp(digest, src + pos, checkSize) != 0)
+    return SZ_ERROR_CRC;
+  return SZ_OK;
+}
+
+/* ---------- threads ---------- */
+
+struct _CXzDecMt;
+
+typedef struct
+{
+  struct _CXzDecMt *dec;
+  unsigned index;
+  CThread thread;
+
+  Bool stopReading;
+  CAutoResetEvent canRead;
+  CAutoResetEvent canWrite;
+
+  CMixCoder coder;
+  Byte *inBuf;
+  Byte *outBuf;
+
+  CXzStreamFlags flags;
+  CXzBlockSizes sizes;
+} CXzDecMtThread;
+
+typedef struct _CXzDecMt
+{
+  const CXzs *xzs;
+  ILookInStream *inStream;
+  ISeqOutStream *outStream;
+  ICompressProgress *progress;
+  ISzAlloc *alloc;
+  ISzAlloc *allocBig;
+  unsigned numThreads;
+
+  /* only the thread that can read uses these */
+  size_t streamIndex; /* xzs->streams[] is in reverse order, so it counts down */
+  size_t blockIndex;
+  UInt64 blockOffset;
+
+  /* only the thread that can write uses these */
+  UInt64 inProcessed;
+  UInt64 outProcessed;
+
+  CCriticalSection cs;
+  SRes res;
+
+  CXzDecMtThread threads[XZ_DEC_MT_THREADS_MAX];
+} CXzDecMt;
+
+static void XzDecMt_SetError(CXzDecMt *p, SRes res)
+{
+  CriticalSection_Enter(&p->cs);
+  if (p->res == SZ_OK)
+    p->res = res;
+  CriticalSection_Leave(&p->cs);
+}
+
+static SRes XzDecMt_GetError(CXzDecMt *p)
+{
+  SRes res;
+  CriticalSection_Enter(&p->cs);
+  res = p->res;
+  CriticalSection_Leave(&p->cs);
+  return res;
+}
+
+/* reads the next block in file order to t->inBuf, *noBlock is set after the last one */
+static SRes XzDecMt_ReadBlock(CXzDecMt *p, CXzDecMtThread *t, Bool *noBlock)
+{
+  const CXzStream *st;
+  size_t size;
+  *noBlock = False;
+  for (;;)
+  {
+    if (p->streamIndex == 0)
+    {
+      *noBlock = True;
+      return SZ_OK;
+    }
+    st = &p->xzs->streams[p->streamIndex - 1];
+    if (p->blockIndex != st->numBlocks)
+      break;
+    p->streamIndex--;
+    p->blockIndex = 0;
+    if (p->streamIndex != 0)
+      p->blockOffset = p->xzs->streams[p->streamIndex - 1].startOffset + XZ_STREAM_HEADER_SIZE;
+  }
+  t->flags = st->flags;
+  t->sizes = st->blocks[p->blockIndex++];
+  size = (size_t)((t->sizes.totalSize + 3) & ~(UInt64)3);
+  RINOK(LookInStream_SeekTo(p->inStream, p->blockOffset));
+  p->blockOffset += size;
+  return LookInStream_Read(p->inStream, t->inBuf, size);
+}
+
+#define GET_NEXT_THREAD(t) &(t)->dec->threads[(t)->index == (t)->dec->numThreads - 1 ? 0 : (t)->index + 1]
+
+static SRes XzDecMtThread_Process(CXzDecMtThread *t, Bool *stop)
+{
+  CXzDecMt *p = t->dec;
+  CXzDecMtThread *next;
+  *stop = True;
+  if (Event_Wait(&t->canRead) != 0)
+    return SZ_ERROR_THREAD;
+  if (XzDecMt_GetError(p) != SZ_OK)
+    return SZ_ERROR_FAIL;
+
+  next = GET_NEXT_THREAD(t);
+
+  if (!t->stopReading)
+  {
+    Bool noBlock;
+    RINOK(XzDecMt_ReadBlock(p, t, &noBlock));
+    *stop = noBlock;
+  }
+  if (*stop)
+  {
+    next->stopReading = True;
+    return Event_Set(&next->canRead) == 0 ? SZ_OK : SZ_ERROR_THREAD;
+  }
+  if (Event_Set(&next->canRead) != 0)
+    return SZ_ERROR_THREAD;
+
+  RINOK(XzDecMt_DecodeBlock(&t->coder, t->flags, &t->sizes, t->inBuf, t->outBuf));
+
+  if (Event_Wait(&t->canWrite) != 0)
+    return SZ_ERROR_THREAD;
+  if (XzDecMt_GetError(p) != SZ_OK)
+    return SZ_ERROR_FAIL;
+  if (t->sizes.unpackSize != 0)
+    if (p->outStream->Write(p->outStream, t->outBuf, (size_t)t->sizes.unpackSize) != t->sizes.unpackSize)
+      return SZ_ERROR_WRITE;
+  p->inProcessed += (t->sizes.totalSize + 3) & ~(UInt64)3;
+  p->outProcessed += t->sizes.unpackSize;
+  RINOK(Progress(p->progress, p->inProcessed, p->outProcessed));
+  return Event_Set(&next->canWrite) == 0 ? SZ_OK : SZ_ERROR_THREAD;
+}
+
+static THREAD_FUNC_RET_TYPE THREAD_FUNC_CALL_TYPE XzDecMt_ThreadFunc(void *pp)
+{
+  CXzDecMtThread *t = (CXzDecMtThread *)pp;
+  for (;;)
+  {
+    Bool stop;
+    SRes res = XzDecMtThread_Process(t, &stop);
+    if (res != SZ_OK)
+    {
+      /* the error is set before the next thread is woken up, so it stops too */
+      CXzDecMtThread *next = GET_NEXT_THREAD(t);
+      XzDecMt_SetError(t->dec, res);
+      Event_Set(&next->canRead);
+      Event_Set(&next->canWrite);
+      return res;
+    }
+    if (stop)
+      return 0;
+  }
+}
+
+static void XzDecMtThread_Free(CXzDecMtThread *t, ISzAlloc *allocBig)
+{
+  Event_Close(&t->canRead);
+  Event_Close(&t->canWrite);
+  MixCoder_Free(&t->coder);
+  IAlloc_Free(allocBig, t->inBuf);
+  IAlloc_Free(allocBig, t->outBuf);
+  t->inBuf = 0;
+  t->outBuf = 0;
+}
+
+static SRes XzDecMt_Code(CXzDecMt *p, size_t inBufSize, size_t outBufSize)
+{
+  unsigned i, numThreads = p->numThreads;
+  SRes res = SZ_OK;
+
+  for (i = 0; i < numThreads; i++)
+  {
+    CXzDecMtThread *t = &p->threads[i];
+    t->dec = p;
+    t->index = i;
+    t->stopReading = False;
+    Thread_Construct(&t->thread);
+    Event_Construct(&t->canRead);
+    Event_Construct(&t->canWrite);
+    MixCoder_Construct(&t->coder, p->alloc);
+    t->inBuf = (Byte *)IAlloc_Alloc(p->allocBig, inBufSize);
+    t->outBuf = (Byte *)IAlloc_Alloc(p->allocBig, outBufSize);
+  }
+
+  for (i = 0; i < numThreads; i++)
+  {
+    CXzDecMtThread *t = &p->threads[i];
+    if (t->inBuf == 0 || t->outBuf == 0)
+      res = SZ_ERROR_MEM;
+    else if (AutoResetEvent_CreateNotSignaled(&t->canRead) != 0 ||
+        AutoResetEvent_CreateNotSignaled(&t->canWrite) != 0)
+      res = SZ_ERROR_THREAD;
+    if (res != SZ_OK)
+      break;
+  }
+
+  if (res == SZ_OK)
+  {
+    /* the threads wait for canRead before they look at numThreads,
+       so the ring can still be cut short if a thread can't be created */
+    for (i = 0; i < numThreads; i++)
+      if (Thread_Create(&p->threads[i].thread, XzDecMt_ThreadFunc, &p->threads[i]) != 0)
+        break;
+    if (i != numThreads)
+    {
+      res = SZ_ERROR_THREAD;
+      p->numThreads = i;
+      if (i != 0)
+        p->threads[0].stopReading = True;
+    }
+    if (i != 0)
+    {
+      unsigned j;
+      Event_Set(&p->threads[0].canWrite);
+      Event_Set(&p->threads[0].canRead);
+      for (j = 0; j < i; j++)
+      {
+        Thread_Wait(&p->threads[j].thread);
+        Thread_Close(&p->threads[j].thread);
+      }
+    }
+  }
+
+  for (i = 0; i < numThreads; i++)
+    XzDecMtThread_Free(&p->threads[i], p->allocBig);
+  return (res == SZ_OK) ? p->res : res;
+}
+
+static SRes XzDecMt_Decode2(CXzDecMt *p, const CXzDecMtProps *props)
+{
+  const CXzs *xzs = p->xzs;
+  UInt64 numBlocks = 0, inBufSize = 0, outBufSize = 0;
+  UInt64 threadMemUsage;
+  unsigned numThreads = props->numThreads;
+  size_t i, k;
+
+  for (i = 0; i < xzs->num; i++)
+  {
+    const CXzStream *st = &xzs->streams[i];
+    numBlocks += st->numBlocks;
+    for (k = 0; k < st->numBlocks; k++)
+    {
+      const CXzBlockSizes *b = &st->blocks[k];
+      if (inBufSize < b->totalSize)
+        inBufSize = b->totalSize;
+      if (outBufSize < b->unpackSize)
+        outBufSize = b->unpackSize;
+    }
+  }
+  inBufSize = (inBufSize + 3) & ~(UInt64)3;
+  if (outBufSize == 0)
+    outBufSize = 1;
+
+  if (numThreads > XZ_DEC_MT_THREADS_MAX)
+    numThreads = XZ_DEC_MT_THREADS_MAX;
+  if (numThreads > numBlocks)
+    numThreads = (unsigned)numBlocks;
+  threadMemUsage = inBufSize + outBufSize;
+  if (threadMemUsage < inBufSize || (size_t)inBufSize != inBufSize || (size_t)outBufSize != outBufSize)
+    numThreads = 0;
+  else if (threadMemUsage * numThreads > props->memUsageMax)
+    numThreads = (unsigned)(props->memUsageMax / threadMemUsage);
+
+  if (numThreads <= 1)
+    return XzDecSt_Decode(p->inStream, p->outStream, p->progress, p->alloc, p->allocBig);
+
+  p->numThreads = numThreads;
+  p->streamIndex = xzs->num;
+  p->blockIndex = 0;
+  p->blockOffset = xzs->streams[xzs->num - 1].startOffset + XZ_STREAM_HEADER_SIZE;
+  p->inProcessed = 0;
+  p->outProcessed = 0;
+  p->res = SZ_OK;
+  return XzDecMt_Code(p, (size_t)inBufSize, (size_t)outBufSize);
+}
+
+#endif
+
+SRes XzDecMt_Decode(const CXzDecMtProps *props, ILookInStream *inStream, ISeqOutStream *outStream,
+    ICompressProgress *progress, ISzAlloc *alloc, ISzAlloc *allocBig)
+{
+  #ifndef _7ZIP_ST
+  if (props->numThreads > 1)
+  {
+    CXzDecMt *p;
+    CXzs xzs;
+    Int64 startOffset;
+    SRes res;
+
+    Xzs_Construct(&xzs);
+    res = Xzs_ReadBackward(&xzs, inStream, &startOffset, NULL, alloc);
+    if (res != SZ_OK)
+    {
+      /* without an index (truncated file, data after the streams) the single-thread decoder
+         reports the error and writes the output up to it */
+      Xzs_Free(&xzs, alloc);
+      return XzDecSt_Decode(inStream, outStream, progress, alloc, allocBig);
+    }
+    p = (CXzDecMt *)IAlloc_Alloc(alloc, sizeof(CXzDecMt));
+    if (p == 0)
+      res = SZ_ERROR_MEM;
+    else
+    {
+      p->xzs = &xzs;
+      p->inStream = inStream;
+      p->outStream = outStream;
+      p->progress = progress;
+      p->alloc = alloc;
+      p->allocBig = allocBig;
+      if (CriticalSection_Init(&p->cs) != 0)
+        res = SZ_ERROR_THREAD;
+      else
+      {
+        res = XzDecMt_Decode2(p, props);
+        CriticalSection_Delete(&p->cs);
+      }
+      IAlloc_Free(alloc, p);
+    }
+    Xzs_Free(&xzs, alloc);
+    return res;
+  }
+  #else
+  props = props;
+  #endif
+  return XzDecSt_Decode(inStream, outStream, progress, alloc, allocBig);
+}
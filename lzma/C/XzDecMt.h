@@ -0,0 +1,56 @@
+/* XzDecMt.h -- Multi-thread Xz Decoder
+2013-05-20 : Public domain */
+
+#ifndef __XZ_DEC_MT_H
+#define __XZ_DEC_MT_H
+
+#include "Xz.h"
+
+EXTERN_C_BEGIN
+
+#ifndef _7ZIP_ST
+#define XZ_DEC_MT_THREADS_MAX 32
+#else
+#define XZ_DEC_MT_THREADS_MAX 1
+#endif
+
+typedef struct
+{
+  unsigned numThreads;
+  UInt64 memUsageMax; /* limit for the block buffers of all threads */
+} CXzDecMtProps;
+
+void XzDecMtProps_Init(CXzDecMtProps *p);
+
+/*
+XzDecMt_Decode
+  Decodes all xz streams in inStream to outStream.
+  It reads the stream indexes first (Xzs_ReadBackward), so inStream must support seeking.
+  Each thread takes the next block from the index, decodes it with its own CMixCoder,
+  and writes it to outStream in file order. A thread holds one packed and one unpacked
+  block, so the threads need about
+    numThreads * (max packed block size + max unpacked block size)
+  bytes of buffers. If that is more than memUsageMax, fewer threads are used.
+  Single-block files, files whose indexes can't be read and numThreads <= 1 are decoded
+  by CXzUnpacker on the calling thread.
+
+  progress (can be NULL) is called with the packed and unpacked sizes after every block.
+
+Returns:
+  SZ_OK
+  SZ_ERROR_NO_ARCHIVE - it's not xz file
+  SZ_ERROR_ARCHIVE    - headers or index error
+  SZ_ERROR_DATA       - data error
+  SZ_ERROR_CRC        - check error
+  SZ_ERROR_UNSUPPORTED - unsupported filter or properties
+  SZ_ERROR_MEM
+  SZ_ERROR_INPUT_EOF  - unexpected end of input
+  SZ_ERROR_READ, SZ_ERROR_WRITE, SZ_ERROR_PROGRESS, SZ_ERROR_THREAD
+*/
+
+SRes XzDecMt_Decode(const CXzDecMtProps *props, ILookInStream *inStream, ISeqOutStream *outStream,
+    ICompressProgress *progress, ISzAlloc *alloc, ISzAlloc *allocBig);
+
+EXTERN_C_END
+
+#endif
@@ -14,6 +14,12 @@
 #include "SbEnc.c"
 #endif
 
+#ifndef _7ZIP_ST
+#include "MtCoder.h"
+#else
+#define NUM_MT_CODER_THREADS_MAX 1
+#endif
+
 #include "XzEnc.h"
 
 static void *SzBigAlloc(void *p, size_t size) { p = p; return BigAlloc(size); }
@@ -137,8 +143,10 @@ SRes Xz_AddIndexRecord(CXzStream *p, UInt64 unpackSize, UInt64 totalSize, ISzAll
       return SZ_ERROR_MEM;
     if (p->numBlocks != 0)
     {
-      memcpy(blocks, p->blocks, p->numBlocks * sizeof(CXzBlockSizes));
+      size_t numBlocks = p->numBlocks;
+      memcpy(blocks, p->blocks, numBlocks * sizeof(CXzBlockSizes));
       Xz_Free(p, alloc);
+      p->numBlocks = numBlocks;
     }
     p->blocks = blocks;
     p->numBlocksAllocated = num;
@@ -218,7 +226,7 @@ static SRes SeqInFilter_Read(void *pp, void *data, size_t *size)
   CSeqInFilter *p = (CSeqInFilter *)pp;
   size_t sizeOriginal = *size;
   if (sizeOriginal == 0)
-    return S_OK;
+    return SZ_OK;
   *size = 0;
   for (;;)
   {
@@ -247,11 +255,22 @@ static SRes SeqInFilter_Read(void *pp, void *data, size_t *size)
 static void SeqInFilter_Construct(CSeqInFilter *p)
 {
   p->buf = NULL;
+  p->StateCoder.p = NULL;
   p->p.Read = SeqInFilter_Read;
 }
 
+static void SeqInFilter_FreeState(CSeqInFilter *p)
+{
+  if (p->StateCoder.p)
+  {
+    p->StateCoder.Free(p->StateCoder.p, &g_Alloc);
+    p->StateCoder.p = NULL;
+  }
+}
+
 static void SeqInFilter_Free(CSeqInFilter *p)
 {
+  SeqInFilter_FreeState(p);
   if (p->buf)
   {
     g_Alloc.Free(&g_Alloc, p->buf);
@@ -271,10 +290,11 @@ static SRes SeqInFilter_Init(CSeqInFilter *p, const CXzFilter *props)
   }
   p->curPos = p->endPos = 0;
   p->srcWasFinished = 0;
+  SeqInFilter_FreeState(p);
   RINOK(BraState_SetFromMethod(&p->StateCoder, props->id, 1, &g_Alloc));
   RINOK(p->StateCoder.SetProps(p->StateCoder.p, props->props, props->propsSize, &g_Alloc));
   p->StateCoder.Init(p->StateCoder.p);
-  return S_OK;
+  return SZ_OK;
 }
 
 /* ---------- CSbEncInStream ---------- */
@@ -293,7 +313,7 @@ static SRes SbEncInStream_Read(void *pp, void *data, size_t *size)
   CSbEncInStream *p = (CSbEncInStream *)pp;
   size_t sizeOriginal = *size;
   if (sizeOriginal == 0)
-    return S_OK;
+    return SZ_OK;
   for (;;)
   {
     if (p->enc.needRead && !p->enc.readWasFinished)
@@ -311,7 +331,7 @@ static SRes SbEncInStream_Read(void *pp, void *data, size_t *size)
     *size = sizeOriginal;
     RINOK(SbEnc_Read(&p->enc, data, size));
     if (*size != 0 || !p->enc.needRead)
-      return S_OK;
+      return SZ_OK;
   }
 }
 
@@ -383,6 +403,9 @@ void XzProps_Init(CXzProps *p)
   p->lzma2Props = 0;
   p->filterProps = 0;
   p->checkId = XZ_CHECK_CRC32;
+  p->blockSize = 0;
+  p->numThreads = 1;
+  p->memUsageMax = (UInt64)(Int64)-1;
 }
 
 void XzFilterProps_Init(CXzFilterProps *p)
@@ -393,6 +416,63 @@ void XzFilterProps_Init(CXzFilterProps *p)
   p->ipDefined = False;
 }
 
+/* fills the filters of block, returns the filter in front of LZMA2 (or NULL) */
+static CXzFilter *XzBlock_SetFilters(CXzBlock *block, const CXzFilterProps *fp, Byte lzma2Prop)
+{
+  int filterIndex = 0;
+  CXzFilter *filter = NULL;
+
+  XzBlock_ClearFlags(block);
+  XzBlock_SetNumFilters(block, 1 + (fp ? 1 : 0));
+
+  if (fp)
+  {
+    filter = &block->filters[filterIndex++];
+    filter->id = fp->id;
+    filter->propsSize = 0;
+    if (fp->id == XZ_ID_Delta)
+    {
+      filter->props[0] = (Byte)(fp->delta - 1);
+      filter->propsSize = 1;
+    }
+    else if (fp->ipDefined)
+    {
+      SetUi32(filter->props, fp->ip);
+      filter->propsSize = 4;
+    }
+  }
+
+  {
+    CXzFilter *f = &block->filters[filterIndex++];
+    f->id = XZ_ID_LZMA2;
+    f->propsSize = 1;
+    f->props[0] = lzma2Prop;
+  }
+  return filter;
+}
+
+/* puts the filter in front of inStream, *res is the stream that LZMA2 reads */
+static SRes Lzma2WithFilters_InitInStream(CLzma2WithFilters *lzmaf, const CXzFilterProps *fp,
+    const CXzFilter *filter, ISeqInStream *inStream, ISeqInStream **res)
+{
+  *res = inStream;
+  if (!fp)
+    return SZ_OK;
+  #ifdef USE_SUBBLOCK
+  if (fp->id == XZ_ID_Subblock)
+  {
+    lzmaf->sb.inStream = inStream;
+    RINOK(SbEncInStream_Init(&lzmaf->sb));
+    *res = &lzmaf->sb.p;
+    return SZ_OK;
+  }
+  #endif
+  lzmaf->filter.realStream = inStream;
+  RINOK(SeqInFilter_Init(&lzmaf->filter, filter));
+  *res = &lzmaf->filter.p;
+  return SZ_OK;
+}
+
 static SRes Xz_Compress(CXzStream *xz, CLzma2WithFilters *lzmaf,
     ISeqOutStream *outStream, ISeqInStream *inStream,
     const CXzProps *props, ICompressProgress *progress)
@@ -406,36 +486,10 @@ static SRes Xz_Compress(CXzStream *xz, CLzma2WithFilters *lzmaf,
     CSeqCheckInStream checkInStream;
     CSeqSizeOutStream seqSizeOutStream;
     CXzBlock block;
-    int filterIndex = 0;
-    CXzFilter *filter = NULL;
-    const CXzFilterProps *fp = props->filterProps;
-    
-    XzBlock_ClearFlags(&block);
-    XzBlock_SetNumFilters(&block, 1 + (fp ? 1 : 0));
+    const CXzFilter *filter;
+    ISeqInStream *lzma2InStream;
     
-    if (fp)
-    {
-      filter = &block.filters[filterIndex++];
-      filter->id = fp->id;
-      filter->propsSize = 0;
-      if (fp->id == XZ_ID_Delta)
-      {
-        filter->props[0] = (Byte)(fp->delta - 1);
-        filter->propsSize = 1;
-      }
-      else if (fp->ipDefined)
-      {
-        SetUi32(filter->props, fp->ip);
-        filter->propsSize = 4;
-      }
-    }
-
-    {
-      CXzFilter *f = &block.filters[filterIndex++];
-      f->id = XZ_ID_LZMA2;
-      f->propsSize = 1;
-      f->props[0] = Lzma2Enc_WriteProperties(lzmaf->lzma2);
-    }
+    filter = XzBlock_SetFilters(&block, props->filterProps, Lzma2Enc_WriteProperties(lzmaf->lzma2));
 
     seqSizeOutStream.p.Write = MyWrite;
     seqSizeOutStream.realStream = outStream;
@@ -447,32 +501,11 @@ static SRes Xz_Compress(CXzStream *xz, CLzma2WithFilters *lzmaf,
     checkInStream.realStream = inStream;
     SeqCheckInStream_Init(&checkInStream, XzFlags_GetCheckType(xz->flags));
     
-    if (fp)
-    {
-      #ifdef USE_SUBBLOCK
-      if (fp->id == XZ_ID_Subblock)
-      {
-        lzmaf->sb.inStream = &checkInStream.p;
-        RINOK(SbEncInStream_Init(&lzmaf->sb));
-      }
-      else
-      #endif
-      {
-        lzmaf->filter.realStream = &checkInStream.p;
-        RINOK(SeqInFilter_Init(&lzmaf->filter, filter));
-      }
-    }
+    RINOK(Lzma2WithFilters_InitInStream(lzmaf, props->filterProps, filter, &checkInStream.p, &lzma2InStream));
 
     {
       UInt64 packPos = seqSizeOutStream.processed;
-      SRes res = Lzma2Enc_Encode(lzmaf->lzma2, &seqSizeOutStream.p,
-        fp ?
-        #ifdef USE_SUBBLOCK
-        (fp->id == XZ_ID_Subblock) ? &lzmaf->sb.p:
-        #endif
-        &lzmaf->filter.p:
-        &checkInStream.p,
-        progress);
+      SRes res = Lzma2Enc_Encode(lzmaf->lzma2, &seqSizeOutStream.p, lzma2InStream, progress);
       RINOK(res);
       block.unpackSize = checkInStream.processed;
       block.packSize = seqSizeOutStream.processed - packPos;
@@ -491,18 +524,392 @@ static SRes Xz_Compress(CXzStream *xz, CLzma2WithFilters *lzmaf,
   return Xz_WriteFooter(xz, outStream);
 }
 
+/* ---------- Blocks ---------- */
+
+typedef struct
+{
+  ISeqInStream p;
+  const Byte *data;
+  size_t size;
+  size_t pos;
+} CBufSeqInStream;
+
+static SRes BufSeqInStream_Read(void *pp, void *data, size_t *size)
+{
+  CBufSeqInStream *p = (CBufSeqInStream *)pp;
+  size_t rem = p->size - p->pos;
+  if (*size > rem)
+    *size = rem;
+  memcpy(data, p->data + p->pos, *size);
+  p->pos += *size;
+  return SZ_OK;
+}
+
+typedef struct
+{
+  ISeqOutStream p;
+  Byte *data;
+  size_t size;
+  size_t pos;
+} CBufSeqOutStream;
+
+static size_t BufSeqOutStream_Write(void *pp, const void *data, size_t size)
+{
+  CBufSeqOutStream *p = (CBufSeqOutStream *)pp;
+  size_t rem = p->size - p->pos;
+  if (size > rem)
+    size = rem;
+  memcpy(p->data + p->pos, data, size);
+  p->pos += size;
+  return size;
+}
+
+static SRes Progress(ICompressProgress *p, UInt64 inSize, UInt64 outSize)
+{
+  return (p && p->Progress(p, inSize, outSize) != SZ_OK) ? SZ_ERROR_PROGRESS : SZ_OK;
+}
+
+/* reports the progress inside a block as the progress of the whole stream */
+typedef struct
+{
+  ICompressProgress p;
+  ICompressProgress *progress;
+  UInt64 inOffset;
+  UInt64 outOffset;
+  #ifndef _7ZIP_ST
+  CMtProgress *mtProgress;
+  unsigned index;
+  #endif
+} CXzBlockProgress;
+
+static SRes XzBlockProgress_Progress(void *pp, UInt64 inSize, UInt64 outSize)
+{
+  CXzBlockProgress *p = (CXzBlockProgress *)pp;
+  #ifndef _7ZIP_ST
+  if (p->mtProgress)
+    return MtProgress_Set(p->mtProgress, p->index, inSize, outSize);
+  #endif
+  return Progress(p->progress, p->inOffset + inSize, p->outOffset + outSize);
+}
+
+static void XzBlockProgress_Init(CXzBlockProgress *p, ICompressProgress *progress)
+{
+  p->p.Progress = XzBlockProgress_Progress;
+  p->progress = progress;
+  p->inOffset = 0;
+  p->outOffset = 0;
+  #ifndef _7ZIP_ST
+  p->mtProgress = NULL;
+  p->index = 0;
+  #endif
+}
+
+#define XZ_BLOCK_DEST_SIZE(blockSize) ((blockSize) + ((blockSize) >> 10) + XZ_BLOCK_HEADER_SIZE_MAX + 128)
+
+/*
+Encodes src as one whole block: header with the sizes, LZMA2 data, padding and check.
+LZMA2 is written after XZ_BLOCK_HEADER_SIZE_MAX bytes, and moved down when the header is known.
+*/
+static SRes Xz_CompressBlock(CLzma2WithFilters *lzmaf, const CXzFilterProps *fp, CXzStreamFlags flags,
+    Byte *dest, size_t *destSize, const Byte *src, size_t srcSize, ICompressProgress *progress)
+{
+  CBufSeqInStream bufInStream;
+  CSeqCheckInStream checkInStream;
+  CBufSeqOutStream bufOutStream;
+  CXzBlock block;
+  const CXzFilter *filter;
+  ISeqInStream *lzma2InStream;
+  unsigned checkSize = XzFlags_GetCheckSize(flags);
+  size_t destLim = *destSize;
+  size_t headerSize, pos;
+
+  *destSize = 0;
+  if (destLim < XZ_BLOCK_HEADER_SIZE_MAX)
+    return SZ_ERROR_OUTPUT_EOF;
+
+  filter = XzBlock_SetFilters(&block, fp, Lzma2Enc_WriteProperties(lzmaf->lzma2));
+
+  bufInStream.p.Read = BufSeqInStream_Read;
+  bufInStream.data = src;
+  bufInStream.size = srcSize;
+  bufInStream.pos = 0;
+
+  checkInStream.p.Read = SeqCheckInStream_Read;
+  checkInStream.realStream = &bufInStream.p;
+  SeqCheckInStream_Init(&checkInStream, XzFlags_GetCheckType(flags));
+
+  RINOK(Lzma2WithFilters_InitInStream(lzmaf, fp, filter, &checkInStream.p, &lzma2InStream));
+
+  bufOutStream.p.Write = BufSeqOutStream_Write;
+  bufOutStream.data = dest + XZ_BLOCK_HEADER_SIZE_MAX;
+  bufOutStream.size = destLim - XZ_BLOCK_HEADER_SIZE_MAX;
+  bufOutStream.pos = 0;
+  RINOK(Lzma2Enc_Encode(lzmaf->lzma2, &bufOutStream.p, lzma2InStream, progress));
+
+  block.packSize = bufOutStream.pos;
+  block.unpackSize = checkInStream.processed;
+  XzBlock_SetHasPackSize(&block);
+  XzBlock_SetHasUnpackSize(&block);
+
+  bufOutStream.data = dest;
+  bufOutStream.size = XZ_BLOCK_HEADER_SIZE_MAX;
+  bufOutStream.pos = 0;
+  RINOK(XzBlock_WriteHeader(&block, &bufOutStream.p));
+  headerSize = bufOutStream.pos;
+
+  memmove(dest + headerSize, dest + XZ_BLOCK_HEADER_SIZE_MAX, (size_t)block.packSize);
+  pos = headerSize + (size_t)block.packSize;
+  if (destLim - pos < 3 + checkSize)
+    return SZ_ERROR_OUTPUT_EOF;
+  while ((pos & 3) != 0)
+    dest[pos++] = 0;
+  SeqCheckInStream_GetDigest(&checkInStream, dest + pos);
+  *destSize = pos + checkSize;
+  return SZ_OK;
+}
+
+/*
+Gets whole blocks from Xz_CompressBlock, one block per Write call, and adds them to the index.
+The sizes are taken from the block header, so the blocks can come from any thread.
+*/
+typedef struct
+{
+  ISeqOutStream p;
+  ISeqOutStream *realStream;
+  CXzStream *xz;
+  SRes res;
+} CXzBlockOutStream;
+
+static size_t XzBlockOutStream_Write(void *pp, const void *data, size_t size)
+{
+  CXzBlockOutStream *p = (CXzBlockOutStream *)pp;
+  const Byte *block = (const Byte *)data;
+  CXzBlock header;
+  if (size == 0)
+    return 0;
+  p->res = XzBlock_Parse(&header, block);
+  if (p->res == SZ_OK)
+    p->res = Xz_AddIndexRecord(p->xz, header.unpackSize,
+        ((UInt32)block[0] << 2) + 4 + header.packSize + XzFlags_GetCheckSize(p->xz->flags), &g_Alloc);
+  if (p->res != SZ_OK)
+    return 0;
+  return p->realStream->Write(p->realStream, data, size);
+}
+
+static SRes FullRead(ISeqInStream *stream, Byte *data, size_t *processedSize)
+{
+  size_t size = *processedSize;
+  *processedSize = 0;
+  while (size != 0)
+  {
+    size_t curSize = size;
+    RINOK(stream->Read(stream, data, &curSize));
+    if (curSize == 0)
+      break;
+    *processedSize += curSize;
+    data += curSize;
+    size -= curSize;
+  }
+  return SZ_OK;
+}
+
+static SRes Xz_CompressBlocksSt(CLzma2WithFilters *lzmaf, CXzBlockOutStream *outStream,
+    ISeqInStream *inStream, const CXzProps *props, size_t blockSize, ICompressProgress *progress)
+{
+  size_t destBlockSize = XZ_BLOCK_DEST_SIZE(blockSize);
+  CXzBlockProgress blockProgress;
+  SRes res = SZ_OK;
+  Byte *inBuf = (Byte *)IAlloc_Alloc(&g_BigAlloc, blockSize);
+  Byte *outBuf = (Byte *)IAlloc_Alloc(&g_BigAlloc, destBlockSize);
+
+  XzBlockProgress_Init(&blockProgress, progress);
+  if (inBuf == 0 || outBuf == 0)
+    res = SZ_ERROR_MEM;
+  while (res == SZ_OK)
+  {
+    size_t size = blockSize;
+    size_t destSize = destBlockSize;
+    res = FullRead(inStream, inBuf, &size);
+    if (res != SZ_OK || size == 0)
+      break;
+    res = Xz_CompressBlock(lzmaf, props->filterProps, outStream->xz->flags, outBuf, &destSize, inBuf, size,
+        &blockProgress.p);
+    if (res != SZ_OK)
+      break;
+    if (outStream->p.Write(outStream, outBuf, destSize) != destSize)
+      res = (outStream->res != SZ_OK) ? outStream->res : SZ_ERROR_WRITE;
+    blockProgress.inOffset += size;
+    blockProgress.outOffset += destSize;
+  }
+  IAlloc_Free(&g_BigAlloc, inBuf);
+  IAlloc_Free(&g_BigAlloc, outBuf);
+  return res;
+}
+
+#ifndef _7ZIP_ST
+
+typedef struct
+{
+  IMtCoderCallback funcTable;
+  const CXzProps *props;
+  CXzStreamFlags flags;
+  CLzma2WithFilters coders[NUM_MT_CODER_THREADS_MAX];
+  CMtCoder mtCoder;
+} CXzEncMt;
+
+static SRes XzEncMt_Code(void *pp, unsigned index, Byte *dest, size_t *destSize,
+    const Byte *src, size_t srcSize, int finished)
+{
+  CXzEncMt *p = (CXzEncMt *)pp;
+  CXzBlockProgress blockProgress;
+  finished = finished;
+  if (srcSize == 0)
+  {
+    *destSize = 0;
+    return SZ_OK;
+  }
+  XzBlockProgress_Init(&blockProgress, NULL);
+  blockProgress.mtProgress = &p->mtCoder.mtProgress;
+  blockProgress.index = index;
+  return Xz_CompressBlock(&p->coders[index], p->props->filterProps, p->flags, dest, destSize, src, srcSize,
+      &blockProgress.p);
+}
+
+static SRes Xz_CompressBlocksMt(CXzBlockOutStream *outStream, ISeqInStream *inStream,
+    const CXzProps *props, const CLzma2EncProps *lzma2Props, size_t blockSize, unsigned numThreads,
+    ICompressProgress *progress)
+{
+  unsigned i;
+  SRes res = SZ_OK;
+  CXzEncMt *p = (CXzEncMt *)IAlloc_Alloc(&g_Alloc, sizeof(CXzEncMt));
+  if (p == 0)
+    return SZ_ERROR_MEM;
+
+  p->funcTable.Code = XzEncMt_Code;
+  p->props = props;
+  p->flags = outStream->xz->flags;
+  for (i = 0; i < numThreads; i++)
+    Lzma2WithFilters_Construct(&p->coders[i], &g_Alloc, &g_BigAlloc);
+  MtCoder_Construct(&p->mtCoder);
+
+  for (i = 0; i < numThreads && res == SZ_OK; i++)
+  {
+    res = Lzma2WithFilters_Create(&p->coders[i]);
+    if (res == SZ_OK)
+      res = Lzma2Enc_SetProps(p->coders[i].lzma2, lzma2Props);
+  }
+
+  if (res == SZ_OK)
+  {
+    p->mtCoder.progress = progress;
+    p->mtCoder.inStream = inStream;
+    p->mtCoder.outStream = &outStream->p;
+    p->mtCoder.alloc = &g_BigAlloc;
+    p->mtCoder.mtCallback = &p->funcTable;
+    p->mtCoder.blockSize = blockSize;
+    p->mtCoder.destBlockSize = XZ_BLOCK_DEST_SIZE(blockSize);
+    p->mtCoder.numThreads = numThreads;
+    res = MtCoder_Code(&p->mtCoder);
+    if (res != SZ_OK && outStream->res != SZ_OK)
+      res = outStream->res;
+  }
+
+  MtCoder_Destruct(&p->mtCoder);
+  for (i = 0; i < numThreads; i++)
+    Lzma2WithFilters_Free(&p->coders[i]);
+  IAlloc_Free(&g_Alloc, p);
+  return res;
+}
+
+#endif
+
+/* rough memory use of one block encoder: match finder, its window and the block buffers */
+static UInt64 Xz_GetBlockEncoderMemUsage(const CLzmaEncProps *lzmaProps, size_t blockSize)
+{
+  UInt64 dictSize = lzmaProps->dictSize;
+  UInt64 mfSize = dictSize * (lzmaProps->btMode ? 11 : 7);
+  return mfSize + ((UInt64)1 << 22) + blockSize + XZ_BLOCK_DEST_SIZE(blockSize);
+}
+
+static SRes Xz_CompressBlocks(CXzStream *xz, ISeqOutStream *outStream, ISeqInStream *inStream,
+    const CXzProps *props, ICompressProgress *progress)
+{
+  CLzma2EncProps lzma2Props;
+  CXzBlockOutStream blockOutStream;
+  size_t blockSize;
+  int numThreads = props->numThreads;
+  SRes res;
+
+  if (props->lzma2Props)
+    lzma2Props = *props->lzma2Props;
+  else
+    Lzma2EncProps_Init(&lzma2Props);
+  Lzma2EncProps_Normalize(&lzma2Props);
+  blockSize = (props->blockSize != 0) ? props->blockSize : lzma2Props.blockSize;
+  if (blockSize > XZ_BLOCK_DEST_SIZE(blockSize))
+    return SZ_ERROR_PARAM;
+
+  /* every block is encoded by one thread, and it doesn't need a dictionary larger than the block */
+  lzma2Props.numBlockThreads = 1;
+  lzma2Props.numTotalThreads = -1;
+  if ((UInt32)blockSize == blockSize)
+    lzma2Props.lzmaProps.reduceSize = (UInt32)blockSize;
+  if (numThreads > NUM_MT_CODER_THREADS_MAX)
+    numThreads = NUM_MT_CODER_THREADS_MAX;
+  if (numThreads > 1)
+  {
+    UInt64 threadMemUsage;
+    lzma2Props.lzmaProps.numThreads = 1;
+    LzmaEncProps_Normalize(&lzma2Props.lzmaProps);
+    threadMemUsage = Xz_GetBlockEncoderMemUsage(&lzma2Props.lzmaProps, blockSize);
+    if (threadMemUsage * numThreads > props->memUsageMax)
+      numThreads = (int)(props->memUsageMax / threadMemUsage);
+  }
+
+  xz->flags = (Byte)props->checkId;
+  RINOK(Xz_WriteHeader(xz->flags, outStream));
+
+  blockOutStream.p.Write = XzBlockOutStream_Write;
+  blockOutStream.realStream = outStream;
+  blockOutStream.xz = xz;
+  blockOutStream.res = SZ_OK;
+
+  #ifndef _7ZIP_ST
+  if (numThreads > 1)
+    res = Xz_CompressBlocksMt(&blockOutStream, inStream, props, &lzma2Props, blockSize, (unsigned)numThreads, progress);
+  else
+  #endif
+  {
+    CLzma2WithFilters lzmaf;
+    Lzma2WithFilters_Construct(&lzmaf, &g_Alloc, &g_BigAlloc);
+    res = Lzma2WithFilters_Create(&lzmaf);
+    if (res == SZ_OK)
+      res = Lzma2Enc_SetProps(lzmaf.lzma2, &lzma2Props);
+    if (res == SZ_OK)
+      res = Xz_CompressBlocksSt(&lzmaf, &blockOutStream, inStream, props, blockSize, progress);
+    Lzma2WithFilters_Free(&lzmaf);
+  }
+  RINOK(res);
+  return Xz_WriteFooter(xz, outStream);
+}
+
 SRes Xz_Encode(ISeqOutStream *outStream, ISeqInStream *inStream,
     const CXzProps *props, ICompressProgress *progress)
 {
   SRes res;
   CXzStream xz;
-  CLzma2WithFilters lzmaf;
   Xz_Construct(&xz);
-  Lzma2WithFilters_Construct(&lzmaf, &g_Alloc, &g_BigAlloc);
-  res = Lzma2WithFilters_Create(&lzmaf);
-  if (res == SZ_OK)
-    res = Xz_Compress(&xz, &lzmaf, outStream, inStream, props, progress);
-  Lzma2WithFilters_Free(&lzmaf);
+  if (props->blockSize != 0 || props->numThreads > 1)
+    res = Xz_CompressBlocks(&xz, outStream, inStream, props, progress);
+  else
+  {
+    CLzma2WithFilters lzmaf;
+    Lzma2WithFilters_Construct(&lzmaf, &g_Alloc, &g_BigAlloc);
+    res = Lzma2WithFilters_Create(&lzmaf);
+    if (res == SZ_OK)
+      res = Xz_Compress(&xz, &lzmaf, outStream, inStream, props, progress);
+    Lzma2WithFilters_Free(&lzmaf);
+  }
   Xz_Free(&xz, &g_Alloc);
   return res;
 }
@@ -25,10 +25,22 @@ typedef struct
   const CLzma2EncProps *lzma2Props;
   const CXzFilterProps *filterProps;
   unsigned checkId;
+  size_t blockSize;   /* 0 - one block for the whole stream if numThreads <= 1,
+                             otherwise the LZMA2 default (4 * dictSize, at least 1 MB) */
+  int numThreads;     /* blocks that are encoded at the same time */
+  UInt64 memUsageMax; /* numThreads is reduced to stay under this estimate */
 } CXzProps;
 
 void XzProps_Init(CXzProps *p);
 
+/*
+Xz_Encode
+  With (blockSize != 0) or (numThreads > 1) the input is split into blocks of blockSize bytes.
+  Each block is encoded on its own, with its sizes in the block header, so the blocks can be
+  decoded in parallel (XzDecMt_Decode). For nonzero blockSize the output doesn't depend on numThreads.
+  Blocks are encoded by MtCoder threads, each thread with its own LZMA2 encoder.
+*/
+
 SRes Xz_Encode(ISeqOutStream *outStream, ISeqInStream *inStream,
     const CXzProps *props, ICompressProgress *progress);
 
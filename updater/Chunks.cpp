@@ -0,0 +1,566 @@
+/********************************************************************************
+ Chunked updates
+
+ Instead of an archive, the package is a chunk index made by
+ lzma/C/Util/ChunkStore: every file of the release as a list of
+ content-defined chunks, each named by its SHA-1. Chunks that are already in
+ the installed files or in the local chunk cache are reused, everything else
+ is downloaded into the cache, and changed files are then assembled next to
+ the originals and swapped in.
+********************************************************************************/
+
+#include "Updater.h"
+
+#include "../lzma/C/Chunker.h"
+#include "../lzma/C/Sha1.h"
+
+#include "scopeguard.hpp"
+
+using namespace std;
+
+#define CHUNK_READ_SIZE (1024*1024)
+
+struct chunk_ref_t
+{
+    BYTE            id[20];
+    DWORD           size;
+};
+
+struct chunked_file_t
+{
+    wstring         name;
+    BYTE            hash[20];
+    vector<chunk_ref_t> chunks;
+};
+
+//Somewhere a chunk can be read from without downloading it
+struct chunk_source_t
+{
+    wstring         path;
+    ULONGLONG       offset;
+};
+
+typedef map<string, chunk_source_t> chunk_source_table_t;
+
+static string ChunkKey(const BYTE *id)
+{
+    return string((const char *)id, 20);
+}
+
+static bool LoadChunkIndex(const _TCHAR *path, vector<chunked_file_t> &files)
+{
+    HANDLE hFile = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return false;
+
+    DEFER{ CloseHandle(hFile); };
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(hFile, &size) || size.QuadPart > 0x7FFFFFFF)
+        return false;
+
+    vector<char> buff((size_t)size.QuadPart + 1);
+
+    DWORD read;
+    if (!ReadFile(hFile, &buff[0], (DWORD)size.QuadPart, &read, NULL) || read != size.QuadPart)
+        return false;
+
+    json_error_t error;
+    json_t *root = json_loadb(&buff[0], read, 0, &error);
+    if (!root)
+        return false;
+
+    DEFER{ json_decref(root); };
+
+    json_t *fileList = json_object_get(root, "files");
+    if (!json_is_array(fileList))
+        return false;
+
+    for (size_t i = 0; i < json_array_size(fileList); i++)
+    {
+        json_t *entry = json_array_get(fileList, i);
+        json_t *name = json_object_get(entry, "name");
+        json_t *hash = json_object_get(entry, "sha1");
+        json_t *chunks = json_object_get(entry, "chunks");
+
+        if (!json_is_string(name) || !json_is_string(hash) || !json_is_array(chunks))
+            return false;
+
+        _TCHAR w_name[MAX_PATH];
+        _TCHAR w_hash[MAX_PATH];
+
+        if (!MultiByteToWideChar(CP_UTF8, 0, json_string_value(name), -1, w_name, _countof(w_name)))
+            return false;
+
+        if (!MultiByteToWideChar(CP_UTF8, 0, json_string_value(hash), -1, w_hash, _countof(w_hash)) || _tcslen(w_hash) != 40)
+            return false;
+
+        //The index comes from the server, don't let it write outside the install directory
+        if (!IsSafeFilename(w_name))
+            return false;
+
+        chunked_file_t file;
+        file.name = w_name;
+        StringToHash(w_hash, file.hash);
+
+        for (size_t j = 0; j < json_array_size(chunks); j++)
+        {
+            json_t *chunk = json_array_get(chunks, j);
+            json_t *id = json_array_get(chunk, 0);
+            json_t *chunkSize = json_array_get(chunk, 1);
+
+            if (!json_is_string(id) || !json_is_integer(chunkSize) || strlen(json_string_value(id)) != 40)
+                return false;
+
+            if (json_integer_value(chunkSize) <= 0 || json_integer_value(chunkSize) > CHUNK_MAX_SIZE)
+                return false;
+
+            _TCHAR w_id[41];
+            if (!MultiByteToWideChar(CP_UTF8, 0, json_string_value(id), -1, w_id, _countof(w_id)))
+                return false;
+
+            chunk_ref_t ref;
+            StringToHash(w_id, ref.id);
+            ref.size = (DWORD)json_integer_value(chunkSize);
+
+            file.chunks.push_back(ref);
+        }
+
+        files.push_back(file);
+    }
+
+    return true;
+}
+
+//Splits an installed file the same way the chunk store does and records where each chunk lives
+static bool IndexLocalChunks(const _TCHAR *path, chunk_source_table_t &sources)
+{
+    HANDLE hFile = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return false;
+
+    DEFER{ CloseHandle(hFile); };
+
+    vector<BYTE> buff(CHUNK_READ_SIZE);
+    size_t start = 0, end = 0;
+    ULONGLONG fileOffset = 0;
+    bool eof = false;
+
+    for (;;)
+    {
+        //Keep at least a maximum chunk buffered so boundaries come out the same as on the server
+        if (!eof && end - start < CHUNK_MAX_SIZE)
+        {
+            memmove(&buff[0], &buff[start], end - start);
+            end -= start;
+            start = 0;
+
+            DWORD read;
+            if (!ReadFile(hFile, &buff[end], (DWORD)(buff.size() - end), &read, NULL))
+                return false;
+
+            if (read == 0)
+                eof = true;
+
+            end += read;
+            continue;
+        }
+
+        if (start == end)
+            break;
+
+        size_t len = Chunker_Next(&buff[start], end - start);
+
+        CSha1 sha;
+        BYTE id[20];
+
+        Sha1_Init(&sha);
+        Sha1_Update(&sha, &buff[start], len);
+        Sha1_Final(&sha, id);
+
+        chunk_source_t source;
+        source.path = path;
+        source.offset = fileOffset;
+
+        sources.insert(make_pair(ChunkKey(id), source));
+
+        start += len;
+        fileOffset += len;
+    }
+
+    return true;
+}
+
+static bool IsCachedChunkValid(const _TCHAR *path, const chunk_ref_t &chunk)
+{
+    HANDLE hFile = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return false;
+
+    DEFER{ CloseHandle(hFile); };
+
+    BYTE buff[CHUNK_MAX_SIZE + 1];
+    DWORD read;
+
+    //Asking for one byte more than the chunk also catches files that are too long
+    if (!ReadFile(hFile, buff, sizeof(buff), &read, NULL) || read != chunk.size)
+        return false;
+
+    CSha1 sha;
+    BYTE hash[20];
+
+    Sha1_Init(&sha);
+    Sha1_Update(&sha, buff, read);
+    Sha1_Final(&sha, hash);
+
+    return !memcmp(hash, chunk.id, 20);
+}
+
+//Copies the chunks of file into outputPath, reading each one from the installed files or the chunk cache
+static bool AssembleFile(const chunked_file_t &file, const _TCHAR *outputPath, const chunk_source_table_t &sources, const _TCHAR *chunkCachePath,
+    map<wstring, HANDLE> &openFiles, bool *hashMismatch)
+{
+    *hashMismatch = false;
+
+    HANDLE hOut = CreateFile(outputPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (hOut == INVALID_HANDLE_VALUE)
+        return false;
+
+    DEFER{ CloseHandle(hOut); };
+
+    BYTE buff[CHUNK_MAX_SIZE];
+    CSha1 sha;
+
+    Sha1_Init(&sha);
+
+    for (size_t i = 0; i < file.chunks.size(); i++)
+    {
+        const chunk_ref_t &chunk = file.chunks[i];
+        wstring sourcePath;
+        ULONGLONG sourceOffset = 0;
+
+        chunk_source_table_t::const_iterator it = sources.find(ChunkKey(chunk.id));
+        if (it != sources.end())
+        {
+            sourcePath = it->second.path;
+            sourceOffset = it->second.offset;
+        }
+        else
+        {
+            _TCHAR chunkName[41];
+            HashToString((BYTE *)chunk.id, chunkName);
+
+            sourcePath = chunkCachePath;
+            sourcePath += _T("\\");
+            sourcePath += chunkName;
+        }
+
+        HANDLE hSource;
+
+        map<wstring, HANDLE>::iterator open = openFiles.find(sourcePath);
+        if (open != openFiles.end())
+        {
+            hSource = open->second;
+        }
+        else
+        {
+            hSource = CreateFile(sourcePath.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+            if (hSource == INVALID_HANDLE_VALUE)
+                return false;
+
+            openFiles[sourcePath] = hSource;
+        }
+
+        OVERLAPPED ov;
+        DWORD read, wrote;
+
+        ZeroMemory(&ov, sizeof(ov));
+        ov.Offset = (DWORD)sourceOffset;
+        ov.OffsetHigh = (DWORD)(sourceOffset >> 32);
+
+        if (!ReadFile(hSource, buff, chunk.size, &read, &ov) || read != chunk.size)
+            return false;
+
+        if (!WriteFile(hOut, buff, chunk.size, &wrote, NULL) || wrote != chunk.size)
+            return false;
+
+        Sha1_Update(&sha, buff, chunk.size);
+    }
+
+    BYTE hash[20];
+    Sha1_Final(&sha, hash);
+
+    //Catches both a bad chunk and an installed file that changed underneath us
+    if (memcmp(hash, file.hash, 20))
+    {
+        *hashMismatch = true;
+        return false;
+    }
+
+    return true;
+}
+
+//Drops cached chunks the new release doesn't use, so the cache doesn't grow with every update
+static void PruneChunkCache(const _TCHAR *chunkCachePath, const vector<chunked_file_t> &files)
+{
+    map<wstring, bool> referenced;
+
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        for (size_t j = 0; j < files[i].chunks.size(); j++)
+        {
+            _TCHAR chunkName[41];
+            HashToString((BYTE *)files[i].chunks[j].id, chunkName);
+            referenced[chunkName] = true;
+        }
+    }
+
+    _TCHAR searchPath[MAX_PATH];
+    StringCbPrintf(searchPath, sizeof(searchPath), _T("%s\\*"), chunkCachePath);
+
+    WIN32_FIND_DATA fd;
+    HANDLE hFind = FindFirstFile(searchPath, &fd);
+    if (hFind == INVALID_HANDLE_VALUE)
+        return;
+
+    do
+    {
+        if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+            continue;
+
+        if (referenced.find(fd.cFileName) == referenced.end())
+        {
+            _TCHAR chunkPath[MAX_PATH];
+            StringCbPrintf(chunkPath, sizeof(chunkPath), _T("%s\\%s"), chunkCachePath, fd.cFileName);
+            DeleteFile(chunkPath);
+        }
+    } while (FindNextFile(hFind, &fd));
+
+    FindClose(hFind);
+}
+
+bool InstallChunkedUpdate(update_t *updates, const _TCHAR *chunkURL, const _TCHAR *chunkCachePath, hash_cache_t *hashCache,
+    vector<pair<wstring, file_hash_t>> &installedHashes)
+{
+    vector<chunked_file_t> files;
+    vector<size_t> changed;
+    chunk_source_table_t sources;
+
+    Status(_T("Reading %s..."), updates->outputPath);
+
+    updates->previousFile = _tcsdup(updates->tempPath); // clean up index on success
+
+    ChunkerGenerateTable();
+
+    if (!LoadChunkIndex(updates->tempPath, files))
+    {
+        Status(_T("Update failed: Invalid chunk index"));
+        return false;
+    }
+
+    //----------------------
+    //Find what changed and what we already have
+    //----------------------
+    vector<wstring> installedPaths;
+    file_hash_table_t existingHashes;
+
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        if (GetFileAttributes(files[i].name.c_str()) != INVALID_FILE_ATTRIBUTES)
+            installedPaths.push_back(files[i].name);
+    }
+
+    //A release has thousands of files, whatever the cache doesn't know is hashed on all cores at once
+    Status(_T("Checking installed files..."));
+    CalculateFileHashes(installedPaths, existingHashes, 0, hashCache);
+
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        _TCHAR *path = (_TCHAR *)files[i].name.c_str();
+        file_hash_table_t::const_iterator existing = existingHashes.find(files[i].name);
+
+        if (existing == existingHashes.end())
+        {
+            changed.push_back(i);
+            continue;
+        }
+
+        if (!existing->second.valid)
+        {
+            Status(_T("Update failed: Couldn't read %s"), path);
+            return false;
+        }
+
+        if (!memcmp(existing->second.hash, files[i].hash, 20))
+            continue;
+
+        changed.push_back(i);
+
+        Status(_T("Scanning %s..."), path);
+
+        if (!IndexLocalChunks(path, sources))
+        {
+            Status(_T("Update failed: Couldn't read %s (error %d)"), path, GetLastError());
+            return false;
+        }
+    }
+
+    if (changed.empty())
+        return true;
+
+    //----------------------
+    //Download missing chunks into the cache
+    //----------------------
+    CreateDirectory(chunkCachePath, NULL);
+
+    update_t chunkList;
+    update_t *chunkUpdates = &chunkList;
+    map<string, bool> queued;
+
+    ZeroMemory(&chunkList, sizeof(chunkList));
+
+    DEFER{ DestroyUpdateList(&chunkList); };
+
+    for (size_t i = 0; i < changed.size(); i++)
+    {
+        const chunked_file_t &file = files[changed[i]];
+
+        for (size_t j = 0; j < file.chunks.size(); j++)
+        {
+            const chunk_ref_t &chunk = file.chunks[j];
+            string key = ChunkKey(chunk.id);
+
+            if (sources.find(key) != sources.end() || queued.find(key) != queued.end())
+                continue;
+
+            queued[key] = true;
+
+            _TCHAR chunkName[41];
+            _TCHAR chunkPath[MAX_PATH];
+            _TCHAR url[1024];
+
+            HashToString((BYTE *)chunk.id, chunkName);
+            StringCbPrintf(chunkPath, sizeof(chunkPath), _T("%s\\%s"), chunkCachePath, chunkName);
+
+            //Anything in the cache that isn't exactly the chunk (an interrupted download, say) is fetched again
+            if (IsCachedChunkValid(chunkPath, chunk))
+                continue;
+
+            DiscardPartialDownload(chunkPath);
+
+            StringCbPrintf(url, sizeof(url), _T("%s%s"), chunkURL, chunkName);
+
+            chunkUpdates->next = (update_t *)malloc(sizeof(update_t));
+            chunkUpdates = chunkUpdates->next;
+            ZeroMemory(chunkUpdates, sizeof(update_t));
+
+            chunkUpdates->outputPath = _tcsdup(chunkName);
+            chunkUpdates->tempPath = _tcsdup(chunkPath);
+            chunkUpdates->URL = _tcsdup(url);
+            chunkUpdates->fileSize = chunk.size;
+            chunkUpdates->state = STATE_PENDING_DOWNLOAD;
+            memcpy(chunkUpdates->hash, chunk.id, 20);
+        }
+    }
+
+    if (!RunDownloadWorkers(MAX_DOWNLOAD_WORKERS, &chunkList))
+        return false;
+
+    //Downloaded chunks belong to the cache now, a failed install shouldn't remove them
+    for (chunkUpdates = chunkList.next; chunkUpdates; chunkUpdates = chunkUpdates->next)
+        chunkUpdates->state = STATE_INVALID;
+
+    //----------------------
+    //Build the new files next to the old ones, then swap them in
+    //----------------------
+    map<wstring, HANDLE> openFiles;
+    vector<wstring> newFiles;
+
+    DEFER
+    {
+        for (map<wstring, HANDLE>::iterator it = openFiles.begin(); it != openFiles.end(); ++it)
+            CloseHandle(it->second);
+
+        for (size_t i = 0; i < newFiles.size(); i++)
+            DeleteFile(newFiles[i].c_str());
+    };
+
+    for (size_t i = 0; i < changed.size(); i++)
+    {
+        const chunked_file_t &file = files[changed[i]];
+        wstring newPath = file.name + _T(".new");
+
+        Status(_T("Assembling %s..."), file.name.c_str());
+
+        CreateFoldersForPath((_TCHAR *)newPath.c_str());
+
+        newFiles.push_back(newPath);
+
+        bool hashMismatch;
+        if (!AssembleFile(file, newPath.c_str(), sources, chunkCachePath, openFiles, &hashMismatch))
+        {
+            if (hashMismatch)
+                Status(_T("Update failed: Integrity check failed on %s"), file.name.c_str());
+            else
+                Status(_T("Update failed: Couldn't build %s (error %d)"), file.name.c_str(), GetLastError());
+            return false;
+        }
+    }
+
+    //The installed files were chunk sources until now
+    for (map<wstring, HANDLE>::iterator it = openFiles.begin(); it != openFiles.end(); ++it)
+        CloseHandle(it->second);
+
+    openFiles.clear();
+
+    for (size_t i = 0; i < changed.size(); i++)
+    {
+        const chunked_file_t &file = files[changed[i]];
+
+        updates->next = (update_t *)malloc(sizeof(update_t));
+        updates = updates->next;
+        ZeroMemory(updates, sizeof(update_t));
+
+        updates->outputPath = _tcsdup(file.name.c_str());
+        updates->state = STATE_INVALID;
+
+        if (GetFileAttributes(updates->outputPath) != INVALID_FILE_ATTRIBUTES)
+        {
+            _TCHAR oldFileRenamedPath[MAX_PATH];
+
+            StringCbCopy(oldFileRenamedPath, sizeof(oldFileRenamedPath), updates->outputPath);
+            StringCbCat(oldFileRenamedPath, sizeof(oldFileRenamedPath), _T(".old"));
+
+            if (!MoveFileEx(updates->outputPath, oldFileRenamedPath, MOVEFILE_REPLACE_EXISTING))
+            {
+                if (GetLastError() == ERROR_SHARING_VIOLATION)
+                    Status(_T("Update failed: %s is still in use. Close all programs and try again."), updates->outputPath);
+                else
+                    Status(_T("Update failed: Couldn't backup %s (error %d)"), updates->outputPath, GetLastError());
+                return false;
+            }
+
+            updates->previousFile = _tcsdup(oldFileRenamedPath);
+        }
+
+        updates->state = STATE_INSTALLED;
+
+        if (!MoveFileEx(newFiles[i].c_str(), updates->outputPath, MOVEFILE_REPLACE_EXISTING))
+        {
+            Status(_T("Update failed: Couldn't install %s (error %d)"), updates->outputPath, GetLastError());
+            return false;
+        }
+
+        file_hash_t installedHash;
+        memcpy(installedHash.hash, file.hash, 20);
+        installedHash.valid = true;
+
+        installedHashes.push_back(make_pair(file.name, installedHash));
+    }
+
+    newFiles.clear();
+
+    PruneChunkCache(chunkCachePath, files);
+
+    return true;
+}
@@ -1,10 +1,151 @@
 #include "Updater.h"
 
-bool HTTPGetFile (const _TCHAR *url, const _TCHAR *outputPath, const _TCHAR *extraHeaders, int *responseCode)
+#include "../lzma/C/Sha1.h"
+
+bool GetURLHostName(const _TCHAR *url, _TCHAR *hostName, DWORD hostNameLen)
+{
+    URL_COMPONENTS  urlComponents;
+
+    ZeroMemory (&urlComponents, sizeof(urlComponents));
+
+    urlComponents.dwStructSize = sizeof(urlComponents);
+
+    urlComponents.lpszHostName = hostName;
+    urlComponents.dwHostNameLength = hostNameLen;
+
+    return WinHttpCrackUrl(url, 0, 0, &urlComponents) != FALSE;
+}
+
+#define RESUME_INFO_MAGIC   0x4D555352 // "RSUM"
+
+struct resume_info_t
+{
+    DWORD           magic;
+    DWORD           reserved;
+    LONGLONG        offset;
+    _TCHAR          validator[128];
+    CSha1           hashState;
+};
+
+static void GetResumeInfoPath(const _TCHAR *outputPath, _TCHAR *resumePath, size_t resumePathSize)
+{
+    StringCbPrintf(resumePath, resumePathSize, _T("%s.part"), outputPath);
+}
+
+static bool LoadResumeInfo(const _TCHAR *outputPath, resume_info_t *info)
+{
+    _TCHAR resumePath[MAX_PATH];
+    HANDLE hFile;
+    DWORD read;
+
+    GetResumeInfoPath(outputPath, resumePath, sizeof(resumePath));
+
+    hFile = CreateFile(resumePath, GENERIC_READ, 0, NULL, OPEN_EXISTING, 0, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return false;
+
+    BOOL success = ReadFile(hFile, info, sizeof(*info), &read, NULL);
+    CloseHandle(hFile);
+
+    if (!success || read != sizeof(*info) || info->magic != RESUME_INFO_MAGIC)
+        return false;
+
+    info->validator[_countof(info->validator) - 1] = 0;
+    return info->offset > 0 && info->validator[0] && info->hashState.count == (UInt64)info->offset;
+}
+
+static void SaveResumeInfo(const _TCHAR *outputPath, const _TCHAR *validator, LONGLONG offset, const CSha1 *hashState)
+{
+    _TCHAR resumePath[MAX_PATH];
+    resume_info_t info;
+    HANDLE hFile;
+    DWORD wrote;
+
+    GetResumeInfoPath(outputPath, resumePath, sizeof(resumePath));
+
+    ZeroMemory(&info, sizeof(info));
+    info.magic = RESUME_INFO_MAGIC;
+    info.offset = offset;
+    info.hashState = *hashState;
+    StringCbCopy(info.validator, sizeof(info.validator), validator);
+
+    hFile = CreateFile(resumePath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 0, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return;
+
+    if (!WriteFile(hFile, &info, sizeof(info), &wrote, NULL) || wrote != sizeof(info))
+    {
+        CloseHandle(hFile);
+        DeleteFile(resumePath);
+        return;
+    }
+
+    CloseHandle(hFile);
+}
+
+static void DeleteResumeInfo(const _TCHAR *outputPath)
+{
+    _TCHAR resumePath[MAX_PATH];
+
+    GetResumeInfoPath(outputPath, resumePath, sizeof(resumePath));
+    DeleteFile(resumePath);
+}
+
+void DiscardPartialDownload(const _TCHAR *outputPath)
+{
+    DeleteResumeInfo(outputPath);
+    DeleteFile(outputPath);
+}
+
+LONGLONG GetResumeOffset(const _TCHAR *outputPath, const _TCHAR *validator)
+{
+    resume_info_t resume;
+    WIN32_FILE_ATTRIBUTE_DATA fileData;
+
+    if (!validator[0] || !LoadResumeInfo(outputPath, &resume) || _tcscmp(resume.validator, validator))
+        return 0;
+
+    if (!GetFileAttributesEx(outputPath, GetFileExInfoStandard, &fileData))
+        return 0;
+
+    LONGLONG partialSize = ((LONGLONG)fileData.nFileSizeHigh << 32) | fileData.nFileSizeLow;
+    return (partialSize >= resume.offset) ? resume.offset : 0;
+}
+
+//Only strong validators are allowed in If-Range, weak ETags fall back to Last-Modified
+static void QueryValidator(HINTERNET hRequest, _TCHAR *validator, DWORD validatorSize)
+{
+    DWORD validatorLen = validatorSize;
+    if (!WinHttpQueryHeaders(hRequest, WINHTTP_QUERY_ETAG, WINHTTP_HEADER_NAME_BY_INDEX, validator, &validatorLen, WINHTTP_NO_HEADER_INDEX) ||
+        !_tcsncmp(validator, _T("W/"), 2))
+    {
+        validator[0] = 0;
+        validatorLen = validatorSize;
+        if (!WinHttpQueryHeaders(hRequest, WINHTTP_QUERY_LAST_MODIFIED, WINHTTP_HEADER_NAME_BY_INDEX, validator, &validatorLen, WINHTTP_NO_HEADER_INDEX))
+            validator[0] = 0;
+    }
+}
+
+//Parses the start offset out of "bytes <start>-<end>/<total>"
+static LONGLONG GetContentRangeStart(const _TCHAR *contentRange)
+{
+    const _TCHAR *p = _tcschr(contentRange, ' ');
+    if (!p)
+        return -1;
+
+    p++;
+    if (!isdigit(*p))
+        return -1;
+
+    return (LONGLONG)_tcstoui64(p, NULL, 10);
+}
+
+bool HTTPGetFile (const _TCHAR *url, const _TCHAR *outputPath, const _TCHAR *extraHeaders, BYTE *hash, int *responseCode)
 {
     HINTERNET hSession = NULL;
     HINTERNET hConnect = NULL;
     HINTERNET hRequest = NULL;
+    HANDLE updateFile = INVALID_HANDLE_VALUE;
     URL_COMPONENTS  urlComponents;
     BOOL secure = FALSE;
     bool ret = false;
@@ -12,11 +153,24 @@ bool HTTPGetFile (const _TCHAR *url, const _TCHAR *outputPath, const _TCHAR *ext
     _TCHAR hostName[256];
     _TCHAR path[1024];
 
+    _TCHAR rangeHeaders[256];
+    _TCHAR validator[128];
+    resume_info_t resume;
+    LONGLONG resumeOffset = 0;
+    LONGLONG fileOffset = 0;
+    bool resumable = false;
+
+    //The digest is built from the bytes as they are written, so the file never has to be read back
+    CSha1 sha;
+    Sha1_Init(&sha);
+
     const TCHAR *acceptTypes[] = {
         TEXT("*/*"),
         NULL
     };
 
+    validator[0] = 0;
+
     ZeroMemory (&urlComponents, sizeof(urlComponents));
 
     urlComponents.dwStructSize = sizeof(urlComponents);
@@ -32,6 +186,30 @@ bool HTTPGetFile (const _TCHAR *url, const _TCHAR *outputPath, const _TCHAR *ext
     if (urlComponents.nPort == 443)
         secure = TRUE;
 
+    //Pick up where a previous attempt left off, as long as the partial file is still there
+    if (LoadResumeInfo(outputPath, &resume))
+    {
+        WIN32_FILE_ATTRIBUTE_DATA fileData;
+
+        //The saved hash state only covers exactly resume.offset bytes
+        if (GetFileAttributesEx(outputPath, GetFileExInfoStandard, &fileData))
+        {
+            LONGLONG partialSize = ((LONGLONG)fileData.nFileSizeHigh << 32) | fileData.nFileSizeLow;
+            if (partialSize >= resume.offset)
+            {
+                resumeOffset = resume.offset;
+                sha = resume.hashState;
+            }
+        }
+
+        if (resumeOffset > 0)
+        {
+            //A gzip encoded body can't be resumed mid-stream, so ask for the raw representation
+            StringCbPrintf(rangeHeaders, sizeof(rangeHeaders), _T("Range: bytes=%I64d-\r\nIf-Range: %s"), resumeOffset, resume.validator);
+            extraHeaders = rangeHeaders;
+        }
+    }
+
     hSession = WinHttpOpen(_T("OBS Updater/1.2-archive1"), WINHTTP_ACCESS_TYPE_DEFAULT_PROXY, WINHTTP_NO_PROXY_NAME, WINHTTP_NO_PROXY_BYPASS, 0);
     if (!hSession)
     {
@@ -70,6 +248,9 @@ bool HTTPGetFile (const _TCHAR *url, const _TCHAR *outputPath, const _TCHAR *ext
     TCHAR encoding[64];
     DWORD encodingLen;
 
+    TCHAR contentRange[128];
+    DWORD contentRangeLen;
+
     statusCodeLen = sizeof(statusCode);
     if (!WinHttpQueryHeaders(hRequest, WINHTTP_QUERY_STATUS_CODE, WINHTTP_HEADER_NAME_BY_INDEX, &statusCode, &statusCodeLen, WINHTTP_NO_HEADER_INDEX))
     {
@@ -87,7 +268,6 @@ bool HTTPGetFile (const _TCHAR *url, const _TCHAR *outputPath, const _TCHAR *ext
             goto failure;
         }
     }
-    totalFileSize += _tstoi(length);
 
     encoding[0] = 0;
     encodingLen = sizeof(encoding);
@@ -100,6 +280,8 @@ bool HTTPGetFile (const _TCHAR *url, const _TCHAR *outputPath, const _TCHAR *ext
         }
     }
 
+    QueryValidator(hRequest, validator, sizeof(validator));
+
     BOOL gzip = FALSE;
     BYTE *outputBuffer = NULL;
 
@@ -130,13 +312,46 @@ bool HTTPGetFile (const _TCHAR *url, const _TCHAR *outputPath, const _TCHAR *ext
 
     *responseCode = wcstoul(statusCode, NULL, 10);
 
-    if (bResults && *responseCode == 200)
+    if (bResults && *responseCode == 206 && resumeOffset > 0)
     {
-        BYTE buffer[32768];
-        DWORD dwSize, dwOutSize, wrote;
+        contentRange[0] = 0;
+        contentRangeLen = sizeof(contentRange);
+        WinHttpQueryHeaders(hRequest, WINHTTP_QUERY_CONTENT_RANGE, WINHTTP_HEADER_NAME_BY_INDEX, contentRange, &contentRangeLen, WINHTTP_NO_HEADER_INDEX);
 
-        HANDLE updateFile;
-        int lastPosition = 0;
+        if (gzip || GetContentRangeStart(contentRange) != resumeOffset)
+        {
+            *responseCode = -15;
+            DiscardPartialDownload(outputPath);
+            goto failure;
+        }
+
+        updateFile = CreateFile(outputPath, GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+        if (updateFile == INVALID_HANDLE_VALUE)
+        {
+            *responseCode = -7;
+            goto failure;
+        }
+
+        LARGE_INTEGER pos;
+        pos.QuadPart = resumeOffset;
+        if (!SetFilePointerEx(updateFile, pos, NULL, FILE_BEGIN) || !SetEndOfFile(updateFile))
+        {
+            *responseCode = -16;
+            goto failure;
+        }
+
+        fileOffset = resumeOffset;
+        InterlockedExchangeAdd(&totalFileSize, (LONG)resumeOffset);
+        InterlockedExchangeAdd(&completedFileSize, (LONG)resumeOffset);
+
+        //The rest of the file follows, from here on it's the same as a full download
+        *responseCode = 200;
+    }
+    else if (bResults && *responseCode == 200)
+    {
+        //Server ignored the range (or the validator changed), start over from scratch
+        DeleteResumeInfo(outputPath);
+        Sha1_Init(&sha);
 
         updateFile = CreateFile(outputPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 0, NULL);
         if (updateFile == INVALID_HANDLE_VALUE)
@@ -144,6 +359,23 @@ bool HTTPGetFile (const _TCHAR *url, const _TCHAR *outputPath, const _TCHAR *ext
             *responseCode = -7;
             goto failure;
         }
+    }
+    else if (*responseCode == 416)
+    {
+        //Our partial file no longer matches anything the server has
+        DiscardPartialDownload(outputPath);
+    }
+
+    InterlockedExchangeAdd(&totalFileSize, _tstoi(length));
+
+    if (updateFile != INVALID_HANDLE_VALUE)
+    {
+        BYTE buffer[32768];
+        DWORD dwSize, dwOutSize, wrote;
+
+        int lastPosition = 0;
+
+        resumable = !gzip && validator[0];
 
         do 
         {
@@ -181,24 +413,23 @@ bool HTTPGetFile (const _TCHAR *url, const _TCHAR *outputPath, const _TCHAR *ext
                         if (zret != Z_STREAM_END && zret != Z_OK)
                         {
                             inflateEnd(&strm);
-                            CloseHandle (updateFile);
                             goto failure;
                         }
 
                         if (!WriteFile(updateFile, outputBuffer, 262144 - strm.avail_out, &wrote, NULL))
                         {
                             *responseCode = -10;
-                            CloseHandle (updateFile);
                             goto failure;
                         }
                         if (wrote != 262144 - strm.avail_out)
                         {
                             *responseCode = -11;
-                            CloseHandle (updateFile);
                             goto failure;
                         }
 
-                        completedFileSize += wrote;
+                        Sha1_Update(&sha, outputBuffer, wrote);
+
+                        InterlockedExchangeAdd(&completedFileSize, wrote);
                     }
                     while (strm.avail_out == 0);
                 }
@@ -207,18 +438,19 @@ bool HTTPGetFile (const _TCHAR *url, const _TCHAR *outputPath, const _TCHAR *ext
                     if (!WriteFile(updateFile, buffer, dwOutSize, &wrote, NULL))
                     {
                         *responseCode = -12;
-                        CloseHandle (updateFile);
                         goto failure;
                     }
 
                     if (wrote != dwOutSize)
                     {
                         *responseCode = -13;
-                        CloseHandle (updateFile);
                         goto failure;
                     }
 
-                    completedFileSize += dwOutSize;
+                    Sha1_Update(&sha, buffer, wrote);
+                    fileOffset += wrote;
+
+                    InterlockedExchangeAdd(&completedFileSize, dwOutSize);
                 }
 
                 int position = (int)(((float)completedFileSize / (float)totalFileSize) * 100.0f);
@@ -229,21 +461,36 @@ bool HTTPGetFile (const _TCHAR *url, const _TCHAR *outputPath, const _TCHAR *ext
                 }
             }
 
-            if (WaitForSingleObject(cancelRequested, 0) == WAIT_OBJECT_0)
+            if (DownloadAborted())
             {
                 *responseCode = -14;
-                CloseHandle (updateFile);
                 goto failure;
             }
 
         } while (dwSize > 0);
 
         CloseHandle (updateFile);
+        updateFile = INVALID_HANDLE_VALUE;
+
+        //Complete, nothing left to resume
+        resumable = false;
+        DeleteResumeInfo(outputPath);
+
+        if (hash)
+            Sha1_Final(&sha, hash);
     }
 
     ret = true;
 
 failure:
+    if (updateFile != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(updateFile);
+
+        //Keep what we have so the next attempt only fetches the remainder
+        if (resumable && fileOffset > 0)
+            SaveResumeInfo(outputPath, validator, fileOffset, &sha);
+    }
     if (outputBuffer)
         free(outputBuffer);
     if (hSession)
@@ -255,3 +502,707 @@ failure:
 
     return ret;
 }
+
+//-------------------------------------------------------------
+// Segmented download: one file fetched over several connections
+
+#define MIN_SEGMENT_SIZE (1024*1024)
+
+struct segment_job_t
+{
+    HINTERNET       hConnect;
+    const _TCHAR    *path;
+    BOOL            secure;
+    HANDLE          outputFile;
+    LONGLONG        start;
+    LONGLONG        end;
+    volatile LONG   *failed;
+    int             responseCode;
+};
+
+static HINTERNET SendRequest(HINTERNET hConnect, const _TCHAR *verb, const _TCHAR *path, BOOL secure, const _TCHAR *extraHeaders, int *responseCode)
+{
+    const TCHAR *acceptTypes[] = {
+        TEXT("*/*"),
+        NULL
+    };
+
+    TCHAR statusCode[8];
+    DWORD statusCodeLen;
+
+    HINTERNET hRequest = WinHttpOpenRequest(hConnect, verb, path, NULL, WINHTTP_NO_REFERER, acceptTypes, secure ? WINHTTP_FLAG_SECURE|WINHTTP_FLAG_REFRESH : WINHTTP_FLAG_REFRESH);
+    if (!hRequest)
+    {
+        *responseCode = -3;
+        return NULL;
+    }
+
+    if (!WinHttpSendRequest(hRequest, extraHeaders, extraHeaders ? -1 : 0, WINHTTP_NO_REQUEST_DATA, 0, 0, 0) ||
+        !WinHttpReceiveResponse(hRequest, NULL))
+    {
+        *responseCode = 0;
+        WinHttpCloseHandle(hRequest);
+        return NULL;
+    }
+
+    statusCodeLen = sizeof(statusCode);
+    if (!WinHttpQueryHeaders(hRequest, WINHTTP_QUERY_STATUS_CODE, WINHTTP_HEADER_NAME_BY_INDEX, &statusCode, &statusCodeLen, WINHTTP_NO_HEADER_INDEX))
+    {
+        *responseCode = -4;
+        WinHttpCloseHandle(hRequest);
+        return NULL;
+    }
+
+    *responseCode = wcstoul(statusCode, NULL, 10);
+    return hRequest;
+}
+
+static DWORD WINAPI SegmentThread(void *arg)
+{
+    segment_job_t *job = (segment_job_t *)arg;
+    HINTERNET hRequest;
+    _TCHAR rangeHeader[128];
+    TCHAR contentRange[128];
+    DWORD contentRangeLen;
+
+    StringCbPrintf(rangeHeader, sizeof(rangeHeader), _T("Range: bytes=%I64d-%I64d"), job->start, job->end);
+
+    hRequest = SendRequest(job->hConnect, TEXT("GET"), job->path, job->secure, rangeHeader, &job->responseCode);
+    if (!hRequest)
+        goto failure;
+
+    contentRange[0] = 0;
+    contentRangeLen = sizeof(contentRange);
+    WinHttpQueryHeaders(hRequest, WINHTTP_QUERY_CONTENT_RANGE, WINHTTP_HEADER_NAME_BY_INDEX, contentRange, &contentRangeLen, WINHTTP_NO_HEADER_INDEX);
+
+    if (job->responseCode != 206 || GetContentRangeStart(contentRange) != job->start)
+    {
+        job->responseCode = -15;
+        goto failure;
+    }
+
+    {
+        BYTE buffer[32768];
+        LONGLONG offset = job->start;
+
+        while (offset <= job->end)
+        {
+            DWORD dwSize = 0, dwOutSize, wrote;
+
+            if (*job->failed || DownloadAborted())
+            {
+                job->responseCode = -14;
+                goto failure;
+            }
+
+            if (!WinHttpQueryDataAvailable(hRequest, &dwSize))
+            {
+                job->responseCode = -8;
+                goto failure;
+            }
+
+            dwSize = (DWORD)min((LONGLONG)min(dwSize, sizeof(buffer)), job->end + 1 - offset);
+
+            if (!WinHttpReadData(hRequest, (LPVOID)buffer, dwSize, &dwOutSize))
+            {
+                job->responseCode = -9;
+                goto failure;
+            }
+
+            if (!dwOutSize)
+            {
+                //Connection closed before the end of our range
+                job->responseCode = -17;
+                goto failure;
+            }
+
+            //Positioned write straight into this segment's slice of the preallocated file
+            OVERLAPPED ov;
+            ZeroMemory(&ov, sizeof(ov));
+            ov.Offset = (DWORD)offset;
+            ov.OffsetHigh = (DWORD)(offset >> 32);
+
+            if (!WriteFile(job->outputFile, buffer, dwOutSize, &wrote, &ov) || wrote != dwOutSize)
+            {
+                job->responseCode = -12;
+                goto failure;
+            }
+
+            offset += wrote;
+            InterlockedExchangeAdd(&completedFileSize, wrote);
+        }
+    }
+
+    WinHttpCloseHandle(hRequest);
+    job->responseCode = 200;
+    return 0;
+
+failure:
+    InterlockedExchange(job->failed, TRUE);
+    if (hRequest)
+        WinHttpCloseHandle(hRequest);
+    return 1;
+}
+
+bool HTTPGetFileSegmented(const _TCHAR *url, const _TCHAR *outputPath, const _TCHAR *extraHeaders, LONGLONG knownSize, int numSegments,
+    HANDLE connectionSlots, BYTE *hash, int *responseCode)
+{
+    HINTERNET hSession = NULL;
+    HINTERNET hConnect = NULL;
+    HINTERNET hRequest = NULL;
+    HANDLE outputFile = INVALID_HANDLE_VALUE;
+    URL_COMPONENTS  urlComponents;
+    BOOL secure = FALSE;
+    bool ret = false;
+
+    _TCHAR hostName[256];
+    _TCHAR path[1024];
+
+    TCHAR length[64];
+    DWORD lengthLen;
+
+    TCHAR acceptRanges[64];
+    DWORD acceptRangesLen;
+
+    LONGLONG fileSize;
+    LONGLONG segmentSize;
+
+    segment_job_t jobs[MAX_DOWNLOAD_SEGMENTS];
+    HANDLE threads[MAX_DOWNLOAD_SEGMENTS];
+    volatile LONG failed = FALSE;
+    int numThreads = 0;
+    int numSlots = 0;
+
+    ZeroMemory (&urlComponents, sizeof(urlComponents));
+
+    urlComponents.dwStructSize = sizeof(urlComponents);
+
+    urlComponents.lpszHostName = hostName;
+    urlComponents.dwHostNameLength = _countof(hostName);
+
+    urlComponents.lpszUrlPath = path;
+    urlComponents.dwUrlPathLength = _countof(path);
+
+    WinHttpCrackUrl(url, 0, 0, &urlComponents);
+
+    if (urlComponents.nPort == 443)
+        secure = TRUE;
+
+    //An earlier single stream attempt left a partial file behind, finish that one instead
+    resume_info_t resume;
+    if (LoadResumeInfo(outputPath, &resume))
+        return HTTPGetFile(url, outputPath, extraHeaders, hash, responseCode);
+
+    //Small files aren't worth the HEAD request
+    if (knownSize > 0 && knownSize < 2 * MIN_SEGMENT_SIZE)
+        return HTTPGetFile(url, outputPath, extraHeaders, hash, responseCode);
+
+    numSegments = max(1, min(numSegments, MAX_DOWNLOAD_SEGMENTS));
+
+    //The caller's connection is the first segment, the others need free slots of the same host.
+    //Only take the ones that are free right now, waiting for more could deadlock the workers.
+    if (connectionSlots)
+    {
+        while (numSlots < numSegments - 1 && WaitForSingleObject(connectionSlots, 0) == WAIT_OBJECT_0)
+            numSlots++;
+
+        numSegments = numSlots + 1;
+    }
+
+    if (numSegments < 2)
+        return HTTPGetFile(url, outputPath, extraHeaders, hash, responseCode);
+
+    hSession = WinHttpOpen(_T("OBS Updater/1.2-archive1"), WINHTTP_ACCESS_TYPE_DEFAULT_PROXY, WINHTTP_NO_PROXY_NAME, WINHTTP_NO_PROXY_BYPASS, 0);
+    if (!hSession)
+    {
+        *responseCode = -1;
+        goto failure;
+    }
+
+    hConnect = WinHttpConnect(hSession, hostName, secure ? INTERNET_DEFAULT_HTTPS_PORT : INTERNET_DEFAULT_HTTP_PORT, 0);
+    if (!hConnect)
+    {
+        *responseCode = -2;
+        goto failure;
+    }
+
+    //Find out whether the file is big enough and the server can serve ranges of it
+    hRequest = SendRequest(hConnect, TEXT("HEAD"), path, secure, NULL, responseCode);
+    if (!hRequest)
+        goto failure;
+
+    length[0] = 0;
+    lengthLen = sizeof(length);
+    WinHttpQueryHeaders(hRequest, WINHTTP_QUERY_CONTENT_LENGTH, WINHTTP_HEADER_NAME_BY_INDEX, length, &lengthLen, WINHTTP_NO_HEADER_INDEX);
+
+    acceptRanges[0] = 0;
+    acceptRangesLen = sizeof(acceptRanges);
+    WinHttpQueryHeaders(hRequest, WINHTTP_QUERY_ACCEPT_RANGES, WINHTTP_HEADER_NAME_BY_INDEX, acceptRanges, &acceptRangesLen, WINHTTP_NO_HEADER_INDEX);
+
+    WinHttpCloseHandle(hRequest);
+    hRequest = NULL;
+
+    fileSize = (LONGLONG)_tcstoui64(length, NULL, 10);
+
+    if (*responseCode != 200 || _tcscmp(acceptRanges, _T("bytes")) || fileSize < 2 * MIN_SEGMENT_SIZE)
+    {
+        WinHttpCloseHandle(hConnect);
+        WinHttpCloseHandle(hSession);
+
+        if (numSlots)
+            ReleaseSemaphore(connectionSlots, numSlots, NULL);
+
+        return HTTPGetFile(url, outputPath, extraHeaders, hash, responseCode);
+    }
+
+    numSegments = (int)min((LONGLONG)numSegments, fileSize / MIN_SEGMENT_SIZE);
+
+    if (numSlots > numSegments - 1)
+    {
+        ReleaseSemaphore(connectionSlots, numSlots - (numSegments - 1), NULL);
+        numSlots = numSegments - 1;
+    }
+
+    segmentSize = (fileSize + numSegments - 1) / numSegments;
+
+    //Preallocate so every segment can write at its own offset without any reassembly
+    outputFile = CreateFile(outputPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 0, NULL);
+    if (outputFile == INVALID_HANDLE_VALUE)
+    {
+        *responseCode = -7;
+        goto failure;
+    }
+
+    LARGE_INTEGER end;
+    end.QuadPart = fileSize;
+    if (!SetFilePointerEx(outputFile, end, NULL, FILE_BEGIN) || !SetEndOfFile(outputFile))
+    {
+        *responseCode = -16;
+        goto failure;
+    }
+
+    InterlockedExchangeAdd(&totalFileSize, (LONG)fileSize);
+
+    for (int i = 0; i < numSegments; i++)
+    {
+        segment_job_t *job = &jobs[i];
+
+        job->hConnect = hConnect;
+        job->path = path;
+        job->secure = secure;
+        job->outputFile = outputFile;
+        job->start = i * segmentSize;
+        job->end = min(job->start + segmentSize, fileSize) - 1;
+        job->failed = &failed;
+        job->responseCode = 0;
+
+        threads[i] = CreateThread(NULL, 0, SegmentThread, job, 0, NULL);
+        if (!threads[i])
+        {
+            *responseCode = -18;
+            InterlockedExchange(&failed, TRUE);
+            break;
+        }
+
+        numThreads++;
+    }
+
+    if (numThreads)
+        WaitForMultipleObjects(numThreads, threads, TRUE, INFINITE);
+
+    for (int i = 0; i < numThreads; i++)
+        CloseHandle(threads[i]);
+
+    if (failed)
+    {
+        for (int i = 0; i < numThreads; i++)
+        {
+            if (jobs[i].responseCode != 200)
+            {
+                *responseCode = jobs[i].responseCode;
+                break;
+            }
+        }
+
+        goto failure;
+    }
+
+    CloseHandle(outputFile);
+    outputFile = INVALID_HANDLE_VALUE;
+
+    //Segments land out of order, so this is the one case where the digest needs a second pass
+    if (hash && !CalculateFileHash(outputPath, hash))
+    {
+        *responseCode = -19;
+        DeleteFile(outputPath);
+        goto failure;
+    }
+
+    *responseCode = 200;
+    ret = true;
+
+failure:
+    if (outputFile != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(outputFile);
+
+        //A partially filled segmented file has holes in it, it can't be resumed
+        if (!ret)
+            DeleteFile(outputPath);
+    }
+    if (hRequest)
+        WinHttpCloseHandle(hRequest);
+    if (hConnect)
+        WinHttpCloseHandle(hConnect);
+    if (hSession)
+        WinHttpCloseHandle(hSession);
+    if (numSlots)
+        ReleaseSemaphore(connectionSlots, numSlots, NULL);
+
+    return ret;
+}
+
+//-------------------------------------------------------------
+// Streaming download: the file is read while it's being written
+
+void DownloadProgress_Init(download_progress_t *progress, LONGLONG available, LONGLONG tailStart, LONGLONG size)
+{
+    InitializeSRWLock(&progress->lock);
+    InitializeConditionVariable(&progress->changed);
+    progress->available = available;
+    progress->tailStart = tailStart;
+    progress->size = size;
+    progress->state = 0;
+    progress->cancelled = 0;
+}
+
+LONGLONG DownloadProgress_Wait(download_progress_t *progress, LONGLONG pos)
+{
+    LONGLONG avail = 0;
+
+    AcquireSRWLockExclusive(&progress->lock);
+
+    while (pos >= progress->available && pos < progress->tailStart && progress->state == 0)
+        SleepConditionVariableSRW(&progress->changed, &progress->lock, INFINITE, 0);
+
+    if (pos >= progress->tailStart)
+        avail = max(progress->size - pos, 0LL);
+    else if (pos < progress->available)
+        avail = progress->available - pos;
+
+    ReleaseSRWLockExclusive(&progress->lock);
+
+    return avail;
+}
+
+static void DownloadProgress_Publish(download_progress_t *progress, LONGLONG available, int state)
+{
+    AcquireSRWLockExclusive(&progress->lock);
+
+    progress->available = available;
+    progress->state = state;
+
+    ReleaseSRWLockExclusive(&progress->lock);
+
+    WakeAllConditionVariable(&progress->changed);
+}
+
+void DownloadProgress_Finish(download_progress_t *progress, bool success)
+{
+    DownloadProgress_Publish(progress, progress->available, success ? 1 : -1);
+}
+
+//Parses the total size out of "bytes <start>-<end>/<total>"
+static LONGLONG GetContentRangeTotal(const _TCHAR *contentRange)
+{
+    const _TCHAR *p = _tcschr(contentRange, '/');
+    if (!p || !isdigit(p[1]))
+        return -1;
+
+    return (LONGLONG)_tcstoui64(p + 1, NULL, 10);
+}
+
+static bool OpenConnection(const _TCHAR *url, HINTERNET *hSession, HINTERNET *hConnect, _TCHAR *path, DWORD pathLen, BOOL *secure, int *responseCode)
+{
+    URL_COMPONENTS  urlComponents;
+    _TCHAR hostName[256];
+
+    ZeroMemory (&urlComponents, sizeof(urlComponents));
+
+    urlComponents.dwStructSize = sizeof(urlComponents);
+
+    urlComponents.lpszHostName = hostName;
+    urlComponents.dwHostNameLength = _countof(hostName);
+
+    urlComponents.lpszUrlPath = path;
+    urlComponents.dwUrlPathLength = pathLen;
+
+    WinHttpCrackUrl(url, 0, 0, &urlComponents);
+
+    *secure = urlComponents.nPort == 443;
+
+    *hSession = WinHttpOpen(_T("OBS Updater/1.2-archive1"), WINHTTP_ACCESS_TYPE_DEFAULT_PROXY, WINHTTP_NO_PROXY_NAME, WINHTTP_NO_PROXY_BYPASS, 0);
+    if (!*hSession)
+    {
+        *responseCode = -1;
+        return false;
+    }
+
+    *hConnect = WinHttpConnect(*hSession, hostName, *secure ? INTERNET_DEFAULT_HTTPS_PORT : INTERNET_DEFAULT_HTTP_PORT, 0);
+    if (!*hConnect)
+    {
+        *responseCode = -2;
+        WinHttpCloseHandle(*hSession);
+        *hSession = NULL;
+        return false;
+    }
+
+    return true;
+}
+
+//Requests bytes [start, end] and checks the server really answered with that range. With a validator, a server
+//that has a different version of the file by now answers with all of it instead, which is refused here as well.
+static HINTERNET SendRangeRequest(HINTERNET hConnect, const _TCHAR *path, BOOL secure, LONGLONG start, LONGLONG end, const _TCHAR *validator,
+    LONGLONG *fileSize, int *responseCode)
+{
+    _TCHAR rangeHeader[256];
+    TCHAR contentRange[128];
+    DWORD contentRangeLen;
+
+    if (validator && validator[0])
+        StringCbPrintf(rangeHeader, sizeof(rangeHeader), _T("Range: bytes=%I64d-%I64d\r\nIf-Range: %s"), start, end, validator);
+    else
+        StringCbPrintf(rangeHeader, sizeof(rangeHeader), _T("Range: bytes=%I64d-%I64d"), start, end);
+
+    HINTERNET hRequest = SendRequest(hConnect, TEXT("GET"), path, secure, rangeHeader, responseCode);
+    if (!hRequest)
+        return NULL;
+
+    contentRange[0] = 0;
+    contentRangeLen = sizeof(contentRange);
+    WinHttpQueryHeaders(hRequest, WINHTTP_QUERY_CONTENT_RANGE, WINHTTP_HEADER_NAME_BY_INDEX, contentRange, &contentRangeLen, WINHTTP_NO_HEADER_INDEX);
+
+    if (*responseCode != 206 || GetContentRangeStart(contentRange) != start)
+    {
+        *responseCode = -15;
+        WinHttpCloseHandle(hRequest);
+        return NULL;
+    }
+
+    if (fileSize)
+        *fileSize = GetContentRangeTotal(contentRange);
+
+    return hRequest;
+}
+
+bool HTTPGetRange(const _TCHAR *url, LONGLONG start, LONGLONG end, BYTE *buffer, LONGLONG *fileSize, _TCHAR *validator, DWORD validatorSize,
+    int *responseCode)
+{
+    HINTERNET hSession = NULL;
+    HINTERNET hConnect = NULL;
+    HINTERNET hRequest = NULL;
+    BOOL secure;
+    _TCHAR path[1024];
+    bool ret = false;
+
+    if (!OpenConnection(url, &hSession, &hConnect, path, _countof(path), &secure, responseCode))
+        return false;
+
+    hRequest = SendRangeRequest(hConnect, path, secure, start, end, validator, fileSize, responseCode);
+    if (!hRequest)
+        goto failure;
+
+    if (!validator[0])
+        QueryValidator(hRequest, validator, validatorSize);
+
+    for (LONGLONG offset = start; offset <= end;)
+    {
+        DWORD dwSize = 0, dwOutSize;
+
+        if (!WinHttpQueryDataAvailable(hRequest, &dwSize))
+        {
+            *responseCode = -8;
+            goto failure;
+        }
+
+        dwSize = (DWORD)min((LONGLONG)dwSize, end + 1 - offset);
+
+        if (!WinHttpReadData(hRequest, buffer + (offset - start), dwSize, &dwOutSize))
+        {
+            *responseCode = -9;
+            goto failure;
+        }
+
+        if (!dwOutSize)
+        {
+            *responseCode = -17;
+            goto failure;
+        }
+
+        offset += dwOutSize;
+    }
+
+    *responseCode = 206;
+    ret = true;
+
+failure:
+    if (hRequest)
+        WinHttpCloseHandle(hRequest);
+    if (hConnect)
+        WinHttpCloseHandle(hConnect);
+    if (hSession)
+        WinHttpCloseHandle(hSession);
+
+    return ret;
+}
+
+//Feeds bytes [start, end) of a file into the digest
+static bool HashFileRange(HANDLE file, LONGLONG start, LONGLONG end, CSha1 *sha)
+{
+    BYTE buffer[32768];
+
+    while (start < end)
+    {
+        DWORD toRead = (DWORD)min((LONGLONG)sizeof(buffer), end - start), read;
+
+        OVERLAPPED ov;
+        ZeroMemory(&ov, sizeof(ov));
+        ov.Offset = (DWORD)start;
+        ov.OffsetHigh = (DWORD)(start >> 32);
+
+        if (!ReadFile(file, buffer, toRead, &read, &ov) || read != toRead)
+            return false;
+
+        Sha1_Update(sha, buffer, read);
+        start += read;
+    }
+
+    return true;
+}
+
+bool HTTPGetFileStreaming(const _TCHAR *url, const _TCHAR *outputPath, HANDLE outputFile, download_progress_t *progress, const _TCHAR *validator,
+    BYTE *hash, int *responseCode)
+{
+    HINTERNET hSession = NULL;
+    HINTERNET hConnect = NULL;
+    HINTERNET hRequest = NULL;
+    BOOL secure;
+    _TCHAR path[1024];
+    bool ret = false;
+    bool resumable = false;
+
+    LONGLONG offset = progress->available;
+    LONGLONG end = progress->tailStart;
+
+    CSha1 sha;
+    Sha1_Init(&sha);
+
+    //Everything before the body was written up front, or by an earlier attempt
+    if (!HashFileRange(outputFile, 0, offset, &sha))
+    {
+        *responseCode = -19;
+        goto failure;
+    }
+
+    resumable = validator[0] != 0;
+
+    if (offset < end)
+    {
+        if (!OpenConnection(url, &hSession, &hConnect, path, _countof(path), &secure, responseCode))
+            goto failure;
+
+        hRequest = SendRangeRequest(hConnect, path, secure, offset, end - 1, validator, NULL, responseCode);
+        if (!hRequest)
+            goto failure;
+    }
+
+    {
+        BYTE buffer[32768];
+        int lastPosition = 0;
+
+        while (offset < end)
+        {
+            DWORD dwSize = 0, dwOutSize, wrote;
+
+            if (progress->cancelled || WaitForSingleObject(cancelRequested, 0) == WAIT_OBJECT_0)
+            {
+                *responseCode = -14;
+                goto failure;
+            }
+
+            if (!WinHttpQueryDataAvailable(hRequest, &dwSize))
+            {
+                *responseCode = -8;
+                goto failure;
+            }
+
+            dwSize = (DWORD)min((LONGLONG)min(dwSize, sizeof(buffer)), end - offset);
+
+            if (!WinHttpReadData(hRequest, (LPVOID)buffer, dwSize, &dwOutSize))
+            {
+                *responseCode = -9;
+                goto failure;
+            }
+
+            if (!dwOutSize)
+            {
+                *responseCode = -17;
+                goto failure;
+            }
+
+            OVERLAPPED ov;
+            ZeroMemory(&ov, sizeof(ov));
+            ov.Offset = (DWORD)offset;
+            ov.OffsetHigh = (DWORD)(offset >> 32);
+
+            if (!WriteFile(outputFile, buffer, dwOutSize, &wrote, &ov) || wrote != dwOutSize)
+            {
+                *responseCode = -12;
+                goto failure;
+            }
+
+            Sha1_Update(&sha, buffer, wrote);
+            offset += wrote;
+
+            //Readers blocked on this range can go ahead now
+            DownloadProgress_Publish(progress, offset, 0);
+
+            InterlockedExchangeAdd(&completedFileSize, wrote);
+
+            int position = (int)(((float)completedFileSize / (float)totalFileSize) * 100.0f);
+            if (position > lastPosition)
+            {
+                lastPosition = position;
+                SendDlgItemMessage (hwndMain, IDC_PROGRESS, PBM_SETPOS, position, 0);
+            }
+        }
+    }
+
+    if (!HashFileRange(outputFile, end, progress->size, &sha))
+    {
+        *responseCode = -19;
+        goto failure;
+    }
+
+    if (hash)
+        Sha1_Final(&sha, hash);
+
+    DeleteResumeInfo(outputPath);
+
+    *responseCode = 200;
+    ret = true;
+
+failure:
+    //The body is written in order, so what we have can be finished by any later download of the same version
+    if (!ret && resumable && offset > 0 && offset < end)
+        SaveResumeInfo(outputPath, validator, offset, &sha);
+
+    if (hRequest)
+        WinHttpCloseHandle(hRequest);
+    if (hConnect)
+        WinHttpCloseHandle(hConnect);
+    if (hSession)
+        WinHttpCloseHandle(hSession);
+
+    return ret;
+}
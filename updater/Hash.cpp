@@ -1,5 +1,9 @@
 #include "Updater.h"
 
+#include "../lzma/C/Sha1.h"
+
+using namespace std;
+
 void HashToString(BYTE *in, TCHAR *out)
 {
     const char alphabet[] = "0123456789abcdef";
@@ -27,14 +31,13 @@ void StringToHash(TCHAR *in, BYTE *out)
 bool CalculateFileHash(TCHAR *path, BYTE *hash)
 {
     BYTE buff[65536];
-    HCRYPTHASH hHash;
+    CSha1 sha;
 
-    if (!CryptCreateHash(hProvider, CALG_SHA1, 0, 0, &hHash))
-        return false;
+    Sha1_Init(&sha);
 
     HANDLE hFile;
 
-    hFile = CreateFile(path, GENERIC_READ, 0, NULL, OPEN_EXISTING, 0, NULL);
+    hFile = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
     if (hFile == INVALID_HANDLE_VALUE)
     {
         if (GetLastError() == ERROR_FILE_NOT_FOUND)
@@ -44,7 +47,7 @@ bool CalculateFileHash(TCHAR *path, BYTE *hash)
             return true;
         }
 
-        return true;
+        return false;
     }
 
     for (;;)
@@ -60,20 +63,198 @@ bool CalculateFileHash(TCHAR *path, BYTE *hash)
         if (!read)
             break;
 
-        if (!CryptHashData(hHash, buff, read, 0))
+        Sha1_Update(&sha, buff, read);
+    }
+
+    CloseHandle(hFile);
+
+    Sha1_Final(&sha, hash);
+    return true;
+}
+
+//-------------------------------------------------------------
+// Batch hashing of many files across a pool of worker threads
+
+#define HASH_MAP_VIEW_SIZE (64*1024*1024)
+
+struct hash_batch_t
+{
+    const wstring   *paths;
+    file_hash_t     *results;
+    const LONG      *pending;
+    LONG            numPending;
+    volatile LONG   nextPending;
+};
+
+//Hashes through a sliding read-only view instead of copying into a buffer
+static bool HashMappedFile(const TCHAR *path, BYTE *hash)
+{
+    CSha1 sha;
+    HANDLE hFile, hMapping;
+    LARGE_INTEGER size;
+
+    Sha1_Init(&sha);
+
+    hFile = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        if (GetLastError() == ERROR_FILE_NOT_FOUND)
         {
-            CryptDestroyHash(hHash);
-            CloseHandle(hFile);
-            return false;
+            //A missing file is OK
+            memset (hash, 0, 20);
+            return true;
         }
+
+        return false;
     }
 
+    if (!GetFileSizeEx(hFile, &size))
+    {
+        CloseHandle(hFile);
+        return false;
+    }
+
+    //Empty files can't be mapped
+    if (size.QuadPart == 0)
+    {
+        CloseHandle(hFile);
+        Sha1_Final(&sha, hash);
+        return true;
+    }
+
+    hMapping = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
     CloseHandle(hFile);
 
-    DWORD hashLength = 20;
-    if (!CryptGetHashParam(hHash, HP_HASHVAL, hash, &hashLength, 0))
+    if (!hMapping)
         return false;
 
-    CryptDestroyHash(hHash);
+    for (LONGLONG offset = 0; offset < size.QuadPart; offset += HASH_MAP_VIEW_SIZE)
+    {
+        SIZE_T viewSize = (SIZE_T)min((LONGLONG)HASH_MAP_VIEW_SIZE, size.QuadPart - offset);
+
+        BYTE *view = (BYTE *)MapViewOfFile(hMapping, FILE_MAP_READ, (DWORD)(offset >> 32), (DWORD)offset, viewSize);
+        if (!view)
+        {
+            CloseHandle(hMapping);
+            return false;
+        }
+
+        Sha1_Update(&sha, view, viewSize);
+        UnmapViewOfFile(view);
+    }
+
+    CloseHandle(hMapping);
+
+    Sha1_Final(&sha, hash);
     return true;
 }
+
+static DWORD WINAPI HashWorkerThread(void *arg)
+{
+    hash_batch_t *batch = (hash_batch_t *)arg;
+
+    for (;;)
+    {
+        LONG next = InterlockedIncrement(&batch->nextPending) - 1;
+        if (next >= batch->numPending)
+            break;
+
+        LONG index = batch->pending[next];
+        file_hash_t *result = &batch->results[index];
+        result->valid = HashMappedFile(batch->paths[index].c_str(), result->hash);
+    }
+
+    return 0;
+}
+
+bool CalculateFileHashes(const vector<wstring> &paths, file_hash_table_t &hashes, int numThreads, hash_cache_t *cache)
+{
+    hash_batch_t batch;
+    vector<file_hash_t> results;
+    vector<file_stamp_t> stamps;
+    vector<bool> stamped;
+    vector<LONG> pending;
+    vector<HANDLE> threads;
+
+    if (paths.empty())
+        return true;
+
+    results.resize(paths.size());
+    stamps.resize(paths.size());
+    stamped.resize(paths.size());
+
+    //Only files the cache can't vouch for go to the pool
+    for (size_t i = 0; i < paths.size(); i++)
+    {
+        if (cache && GetFileStamp(paths[i].c_str(), &stamps[i]))
+        {
+            stamped[i] = true;
+
+            if (HashCache_Lookup(cache, paths[i].c_str(), &stamps[i], results[i].hash))
+            {
+                results[i].valid = true;
+                continue;
+            }
+        }
+
+        pending.push_back((LONG)i);
+    }
+
+    if (pending.empty())
+        numThreads = 0;
+    else if (numThreads <= 0)
+    {
+        SYSTEM_INFO si;
+        GetSystemInfo(&si);
+        numThreads = (int)si.dwNumberOfProcessors;
+    }
+
+    //The threads are waited for in one WaitForMultipleObjects call
+    numThreads = min(numThreads, MAX_HASH_THREADS);
+    numThreads = min(numThreads, (int)pending.size());
+
+    batch.paths = &paths[0];
+    batch.results = &results[0];
+    batch.pending = pending.empty() ? NULL : &pending[0];
+    batch.numPending = (LONG)pending.size();
+    batch.nextPending = 0;
+
+    for (int i = 0; i < numThreads; i++)
+    {
+        HANDLE hThread = CreateThread(NULL, 0, HashWorkerThread, &batch, 0, NULL);
+        if (!hThread)
+            break;
+
+        threads.push_back(hThread);
+    }
+
+    //Whatever the pool didn't get to (or all of it, if no thread started) is done here
+    HashWorkerThread(&batch);
+
+    if (!threads.empty())
+        WaitForMultipleObjects((DWORD)threads.size(), &threads[0], TRUE, INFINITE);
+
+    for (size_t i = 0; i < threads.size(); i++)
+        CloseHandle(threads[i]);
+
+    bool success = true;
+
+    for (size_t i = 0; i < paths.size(); i++)
+    {
+        hashes[paths[i]] = results[i];
+        if (!results[i].valid)
+            success = false;
+    }
+
+    if (cache)
+    {
+        for (size_t i = 0; i < pending.size(); i++)
+        {
+            LONG index = pending[i];
+            if (stamped[index] && results[index].valid)
+                HashCache_Update(cache, paths[index].c_str(), &stamps[index], results[index].hash);
+        }
+    }
+
+    return success;
+}
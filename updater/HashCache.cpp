@@ -0,0 +1,372 @@
+/********************************************************************************
+ Persistent file hash cache
+
+ Maps a file's identity (path, size, last write time, volume serial and file
+ index) to its SHA-1 so unchanged files don't have to be hashed again on the
+ next run. The cache file is a flat, memory-mappable table:
+
+   hash_cache_header_t
+   hash_cache_entry_t[numEntries]  sorted by path, for binary search
+   WCHAR strings[]                 lowercased paths, not null terminated
+********************************************************************************/
+
+#include "Updater.h"
+
+using namespace std;
+
+#define HASH_CACHE_MAGIC    0x43484F42 // "BOHC"
+#define HASH_CACHE_VERSION  1
+
+struct hash_cache_header_t
+{
+    DWORD           magic;
+    DWORD           version;
+    DWORD           numEntries;
+    DWORD           stringsSize;
+};
+
+struct hash_cache_entry_t
+{
+    ULONGLONG       size;
+    ULONGLONG       lastWriteTime;
+    ULONGLONG       fileIndex;
+    DWORD           volumeSerial;
+    DWORD           pathOffset;
+    DWORD           pathLength;
+    BYTE            hash[20];
+};
+
+static void NormalizePath(const TCHAR *path, wstring &key)
+{
+    TCHAR fullPath[MAX_PATH];
+
+    if (!GetFullPathName(path, _countof(fullPath), fullPath, NULL))
+        StringCbCopy(fullPath, sizeof(fullPath), path);
+
+    key = fullPath;
+    for (size_t i = 0; i < key.size(); i++)
+    {
+        if (key[i] == '/')
+            key[i] = '\\';
+        else
+            key[i] = (wchar_t)towlower(key[i]);
+    }
+}
+
+bool GetFileStamp(const TCHAR *path, file_stamp_t *stamp)
+{
+    BY_HANDLE_FILE_INFORMATION info;
+
+    HANDLE hFile = CreateFile(path, 0, FILE_SHARE_READ|FILE_SHARE_WRITE|FILE_SHARE_DELETE, NULL, OPEN_EXISTING, 0, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return false;
+
+    BOOL success = GetFileInformationByHandle(hFile, &info);
+    CloseHandle(hFile);
+
+    if (!success)
+        return false;
+
+    stamp->size = ((ULONGLONG)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+    stamp->lastWriteTime = ((ULONGLONG)info.ftLastWriteTime.dwHighDateTime << 32) | info.ftLastWriteTime.dwLowDateTime;
+    stamp->fileIndex = ((ULONGLONG)info.nFileIndexHigh << 32) | info.nFileIndexLow;
+    stamp->volumeSerial = info.dwVolumeSerialNumber;
+
+    return true;
+}
+
+void HashCache_Init(hash_cache_t *cache)
+{
+    cache->mapping = NULL;
+    cache->view = NULL;
+    cache->numEntries = 0;
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->path[0] = 0;
+}
+
+bool HashCache_Open(hash_cache_t *cache, const TCHAR *cachePath)
+{
+    HANDLE hFile;
+    LARGE_INTEGER size;
+
+    HashCache_Close(cache);
+    StringCbCopy(cache->path, sizeof(cache->path), cachePath);
+
+    hFile = CreateFile(cachePath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return GetLastError() == ERROR_FILE_NOT_FOUND; //no cache yet is fine
+
+    if (!GetFileSizeEx(hFile, &size) || size.QuadPart < sizeof(hash_cache_header_t))
+    {
+        CloseHandle(hFile);
+        return false;
+    }
+
+    cache->mapping = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(hFile);
+
+    if (!cache->mapping)
+        return false;
+
+    cache->view = (const BYTE *)MapViewOfFile(cache->mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!cache->view)
+    {
+        HashCache_Close(cache);
+        return false;
+    }
+
+    const hash_cache_header_t *header = (const hash_cache_header_t *)cache->view;
+
+    ULONGLONG expectedSize = sizeof(hash_cache_header_t) +
+        (ULONGLONG)header->numEntries * sizeof(hash_cache_entry_t) +
+        (ULONGLONG)header->stringsSize * sizeof(WCHAR);
+
+    //Anything that doesn't look exactly right is treated as an empty cache
+    if (header->magic != HASH_CACHE_MAGIC || header->version != HASH_CACHE_VERSION || expectedSize != (ULONGLONG)size.QuadPart)
+    {
+        UnmapViewOfFile(cache->view);
+        CloseHandle(cache->mapping);
+        cache->view = NULL;
+        cache->mapping = NULL;
+        return false;
+    }
+
+    cache->numEntries = header->numEntries;
+    return true;
+}
+
+void HashCache_Close(hash_cache_t *cache)
+{
+    if (cache->view)
+        UnmapViewOfFile(cache->view);
+    if (cache->mapping)
+        CloseHandle(cache->mapping);
+
+    cache->view = NULL;
+    cache->mapping = NULL;
+    cache->numEntries = 0;
+    cache->updates.clear();
+}
+
+static const hash_cache_entry_t *FindEntry(const hash_cache_t *cache, const wstring &key, const WCHAR **strings)
+{
+    if (!cache->view)
+        return nullptr;
+
+    const hash_cache_entry_t *entries = (const hash_cache_entry_t *)(cache->view + sizeof(hash_cache_header_t));
+    const WCHAR *pathStrings = (const WCHAR *)(entries + cache->numEntries);
+    DWORD stringsSize = ((const hash_cache_header_t *)cache->view)->stringsSize;
+
+    DWORD left = 0, right = cache->numEntries;
+    while (left < right)
+    {
+        DWORD mid = left + (right - left) / 2;
+        const hash_cache_entry_t *entry = &entries[mid];
+
+        if (entry->pathOffset > stringsSize || entry->pathLength > stringsSize - entry->pathOffset)
+            return nullptr;
+
+        int cmp = key.compare(0, wstring::npos, pathStrings + entry->pathOffset, entry->pathLength);
+        if (cmp == 0)
+        {
+            *strings = pathStrings;
+            return entry;
+        }
+
+        if (cmp < 0)
+            right = mid;
+        else
+            left = mid + 1;
+    }
+
+    return nullptr;
+}
+
+bool HashCache_Lookup(hash_cache_t *cache, const TCHAR *path, const file_stamp_t *stamp, BYTE *hash)
+{
+    wstring key;
+    const WCHAR *strings;
+
+    NormalizePath(path, key);
+
+    //Recorded this run, not yet saved
+    map<wstring, hash_cache_update_t>::const_iterator it = cache->updates.find(key);
+    if (it != cache->updates.end())
+    {
+        const file_stamp_t &cached = it->second.stamp;
+        if (cached.size == stamp->size &&
+            cached.lastWriteTime == stamp->lastWriteTime &&
+            cached.fileIndex == stamp->fileIndex &&
+            cached.volumeSerial == stamp->volumeSerial)
+        {
+            memcpy(hash, it->second.hash, 20);
+            InterlockedIncrement(&cache->hits);
+            return true;
+        }
+    }
+    else
+    {
+        const hash_cache_entry_t *entry = FindEntry(cache, key, &strings);
+        if (entry &&
+            entry->size == stamp->size &&
+            entry->lastWriteTime == stamp->lastWriteTime &&
+            entry->fileIndex == stamp->fileIndex &&
+            entry->volumeSerial == stamp->volumeSerial)
+        {
+            memcpy(hash, entry->hash, 20);
+            InterlockedIncrement(&cache->hits);
+            return true;
+        }
+    }
+
+    InterlockedIncrement(&cache->misses);
+    return false;
+}
+
+void HashCache_Update(hash_cache_t *cache, const TCHAR *path, const file_stamp_t *stamp, const BYTE *hash)
+{
+    wstring key;
+    hash_cache_update_t update;
+
+    NormalizePath(path, key);
+
+    ZeroMemory(&update, sizeof(update));
+    update.stamp = *stamp;
+    memcpy(update.hash, hash, 20);
+
+    cache->updates[key] = update;
+}
+
+//Writes the merged table next to the old one and swaps it in, so a crash never leaves a torn cache
+bool HashCache_Save(hash_cache_t *cache)
+{
+    map<wstring, hash_cache_entry_t> merged;
+    vector<hash_cache_entry_t> entries;
+    wstring strings;
+    TCHAR tempPath[MAX_PATH];
+
+    if (!cache->path[0])
+        return false;
+
+    if (cache->updates.empty())
+        return true;
+
+    if (cache->view)
+    {
+        const hash_cache_entry_t *oldEntries = (const hash_cache_entry_t *)(cache->view + sizeof(hash_cache_header_t));
+        const WCHAR *oldStrings = (const WCHAR *)(oldEntries + cache->numEntries);
+        DWORD stringsSize = ((const hash_cache_header_t *)cache->view)->stringsSize;
+
+        for (DWORD i = 0; i < cache->numEntries; i++)
+        {
+            const hash_cache_entry_t &entry = oldEntries[i];
+            if (entry.pathOffset > stringsSize || entry.pathLength > stringsSize - entry.pathOffset)
+                continue;
+
+            merged[wstring(oldStrings + entry.pathOffset, entry.pathLength)] = entry;
+        }
+    }
+
+    for (map<wstring, hash_cache_update_t>::const_iterator it = cache->updates.begin(); it != cache->updates.end(); ++it)
+    {
+        hash_cache_entry_t entry;
+
+        ZeroMemory(&entry, sizeof(entry));
+        entry.size = it->second.stamp.size;
+        entry.lastWriteTime = it->second.stamp.lastWriteTime;
+        entry.fileIndex = it->second.stamp.fileIndex;
+        entry.volumeSerial = it->second.stamp.volumeSerial;
+        memcpy(entry.hash, it->second.hash, 20);
+
+        merged[it->first] = entry;
+    }
+
+    for (map<wstring, hash_cache_entry_t>::iterator it = merged.begin(); it != merged.end(); ++it)
+    {
+        it->second.pathOffset = (DWORD)strings.size();
+        it->second.pathLength = (DWORD)it->first.size();
+        strings += it->first;
+
+        entries.push_back(it->second);
+    }
+
+    hash_cache_header_t header;
+    header.magic = HASH_CACHE_MAGIC;
+    header.version = HASH_CACHE_VERSION;
+    header.numEntries = (DWORD)entries.size();
+    header.stringsSize = (DWORD)strings.size();
+
+    StringCbPrintf(tempPath, sizeof(tempPath), _T("%s.new"), cache->path);
+
+    HANDLE hFile = CreateFile(tempPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 0, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return false;
+
+    DWORD wrote;
+    DWORD entriesSize = (DWORD)(entries.size() * sizeof(hash_cache_entry_t));
+    DWORD stringsSize = (DWORD)(strings.size() * sizeof(WCHAR));
+
+    bool success =
+        WriteFile(hFile, &header, sizeof(header), &wrote, NULL) && wrote == sizeof(header) &&
+        (!entriesSize || (WriteFile(hFile, &entries[0], entriesSize, &wrote, NULL) && wrote == entriesSize)) &&
+        (!stringsSize || (WriteFile(hFile, strings.c_str(), stringsSize, &wrote, NULL) && wrote == stringsSize)) &&
+        FlushFileBuffers(hFile);
+
+    CloseHandle(hFile);
+
+    if (!success)
+    {
+        DeleteFile(tempPath);
+        return false;
+    }
+
+    //The old mapping has to go before the file underneath it can be replaced
+    if (cache->view)
+        UnmapViewOfFile(cache->view);
+    if (cache->mapping)
+        CloseHandle(cache->mapping);
+
+    cache->view = NULL;
+    cache->mapping = NULL;
+    cache->numEntries = 0;
+
+    if (!MoveFileEx(tempPath, cache->path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+    {
+        DeleteFile(tempPath);
+        return false;
+    }
+
+    cache->updates.clear();
+
+    TCHAR cachePath[MAX_PATH];
+    StringCbCopy(cachePath, sizeof(cachePath), cache->path);
+    return HashCache_Open(cache, cachePath);
+}
+
+bool CalculateFileHashCached(hash_cache_t *cache, TCHAR *path, BYTE *hash)
+{
+    file_stamp_t stamp;
+
+    if (!cache || !GetFileStamp(path, &stamp))
+        return CalculateFileHash(path, hash);
+
+    if (HashCache_Lookup(cache, path, &stamp, hash))
+        return true;
+
+    if (!CalculateFileHash(path, hash))
+        return false;
+
+    //Don't cache the zeros of a file that went missing, or a file that changed while it was hashed
+    file_stamp_t hashedStamp;
+    if (GetFileStamp(path, &hashedStamp) &&
+        hashedStamp.size == stamp.size &&
+        hashedStamp.lastWriteTime == stamp.lastWriteTime &&
+        hashedStamp.fileIndex == stamp.fileIndex &&
+        hashedStamp.volumeSerial == stamp.volumeSerial)
+    {
+        HashCache_Update(cache, path, &stamp, hash);
+    }
+
+    return true;
+}
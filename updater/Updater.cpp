@@ -21,6 +21,7 @@
 #include "scopeguard.hpp"
 
 #include <vector>
+#include <algorithm>
 #include <codecvt>
 
 #include <stdio.h>
@@ -31,10 +32,15 @@
 #include "../lzma/C/7zCrc.h"
 #include "../lzma/C/7zFile.h"
 #include "../lzma/C/7zVersion.h"
+#include "../lzma/C/BinPatch.h"
+#include "../lzma/C/CpuArch.h"
+#include "../lzma/C/Sha1.h"
 
 /* required defines to avoid clashes with the standard obs updater
 #define MANIFEST_PATH "/updates/org.example.foo.xconfig"
 #define TEMP_PATH "/updates/org.example.foo"
+#define HASH_CACHE_PATH "/updates/org.example.foo.hashcache"
+#define CHUNK_CACHE_PATH "/updates/org.example.foo.chunks"
 */
 
 #ifndef MANIFEST_PATH
@@ -45,24 +51,31 @@
 #define TEMP_PATH "\\updates\\temp"
 #endif
 
-using namespace std;
+#ifndef HASH_CACHE_PATH
+#define HASH_CACHE_PATH "\\updates\\hashcache.bin"
+#endif
+
+#ifndef CHUNK_CACHE_PATH
+#define CHUNK_CACHE_PATH "\\updates\\chunks"
+#endif
 
-CRITICAL_SECTION updateMutex;
+#define MAX_CONNECTIONS_PER_HOST    4
+#define MAX_DOWNLOAD_ATTEMPTS       3
+
+using namespace std;
 
 HANDLE cancelRequested;
+HANDLE downloadFailed;
 HANDLE updateThread;
 HINSTANCE hinstMain;
 HWND hwndMain;
-HCRYPTPROV hProvider;
 
 BOOL bExiting;
 BOOL updateFailed = FALSE;
 
-BOOL downloadThreadFailure = FALSE;
-
-int totalFileSize = 0;
-int completedFileSize = 0;
-int completedUpdates = 0;
+volatile LONG totalFileSize = 0;
+volatile LONG completedFileSize = 0;
+volatile LONG completedUpdates = 0;
 
 template <typename T>
 void Zero(T &t)
@@ -73,6 +86,87 @@ void Zero(T &t)
 void *Alloc_(void*, size_t size) { if (size) return malloc(size); return nullptr; }
 void Free_(void*, void *addr) { free(addr); }
 
+struct mem_in_stream_t
+{
+    ISeqInStream    s;
+    const Byte      *data;
+    size_t          size;
+    size_t          pos;
+};
+
+static SRes MemInStream_Read(void *p, void *buf, size_t *size)
+{
+    mem_in_stream_t *stream = (mem_in_stream_t *)p;
+
+    *size = min(*size, stream->size - stream->pos);
+    memcpy(buf, stream->data + stream->pos, *size);
+    stream->pos += *size;
+
+    return SZ_OK;
+}
+
+static void MemInStream_Init(mem_in_stream_t *stream, const Byte *data, size_t size)
+{
+    stream->s.Read = MemInStream_Read;
+    stream->data = data;
+    stream->size = size;
+    stream->pos = 0;
+}
+
+//Reads an archive that is still being downloaded, blocking until the requested bytes are there
+struct pipe_in_stream_t
+{
+    ISeekInStream       s;
+    HANDLE              hFile;
+    LONGLONG            pos;
+    download_progress_t *progress;
+};
+
+static SRes PipeInStream_Read(void *p, void *buf, size_t *size)
+{
+    pipe_in_stream_t *stream = (pipe_in_stream_t *)p;
+
+    if (*size == 0 || stream->pos >= stream->progress->size)
+    {
+        *size = 0;
+        return SZ_OK;
+    }
+
+    LONGLONG avail = DownloadProgress_Wait(stream->progress, stream->pos);
+    if (!avail)
+        return SZ_ERROR_READ;
+
+    DWORD toRead = (DWORD)min((LONGLONG)min(*size, (size_t)(1 << 20)), avail), read;
+
+    OVERLAPPED ov;
+    ZeroMemory(&ov, sizeof(ov));
+    ov.Offset = (DWORD)stream->pos;
+    ov.OffsetHigh = (DWORD)(stream->pos >> 32);
+
+    if (!ReadFile(stream->hFile, buf, toRead, &read, &ov))
+        return SZ_ERROR_READ;
+
+    stream->pos += read;
+    *size = read;
+    return SZ_OK;
+}
+
+static SRes PipeInStream_Seek(void *p, Int64 *pos, ESzSeek origin)
+{
+    pipe_in_stream_t *stream = (pipe_in_stream_t *)p;
+
+    switch (origin)
+    {
+        case SZ_SEEK_SET: stream->pos = *pos; break;
+        case SZ_SEEK_CUR: stream->pos += *pos; break;
+        case SZ_SEEK_END: stream->pos = stream->progress->size + *pos; break;
+        default: return SZ_ERROR_PARAM;
+    }
+
+    *pos = stream->pos;
+    return SZ_OK;
+}
+
 void Status(const _TCHAR *fmt, ...)
 {
     _TCHAR str[512];
@@ -188,204 +282,1232 @@ void CleanupPartialUpdates(update_t *updates)
             DeleteFile(updates->tempPath);
         }
     }
-}
+}
+
+void DestroyUpdateList(update_t *updates)
+{
+    update_t *next;
+
+    updates = updates->next;
+    if (!updates)
+        return;
+
+    updates->next = NULL;
+
+    while (updates)
+    {
+        next = updates->next;
+
+        if (updates->outputPath)
+            free(updates->outputPath);
+        if (updates->previousFile)
+            free(updates->previousFile);
+        if (updates->tempPath)
+            free(updates->tempPath);
+        if (updates->URL)
+            free(updates->URL);
+
+        free(updates);
+
+        updates = next;
+    }
+}
+
+bool IsSafeFilename(_TCHAR *path)
+{
+    const _TCHAR *p;
+
+    p = path;
+
+    if (!*p)
+       return FALSE;
+
+    if (_tcsstr(path, _T("..")))
+        return FALSE;
+
+    if (*p == '/')
+        return FALSE;
+
+    while (*p)
+    {
+        if (!isalnum(*p) && *p != '.' && *p != '/' && *p != '_' && *p != '-')
+            return FALSE;
+        p++;
+    }
+
+    return TRUE;
+}
+
+bool IsSafePath(_TCHAR * path)
+{
+    const _TCHAR *p;
+
+    p = path;
+
+    if (!*p)
+        return TRUE;
+
+    if (!isalnum(*p))
+        return FALSE;
+
+    while (*p)
+    {
+        if (*p == '.' || *p == '\\')
+            return FALSE;
+        p++;
+    }
+    
+    return TRUE;
+}
+
+struct host_slot_t
+{
+    _TCHAR          hostName[256];
+    HANDLE          semaphore;
+};
+
+struct download_queue_t
+{
+    update_t        **items;
+    host_slot_t     **itemHosts;
+    LONG            numItems;
+    volatile LONG   nextItem;
+
+    host_slot_t     *hosts;
+    int             numHosts;
+};
+
+bool DownloadAborted()
+{
+    HANDLE hWait[2] = { cancelRequested, downloadFailed };
+    return WaitForMultipleObjects(2, hWait, FALSE, 0) != WAIT_TIMEOUT;
+}
+
+static void FailDownloads()
+{
+    SetEvent(downloadFailed);
+}
+
+DWORD WINAPI DownloadWorkerThread(void *arg)
+{
+    download_queue_t *queue = (download_queue_t *)arg;
+
+    for (;;)
+    {
+        int responseCode;
+
+        if (DownloadAborted())
+            return 1;
+
+        //Claim the next pending item, the queue is sorted largest file first
+        LONG index = InterlockedIncrement(&queue->nextItem) - 1;
+        if (index >= queue->numItems)
+            break;
+
+        update_t *update = queue->items[index];
+        host_slot_t *host = queue->itemHosts[index];
+
+        HANDLE hWait[3] = { host->semaphore, cancelRequested, downloadFailed };
+        if (WaitForMultipleObjects(3, hWait, FALSE, INFINITE) != WAIT_OBJECT_0)
+            return 1;
+
+        DEFER{ ReleaseSemaphore(host->semaphore, 1, NULL); };
+
+        update->state = STATE_DOWNLOADING;
+
+        Status(_T("Downloading %s"), update->outputPath);
+
+        //Interrupted transfers are resumed from the partial file on the next attempt
+        BYTE downloadHash[20];
+        bool downloaded = false;
+        for (int attempt = 0; attempt < MAX_DOWNLOAD_ATTEMPTS; attempt++)
+        {
+            if (DownloadAborted())
+                return 1;
+
+            //Fetch big files over several connections first, retries resume over a single one.
+            //The extra connections count against the host's limit like the workers' own.
+            if (attempt == 0)
+                downloaded = HTTPGetFileSegmented(update->URL, update->tempPath, _T("Accept-Encoding: gzip"), update->fileSize,
+                    MAX_DOWNLOAD_SEGMENTS, host->semaphore, downloadHash, &responseCode);
+            else
+                downloaded = HTTPGetFile(update->URL, update->tempPath, _T("Accept-Encoding: gzip"), downloadHash, &responseCode);
+            if (downloaded && responseCode != 416 && responseCode < 500)
+                break;
+        }
+
+        if (!downloaded)
+        {
+            FailDownloads();
+            Status(_T("Update failed: Could not download %s (error code %d)"), update->outputPath, responseCode);
+            return 1;
+        }
+
+        if (responseCode != 200)
+        {
+            FailDownloads();
+            DiscardPartialDownload(update->tempPath);
+            Status(_T("Update failed: %s (error code %d)"), update->outputPath, responseCode);
+            return 1;
+        }
+
+        if (memcmp(update->hash, downloadHash, 20))
+        {
+            FailDownloads();
+            DiscardPartialDownload(update->tempPath);
+            Status(_T("Update failed: Integrity check failed on %s"), update->outputPath);
+            return 1;
+        }
+
+        update->state = STATE_DOWNLOADED;
+        InterlockedIncrement(&completedUpdates);
+    }
+
+    return 0;
+}
+
+static host_slot_t *GetHostSlot(download_queue_t *queue, const _TCHAR *url)
+{
+    _TCHAR hostName[256];
+
+    if (!GetURLHostName(url, hostName, _countof(hostName)))
+        hostName[0] = 0;
+
+    for (int i = 0; i < queue->numHosts; i++)
+    {
+        if (!_tcsicmp(queue->hosts[i].hostName, hostName))
+            return &queue->hosts[i];
+    }
+
+    host_slot_t *host = &queue->hosts[queue->numHosts];
+
+    host->semaphore = CreateSemaphore(NULL, MAX_CONNECTIONS_PER_HOST, MAX_CONNECTIONS_PER_HOST, NULL);
+    if (!host->semaphore)
+        return nullptr;
+
+    StringCbCopy(host->hostName, sizeof(host->hostName), hostName);
+    queue->numHosts++;
+
+    return host;
+}
+
+bool RunDownloadWorkers(int maxWorkers, update_t *updates)
+{
+    download_queue_t queue;
+    vector<update_t*> items;
+    vector<host_slot_t*> itemHosts;
+    vector<host_slot_t> hosts;
+    vector<HANDLE> handles;
+
+    Zero(queue);
+
+    downloadFailed = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (!downloadFailed)
+        return false;
+
+    DEFER
+    {
+        for (size_t i = 0; i < handles.size(); i++)
+            CloseHandle(handles[i]);
+
+        for (int i = 0; i < queue.numHosts; i++)
+            CloseHandle(hosts[i].semaphore);
+
+        CloseHandle(downloadFailed);
+        downloadFailed = NULL;
+    };
+
+    //Build the work queue once so workers can claim items without walking the list
+    while (updates->next)
+    {
+        updates = updates->next;
+
+        if (updates->state == STATE_PENDING_DOWNLOAD)
+            items.push_back(updates);
+    }
+
+    if (items.empty())
+        return true;
+
+    //Start the biggest files first so a large archive doesn't end up as the long tail
+    stable_sort(items.begin(), items.end(), [](const update_t *a, const update_t *b) { return a->fileSize > b->fileSize; });
+
+    hosts.resize(items.size());
+    itemHosts.resize(items.size());
+
+    queue.hosts = &hosts[0];
+
+    for (size_t i = 0; i < items.size(); i++)
+    {
+        itemHosts[i] = GetHostSlot(&queue, items[i]->URL);
+        if (!itemHosts[i])
+            return false;
+    }
+
+    queue.items = &items[0];
+    queue.itemHosts = &itemHosts[0];
+    queue.numItems = (LONG)items.size();
+    queue.nextItem = 0;
+
+    int num = min(maxWorkers, (int)items.size());
+
+    for (int i = 0; i < num; i++)
+    {
+        DWORD threadID;
+        HANDLE hThread = CreateThread(NULL, 0, DownloadWorkerThread, &queue, 0, &threadID);
+        if (!hThread)
+        {
+            FailDownloads();
+            break;
+        }
+
+        handles.push_back(hThread);
+    }
+
+    if (handles.empty())
+        return false;
+
+    WaitForMultipleObjects((DWORD)handles.size(), &handles[0], TRUE, INFINITE);
+
+    for (size_t i = 0; i < handles.size(); i++)
+    {
+        DWORD exitCode;
+        GetExitCodeThread(handles[i], &exitCode);
+        if (exitCode != 0)
+            return false;
+    }
+
+    return WaitForSingleObject(downloadFailed, 0) == WAIT_TIMEOUT;
+}
+
+//A file decoded from the archive, waiting to be installed
+struct archive_file_t
+{
+    wstring             name;
+    wstring             newPath;
+    bool                isDir;
+    bool                isPatch;
+    file_hash_t         hash;
+    vector<Byte>        patchData;
+};
+
+//One folder (solid block) of the archive; folders are decoded independently on the extraction pool
+struct archive_folder_t
+{
+    ISzExtractCallback  callback;
+    const CSzArEx       *db;
+    volatile LONG       *aborted;
+    vector<archive_file_t> files;
+    HANDLE              hOutFile;
+    CSha1               sha;
+    SRes                res;
+    HANDLE              hDone;
+};
+
+struct archive_pool_t
+{
+    const CSzArEx       *db;
+    const _TCHAR        *archivePath;
+    download_progress_t *progress;
+    archive_folder_t    *folders;
+    LONG                numFolders;
+    volatile LONG       nextFolder;
+    volatile LONG       aborted;
+    HANDLE              hSlots;
+};
+
+//One view of the archive: a mapping of the file, or as much of it as a streaming download has written so far
+struct archive_reader_t
+{
+    ILookInStream       *stream;
+    CMappedInStream     mapStream;
+    CFileInStream       fileStream;
+    pipe_in_stream_t    pipeStream;
+    CLookToRead         lookStream;
+    bool                opened;
+};
+
+static bool ArchiveReader_Open(archive_reader_t *reader, const _TCHAR *path, download_progress_t *progress)
+{
+    LookToRead_CreateVTable(&reader->lookStream, False);
+    MappedInStream_Construct(&reader->mapStream);
+
+    reader->stream = &reader->lookStream.s;
+    reader->pipeStream.progress = progress;
+
+    if (progress)
+    {
+        //The download still has the file open for writing
+        reader->pipeStream.s.Read = PipeInStream_Read;
+        reader->pipeStream.s.Seek = PipeInStream_Seek;
+        reader->pipeStream.pos = 0;
+        reader->pipeStream.hFile = CreateFile(path, GENERIC_READ, FILE_SHARE_READ|FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+        reader->opened = reader->pipeStream.hFile != INVALID_HANDLE_VALUE;
+        reader->lookStream.realStream = &reader->pipeStream.s;
+    }
+    else
+    {
+        FileInStream_CreateVTable(&reader->fileStream);
+        File_Construct(&reader->fileStream.file);
+        reader->opened = InFile_OpenW(&reader->fileStream.file, path) == 0;
+        reader->lookStream.realStream = &reader->fileStream.s;
+
+        //Decoders look straight into the mapping, the buffered file stream is only a fallback for when it can't be mapped
+        if (reader->opened && MappedInStream_Open(&reader->mapStream, &reader->fileStream.file) == 0)
+        {
+            File_Close(&reader->fileStream.file);
+            reader->stream = &reader->mapStream.s;
+        }
+    }
+
+    LookToRead_Init(&reader->lookStream);
+    return reader->opened;
+}
+
+static void ArchiveReader_Close(archive_reader_t *reader)
+{
+    if (!reader->opened)
+        return;
+
+    if (reader->pipeStream.progress)
+        CloseHandle(reader->pipeStream.hFile);
+    else if (reader->stream == &reader->mapStream.s)
+        MappedInStream_Close(&reader->mapStream);
+    else
+        File_Close(&reader->fileStream.file);
+
+    reader->opened = false;
+}
+
+static SRes ArchiveFileStart(void *p, UInt32 fileIndex)
+{
+    archive_folder_t *folder = (archive_folder_t *)p;
+    _TCHAR w_outfilename[MAX_PATH];
+
+    folder->files.push_back(archive_file_t());
+    archive_file_t &file = folder->files.back();
+
+    static_assert(sizeof(_TCHAR) == sizeof(UInt16), "_TCHAR != UInt16");
+    if (SzArEx_GetFileNameUtf16(folder->db, fileIndex, NULL) > _countof(w_outfilename))
+        return SZ_ERROR_ARCHIVE;
+    SzArEx_GetFileNameUtf16(folder->db, fileIndex, (UInt16*)w_outfilename);
+
+    //Patches are installed under the name of the file they patch
+    size_t nameLen = _tcslen(w_outfilename);
+    size_t suffixLen = _countof(TEXT(BIN_PATCH_SUFFIX)) - 1;
+    file.isPatch = nameLen > suffixLen && !_tcsicmp(w_outfilename + nameLen - suffixLen, TEXT(BIN_PATCH_SUFFIX));
+    if (file.isPatch)
+        w_outfilename[nameLen - suffixLen] = 0;
+
+    //We may be installing into new folders, make sure they exist
+    CreateFoldersForPath(w_outfilename);
+
+    file.name = w_outfilename;
+    file.isDir = folder->db->db.Files[fileIndex].IsDir != 0;
+    file.hash.valid = false;
+
+    if (file.isDir)
+        return SZ_OK;
+
+    Status(L"Extracting %s...", w_outfilename);
+
+    //Patches are small, so they are kept in memory until the install stage applies them
+    if (file.isPatch)
+        return SZ_OK;
+
+    //Decoded data goes to a file next to the target, which replaces it once it's complete and verified
+    file.newPath = file.name + L".new";
+
+    folder->hOutFile = CreateFile(file.newPath.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (folder->hOutFile == INVALID_HANDLE_VALUE)
+    {
+        Status(L"Failed to open files '%s'", file.newPath.c_str());
+        return SZ_ERROR_WRITE;
+    }
+
+    Sha1_Init(&folder->sha);
+    return SZ_OK;
+}
+
+static SRes ArchiveFileWrite(void *p, UInt32 fileIndex, const Byte *data, size_t size)
+{
+    archive_folder_t *folder = (archive_folder_t *)p;
+    archive_file_t &file = folder->files.back();
+
+    //Another folder failed, no point in finishing this one
+    if (*folder->aborted)
+        return SZ_ERROR_PROGRESS;
+
+    if (file.isDir)
+        return SZ_OK;
+
+    if (file.isPatch)
+    {
+        file.patchData.insert(file.patchData.end(), data, data + size);
+        return SZ_OK;
+    }
+
+    DWORD written;
+    if (!WriteFile(folder->hOutFile, data, (DWORD)size, &written, NULL) || written != size)
+    {
+        Status(_T("Update failed: Couldn't install %s (error %d)"), file.name.c_str(), GetLastError());
+        return SZ_ERROR_WRITE;
+    }
+
+    Sha1_Update(&folder->sha, data, size);
+    return SZ_OK;
+}
+
+static SRes ArchiveFileEnd(void *p, UInt32 fileIndex)
+{
+    archive_folder_t *folder = (archive_folder_t *)p;
+    archive_file_t &file = folder->files.back();
+
+    if (folder->hOutFile == INVALID_HANDLE_VALUE)
+        return SZ_OK;
+
+    CloseHandle(folder->hOutFile);
+    folder->hOutFile = INVALID_HANDLE_VALUE;
+
+    Sha1_Final(&folder->sha, file.hash.hash);
+    file.hash.valid = true;
+    return SZ_OK;
+}
+
+static void ArchiveFolder_Init(archive_folder_t *folder, const CSzArEx *db, volatile LONG *aborted)
+{
+    folder->callback.FileStart = ArchiveFileStart;
+    folder->callback.FileWrite = ArchiveFileWrite;
+    folder->callback.FileEnd = ArchiveFileEnd;
+    folder->db = db;
+    folder->aborted = aborted;
+    folder->hOutFile = INVALID_HANDLE_VALUE;
+    folder->res = SZ_OK;
+    folder->hDone = NULL;
+}
+
+//Reads from a mapped archive fail with an exception rather than an error code, so turn those into one
+static SRes OpenArchiveGuarded(CSzArEx *db, ILookInStream *stream, ISzAlloc *allocMain, ISzAlloc *allocTemp)
+{
+    __try
+    {
+        return SzArEx_Open(db, stream, allocMain, allocTemp);
+    }
+    __except (GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR ? EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH)
+    {
+        return SZ_ERROR_READ;
+    }
+}
+
+static SRes ExtractFolderGuarded(const CSzArEx *db, ILookInStream *stream, UInt32 folderIndex, ISzExtractCallback *callback, ISzAlloc *allocMain)
+{
+    __try
+    {
+        return SzArEx_ExtractFolder(db, stream, folderIndex, callback, allocMain);
+    }
+    __except (GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR ? EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH)
+    {
+        return SZ_ERROR_READ;
+    }
+}
+
+static DWORD WINAPI ArchiveWorkerThread(void *arg)
+{
+    archive_pool_t *pool = (archive_pool_t *)arg;
+    archive_reader_t reader;
+    ISzAlloc allocImp;
+    CSzBufPool bufPool;
+
+    allocImp.Alloc = Alloc_;
+    allocImp.Free = Free_;
+
+    //Consecutive folders need buffers of about the same size, so keep them instead of going back to the heap every time
+    SzBufPool_Construct(&bufPool, &allocImp, SZ_BUF_POOL_MIN_SIZE_DEFAULT);
+
+    //Each worker reads through its own handle so seeks don't interfere
+    ArchiveReader_Open(&reader, pool->archivePath, pool->progress);
+
+    //Folders are claimed in order, so the install stage never waits on one that nobody has started
+    for (;;)
+    {
+        //Decoded folders wait on disk for the install stage, don't let them pile up
+        if (pool->hSlots)
+            WaitForSingleObject(pool->hSlots, INFINITE);
+
+        LONG next = InterlockedIncrement(&pool->nextFolder) - 1;
+        if (next >= pool->numFolders)
+            break;
+
+        archive_folder_t *folder = &pool->folders[next];
+
+        if (!reader.opened)
+            folder->res = SZ_ERROR_READ;
+        else if (pool->aborted)
+            folder->res = SZ_ERROR_PROGRESS;
+        else
+            folder->res = ExtractFolderGuarded(pool->db, reader.stream, (UInt32)next, &folder->callback, &bufPool.s);
+
+        if (folder->hOutFile != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(folder->hOutFile);
+            folder->hOutFile = INVALID_HANDLE_VALUE;
+        }
+
+        if (folder->res != SZ_OK)
+            InterlockedExchange(&pool->aborted, 1);
+
+        SetEvent(folder->hDone);
+
+        //The install stage gives the slot back when it gets to the folder's first file, a folder without files has none
+        if (pool->hSlots && pool->db->db.Folders[next].NumUnpackStreams == 0)
+            ReleaseSemaphore(pool->hSlots, 1, NULL);
+    }
+
+    ArchiveReader_Close(&reader);
+
+    SzBufPool_Free(&bufPool);
+
+    return 0;
+}
+
+//Moves a decoded file into place (or applies a patch), keeping a backup for CleanupPartialUpdates
+static bool InstallArchiveFile(update_t **tail, archive_file_t *file, hash_cache_t *hashCache, vector<pair<wstring, file_hash_t>> &installedHashes)
+{
+    _TCHAR oldFileRenamedPath[MAX_PATH];
+
+    update_t *updates = *tail;
+    updates->next = (update_t *)malloc(sizeof(*updates));
+    updates = updates->next;
+    Zero(*updates);
+    *tail = updates;
+
+    updates->tempPath = nullptr;
+    updates->outputPath = _tcsdup(file->name.c_str());
+    updates->state = STATE_INVALID;
+
+    if (file->isDir)
+        return true;
+
+    if (file->isPatch)
+    {
+        mem_in_stream_t patchStream;
+        CBinPatchHeader header;
+        BYTE existingHash[20];
+        SRes res;
+
+        MemInStream_Init(&patchStream, file->patchData.empty() ? NULL : &file->patchData[0], file->patchData.size());
+
+        if (BinPatch_ReadHeader(&header, &patchStream.s) != SZ_OK)
+        {
+            Status(_T("Update failed: Invalid patch for %s"), updates->outputPath);
+            return false;
+        }
+
+        if (!CalculateFileHashCached(hashCache, updates->outputPath, existingHash))
+        {
+            if (GetLastError() == ERROR_SHARING_VIOLATION)
+                Status(_T("Update failed: %s is still in use. Close all programs and try again."), updates->outputPath);
+            else
+                Status(_T("Update failed: Couldn't read %s (error %d)"), updates->outputPath, GetLastError());
+            return false;
+        }
+
+        //Already up to date
+        if (!memcmp(existingHash, header.targetHash, 20))
+            return true;
+
+        if (memcmp(existingHash, header.sourceHash, 20))
+        {
+            Status(_T("Update failed: %s has been modified, please reinstall"), updates->outputPath);
+            return false;
+        }
+
+        //The backup doubles as the patch source
+        StringCbCopy(oldFileRenamedPath, sizeof(oldFileRenamedPath), updates->outputPath);
+        StringCbCat(oldFileRenamedPath, sizeof(oldFileRenamedPath), _T(".old"));
+
+        if (!MyCopyFile(updates->outputPath, oldFileRenamedPath))
+        {
+            Status(_T("Update failed: Couldn't backup %s (error %d)"), updates->outputPath, GetLastError());
+            return false;
+        }
+
+        updates->previousFile = _tcsdup(oldFileRenamedPath);
+        updates->state = STATE_INSTALLED;
+
+        CFileInStream sourceStream;
+        CFileOutStream targetStream;
+
+        FileInStream_CreateVTable(&sourceStream);
+        FileOutStream_CreateVTable(&targetStream);
+        File_Construct(&sourceStream.file);
+        File_Construct(&targetStream.file);
+
+        if (InFile_OpenW(&sourceStream.file, oldFileRenamedPath))
+        {
+            Status(L"Failed to open files '%s'", oldFileRenamedPath);
+            return false;
+        }
+
+        DEFER{ File_Close(&sourceStream.file); };
+
+        if (OutFile_OpenW(&targetStream.file, updates->outputPath))
+        {
+            if (GetLastError() == ERROR_SHARING_VIOLATION)
+                Status(_T("Update failed: %s is still in use. Close all programs and try again."), updates->outputPath);
+            else
+                Status(L"Failed to open files '%s'", updates->outputPath);
+            return false;
+        }
+
+        DEFER{ File_Close(&targetStream.file); };
+
+        res = BinPatch_Apply(&header, &patchStream.s, &sourceStream.s, &targetStream.s);
+        if (res != SZ_OK)
+        {
+            if (res == SZ_ERROR_CRC)
+                Status(_T("Update failed: Patched %s doesn't match the update"), updates->outputPath);
+            else
+                Status(_T("Update failed: Couldn't patch %s (error %d)"), updates->outputPath, res);
+            return false;
+        }
+
+        file_hash_t patchedHash;
+        memcpy(patchedHash.hash, header.targetHash, 20);
+        patchedHash.valid = true;
+
+        installedHashes.push_back(make_pair(wstring(updates->outputPath), patchedHash));
+        return true;
+    }
+
+    //Cleaned up like a download if we fail before it's moved into place
+    updates->tempPath = _tcsdup(file->newPath.c_str());
+    updates->state = STATE_DOWNLOADED;
+
+    //Check if we're replacing an existing file or just installing a new one
+    if (GetFileAttributes(updates->outputPath) != INVALID_FILE_ATTRIBUTES)
+    {
+        //Nothing to do if the installed copy is already identical
+        BYTE existingHash[20];
+        if (CalculateFileHashCached(hashCache, updates->outputPath, existingHash) &&
+            !memcmp(existingHash, file->hash.hash, 20))
+        {
+            DeleteFile(updates->tempPath);
+            updates->state = STATE_INVALID;
+            return true;
+        }
+
+        //Backup the existing file in case a rollback is needed
+        StringCbCopy(oldFileRenamedPath, sizeof(oldFileRenamedPath), updates->outputPath);
+        StringCbCat(oldFileRenamedPath, sizeof(oldFileRenamedPath), _T(".old"));
+
+        if (!MoveFileEx(updates->outputPath, oldFileRenamedPath, MOVEFILE_REPLACE_EXISTING))
+        {
+            if (GetLastError() == ERROR_SHARING_VIOLATION)
+                Status(_T("Update failed: %s is still in use. Close all programs and try again."), updates->outputPath);
+            else
+                Status(_T("Update failed: Couldn't backup %s (error %d)"), updates->outputPath, GetLastError());
+            return false;
+        }
+
+        updates->previousFile = _tcsdup(oldFileRenamedPath);
+    }
+
+    //From here on a rollback removes the file (and restores the backup if there is one)
+    updates->state = STATE_INSTALLED;
+
+    if (!MoveFileEx(updates->tempPath, updates->outputPath, MOVEFILE_REPLACE_EXISTING))
+    {
+        Status(_T("Update failed: Couldn't install %s (error %d)"), updates->outputPath, GetLastError());
+        DeleteFile(updates->tempPath);
+        return false;
+    }
+
+    installedHashes.push_back(make_pair(wstring(updates->outputPath), file->hash));
+    return true;
+}
+
+//A package that's installed while it downloads
+struct stream_job_t
+{
+    update_t            *update;
+    HANDLE              hFile;
+    HANDLE              hThread;
+    download_progress_t *progress;
+    _TCHAR              validator[128];
+    BYTE                hash[20];
+    int                 responseCode;
+    bool                success;
+};
+
+//Waits for the rest of a streamed package, nothing from it can be installed before its hash checks out
+static bool ArchiveDownload_Verify(stream_job_t *download)
+{
+    WaitForSingleObject(download->hThread, INFINITE);
+
+    if (!download->success)
+        return false;
+
+    if (memcmp(download->update->hash, download->hash, 20))
+    {
+        Status(_T("Update failed: Integrity check failed on %s"), download->update->outputPath);
+        return false;
+    }
+
+    return true;
+}
+
+static void ArchiveFolder_ReportError(const archive_folder_t *folder, const _TCHAR *archiveName)
+{
+    if (folder->res == SZ_ERROR_UNSUPPORTED)
+        Status(L"Archive type is unsupported");
+    else if (folder->res == SZ_ERROR_CRC)
+        Status(L"CRC error for file %s", folder->files.empty() ? archiveName : folder->files.back().name.c_str());
+}
+
+//Extracts the downloaded 7z package in updates (the first entry of the list) into the current directory.
+//Folders are decoded straight to disk on a thread pool while this thread installs the finished ones in order.
+//With download set, the archive is still being downloaded and reads wait for the bytes they need; then
+//every folder is decoded before anything is installed, since the package can't be verified any earlier.
+static bool InstallArchive(update_t *updates, hash_cache_t *hashCache, vector<pair<wstring, file_hash_t>> &installedHashes,
+    stream_job_t *download)
+{
+    const _TCHAR *archiveName = updates->outputPath;
+    download_progress_t *progress = download ? download->progress : NULL;
+    bool installed = false;
+
+    Status(_T("Extracting from %s..."), updates->outputPath);
+
+    if (!updates->previousFile)
+        updates->previousFile = _tcsdup(updates->tempPath); // clean up archive on success
+
+    archive_reader_t reader;
+    CSzArEx db;
+    SRes res;
+    ISzAlloc allocImp;
+    CSzArena arenaMain, arenaTemp;
+
+    allocImp.Alloc = Alloc_;
+    allocImp.Free = Free_;
+
+    //The header parsing makes lots of small allocations: the ones that live with db go to one arena,
+    //the temporary ones to another that's dropped as soon as the header is parsed
+    SzArena_Construct(&arenaMain, &allocImp, SZ_ARENA_BLOCK_SIZE_DEFAULT);
+    SzArena_Construct(&arenaTemp, &allocImp, SZ_ARENA_BLOCK_SIZE_DEFAULT);
+
+    if (!ArchiveReader_Open(&reader, updates->tempPath, progress))
+    {
+        Status(L"Could not open archive");
+        return false;
+    }
+
+    DEFER{ ArchiveReader_Close(&reader); DeleteFile(archiveName); };
+
+    DEFER{ SzArena_Free(&arenaMain); };
+
+    SzArEx_Init(&db);
+    DEFER{ SzArEx_Free(&db, &arenaMain.s); };
+    res = OpenArchiveGuarded(&db, reader.stream, &arenaMain.s, &arenaTemp.s);
+
+    SzArena_Free(&arenaTemp);
+
+    if (res != SZ_OK)
+        return false;
+
+    archive_pool_t pool;
+    vector<archive_folder_t> folders;
+    vector<HANDLE> threads;
+
+    pool.db = &db;
+    pool.archivePath = updates->tempPath;
+    pool.progress = progress;
+    pool.numFolders = (LONG)db.db.NumFolders;
+    pool.nextFolder = 0;
+    pool.aborted = 0;
+    pool.hSlots = NULL;
+
+    folders.resize(db.db.NumFolders);
+    pool.folders = folders.empty() ? NULL : &folders[0];
+
+    //Stop the pool and remove whatever it decoded but we didn't install
+    DEFER
+    {
+        //Workers waiting on the download only wake up when it moves on, so stop that as well if we're bailing out
+        if (!installed && progress)
+            InterlockedExchange(&progress->cancelled, 1);
+
+        InterlockedExchange(&pool.aborted, 1);
+
+        if (pool.hSlots && !threads.empty())
+            ReleaseSemaphore(pool.hSlots, (LONG)threads.size(), NULL);
+
+        if (!threads.empty())
+            WaitForMultipleObjects((DWORD)threads.size(), &threads[0], TRUE, INFINITE);
+
+        if (pool.hSlots)
+            CloseHandle(pool.hSlots);
+
+        for (size_t i = 0; i < threads.size(); i++)
+            CloseHandle(threads[i]);
+
+        for (size_t i = 0; i < folders.size(); i++)
+        {
+            for (size_t j = 0; j < folders[i].files.size(); j++)
+            {
+                if (!folders[i].files[j].newPath.empty())
+                    DeleteFile(folders[i].files[j].newPath.c_str());
+            }
+
+            if (folders[i].hDone)
+                CloseHandle(folders[i].hDone);
+        }
+    };
+
+    for (size_t i = 0; i < folders.size(); i++)
+    {
+        ArchiveFolder_Init(&folders[i], &db, &pool.aborted);
+
+        folders[i].hDone = CreateEvent(NULL, TRUE, FALSE, NULL);
+        if (!folders[i].hDone)
+            return false;
+    }
+
+    //Every worker holds one dictionary worth of memory
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+
+    int numThreads = min((int)si.dwNumberOfProcessors, MAX_EXTRACT_THREADS);
+    numThreads = min(numThreads, (int)folders.size());
+
+    //With fewer folders than CPUs (usually one big solid folder) the spare ones decode the LZMA2 blocks
+    //of each folder in parallel. That holds up to 2 * SZ_DECODE_MT_SEGMENT_MAX of blocks per decode thread,
+    //and all workers together stay within MAX_DECODE_MEMORY of our 2 GB address space
+    if (numThreads > 0 && numThreads < (int)si.dwNumberOfProcessors)
+    {
+        unsigned memThreads = (unsigned)(MAX_DECODE_MEMORY / (2 * SZ_DECODE_MT_SEGMENT_MAX * numThreads));
+        db.NumThreads = min((unsigned)si.dwNumberOfProcessors / numThreads, (unsigned)MAX_DECODE_THREADS);
+        db.NumThreads = max(min(db.NumThreads, memThreads), 1u);
+    }
+
+    //The decoders run at most MAX_EXTRACT_AHEAD folders ahead of the install stage, unless that has to wait for the download
+    if (numThreads > 0 && !download)
+    {
+        pool.hSlots = CreateSemaphore(NULL, MAX_EXTRACT_AHEAD, MAX_EXTRACT_AHEAD + numThreads, NULL);
+        if (!pool.hSlots)
+            return false;
+    }
+
+    for (int i = 0; i < numThreads; i++)
+    {
+        HANDLE hThread = CreateThread(NULL, 0, ArchiveWorkerThread, &pool, 0, NULL);
+        if (!hThread)
+            break;
+
+        threads.push_back(hThread);
+    }
+
+    //Without a pool everything is decoded up front, same as before
+    if (threads.empty())
+    {
+        if (pool.hSlots)
+        {
+            CloseHandle(pool.hSlots);
+            pool.hSlots = NULL;
+        }
+
+        ArchiveWorkerThread(&pool);
+    }
 
-void DestroyUpdateList(update_t *updates)
-{
-    update_t *next;
+    if (download)
+    {
+        for (size_t i = 0; i < folders.size(); i++)
+        {
+            WaitForSingleObject(folders[i].hDone, INFINITE);
 
-    updates = updates->next;
-    if (!updates)
-        return;
+            if (folders[i].res != SZ_OK)
+            {
+                ArchiveFolder_ReportError(&folders[i], archiveName);
+                return false;
+            }
+        }
 
-    updates->next = NULL;
+        if (!ArchiveDownload_Verify(download))
+            return false;
+    }
 
-    while (updates)
+    for (UInt32 i = 0; i < db.db.NumFiles; i++)
     {
-        next = updates->next;
+        UInt32 folderIndex = db.FileIndexToFolderIndexMap[i];
 
-        if (updates->outputPath)
-            free(updates->outputPath);
-        if (updates->previousFile)
-            free(updates->previousFile);
-        if (updates->tempPath)
-            free(updates->tempPath);
-        if (updates->URL)
-            free(updates->URL);
+        //Directories and empty files don't belong to any folder
+        if (folderIndex == (UInt32)-1)
+        {
+            archive_folder_t emptyFolder;
+            ArchiveFolder_Init(&emptyFolder, &db, &pool.aborted);
 
-        free(updates);
+            res = ArchiveFileStart(&emptyFolder, i);
+            if (res == SZ_OK)
+                res = ArchiveFileEnd(&emptyFolder, i);
+            if (emptyFolder.hOutFile != INVALID_HANDLE_VALUE)
+                CloseHandle(emptyFolder.hOutFile);
 
-        updates = next;
-    }
-}
+            if (res != SZ_OK)
+            {
+                if (!emptyFolder.files.empty() && !emptyFolder.files[0].newPath.empty())
+                    DeleteFile(emptyFolder.files[0].newPath.c_str());
+                return false;
+            }
 
-bool IsSafeFilename(_TCHAR *path)
-{
-    const _TCHAR *p;
+            if (!InstallArchiveFile(&updates, &emptyFolder.files[0], hashCache, installedHashes))
+                return false;
+            continue;
+        }
 
-    p = path;
+        //Each folder is installed as a whole when we reach its first file
+        if (db.FolderStartFileIndex[folderIndex] != i)
+            continue;
 
-    if (!*p)
-       return FALSE;
+        archive_folder_t *folder = &folders[folderIndex];
+        WaitForSingleObject(folder->hDone, INFINITE);
 
-    if (_tcsstr(path, _T("..")))
-        return FALSE;
+        if (folder->res != SZ_OK)
+        {
+            ArchiveFolder_ReportError(folder, archiveName);
+            return false;
+        }
 
-    if (*p == '/')
-        return FALSE;
+        for (size_t j = 0; j < folder->files.size(); j++)
+        {
+            if (!InstallArchiveFile(&updates, &folder->files[j], hashCache, installedHashes))
+                return false;
+        }
 
-    while (*p)
-    {
-        if (!isalnum(*p) && *p != '.' && *p != '/' && *p != '_' && *p != '-')
-            return FALSE;
-        p++;
+        if (pool.hSlots)
+            ReleaseSemaphore(pool.hSlots, 1, NULL);
     }
 
-    return TRUE;
+    installed = true;
+    return true;
 }
 
-bool IsSafePath(_TCHAR * path)
+//Finds where the part of the archive SzArEx_Open needs begins: the header, or the packed header in front of it.
+//The result is between k7zStartHeaderSize and headerStart
+static LONGLONG GetArchiveHeaderStart(const vector<BYTE> &header, LONGLONG headerStart)
 {
-    const _TCHAR *p;
+    size_t pos = 0;
 
-    p = path;
+    //7z numbers: the count of leading 1 bits in the first byte is the number of extra little endian bytes
+    auto readNumber = [&](UInt64 *value) -> bool
+    {
+        if (pos >= header.size())
+            return false;
 
-    if (!*p)
-        return TRUE;
+        BYTE first = header[pos++];
+        BYTE mask = 0x80;
+        *value = 0;
 
-    if (!isalnum(*p))
-        return FALSE;
+        for (int i = 0; i < 8; i++)
+        {
+            if ((first & mask) == 0)
+            {
+                *value |= (UInt64)(first & (mask - 1)) << (8 * i);
+                return true;
+            }
 
-    while (*p)
-    {
-        if (*p == '.' || *p == '\\')
-            return FALSE;
-        p++;
-    }
-    
-    return TRUE;
+            if (pos >= header.size())
+                return false;
+
+            *value |= (UInt64)header[pos++] << (8 * i);
+            mask >>= 1;
+        }
+
+        return true;
+    };
+
+    UInt64 id, packPos;
+    if (!readNumber(&id) || id != k7zIdEncodedHeader ||
+        !readNumber(&id) || id != k7zIdPackInfo ||
+        !readNumber(&packPos))
+        return headerStart;
+
+    if (packPos > (UInt64)(headerStart - k7zStartHeaderSize))
+        return headerStart;
+
+    return k7zStartHeaderSize + (LONGLONG)packPos;
 }
 
-DWORD WINAPI DownloadWorkerThread(void *arg)
+static DWORD WINAPI StreamDownloadThread(void *arg)
 {
-    BOOL foundWork;
-    update_t *updates = (update_t *)arg;
+    stream_job_t *job = (stream_job_t *)arg;
 
-    for (;;)
+    //Every attempt continues from what the previous ones got, readers only see a failure once we give up
+    for (int attempt = 0; attempt < MAX_DOWNLOAD_ATTEMPTS; attempt++)
     {
-        foundWork = FALSE;
+        if (job->progress->cancelled || WaitForSingleObject(cancelRequested, 0) == WAIT_OBJECT_0)
+            break;
 
-        EnterCriticalSection(&updateMutex);
+        job->success = HTTPGetFileStreaming(job->update->URL, job->update->tempPath, job->hFile, job->progress, job->validator,
+            job->hash, &job->responseCode);
+        if (job->success)
+            break;
+    }
 
-        while (updates->next)
-        {
-            int responseCode;
+    DownloadProgress_Finish(job->progress, job->success);
+    return job->success ? 0 : 1;
+}
 
-            if (WaitForSingleObject(cancelRequested, 0) == WAIT_OBJECT_0)
-            {
-                LeaveCriticalSection(&updateMutex);
-                return 1;
-            }
+//Downloads the package and extracts it at the same time: the 7z header is fetched first, then folders are
+//decoded as their packed data comes in, and installed once the whole package is verified. Sets fallback if
+//the server can't serve ranges or the download breaks off, the caller then downloads the rest of the archive
+//with the regular workers before installing it.
+static bool DownloadAndInstallArchive(update_t *updates, hash_cache_t *hashCache, vector<pair<wstring, file_hash_t>> &installedHashes,
+    bool *fallback)
+{
+    BYTE startHeader[k7zStartHeaderSize];
+    LONGLONG fileSize;
+    int responseCode;
+
+    stream_job_t job;
+    job.update = updates;
+    job.hFile = INVALID_HANDLE_VALUE;
+    job.hThread = NULL;
+    job.progress = NULL;
+    job.validator[0] = 0;
+    job.responseCode = 0;
+    job.success = false;
+
+    *fallback = true;
+
+    //All the ranges have to come from the same version of the file, the first response tells us which one that is
+    if (!HTTPGetRange(updates->URL, 0, k7zStartHeaderSize - 1, startHeader, &fileSize, job.validator, sizeof(job.validator), &responseCode))
+        return false;
 
-            updates = updates->next;
+    if (memcmp(startHeader, k7zSignature, k7zSignatureSize) ||
+        CrcCalc(startHeader + 12, 20) != GetUi32(startHeader + 8))
+        return false;
 
-            if (updates->state != STATE_PENDING_DOWNLOAD)
-                continue;
+    //Anything that doesn't fit in the file, or too big a tail to keep in memory, goes to the regular download
+    UInt64 headerOffset = GetUi64(startHeader + 12);
+    UInt64 headerSize = GetUi64(startHeader + 20);
+    if (fileSize < k7zStartHeaderSize ||
+        headerOffset > (UInt64)(fileSize - k7zStartHeaderSize) ||
+        headerSize > (UInt64)(fileSize - k7zStartHeaderSize) - headerOffset ||
+        (UInt64)(fileSize - k7zStartHeaderSize) - headerOffset > MAX_STREAM_TAIL_SIZE)
+        return false;
 
-            updates->state = STATE_DOWNLOADING;
+    LONGLONG headerStart = k7zStartHeaderSize + (LONGLONG)headerOffset;
 
-            LeaveCriticalSection(&updateMutex);
+    vector<BYTE> tail((size_t)(fileSize - headerStart));
+    if (!tail.empty() && !HTTPGetRange(updates->URL, headerStart, fileSize - 1, &tail[0], NULL, job.validator, sizeof(job.validator), &responseCode))
+        return false;
 
-            foundWork = TRUE;
+    //A compressed header lives in the body, fetch it along with the rest of the tail
+    LONGLONG tailStart = GetArchiveHeaderStart(tail, headerStart);
+    if (fileSize - tailStart > MAX_STREAM_TAIL_SIZE)
+        return false;
 
-            if (downloadThreadFailure)
-                return 1;
+    if (tailStart < headerStart)
+    {
+        tail.insert(tail.begin(), (size_t)(headerStart - tailStart), 0);
+        if (!HTTPGetRange(updates->URL, tailStart, headerStart - 1, &tail[0], NULL, job.validator, sizeof(job.validator), &responseCode))
+            return false;
+    }
 
-            Status(_T("Downloading %s"), updates->outputPath);
+    //From here on the server has shown it can do this, any failure other than in the download itself is a real one
+    *fallback = false;
 
-            if (!HTTPGetFile(updates->URL, updates->tempPath, _T("Accept-Encoding: gzip"), &responseCode))
-            {
-                downloadThreadFailure = TRUE;
-                DeleteFile(updates->tempPath);
-                Status(_T("Update failed: Could not download %s (error code %d)"), updates->outputPath, responseCode);
-                return 1;
-            }
+    Status(_T("Downloading %s"), updates->outputPath);
 
-            if (responseCode != 200)
-            {
-                downloadThreadFailure = TRUE;
-                DeleteFile(updates->tempPath);
-                Status(_T("Update failed: %s (error code %d)"), updates->outputPath, responseCode);
-                return 1;
-            }
+    //The body of an interrupted download of this version is still good
+    LONGLONG resumeOffset = min(GetResumeOffset(updates->tempPath, job.validator), tailStart);
+    if (resumeOffset <= 0)
+        DiscardPartialDownload(updates->tempPath);
 
-            BYTE downloadHash[20];
-            if (!CalculateFileHash(updates->tempPath, downloadHash))
-            {
-                downloadThreadFailure = TRUE;
-                DeleteFile(updates->tempPath);
-                Status(_T("Update failed: Couldn't verify integrity of %s"), updates->outputPath);
-                return 1;
-            }
+    HANDLE hFile = CreateFile(updates->tempPath, GENERIC_READ|GENERIC_WRITE, FILE_SHARE_READ|FILE_SHARE_WRITE, NULL, OPEN_ALWAYS, 0, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        Status(_T("Update failed: Could not download %s (error code %d)"), updates->outputPath, -7);
+        return false;
+    }
 
-            if (memcmp(updates->hash, downloadHash, 20))
-            {
-                downloadThreadFailure = TRUE;
-                DeleteFile(updates->tempPath);
-                Status(_T("Update failed: Integrity check failed on %s"), updates->outputPath);
-                return 1;
-            }
+    //What the download got so far stays for the next attempt, if it left a resume file
+    bool keepPartial = false;
+    DEFER{ CloseHandle(hFile); if (!keepPartial) DiscardPartialDownload(updates->tempPath); };
 
-            EnterCriticalSection(&updateMutex);
+    //Start and end of the archive go in first, the body is filled in between as it arrives
+    DWORD wrote;
+    OVERLAPPED ov;
+    ZeroMemory(&ov, sizeof(ov));
 
-            updates->state = STATE_DOWNLOADED;
-            completedUpdates++;
+    bool written = WriteFile(hFile, startHeader, sizeof(startHeader), &wrote, &ov) && wrote == sizeof(startHeader);
 
-            LeaveCriticalSection(&updateMutex);
-        }
+    ov.Offset = (DWORD)tailStart;
+    ov.OffsetHigh = (DWORD)(tailStart >> 32);
 
-        if (!foundWork)
-        {
-            LeaveCriticalSection(&updateMutex);
-            break;
-        }
+    if (written && !tail.empty())
+        written = WriteFile(hFile, &tail[0], (DWORD)tail.size(), &wrote, &ov) && wrote == tail.size();
 
-        if (downloadThreadFailure)
-            return 1;
+    if (!written)
+    {
+        Status(_T("Update failed: Could not download %s (error code %d)"), updates->outputPath, -12);
+        return false;
     }
 
-    return 0;
-}
+    LONGLONG available = max((LONGLONG)sizeof(startHeader), resumeOffset);
 
-bool RunDownloadWorkers(int num, update_t *updates)
-{
-    DWORD threadID;
-    HANDLE *handles;
+    //The workers count the download from scratch if they have to take over
+    LONG totalBefore = totalFileSize;
+    LONG completedBefore = completedFileSize;
 
-    InitializeCriticalSection(&updateMutex);
+    InterlockedExchangeAdd(&totalFileSize, (LONG)fileSize);
+    InterlockedExchangeAdd(&completedFileSize, (LONG)(available + tail.size()));
 
-    handles = (HANDLE *)malloc(sizeof(*handles) * num);
-    if (!handles)
+    download_progress_t progress;
+    DownloadProgress_Init(&progress, available, tailStart, fileSize);
+
+    job.hFile = hFile;
+    job.progress = &progress;
+    job.hThread = CreateThread(NULL, 0, StreamDownloadThread, &job, 0, NULL);
+
+    if (!job.hThread)
         return false;
 
-    for (int i = 0; i < num; i++)
+    updates->state = STATE_DOWNLOADING;
+
+    bool installed = InstallArchive(updates, hashCache, installedHashes, &job);
+    if (!installed)
+        InterlockedExchange(&progress.cancelled, 1);
+
+    WaitForSingleObject(job.hThread, INFINITE);
+    CloseHandle(job.hThread);
+
+    if (installed)
     {
-        handles[i] = CreateThread(NULL, 0, DownloadWorkerThread, updates, 0, &threadID);
-        if (!handles[i])
-            return false;
+        updates->state = STATE_DOWNLOADED;
+        return true;
     }
 
-    WaitForMultipleObjects(num, handles, TRUE, INFINITE);
+    //Stopped by the user: what we have is picked up on the next run
+    if (WaitForSingleObject(cancelRequested, 0) == WAIT_OBJECT_0)
+    {
+        keepPartial = true;
+        return false;
+    }
 
-    for (int i = 0; i < num; i++)
+    //Nothing is installed before the package is verified, so if the connection is what failed, the workers can
+    //finish the download from where it stopped and we install it from there
+    if (!job.success && job.responseCode != -14)
     {
-        DWORD exitCode;
-        GetExitCodeThread(handles[i], &exitCode);
-        if (exitCode != 0)
-            return false;
+        keepPartial = true;
+        *fallback = true;
+
+        InterlockedExchange(&totalFileSize, totalBefore);
+        InterlockedExchange(&completedFileSize, completedBefore);
+
+        updates->state = STATE_PENDING_DOWNLOAD;
     }
 
-    return true;
+    return false;
 }
 
 DWORD WINAPI UpdateThread(void *arg)
@@ -435,11 +1557,10 @@ DWORD WINAPI UpdateThread(void *arg)
             return ret;
     }
 
-    if (!CryptAcquireContext(&hProvider, NULL, NULL, PROV_RSA_FULL, CRYPT_VERIFYCONTEXT))
-    {
-        SetDlgItemText(hwndMain, IDC_STATUS, TEXT("Update failed: CryptAcquireContext failure"));
-        return ret;
-    }
+    Sha1Prepare();
+
+    //Our zlib crc32.c is built with Z_7ZIP_CRC, so this also sets up the CRC code that checks gzip downloads
+    CrcGenerateTable();
 
     SetDlgItemText(hwndMain, IDC_STATUS, TEXT("Searching for available updates..."));
 
@@ -478,6 +1599,8 @@ DWORD WINAPI UpdateThread(void *arg)
 
     TCHAR manifestPath[MAX_PATH];
     TCHAR tempPath[MAX_PATH];
+    TCHAR hashCachePath[MAX_PATH];
+    TCHAR chunkCachePath[MAX_PATH];
     TCHAR lpAppDataPath[MAX_PATH];
 
     if (bIsPortable)
@@ -492,11 +1615,20 @@ DWORD WINAPI UpdateThread(void *arg)
 
     StringCbPrintf(manifestPath, sizeof(manifestPath), L"%s" TEXT(MANIFEST_PATH), lpAppDataPath);
     StringCbPrintf(tempPath, sizeof(tempPath), L"%s" TEXT(TEMP_PATH), lpAppDataPath);
+    StringCbPrintf(hashCachePath, sizeof(hashCachePath), L"%s" TEXT(HASH_CACHE_PATH), lpAppDataPath);
+    StringCbPrintf(chunkCachePath, sizeof(chunkCachePath), L"%s" TEXT(CHUNK_CACHE_PATH), lpAppDataPath);
 
     CreateDirectory(tempPath, NULL);
 
     DEFER{ RemoveDirectory(tempPath); };
 
+    hash_cache_t hashCache;
+
+    HashCache_Init(&hashCache);
+    HashCache_Open(&hashCache, hashCachePath);
+
+    DEFER{ HashCache_Close(&hashCache); };
+
     HANDLE hManifest = CreateFile(manifestPath, GENERIC_READ, 0, NULL, OPEN_EXISTING, 0, NULL);
     if (hManifest == INVALID_HANDLE_VALUE)
     {
@@ -578,6 +1710,60 @@ DWORD WINAPI UpdateThread(void *arg)
     json_t *hash = json_object_get(plat, "sha1");
     json_t *url = json_object_get(plat, "url");
     json_t *filename = json_object_get(plat, "file");
+    json_t *size = json_object_get(plat, "size");
+
+    //Prefer the incremental package if the installed build is the one it was made against
+    json_t *delta = json_object_get(plat, "delta");
+    if (json_is_object(delta))
+    {
+        json_t *base = json_object_get(delta, "base");
+        json_t *baseHash = json_object_get(delta, "base_sha1");
+
+        _TCHAR w_base[MAX_PATH];
+        _TCHAR w_baseHash[MAX_PATH];
+        BYTE expectedHash[20], installedHash[20];
+
+        if (json_is_string(base) && json_is_string(baseHash) &&
+            json_is_string(json_object_get(delta, "sha1")) &&
+            json_is_string(json_object_get(delta, "url")) &&
+            json_is_string(json_object_get(delta, "file")) &&
+            MultiByteToWideChar(CP_UTF8, 0, json_string_value(base), -1, w_base, _countof(w_base)) &&
+            MultiByteToWideChar(CP_UTF8, 0, json_string_value(baseHash), -1, w_baseHash, _countof(w_baseHash)))
+        {
+            StringToHash(w_baseHash, expectedHash);
+
+            if (CalculateFileHashCached(&hashCache, w_base, installedHash) && !memcmp(installedHash, expectedHash, 20))
+            {
+                hash = json_object_get(delta, "sha1");
+                url = json_object_get(delta, "url");
+                filename = json_object_get(delta, "file");
+                size = json_object_get(delta, "size");
+            }
+        }
+    }
+
+    //A chunked release beats both, only the chunks we don't have get downloaded
+    _TCHAR w_chunk_url[MAX_PATH];
+    bool bChunked = false;
+
+    json_t *chunked = json_object_get(plat, "chunked");
+    if (json_is_object(chunked))
+    {
+        json_t *chunkURL = json_object_get(chunked, "chunk_url");
+
+        if (json_is_string(chunkURL) &&
+            json_is_string(json_object_get(chunked, "sha1")) &&
+            json_is_string(json_object_get(chunked, "url")) &&
+            json_is_string(json_object_get(chunked, "file")) &&
+            MultiByteToWideChar(CP_UTF8, 0, json_string_value(chunkURL), -1, w_chunk_url, _countof(w_chunk_url)))
+        {
+            hash = json_object_get(chunked, "sha1");
+            url = json_object_get(chunked, "url");
+            filename = json_object_get(chunked, "file");
+            size = json_object_get(chunked, "size");
+            bChunked = true;
+        }
+    }
 
     if (!json_is_string(hash))
         return ret;
@@ -618,193 +1804,54 @@ DWORD WINAPI UpdateThread(void *arg)
     updates->tempPath = _tcsdup(w_temp_filepath);
     updates->URL = _tcsdup(w_url);
     updates->state = STATE_PENDING_DOWNLOAD;
+    updates->fileSize = json_is_integer(size) ? (DWORD)json_integer_value(size) : 0;
     StringToHash(w_hash, updates->hash);
 
-    //-------------------
-    //Download Updates
-    //-------------------
-    updates = &updateList;
-    if (!RunDownloadWorkers(1, updates))
-        return ret;
-
     DEFER{ if (ret) CleanupPartialUpdates(&updateList); };
 
-    //----------------
-    //Install updates
-    //----------------
-    if (completedUpdates != 1)
-        return ret;
-
-    _TCHAR oldFileRenamedPath[MAX_PATH];
-
-    updates = &updateList;
-    if (!updates->next)
-        return ret;
-
-    updates = updates->next;
-
-    Status(_T("Extracting from %s..."), updates->outputPath);
-
-    updates->previousFile = _tcsdup(updates->tempPath); // clean up archive on success
-
-    CFileInStream archiveStream;
-    CLookToRead lookStream;
-    CSzArEx db;
-    SRes res;
-    ISzAlloc allocImp;
-    UInt16 *temp = NULL;
-    size_t tempSize = 0;
-
-    allocImp.Alloc = Alloc_;
-    allocImp.Free = Free_;
-
-    char tmp_path[MAX_PATH];
-    if (!WideCharToMultiByte(CP_UTF8, 0, updates->tempPath, -1, tmp_path, _countof(tmp_path), nullptr, nullptr))
-        return ret;
+    vector<pair<wstring, file_hash_t>> installedHashes;
 
-    if (InFile_Open(&archiveStream.file, tmp_path))
-    {
-        Status(L"Could not open archive");
-        return ret;
-    }
+    //A plain archive is installed while it's still downloading, as long as the server can send us its header first
+    bool bInstalled = false;
+    if (!bChunked)
     {
-        DEFER{ File_Close(&archiveStream.file); DeleteFile(w_filename); };
-
-        FileInStream_CreateVTable(&archiveStream);
-        LookToRead_CreateVTable(&lookStream, False);
+        bool fallback;
 
-        lookStream.realStream = &archiveStream.s;
-        LookToRead_Init(&lookStream);
-
-        CrcGenerateTable();
+        bInstalled = DownloadAndInstallArchive(updates, &hashCache, installedHashes, &fallback);
+        if (!bInstalled && !fallback)
+            return ret;
+    }
 
-        SzArEx_Init(&db);
-        DEFER{ SzArEx_Free(&db, &allocImp); };
-        res = SzArEx_Open(&db, &lookStream.s, &allocImp, &allocImp);
+    if (!bInstalled)
+    {
+        //-------------------
+        //Download Updates
+        //-------------------
+        updates = &updateList;
+        if (!RunDownloadWorkers(MAX_DOWNLOAD_WORKERS, updates))
+            return ret;
 
-        if (res != SZ_OK)
+        //----------------
+        //Install updates
+        //----------------
+        if (completedUpdates != 1)
             return ret;
 
-        UInt32 blockIndex = 0xFFFFFFFF;
-        Byte *outBuffer = nullptr;
-        size_t outBufferSize = 0;
+        updates = &updateList;
+        if (!updates->next)
+            return ret;
 
-        DEFER{ IAlloc_Free(&allocImp, outBuffer); };
+        updates = updates->next;
 
-        _TCHAR w_outfilename[MAX_PATH];
-        for (UInt32 i = 0; i < db.db.NumFiles; i++)
+        if (bChunked)
         {
-            updates->next = (update_t *)malloc(sizeof(*updates));
-            updates = updates->next;
-            Zero(*updates);
-
-            static_assert(sizeof(_TCHAR) == sizeof(UInt16), "_TCHAR != UInt16");
-            SzArEx_GetFileNameUtf16(&db, i, (UInt16*)w_outfilename);
-
-            updates->tempPath = nullptr;
-            updates->outputPath = _tcsdup(w_outfilename);
-            updates->state = STATE_INVALID;
-
-            size_t offset = 0;
-            size_t outSizeProcessed = 0;
-            CSzFileItem const *f = db.db.Files + i;
-            CSzFile outFile;
-            size_t processedSize;
-
-            Status(L"Extracting %s...", w_outfilename);
-
-            res = SzArEx_Extract(&db, &lookStream.s, i,
-                &blockIndex, &outBuffer, &outBufferSize,
-                &offset, &outSizeProcessed,
-                &allocImp, &allocImp);
-
-            if (res != SZ_OK)
-            {
-                if (res == SZ_ERROR_UNSUPPORTED)
-                    Status(L"Archive type is unsupported");
-                else if (res == SZ_ERROR_CRC)
-                    Status(L"CRC error for file %s", w_outfilename);
+            if (!InstallChunkedUpdate(updates, w_chunk_url, chunkCachePath, &hashCache, installedHashes))
+                return ret;
+        }
+        else
+        {
+            if (!InstallArchive(updates, &hashCache, installedHashes, NULL))
                 return ret;
-            }
-
-            if (f->IsDir)
-                continue;
-
-            //Check if we're replacing an existing file or just installing a new one
-            if (GetFileAttributes(updates->outputPath) != INVALID_FILE_ATTRIBUTES)
-            {
-                //Backup the existing file in case a rollback is needed
-                StringCbCopy(oldFileRenamedPath, sizeof(oldFileRenamedPath), updates->outputPath);
-                StringCbCat(oldFileRenamedPath, sizeof(oldFileRenamedPath), _T(".old"));
-
-                if (!MyCopyFile(updates->outputPath, oldFileRenamedPath))
-                {
-                    Status(_T("Update failed: Couldn't backup %s (error %d)"), updates->outputPath, GetLastError());
-                    return ret;
-                }
-
-                if (OutFile_OpenW(&outFile, updates->outputPath))
-                {
-                    Status(L"Failed to open files '%s'", updates->outputPath);
-                    return ret;
-                }
-
-                DEFER{ File_Close(&outFile); };
-
-                processedSize = outSizeProcessed;
-                if (File_Write(&outFile, outBuffer + offset, &processedSize) != 0 || processedSize != outSizeProcessed)
-                {
-                    _TCHAR baseName[MAX_PATH];
-
-                    int is_sharing_violation = (GetLastError() == ERROR_SHARING_VIOLATION);
-
-                    StringCbCopy(baseName, sizeof(baseName), updates->outputPath);
-                    p = _tcsrchr(baseName, '/');
-                    if (p)
-                    {
-                        p[0] = '\0';
-                        p++;
-                    }
-                    else
-                        p = baseName;
-
-                    if (is_sharing_violation)
-                        Status(_T("Update failed: %s is still in use. Close all programs and try again."), p);
-                    else
-                        Status(_T("Update failed: Couldn't update %s (error %d)"), p, GetLastError());
-                    return ret;
-                }
-
-                DeleteFile(updates->tempPath);
-
-                updates->previousFile = _tcsdup(oldFileRenamedPath);
-                updates->state = STATE_INSTALLED;
-            }
-            else
-            {
-                //We may be installing into new folders, make sure they exist
-                CreateFoldersForPath(updates->outputPath);
-
-                if (OutFile_OpenW(&outFile, updates->outputPath))
-                {
-                    Status(L"Failed to open files '%s'", updates->outputPath);
-                    return ret;
-                }
-
-                DEFER{ File_Close(&outFile); };
-
-                processedSize = outSizeProcessed;
-                if (File_Write(&outFile, outBuffer + offset, &processedSize) != 0 || processedSize != outSizeProcessed)
-                {
-                    Status(_T("Update failed: Couldn't install %s (error %d)"), updates->outputPath, GetLastError());
-                    return ret;
-                }
-
-                DeleteFile(updates->tempPath);
-
-                updates->previousFile = NULL;
-                updates->state = STATE_INSTALLED;
-            }
         }
     }
 
@@ -818,7 +1865,17 @@ DWORD WINAPI UpdateThread(void *arg)
             DeleteFile(updates->previousFile);
     }
 
-    Status(_T("Update complete."));
+    //Remember what we just wrote so the next run doesn't have to read it back (files are closed by now, so the stamps are final)
+    for (size_t i = 0; i < installedHashes.size(); i++)
+    {
+        file_stamp_t stamp;
+        if (GetFileStamp(installedHashes[i].first.c_str(), &stamp))
+            HashCache_Update(&hashCache, installedHashes[i].first.c_str(), &stamp, installedHashes[i].second.hash);
+    }
+
+    HashCache_Save(&hashCache);
+
+    Status(_T("Update complete. Hash cache: %ld hits, %ld misses."), hashCache.hits, hashCache.misses);
 
     ret = 0;
 
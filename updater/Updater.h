@@ -31,6 +31,19 @@
 #include <jansson.h>
 #include "resource.h"
 
+#include <map>
+#include <string>
+#include <vector>
+
+#define MAX_DOWNLOAD_WORKERS  8
+#define MAX_DOWNLOAD_SEGMENTS 4
+#define MAX_EXTRACT_THREADS   8
+#define MAX_HASH_THREADS      (MAXIMUM_WAIT_OBJECTS - 1)
+#define MAX_EXTRACT_AHEAD     16
+#define MAX_DECODE_THREADS    4
+#define MAX_DECODE_MEMORY     (512 << 20)
+#define MAX_STREAM_TAIL_SIZE  (64 << 20)
+
 enum state_t
 {
     STATE_INVALID,
@@ -52,15 +65,117 @@ struct update_t
     state_t         state;
 };
 
-bool HTTPGetFile(const _TCHAR *url, const _TCHAR *outputPath, const _TCHAR *extraHeaders, int *responseCode);
+bool HTTPGetFile(const _TCHAR *url, const _TCHAR *outputPath, const _TCHAR *extraHeaders, BYTE *hash, int *responseCode);
+//Fetches a file over up to numSegments connections. knownSize is the expected size (0 if unknown), small files
+//go through HTTPGetFile without asking the server first. The extra connections are taken from connectionSlots
+//(if given) when they're free, and given back before returning.
+bool HTTPGetFileSegmented(const _TCHAR *url, const _TCHAR *outputPath, const _TCHAR *extraHeaders, LONGLONG knownSize, int numSegments,
+    HANDLE connectionSlots, BYTE *hash, int *responseCode);
+void DiscardPartialDownload(const _TCHAR *outputPath);
+
+//Returns how many bytes of outputPath an interrupted download of the version identified by validator left behind
+LONGLONG GetResumeOffset(const _TCHAR *outputPath, const _TCHAR *validator);
+
+//Fetches bytes [start, end] of url into buffer, fileSize receives the size of the whole file. If validator is
+//empty it receives the file's ETag (or Last-Modified date), otherwise the request fails if the file has changed since.
+bool HTTPGetRange(const _TCHAR *url, LONGLONG start, LONGLONG end, BYTE *buffer, LONGLONG *fileSize, _TCHAR *validator, DWORD validatorSize,
+    int *responseCode);
+
+//Shared between a streaming download and the readers following it through the file
+struct download_progress_t
+{
+    SRWLOCK             lock;
+    CONDITION_VARIABLE  changed;
+    LONGLONG            available;  //bytes before this offset are on disk
+    LONGLONG            tailStart;  //bytes from here to the end were on disk before the download started
+    LONGLONG            size;
+    int                 state;      //0 while downloading, 1 when done, -1 on failure
+    volatile LONG       cancelled;  //set by the readers to stop the download
+};
+
+void DownloadProgress_Init(download_progress_t *progress, LONGLONG available, LONGLONG tailStart, LONGLONG size);
+
+//Blocks until pos can be read, returns how many bytes from there are readable (0 if the download failed)
+LONGLONG DownloadProgress_Wait(download_progress_t *progress, LONGLONG pos);
+
+//Wakes up the readers for good once no more data is coming
+void DownloadProgress_Finish(download_progress_t *progress, bool success);
+
+//Downloads [progress->available, progress->tailStart) of url into the preallocated outputFile (opened from outputPath),
+//in order, publishing progress as it goes. Can be called again after a failure to continue from there. The requests
+//fail if the file no longer matches validator; an interrupted download leaves a resume file for HTTPGetFile.
+//hash is the digest of the whole file, including the parts written beforehand.
+bool HTTPGetFileStreaming(const _TCHAR *url, const _TCHAR *outputPath, HANDLE outputFile, download_progress_t *progress, const _TCHAR *validator,
+    BYTE *hash, int *responseCode);
+bool GetURLHostName(const _TCHAR *url, _TCHAR *hostName, DWORD hostNameLen);
+
+bool DownloadAborted();
+bool RunDownloadWorkers(int maxWorkers, update_t *updates);
+void DestroyUpdateList(update_t *updates);
+
+void Status(const _TCHAR *fmt, ...);
+void CreateFoldersForPath(_TCHAR *path);
+bool IsSafeFilename(_TCHAR *path);
 
 void HashToString (BYTE *in, TCHAR *out);
 void StringToHash (TCHAR *in, BYTE *out);
 
 bool CalculateFileHash(TCHAR *path, BYTE *hash);
 
+struct file_hash_t
+{
+    BYTE            hash[20];
+    bool            valid;
+};
+
+typedef std::map<std::wstring, file_hash_t> file_hash_table_t;
+
+//Hashes all paths on a thread pool (numThreads <= 0 uses one per CPU); missing files get an all-zero hash
+bool CalculateFileHashes(const std::vector<std::wstring> &paths, file_hash_table_t &hashes, int numThreads, struct hash_cache_t *cache);
+
+struct file_stamp_t
+{
+    ULONGLONG       size;
+    ULONGLONG       lastWriteTime;
+    ULONGLONG       fileIndex;
+    DWORD           volumeSerial;
+};
+
+struct hash_cache_update_t
+{
+    file_stamp_t    stamp;
+    BYTE            hash[20];
+};
+
+struct hash_cache_t
+{
+    TCHAR           path[MAX_PATH];
+    HANDLE          mapping;
+    const BYTE      *view;
+    DWORD           numEntries;
+    std::map<std::wstring, hash_cache_update_t> updates;
+    volatile LONG   hits;
+    volatile LONG   misses;
+};
+
+bool GetFileStamp(const TCHAR *path, file_stamp_t *stamp);
+
+void HashCache_Init(hash_cache_t *cache);
+bool HashCache_Open(hash_cache_t *cache, const TCHAR *cachePath);
+void HashCache_Close(hash_cache_t *cache);
+bool HashCache_Lookup(hash_cache_t *cache, const TCHAR *path, const file_stamp_t *stamp, BYTE *hash);
+void HashCache_Update(hash_cache_t *cache, const TCHAR *path, const file_stamp_t *stamp, const BYTE *hash);
+bool HashCache_Save(hash_cache_t *cache);
+
+//Like CalculateFileHash, but skips hashing when the cache has a matching entry (cache may be NULL)
+bool CalculateFileHashCached(hash_cache_t *cache, TCHAR *path, BYTE *hash);
+
+//Installs the release described by the chunk index downloaded into updates->tempPath, see Chunks.cpp
+bool InstallChunkedUpdate(update_t *updates, const _TCHAR *chunkURL, const _TCHAR *chunkCachePath, hash_cache_t *hashCache,
+    std::vector<std::pair<std::wstring, file_hash_t>> &installedHashes);
+
 extern HWND hwndMain;
-extern HCRYPTPROV hProvider;
-extern int totalFileSize;
-extern int completedFileSize;
+extern volatile LONG totalFileSize;
+extern volatile LONG completedFileSize;
 extern HANDLE cancelRequested;
+extern HANDLE downloadFailed;
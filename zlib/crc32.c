@@ -19,6 +19,13 @@
   one thread to use crc32().
 
   DYNAMIC_CRC_TABLE and MAKECRCH can be #defined to write out crc32.h.
+
+  If Z_7ZIP_CRC is #defined, crc32() and crc32_combine() are computed by the
+  CRC-32 engine of the LZMA SDK (lzma/C/7zCrc.c), which picks table or
+  carry-less multiply code for the CPU at run time.  The SDK is then linked by
+  the application, not into zlib, and the application has to call
+  CrcGenerateTable() before zlib is used.  The updater compiles this file
+  itself with Z_7ZIP_CRC, so its copy replaces the one in zlib.lib.
  */
 
 #ifdef MAKECRCH
@@ -30,6 +37,22 @@
 
 #include "zutil.h"      /* for STDC and FAR definitions */
 
+#ifdef Z_7ZIP_CRC
+/* The prototypes from 7zCrc.h, whose Types.h can't be included next to
+   zconf.h since both define Byte.  UInt32 is unsigned int there. */
+#  ifdef _MSC_VER
+#    define Z_7ZIP_CALL __fastcall
+     typedef unsigned __int64 z_7zip_size64;
+#  else
+#    define Z_7ZIP_CALL
+     typedef unsigned long long z_7zip_size64;
+#  endif
+extern unsigned Z_7ZIP_CALL CrcUpdate OF((unsigned crc, const void *data,
+                                          size_t size));
+extern unsigned Z_7ZIP_CALL CrcCombine OF((unsigned crc1, unsigned crc2,
+                                           z_7zip_size64 size2));
+#endif
+
 #define local static
 
 /* Definitions for doing the crc four data bytes at a time. */
@@ -208,6 +231,11 @@ unsigned long ZEXPORT crc32(crc, buf, len)
 {
     if (buf == Z_NULL) return 0UL;
 
+#ifdef Z_7ZIP_CRC
+    return (unsigned long)CrcUpdate((unsigned)crc ^ 0xffffffffU, buf, len) ^
+           0xffffffffUL;
+#endif
+
 #ifdef DYNAMIC_CRC_TABLE
     if (crc_table_empty)
         make_crc_table();
@@ -366,6 +394,10 @@ local uLong crc32_combine_(crc1, crc2, len2)
     if (len2 <= 0)
         return crc1;
 
+#ifdef Z_7ZIP_CRC
+    return CrcCombine((unsigned)crc1, (unsigned)crc2, (z_7zip_size64)len2);
+#endif
+
     /* put operator for one zero bit in odd */
     odd[0] = 0xedb88320UL;          /* CRC-32 polynomial */
     row = 1;